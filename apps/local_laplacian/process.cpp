@@ -11,12 +11,24 @@ using namespace Halide::Tools;
 
 int main(int argc, char **argv) {
     if (argc < 7) {
-        printf("Usage: ./process input.png levels alpha beta timing_iterations output.png\n"
-               "e.g.: ./process input.png 8 1 1 10 output.png\n");
+        printf("Usage: ./process input.png levels alpha beta timing_iterations output.png [width height]\n"
+               "e.g.: ./process input.png 8 1 1 10 output.png\n"
+               "If width and height are given, the input is tiled to that size.\n");
         return 0;
     }
 
     Image<uint16_t> input = load_image(argv[1]);
+    if (argc >= 9) {
+        Image<uint16_t> tiled(atoi(argv[7]), atoi(argv[8]), input.channels());
+        for (int c = 0; c < tiled.channels(); c++) {
+            for (int y = 0; y < tiled.height(); y++) {
+                for (int x = 0; x < tiled.width(); x++) {
+                    tiled(x, y, c) = input(x % input.width(), y % input.height(), c);
+                }
+            }
+        }
+        input = tiled;
+    }
     int levels = atoi(argv[2]);
     float alpha = atof(argv[3]), beta = atof(argv[4]);
     Image<uint16_t> output(input.width(), input.height(), 3);
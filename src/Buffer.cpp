@@ -4,6 +4,10 @@
 #include "JITModule.h"
 #include "runtime/HalideRuntime.h"
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 namespace Halide {
 namespace Internal {
 
@@ -11,6 +15,41 @@ namespace {
 void check_buffer_size(uint64_t bytes, const std::string &name) {
     user_assert(bytes < (1UL << 31)) << "Total size of buffer " << name << " exceeds 2^31 - 1\n";
 }
+
+// Buffers of at least this many bytes are mapped directly and backed by
+// transparent huge pages, like large allocations in the runtime (see
+// halide_set_huge_page_threshold). Set with the environment variable
+// HL_HUGE_PAGE_THRESHOLD, in megabytes. Zero means never.
+uint64_t huge_page_threshold() {
+    static uint64_t threshold = []() {
+        size_t defined = 0;
+        std::string value = get_env_variable("HL_HUGE_PAGE_THRESHOLD", defined);
+        return defined ? (uint64_t)atoll(value.c_str()) << 20 : 0;
+    }();
+    return threshold;
+}
+
+// Returns zeroed memory, or nullptr if huge pages aren't available.
+uint8_t *map_huge_pages(size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    // Only the 2MB-aligned parts of the mapping can use huge pages,
+    // which for a buffer this large is nearly all of it.
+    madvise(ptr, size, MADV_HUGEPAGE);
+    return (uint8_t *)ptr;
+#else
+    return nullptr;
+#endif
+}
+
+void unmap_huge_pages(uint8_t *ptr, size_t size) {
+#ifdef __linux__
+    munmap(ptr, size);
+#endif
+}
 }
 
 
@@ -27,6 +66,10 @@ struct BufferContents {
      * nullptr. */
     uint8_t *allocation;
 
+    /** If the allocation was mapped with map_huge_pages rather than
+     * calloc'd, the size of the mapping. Otherwise zero. */
+    size_t mapped_size;
+
     /** How many Buffer objects point to this BufferContents */
     mutable RefCount ref_count;
 
@@ -35,7 +78,7 @@ struct BufferContents {
 
     BufferContents(Type t, int x_size, int y_size, int z_size, int w_size,
                    uint8_t* data, const std::string &n) :
-        type(t), allocation(nullptr), name(n.empty() ? unique_name('b') : n) {
+        type(t), allocation(nullptr), mapped_size(0), name(n.empty() ? unique_name('b') : n) {
         user_assert(t.lanes() == 1) << "Can't create of a buffer of a vector type";
         buf.elem_size = t.bytes();
         uint64_t size = 1;
@@ -61,7 +104,14 @@ struct BufferContents {
         if (!data) {
             size = size + 32;
             check_buffer_size(size, name);
-            allocation = (uint8_t *)calloc(1, (size_t)size);
+            uint64_t threshold = huge_page_threshold();
+            if (threshold && size >= threshold) {
+                allocation = map_huge_pages((size_t)size);
+                mapped_size = allocation ? (size_t)size : 0;
+            }
+            if (!allocation) {
+                allocation = (uint8_t *)calloc(1, (size_t)size);
+            }
             user_assert(allocation) << "Out of memory allocating buffer " << name << " of size " << size << "\n";
             buf.host = allocation;
             while ((size_t)(buf.host) & 0x1f) buf.host++;
@@ -86,7 +136,7 @@ struct BufferContents {
     }
 
     BufferContents(Type t, const buffer_t *b, const std::string &n) :
-        type(t), allocation(nullptr), name(n.empty() ? unique_name('b') : n) {
+        type(t), allocation(nullptr), mapped_size(0), name(n.empty() ? unique_name('b') : n) {
         buf = *b;
         user_assert(t.lanes() == 1) << "Can't create of a buffer of a vector type";
     }
@@ -101,7 +151,11 @@ template<>
 EXPORT void destroy<BufferContents>(const BufferContents *p) {
     int error = halide_device_free(nullptr, const_cast<buffer_t *>(&p->buf));
     user_assert(!error) << "Failed to free device buffer\n";
-    free(p->allocation);
+    if (p->mapped_size) {
+        unmap_huge_pages(p->allocation, p->mapped_size);
+    } else {
+        free(p->allocation);
+    }
 
     delete p;
 }
@@ -1239,11 +1239,16 @@ void CodeGen_C::visit(const Provide *op) {
 void CodeGen_C::visit(const Allocate *op) {
     open_scope();
 
-    // For sizes less than 8k, do a stack allocation
+    // For sizes less than 8k, do a stack allocation, unless the
+    // schedule says otherwise.
     bool on_stack = false;
     int32_t constant_size;
     string size_id;
     if (op->new_expr.defined()) {
+        user_assert(op->memory_type != MemoryType::Stack &&
+                    op->memory_type != MemoryType::Register)
+            << "Allocation " << op->name << " is scheduled to be stored in "
+            << op->memory_type << ", but it is memoized, so it must live on the heap.\n";
         Allocation alloc;
         alloc.type = op->type;
         alloc.free_function = op->free_function;
@@ -1259,11 +1264,14 @@ void CodeGen_C::visit(const Allocate *op) {
                            << op->name << " is constant but exceeds 2^31 - 1.\n";
             } else {
                 size_id = print_expr(Expr(static_cast<int32_t>(constant_size)));
-                if (stack_bytes <= 1024 * 8) {
-                    on_stack = true;
-                }
+                on_stack = is_stack_allocation(op);
             }
         } else {
+            user_assert(op->memory_type != MemoryType::Stack &&
+                        op->memory_type != MemoryType::Register)
+                << "Allocation " << op->name << " is scheduled to be stored in "
+                << op->memory_type << ", but its size is not a compile-time constant.\n";
+
             // Check that the allocation is not scalar (if it were scalar
             // it would have constant size).
             internal_assert(op->extents.size() > 0);
@@ -181,6 +181,8 @@ bool function_takes_user_context(const std::string &name) {
         "halide_trace",
         "halide_memoization_cache_lookup",
         "halide_memoization_cache_store",
+        "halide_memoization_cache_lookup_v2",
+        "halide_memoization_cache_store_v2",
         "halide_memoization_cache_release",
         "halide_cuda_run",
         "halide_opencl_run",
@@ -7,6 +7,8 @@
 #include "IROperator.h"
 #include "Debug.h"
 #include "IRPrinter.h"
+#include "IRVisitor.h"
+#include "ExprUsesVar.h"
 #include "Simplify.h"
 
 namespace Halide {
@@ -20,6 +22,94 @@ using std::make_pair;
 
 using namespace llvm;
 
+namespace {
+
+// Finds accesses to an allocation that would prevent it from being
+// promoted to registers: loads or stores at indices that vary with a
+// loop inside the allocation, and any use of its address. Unrolled
+// loops have already been expanded by the time we get here, and
+// vectorized loops have been turned into ramps.
+class FindDynamicAccesses : public IRVisitor {
+    const string &name;
+    Scope<int> loop_vars;
+    Scope<Expr> lets;
+
+    using IRVisitor::visit;
+
+    void check_index(Expr index) {
+        if (expr_uses_vars(index, loop_vars, lets)) {
+            found = true;
+        }
+    }
+
+    void visit(const Load *op) {
+        if (op->name == name) {
+            check_index(op->index);
+        }
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Store *op) {
+        if (op->name == name) {
+            check_index(op->index);
+        }
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Call *op) {
+        if (op->name == Call::address_of) {
+            const Load *load = op->args[0].as<Load>();
+            if (load && load->name == name) {
+                found = true;
+            }
+        }
+        IRVisitor::visit(op);
+    }
+
+    void visit(const Variable *op) {
+        if (op->name == name + ".buffer") {
+            found = true;
+        }
+    }
+
+    void visit(const For *op) {
+        op->min.accept(this);
+        op->extent.accept(this);
+        loop_vars.push(op->name, 0);
+        op->body.accept(this);
+        loop_vars.pop(op->name);
+    }
+
+    void visit(const Let *op) {
+        op->value.accept(this);
+        lets.push(op->name, op->value);
+        op->body.accept(this);
+        lets.pop(op->name);
+    }
+
+    void visit(const LetStmt *op) {
+        op->value.accept(this);
+        lets.push(op->name, op->value);
+        op->body.accept(this);
+        lets.pop(op->name);
+    }
+
+public:
+    bool found;
+    FindDynamicAccesses(const string &n) : name(n), found(false) {}
+};
+
+}
+
+void CodeGen_Posix::check_register_allocation(const string &name, Stmt body) {
+    FindDynamicAccesses finder(name);
+    body.accept(&finder);
+    user_assert(!finder.found)
+        << "Allocation " << name << " is scheduled to be stored in registers, "
+        << "but it is accessed at indices that vary within a loop. "
+        << "Unroll or vectorize the loops that access it.\n";
+}
+
 CodeGen_Posix::CodeGen_Posix(Target t) :
   CodeGen_LLVM(t) {
 }
@@ -51,7 +141,14 @@ Value *CodeGen_Posix::codegen_allocation_size(const std::string &name, Type type
 
 CodeGen_Posix::Allocation CodeGen_Posix::create_allocation(const std::string &name, Type type,
                                                            const std::vector<Expr> &extents, Expr condition,
-                                                           Expr new_expr, std::string free_function) {
+                                                           Expr new_expr, std::string free_function,
+                                                           MemoryType memory_type) {
+    if (new_expr.defined() &&
+        (memory_type == MemoryType::Stack || memory_type == MemoryType::Register)) {
+        user_error << "Allocation " << name << " is scheduled to be stored in "
+                   << memory_type << ", but it is memoized, so it must live on the heap.\n";
+    }
+
     Value *llvm_size = nullptr;
     int64_t stack_bytes = 0;
     int32_t constant_bytes = 0;
@@ -61,10 +158,14 @@ CodeGen_Posix::Allocation CodeGen_Posix::create_allocation(const std::string &na
 
         if (stack_bytes > ((int64_t(1) << 31) - 1)) {
             user_error << "Total size for allocation " << name << " is constant but exceeds 2^31 - 1.";
-        } else if (stack_bytes > 1024 * 16) {
+        } else if (memory_type == MemoryType::Heap ||
+                   (memory_type == MemoryType::Auto && stack_bytes > 1024 * 16)) {
             stack_bytes = 0;
             llvm_size = codegen(Expr(constant_bytes));
         }
+    } else if (memory_type == MemoryType::Stack || memory_type == MemoryType::Register) {
+        user_error << "Allocation " << name << " is scheduled to be stored in "
+                   << memory_type << ", but its size is not a compile-time constant.\n";
     } else {
         llvm_size = codegen_allocation_size(name, type, extents);
     }
@@ -187,9 +288,14 @@ void CodeGen_Posix::visit(const Allocate *alloc) {
                    << alloc->name << "\n";
     }
 
+    if (alloc->memory_type == MemoryType::Register) {
+        check_register_allocation(alloc->name, alloc->body);
+    }
+
     Allocation allocation = create_allocation(alloc->name, alloc->type,
                                               alloc->extents, alloc->condition,
-                                              alloc->new_expr, alloc->free_function);
+                                              alloc->new_expr, alloc->free_function,
+                                              alloc->memory_type);
     sym_push(alloc->name + ".host", allocation.ptr);
 
     codegen(alloc->body);
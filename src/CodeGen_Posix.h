@@ -82,10 +82,20 @@ private:
      * name.host that provides the base pointer.
      *
      * When the allocation can be freed call 'free_allocation', and
-     * when it goes out of scope call 'destroy_allocation'. */
+     * when it goes out of scope call 'destroy_allocation'.
+     *
+     * The memory type selects between the stack and the heap. Auto
+     * places small constant-sized allocations on the stack, and
+     * everything else on the heap. */
     Allocation create_allocation(const std::string &name, Type type,
                                  const std::vector<Expr> &extents,
-                                 Expr condition, Expr new_expr, std::string free_function);
+                                 Expr condition, Expr new_expr, std::string free_function,
+                                 MemoryType memory_type = MemoryType::Auto);
+
+    /** Check that an allocation scheduled to be stored in registers is
+     * never accessed at an index that varies within a loop in the
+     * given body, and raise a user error if it is. */
+    void check_register_allocation(const std::string &name, Stmt body);
 };
 
 }}
@@ -184,7 +184,8 @@ class InjectEarlyFrees : public IRMutator {
             stmt = inject_marker.mutate(stmt);
         } else {
             stmt = Allocate::make(alloc->name, alloc->type, alloc->extents, alloc->condition,
-                                  Block::make(alloc->body, Free::make(alloc->name)), alloc->new_expr);
+                                  Block::make(alloc->body, Free::make(alloc->name)),
+                                  alloc->new_expr, alloc->free_function, alloc->memory_type);
         }
 
     }
@@ -280,6 +280,22 @@ const DeviceAPI all_device_apis[] = {DeviceAPI::Parent,
                                      DeviceAPI::OpenGLCompute,
                                      DeviceAPI::Metal};
 
+/** An enum describing where the storage of a Func goes. Used by
+ * schedules (see Func::store_in), and in the Allocate IR node. */
+enum class MemoryType {
+    /** Let the code generator decide: small allocations of constant
+     * size go on the stack, and everything else on the heap. */
+    Auto,
+    /** On the stack. The size must be a compile-time constant. */
+    Stack,
+    /** On the heap, via halide_malloc. */
+    Heap,
+    /** On the stack, with every access at an index known at compile
+     * time (e.g. because the loops over it are unrolled), so that the
+     * values can live in registers. */
+    Register
+};
+
 namespace Internal {
 
 /** An enum describing a type of loop traversal. Used in schedules,
@@ -1135,6 +1135,12 @@ Func &Func::store_root() {
     return *this;
 }
 
+Func &Func::store_in(MemoryType memory_type) {
+    invalidate_cache();
+    func.schedule().memory_type() = memory_type;
+    return *this;
+}
+
 Func &Func::compute_inline() {
     invalidate_cache();
     func.schedule().compute_level() = LoopLevel();
@@ -1154,6 +1160,51 @@ Func &Func::trace_stores() {
     return *this;
 }
 
+namespace {
+vector<pair<Expr, Expr>> trace_region(const Function &func, const vector<pair<Expr, Expr>> &region) {
+    user_assert(region.size() <= (size_t)func.dimensions())
+        << "Can't trace a region of Func " << func.name() << " with " << region.size()
+        << " dimensions, because it only has " << func.dimensions() << ".\n";
+    vector<pair<Expr, Expr>> r;
+    for (const pair<Expr, Expr> &p : region) {
+        user_assert(p.first.defined() && p.second.defined())
+            << "Tracing region of Func " << func.name() << " has an undefined min or extent.\n";
+        r.push_back({cast<int>(p.first), cast<int>(p.second)});
+    }
+    return r;
+}
+}
+
+Func &Func::trace_loads(int sample_rate) {
+    user_assert(sample_rate >= 1)
+        << "Sample rate for tracing loads from Func " << name() << " must be at least one.\n";
+    trace_loads();
+    func.load_trace_filter().sample_rate = sample_rate;
+    return *this;
+}
+
+Func &Func::trace_loads(const vector<pair<Expr, Expr>> &region) {
+    vector<pair<Expr, Expr>> r = trace_region(func, region);
+    trace_loads();
+    func.load_trace_filter().region = r;
+    return *this;
+}
+
+Func &Func::trace_stores(int sample_rate) {
+    user_assert(sample_rate >= 1)
+        << "Sample rate for tracing stores to Func " << name() << " must be at least one.\n";
+    trace_stores();
+    func.store_trace_filter().sample_rate = sample_rate;
+    return *this;
+}
+
+Func &Func::trace_stores(const vector<pair<Expr, Expr>> &region) {
+    vector<pair<Expr, Expr>> r = trace_region(func, region);
+    trace_stores();
+    func.store_trace_filter().region = r;
+    return *this;
+}
+
 Func &Func::trace_realizations() {
     invalidate_cache();
     func.trace_realizations();
@@ -1453,6 +1453,21 @@ public:
      * outside the outermost loop. */
     EXPORT Func &store_root();
 
+    /** Choose where the storage for this function goes: on the stack,
+     * on the heap, or in registers. By default (MemoryType::Auto),
+     * allocations of constant size up to 16KB go on the stack and
+     * everything else on the heap. Forcing a larger tile-sized
+     * scratch buffer onto the stack saves a heap allocation each
+     * time it is allocated, e.g. in every task of a parallel loop,
+     * but uses up stack space. MemoryType::Register additionally
+     * requires every access to be at a constant index, e.g. because
+     * the loops over the function are unrolled. It is a user error
+     * if the size of a Stack or Register allocation isn't a
+     * compile-time constant, or if a Register allocation is accessed
+     * at a non-constant index. Only affects code generated for the
+     * CPU. */
+    EXPORT Func &store_in(MemoryType memory_type);
+
     /** Aggressively inline all uses of this function. This is the
      * default schedule, so you're unlikely to need to call this. For
      * a Func with an update definition, that means it gets computed
@@ -1489,11 +1504,30 @@ public:
      * effect. */
     EXPORT Func &trace_loads();
 
+    /** Trace loads from this Func, but only a pseudo-random sample of
+     * one in every sample_rate of them. The sample is chosen by
+     * hashing the coordinates of each load, so the same sites are
+     * traced on every run. Can be combined with a region. */
+    EXPORT Func &trace_loads(int sample_rate);
+
+    /** Trace loads from this Func, but only those at coordinates
+     * inside the given box. The box is a list of (min, extent) pairs
+     * for the leading dimensions. The rest are unrestricted. */
+    EXPORT Func &trace_loads(const std::vector<std::pair<Expr, Expr>> &region);
+
     /** Trace all stores to the buffer backing this Func by emitting
      * calls to halide_trace. If the Func is inlined, this call
      * has no effect. */
     EXPORT Func &trace_stores();
 
+    /** Trace a pseudo-random sample of one in every sample_rate of
+     * the stores to this Func. See trace_loads(int). */
+    EXPORT Func &trace_stores(int sample_rate);
+
+    /** Trace the stores to this Func at coordinates inside the given
+     * box. See trace_loads(const std::vector<std::pair<Expr, Expr>> &). */
+    EXPORT Func &trace_stores(const std::vector<std::pair<Expr, Expr>> &region);
+
     /** Trace all realizations of this Func by emitting calls to
      * halide_trace. */
     EXPORT Func &trace_realizations();
@@ -38,6 +38,7 @@ struct FunctionContents {
     std::string extern_function_name;
 
     bool trace_loads, trace_stores, trace_realizations;
+    TraceFilter load_trace_filter, store_trace_filter;
 
     bool frozen;
 
@@ -78,6 +79,15 @@ struct FunctionContents {
             }
         }
 
+        for (const std::pair<Expr, Expr> &r : load_trace_filter.region) {
+            r.first.accept(visitor);
+            r.second.accept(visitor);
+        }
+        for (const std::pair<Expr, Expr> &r : store_trace_filter.region) {
+            r.first.accept(visitor);
+            r.second.accept(visitor);
+        }
+
         for (Parameter i : output_buffers) {
             for (size_t j = 0; j < args.size() && j < 4; j++) {
                 if (i.min_constraint(j).defined()) {
@@ -632,6 +642,19 @@ bool Function::is_tracing_realizations() const {
     return contents.ptr->trace_realizations;
 }
 
+TraceFilter &Function::load_trace_filter() {
+    return contents.ptr->load_trace_filter;
+}
+const TraceFilter &Function::load_trace_filter() const {
+    return contents.ptr->load_trace_filter;
+}
+TraceFilter &Function::store_trace_filter() {
+    return contents.ptr->store_trace_filter;
+}
+const TraceFilter &Function::store_trace_filter() const {
+    return contents.ptr->store_trace_filter;
+}
+
 void Function::freeze() {
     contents.ptr->frozen = true;
 }
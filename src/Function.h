@@ -56,6 +56,23 @@ struct UpdateDefinition {
     ReductionDomain domain;
 };
 
+/** Restricts which of the loads from or stores to a function are
+ * traced. */
+struct TraceFilter {
+    /** Only trace events at coordinates inside this box, given as a
+     * (min, extent) pair per dimension. It may cover fewer dimensions
+     * than the function has, in which case the rest are
+     * unrestricted. Empty means everywhere. */
+    std::vector<std::pair<Expr, Expr>> region;
+
+    /** Only trace a pseudo-random sample of one in this many
+     * events. Which events are traced depends only on their
+     * coordinates. */
+    int sample_rate;
+
+    TraceFilter() : sample_rate(1) {}
+};
+
 /** A reference-counted handle to Halide's internal representation of
  * a function. Similar to a front-end Func object, but with no
  * syntactic sugar to help with definitions. */
@@ -193,6 +210,15 @@ public:
     EXPORT bool is_tracing_realizations() const;
     // @}
 
+    /** Get a handle to the filters that restrict which loads and
+     * stores are traced. */
+    // @{
+    EXPORT TraceFilter &load_trace_filter();
+    EXPORT const TraceFilter &load_trace_filter() const;
+    EXPORT TraceFilter &store_trace_filter();
+    EXPORT const TraceFilter &store_trace_filter() const;
+    // @}
+
     /** Mark function as frozen, which means it cannot accept new
      * definitions. */
     EXPORT void freeze();
@@ -0,0 +1,194 @@
+#include "HoistAllocations.h"
+#include "Bounds.h"
+#include "CodeGen_GPU_Dev.h"
+#include "ExprUsesVar.h"
+#include "IRMutator.h"
+#include "IRVisitor.h"
+#include "IROperator.h"
+#include "Scope.h"
+#include "Simplify.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+bool is_gpu_loop(const For *op) {
+    return CodeGen_GPU_Dev::is_gpu_var(op->name) ||
+        (op->device_api != DeviceAPI::Host &&
+         op->device_api != DeviceAPI::Parent);
+}
+
+// Checks if a statement contains any allocations.
+class ContainsAllocation : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Allocate *op) {
+        result = true;
+    }
+
+public:
+    bool result;
+    ContainsAllocation() : result(false) {}
+};
+
+// An allocation that has been pulled out of a loop, with the extents
+// it should be given outside of it.
+struct HoistedAllocation {
+    const Allocate *op;
+    vector<Expr> extents;
+};
+
+// Pull the allocations that can be moved out of a serial loop out of
+// its body. The hoisted allocations are left in the 'hoisted' list.
+class ExtractInvariantAllocations : public IRMutator {
+    // Everything defined inside the loop, including the loop variable itself.
+    Scope<int> inner_vars;
+
+    // Bounds of the same, for computing upper bounds on extents.
+    Scope<Interval> bounds;
+
+    using IRMutator::visit;
+
+    // Get an expression for an upper bound of the extent that doesn't
+    // depend on anything defined inside the loop, or an undefined
+    // Expr if there isn't one. The bound is taken over the range of
+    // the loop variables, which is empty for a loop that doesn't run,
+    // so clamp it at zero.
+    Expr invariant_bound(Expr extent) {
+        if (!expr_uses_vars(extent, inner_vars)) {
+            return extent;
+        }
+        Interval i = bounds_of_expr_in_scope(extent, bounds);
+        if (i.max.defined() && !expr_uses_vars(i.max, inner_vars)) {
+            return simplify(max(i.max, 0));
+        }
+        return Expr();
+    }
+
+    void visit(const Allocate *op) {
+        Stmt body = mutate(op->body);
+
+        // Stack allocations are already reused by codegen, so
+        // there's nothing to gain from moving them.
+        bool hoistable =
+            !op->new_expr.defined() &&
+            op->free_function.empty() &&
+            !is_stack_allocation(op) &&
+            !expr_uses_vars(op->condition, inner_vars);
+
+        vector<Expr> extents;
+        for (size_t i = 0; hoistable && i < op->extents.size(); i++) {
+            Expr e = invariant_bound(op->extents[i]);
+            if (e.defined()) {
+                extents.push_back(e);
+            } else {
+                hoistable = false;
+            }
+        }
+
+        if (hoistable) {
+            debug(3) << "Hoisting allocation of " << op->name << " out of the loop\n";
+            hoisted.push_back({op, extents});
+            stmt = body;
+        } else if (body.same_as(op->body)) {
+            stmt = op;
+        } else {
+            stmt = Allocate::make(op->name, op->type, op->extents, op->condition, body,
+                                  op->new_expr, op->free_function, op->memory_type);
+        }
+    }
+
+    void visit(const For *op) {
+        // Each parallel task needs its own allocation, and GPU loops
+        // manage memory differently.
+        if (op->for_type == ForType::Parallel || is_gpu_loop(op)) {
+            stmt = op;
+            return;
+        }
+        Interval min_bounds = bounds_of_expr_in_scope(op->min, bounds);
+        Interval max_bounds = bounds_of_expr_in_scope(op->min + op->extent - 1, bounds);
+        inner_vars.push(op->name, 0);
+        bounds.push(op->name, Interval(min_bounds.min, max_bounds.max));
+        IRMutator::visit(op);
+        bounds.pop(op->name);
+        inner_vars.pop(op->name);
+    }
+
+    void visit(const LetStmt *op) {
+        inner_vars.push(op->name, 0);
+        bounds.push(op->name, bounds_of_expr_in_scope(op->value, bounds));
+        IRMutator::visit(op);
+        bounds.pop(op->name);
+        inner_vars.pop(op->name);
+    }
+
+    void visit(const IfThenElse *op) {
+        // Don't allocate memory for a branch that may never be taken.
+        stmt = op;
+    }
+
+public:
+    vector<HoistedAllocation> hoisted;
+
+    ExtractInvariantAllocations(const For *loop) {
+        inner_vars.push(loop->name, 0);
+        bounds.push(loop->name, Interval(loop->min, loop->min + loop->extent - 1));
+    }
+};
+
+class HoistAllocations : public IRMutator {
+    using IRMutator::visit;
+
+    void visit(const For *op) {
+        if (is_gpu_loop(op)) {
+            stmt = op;
+            return;
+        }
+
+        IRMutator::visit(op);
+        if (op->for_type != ForType::Serial) {
+            return;
+        }
+
+        op = stmt.as<For>();
+        internal_assert(op);
+
+        ContainsAllocation contains;
+        op->body.accept(&contains);
+        if (!contains.result) {
+            return;
+        }
+
+        ExtractInvariantAllocations extract(op);
+        Stmt body = extract.mutate(op->body);
+        if (extract.hoisted.empty()) {
+            return;
+        }
+
+        // Keep the old loop alive, as the hoisted list points into it.
+        Stmt old_loop = stmt;
+        stmt = For::make(op->name, op->min, op->extent, op->for_type, op->device_api, body);
+
+        // Don't allocate anything for a loop that doesn't run.
+        Expr runs = simplify(op->extent > 0);
+        for (const HoistedAllocation &h : extract.hoisted) {
+            const Allocate *a = h.op;
+            Expr condition = is_one(runs) ? a->condition : simplify(a->condition && runs);
+            stmt = Allocate::make(a->name, a->type, h.extents, condition, stmt,
+                                  a->new_expr, a->free_function, a->memory_type);
+        }
+    }
+};
+
+}
+
+Stmt hoist_allocations(Stmt s) {
+    return HoistAllocations().mutate(s);
+}
+
+}
+}
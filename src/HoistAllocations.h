@@ -0,0 +1,28 @@
+#ifndef HALIDE_HOIST_ALLOCATIONS_H
+#define HALIDE_HOIST_ALLOCATIONS_H
+
+/** \file
+ * Defines the lowering pass that moves heap allocations out of serial
+ * loops when their size does not depend on the loop.
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Find Allocate nodes inside serial for loops whose extents are
+ * either independent of the loop, or have an upper bound that is, and
+ * move them outside the loop so that the memory is allocated once and
+ * reused by every iteration. Allocations are never moved out of
+ * parallel or GPU loops, so each parallel task still gets its own
+ * buffer. Small constant-sized allocations are left alone, because
+ * they go on the stack. This doesn't touch Realize nodes and so must
+ * be called after storage_flattening, and before inject_early_frees.
+ */
+Stmt hoist_allocations(Stmt s);
+
+}
+}
+
+#endif
@@ -393,7 +393,8 @@ Stmt Provide::make(std::string name, const std::vector<Expr> &values, const std:
 
 Stmt Allocate::make(std::string name, Type type, const std::vector<Expr> &extents,
                     Expr condition, Stmt body,
-                    Expr new_expr, std::string free_function) {
+                    Expr new_expr, std::string free_function,
+                    MemoryType memory_type) {
     for (size_t i = 0; i < extents.size(); i++) {
         internal_assert(extents[i].defined()) << "Allocate of undefined extent\n";
         internal_assert(extents[i].type().is_scalar() == 1) << "Allocate of vector extent\n";
@@ -408,6 +409,7 @@ Stmt Allocate::make(std::string name, Type type, const std::vector<Expr> &extent
     node->extents = extents;
     node->new_expr = new_expr;
     node->free_function = free_function;
+    node->memory_type = memory_type;
     node->condition = condition;
     node->body = body;
     return node;
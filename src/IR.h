@@ -280,11 +280,16 @@ struct Allocate : public StmtNode<Allocate> {
     // default will be called.
     Expr new_expr;
     std::string free_function;
+
+    // Where the code generator should put the allocation. Ignored if
+    // new_expr is defined.
+    MemoryType memory_type;
     Stmt body;
 
     EXPORT static Stmt make(std::string name, Type type, const std::vector<Expr> &extents,
                             Expr condition, Stmt body,
-                            Expr new_expr = Expr(), std::string free_function = std::string());
+                            Expr new_expr = Expr(), std::string free_function = std::string(),
+                            MemoryType memory_type = MemoryType::Auto);
 };
 
 /** Free the resources associated with the given buffer. */
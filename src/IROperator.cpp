@@ -87,6 +87,29 @@ bool is_no_op(Stmt s) {
     return e && is_const(e->value);
 }
 
+bool is_stack_allocation(const Allocate *op) {
+    if (op->new_expr.defined()) {
+        return false;
+    }
+    switch (op->memory_type) {
+    case MemoryType::Stack:
+    case MemoryType::Register:
+        return true;
+    case MemoryType::Heap:
+        return false;
+    case MemoryType::Auto:
+        break;
+    }
+    int64_t size = op->type.bytes();
+    for (Expr e : op->extents) {
+        const IntImm *i = e.as<IntImm>();
+        if (!i) return false;
+        size *= i->value;
+        if (size > 1024 * 16) return false;
+    }
+    return true;
+}
+
 const int64_t *as_const_int(Expr e) {
     if (!e.defined()) {
         return nullptr;
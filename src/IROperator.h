@@ -72,6 +72,12 @@ EXPORT bool is_two(Expr e);
  * undefined Stmt, or as an Evaluate node of a constant) */
 EXPORT bool is_no_op(Stmt s);
 
+/** Will codegen place this allocation on the stack rather than the
+ * heap. True for allocations scheduled with MemoryType::Stack or
+ * MemoryType::Register, and for small allocations of constant size
+ * with MemoryType::Auto. */
+EXPORT bool is_stack_allocation(const Allocate *op);
+
 /** Construct an immediate of the given type from any numeric C++ type. */
 // @{
 EXPORT Expr make_const(Type t, int64_t val);
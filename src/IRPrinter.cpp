@@ -89,6 +89,24 @@ ostream &operator<<(ostream &out, const DeviceAPI &api) {
     return out;
 }
 
+ostream &operator<<(ostream &out, const MemoryType &t) {
+    switch (t) {
+    case MemoryType::Auto:
+        out << "Auto";
+        break;
+    case MemoryType::Stack:
+        out << "Stack";
+        break;
+    case MemoryType::Heap:
+        out << "Heap";
+        break;
+    case MemoryType::Register:
+        out << "Register";
+        break;
+    }
+    return out;
+}
+
 namespace Internal {
 
 void IRPrinter::test() {
@@ -572,6 +590,9 @@ void IRPrinter::visit(const Allocate *op) {
         print(op->extents[i]);
     }
     stream << "]";
+    if (op->memory_type != MemoryType::Auto) {
+        stream << " in " << op->memory_type;
+    }
     if (!is_one(op->condition)) {
         stream << " if ";
         print(op->condition);
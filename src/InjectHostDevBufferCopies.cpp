@@ -508,7 +508,8 @@ class InjectBufferCopies : public IRMutator {
         // If this buffer is only ever touched on gpu, nuke the host-side allocation.
         if (!state[buf_name].host_touched) {
             debug(4) << "Eliding host alloc for " << op->name << "\n";
-            stmt = Allocate::make(op->name, op->type, op->extents, const_false(), op->body);
+            stmt = Allocate::make(op->name, op->type, op->extents, const_false(), op->body,
+                                  op->new_expr, op->free_function, op->memory_type);
         }
         state.erase(buf_name);
     }
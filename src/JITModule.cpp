@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <string>
 #include <stdint.h>
+#include <map>
 #include <mutex>
 #include <set>
+#include <sstream>
+#include <sys/stat.h>
 
 #include "CodeGen_Internal.h"
 #include "JITModule.h"
@@ -9,6 +13,8 @@
 #include "LLVM_Runtime_Linker.h"
 #include "Debug.h"
 #include "LLVM_Output.h"
+#include "IRPrinter.h"
+#include "Util.h"
 
 
 #ifdef _MSC_VER
@@ -127,6 +133,11 @@ public:
         }
     }
 
+    // If non-empty, the directory and key under which the compiled
+    // object is stored in the on-disk cache (see JITObjectCache below).
+    std::string cache_dir, cache_key;
+    std::unique_ptr<llvm::ObjectCache> object_cache;
+
     std::map<std::string, JITModule::Symbol> exports;
     llvm::LLVMContext context;
     ExecutionEngine *execution_engine;
@@ -200,6 +211,240 @@ public:
     }
 };
 
+// 64-bit FNV-1a
+uint64_t fnv1a(uint64_t h, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+const uint64_t fnv1a_basis = 0xcbf29ce484222325ULL;
+
+#if LLVM_VERSION >= 36
+// An llvm::ObjectCache that keeps the object code for a JITModule in
+// the directory named by HL_JIT_CACHE_DIR, so that later processes
+// compiling the same lowered pipeline for the same target can skip
+// the LLVM backend. Each entry is a single file holding the full key,
+// a null byte, then the object code. The file name is a hash of the
+// key, and the key is checked on load, so a collision is just a miss.
+class JITObjectCache : public llvm::ObjectCache {
+    string key, path;
+
+public:
+    JITObjectCache(const string &dir, const string &key) : key(key) {
+        uint64_t h = fnv1a(fnv1a_basis, key.data(), key.size());
+        std::ostringstream name;
+        name << dir << "/halide_jit_" << std::hex << h << ".o";
+        path = name.str();
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *m) override {
+        auto buf = llvm::MemoryBuffer::getFile(path);
+        if (buf) {
+            llvm::StringRef contents = (*buf)->getBuffer();
+            if (contents.size() > key.size() &&
+                contents.startswith(key) &&
+                contents[key.size()] == 0) {
+                debug(1) << "JIT cache hit for " << m->getModuleIdentifier() << ": " << path << "\n";
+                return llvm::MemoryBuffer::getMemBufferCopy(contents.substr(key.size() + 1));
+            }
+        }
+        debug(1) << "JIT cache miss for " << m->getModuleIdentifier() << ": " << path << "\n";
+        return nullptr;
+    }
+
+    void notifyObjectCompiled(const llvm::Module *m, llvm::MemoryBufferRef obj) override {
+        // Write to a temporary file and rename it into place, so that
+        // other processes sharing the cache never see a partial entry.
+        int fd;
+        llvm::SmallString<256> tmp_path;
+        if (llvm::sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmp_path)) {
+            debug(1) << "Could not write to JIT cache " << path << "\n";
+            return;
+        }
+        {
+            llvm::raw_fd_ostream out(fd, true);
+            out << key;
+            out.write((char)0);
+            out << obj.getBuffer();
+        }
+        if (llvm::sys::fs::rename(tmp_path.str(), path)) {
+            llvm::sys::fs::remove(tmp_path.str());
+            debug(1) << "Could not write to JIT cache " << path << "\n";
+            return;
+        }
+        debug(1) << "Stored " << m->getModuleIdentifier() << " in JIT cache: " << path << "\n";
+    }
+};
+#endif
+
+// Identify the build of Halide by the path, size and modification
+// time of the binary it was loaded from: libHalide, or the executable
+// it is linked into. Returns an empty string if the binary can't be
+// found.
+string halide_build_id() {
+    string path;
+    #ifdef _WIN32
+    HMODULE module;
+    char buf[MAX_PATH];
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                           GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           (LPCSTR)&halide_build_id, &module) &&
+        GetModuleFileNameA(module, buf, MAX_PATH)) {
+        path = buf;
+    }
+    #else
+    Dl_info info;
+    if (dladdr((void *)&halide_build_id, &info) && info.dli_fname) {
+        path = info.dli_fname;
+    }
+    #endif
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0) {
+        return "";
+    }
+    std::ostringstream id;
+    id << path << " " << st.st_size << " " << st.st_mtime;
+    return id.str();
+}
+
+// The name that unique_name was called with to make the given part
+// of a name, or the part itself if it doesn't look like it was made
+// by unique_name. unique_name(char) makes a letter or underscore
+// followed by digits, and unique_name(string) makes the string itself
+// the first time, and then the string followed by '$' and digits.
+string unique_name_base(const string &part) {
+    size_t digits = part.find('$');
+    if (digits == string::npos) {
+        if (part.size() < 2 || !(isalpha(part[0]) || part[0] == '_')) {
+            return part;
+        }
+        digits = 1;
+    } else if (digits == 0) {
+        return part;
+    } else {
+        digits++;
+    }
+    if (digits == part.size()) return part;
+    for (size_t i = digits; i < part.size(); i++) {
+        if (!isdigit(part[i])) return part;
+    }
+    return part.substr(0, part[digits - 1] == '$' ? digits - 1 : digits);
+}
+
+bool is_name_char(char c) {
+    return isalnum(c) || c == '_' || c == '$' || c == '.';
+}
+
+// Print a module so that the names made by unique_name don't depend
+// on what else was compiled in the process. Each part of a name is replaced by the name unique_name was
+// called with, numbered by the order in which the different parts
+// made from that name first appear. So "f" and "t3" print as "f" and
+// "t" in one process, and the same pipeline prints the same way in a
+// process where they were named "f$2" and "t12". Distinct names stay
+// distinct, and nothing that isn't made by unique_name changes.
+//
+// Anything whose name ends up as a symbol or a string in the object
+// code is printed as is: string literals, the functions and buffers of
+// the module, and tokens followed by '(', which are calls to extern
+// functions or broadcasts. The one exception is the names in the
+// allocation size errors that CodeGen_Posix generates, which may come
+// from the process that stored the entry.
+string canonical_module_text(const Module &m) {
+    std::set<string> keep;
+    for (const Buffer &buf : m.buffers) {
+        keep.insert(buf.name());
+    }
+    for (const LoweredFunc &f : m.functions) {
+        keep.insert(f.name);
+    }
+    std::ostringstream printed;
+    printed << m;
+    const string text = printed.str();
+
+    // The parts seen so far made from each name, in order.
+    std::map<string, std::vector<string>> seen;
+    std::ostringstream result;
+    size_t i = 0;
+    while (i < text.size()) {
+        size_t j = i + 1;
+        if (text[i] == '"') {
+            while (j < text.size() && text[j] != '"') {
+                j += (text[j] == '\\') ? 2 : 1;
+            }
+            j = std::min(j + 1, text.size());
+            result << text.substr(i, j - i);
+        } else if (is_name_char(text[i])) {
+            while (j < text.size() && is_name_char(text[j])) j++;
+            string token = text.substr(i, j - i);
+            if (keep.count(token) || (j < text.size() && text[j] == '(')) {
+                result << token;
+            } else {
+                std::vector<string> parts = split_string(token, ".");
+                for (size_t k = 0; k < parts.size(); k++) {
+                    if (k > 0) result << '.';
+                    string base = unique_name_base(parts[k]);
+                    std::vector<string> &family = seen[base];
+                    size_t n = std::find(family.begin(), family.end(), parts[k]) - family.begin();
+                    if (n == family.size()) {
+                        family.push_back(parts[k]);
+                    }
+                    result << base;
+                    if (n > 0) {
+                        result << '$' << n + 1;
+                    }
+                }
+            }
+        } else {
+            result << text[i];
+        }
+        i = j;
+    }
+    return result.str();
+}
+
+// The key for a module in the JIT cache, or an empty string if it
+// shouldn't be cached. The key holds the target and the canonical
+// text of the module, which includes the lowered Stmt for each
+// function but only names the buffers embedded in it, so their shapes
+// and a hash of their contents go in too. So do the build of Halide
+// and the version of LLVM it uses, because a different build may
+// generate different code for the same Stmt.
+string jit_cache_key(const Module &m) {
+    static const string build_id = halide_build_id();
+    if (build_id.empty()) {
+        debug(1) << "Can't identify the build of Halide; not using the JIT cache\n";
+        return "";
+    }
+
+    std::ostringstream key;
+    key << "Halide JIT cache entry, Halide build " << build_id
+        << " with LLVM " << LLVM_VERSION << "\n"
+        << "Target = " << m.target().to_string() << "\n"
+        << canonical_module_text(m);
+
+    for (const Buffer &buf : m.buffers) {
+        // Hash the same bytes that CodeGen_LLVM::compile_buffer embeds.
+        const buffer_t *b = buf.raw_buffer();
+        if (!b->host || b->dev_dirty) {
+            return "";
+        }
+        size_t num_elems = 1;
+        for (int d = 0; d < 4 && b->extent[d]; d++) {
+            num_elems += b->stride[d] * (b->extent[d] - 1);
+        }
+        key << "buffer " << buf.name() << " elem_size " << b->elem_size;
+        for (int d = 0; d < 4; d++) {
+            key << " [" << b->min[d] << ", " << b->extent[d] << ", " << b->stride[d] << "]";
+        }
+        key << " contents " << std::hex
+            << fnv1a(fnv1a_basis, (const char *)b->host, num_elems * b->elem_size)
+            << std::dec << "\n";
+    }
+    return key.str();
+}
+
 }
 
 JITModule::JITModule() {
@@ -209,6 +454,18 @@ JITModule::JITModule() {
 JITModule::JITModule(const Module &m, const LoweredFunc &fn,
                      const std::vector<JITModule> &dependencies) {
     jit_module = new JITModuleContents();
+    size_t cache_dir_defined;
+    string cache_dir = get_env_variable("HL_JIT_CACHE_DIR", cache_dir_defined);
+    if (!cache_dir.empty()) {
+        jit_module.ptr->cache_key = jit_cache_key(m);
+        if (!jit_module.ptr->cache_key.empty()) {
+            jit_module.ptr->cache_dir = cache_dir;
+        }
+    }
+    // This runs even if the object code is in the cache, because the
+    // execution engine still needs the module to find the entrypoints
+    // and their types, and the runtime modules it depends on. Only
+    // the LLVM backend is skipped on a hit.
     std::unique_ptr<llvm::Module> llvm_module(compile_module_to_llvm_module(m, jit_module.ptr->context));
     std::vector<JITModule> deps_with_runtime = dependencies;
     std::vector<JITModule> shared_runtime = JITSharedRuntime::get(llvm_module.get(), m.target());
@@ -287,6 +544,15 @@ void JITModule::compile_module(std::unique_ptr<llvm::Module> m, const string &fu
     start = end = nullptr;
     #endif
 
+    if (!jit_module.ptr->cache_key.empty()) {
+        #if LLVM_VERSION >= 36
+        jit_module.ptr->object_cache.reset(new JITObjectCache(jit_module.ptr->cache_dir, jit_module.ptr->cache_key));
+        ee->setObjectCache(jit_module.ptr->object_cache.get());
+        #else
+        debug(1) << "HL_JIT_CACHE_DIR requires LLVM 3.6 or later; not caching " << module_name << "\n";
+        #endif
+    }
+
     // Do any target-specific initialization
     std::vector<llvm::JITEventListener *> listeners;
 
@@ -456,6 +722,65 @@ void JITModule::memoization_cache_set_size(int64_t size) const {
     }
 }
 
+void JITModule::memoization_cache_set_eviction_policy(int policy) const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_set_eviction_policy");
+    if (f != exports().end()) {
+        return (reinterpret_bits<void (*)(int)>(f->second.address))(policy);
+    }
+}
+
+int JITModule::memoization_cache_set_file(const std::string &path, int64_t size) const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_set_file");
+    if (f != exports().end()) {
+        return (reinterpret_bits<int (*)(void *, const char *, int64_t)>(f->second.address))
+            (nullptr, path.empty() ? nullptr : path.c_str(), size);
+    }
+    return -1;
+}
+
+std::vector<halide_memoization_cache_func_stats> JITModule::memoization_cache_stats() const {
+    std::vector<halide_memoization_cache_func_stats> stats;
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_get_stats");
+    if (f != exports().end()) {
+        auto get_stats = reinterpret_bits<int (*)(halide_memoization_cache_func_stats *, int)>(f->second.address);
+        // The number of Funcs may grow between the two calls.
+        int n = get_stats(nullptr, 0);
+        stats.resize(n);
+        n = get_stats(stats.data(), n);
+        if ((size_t)n < stats.size()) {
+            stats.resize(n);
+        }
+    }
+    return stats;
+}
+
+void JITModule::memoization_cache_reset_stats() const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_reset_stats");
+    if (f != exports().end()) {
+        return (reinterpret_bits<void (*)()>(f->second.address))();
+    }
+}
+
+void JITModule::memoization_cache_report() const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_memoization_cache_report");
+    if (f != exports().end()) {
+        return (reinterpret_bits<void (*)(void *)>(f->second.address))(nullptr);
+    }
+}
+
+void JITModule::set_num_threads(int n) const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_set_num_threads");
+    if (f != exports().end()) {
+        return (reinterpret_bits<void (*)(int)>(f->second.address))(n);
+    }
+}
+
 bool JITModule::compiled() const {
   return jit_module.ptr->execution_engine != nullptr;
 }
@@ -466,6 +791,13 @@ JITHandlers runtime_internal_handlers;
 JITHandlers default_handlers;
 JITHandlers active_handlers;
 int64_t default_cache_size;
+int default_eviction_policy;
+std::string default_cache_file;
+int64_t default_cache_file_size;
+int default_num_threads;
+bool default_pooled_allocator;
+// The runtime's own malloc and free, before they were hooked.
+JITHandlers runtime_allocator;
 
 void merge_handlers(JITHandlers &base, const JITHandlers &addins) {
     if (addins.custom_print) {
@@ -611,6 +943,24 @@ JITModule &shared_runtimes(RuntimeKind k) {
     return m[k];
 }
 
+// Point the runtime's allocator at either the pooled allocator or the
+// default one. Must be called with the shared runtime mutex held.
+void set_runtime_allocator(bool pooled) {
+    runtime_internal_handlers.custom_malloc = runtime_allocator.custom_malloc;
+    runtime_internal_handlers.custom_free = runtime_allocator.custom_free;
+    if (pooled) {
+        const std::map<std::string, JITModule::Symbol> &exports = shared_runtimes(MainShared).exports();
+        std::map<std::string, JITModule::Symbol>::const_iterator m = exports.find("halide_pooled_malloc");
+        std::map<std::string, JITModule::Symbol>::const_iterator f = exports.find("halide_pooled_free");
+        if (m != exports.end() && f != exports.end()) {
+            runtime_internal_handlers.custom_malloc = reinterpret_bits<void *(*)(void *, size_t)>(m->second.address);
+            runtime_internal_handlers.custom_free = reinterpret_bits<void (*)(void *, void *)>(f->second.address);
+        }
+    }
+    active_handlers = runtime_internal_handlers;
+    merge_handlers(active_handlers, default_handlers);
+}
+
 JITModule &make_module(llvm::Module *for_module, Target target,
                        RuntimeKind runtime_kind, const std::vector<JITModule> &deps,
                        bool create) {
@@ -686,6 +1036,9 @@ JITModule &make_module(llvm::Module *for_module, Target target,
             runtime_internal_handlers.custom_free =
                 hook_function(shared_runtimes(MainShared).exports(), "halide_set_custom_free", free_handler);
 
+            runtime_allocator.custom_malloc = runtime_internal_handlers.custom_malloc;
+            runtime_allocator.custom_free = runtime_internal_handlers.custom_free;
+
             runtime_internal_handlers.custom_do_task =
                 hook_function(shared_runtimes(MainShared).exports(), "halide_set_custom_do_task", do_task_handler);
 
@@ -705,6 +1058,22 @@ JITModule &make_module(llvm::Module *for_module, Target target,
                 shared_runtimes(MainShared).memoization_cache_set_size(default_cache_size);
             }
 
+            if (default_eviction_policy != 0) {
+                shared_runtimes(MainShared).memoization_cache_set_eviction_policy(default_eviction_policy);
+            }
+
+            if (!default_cache_file.empty()) {
+                shared_runtimes(MainShared).memoization_cache_set_file(default_cache_file, default_cache_file_size);
+            }
+
+            if (default_num_threads != 0) {
+                shared_runtimes(MainShared).set_num_threads(default_num_threads);
+            }
+
+            if (default_pooled_allocator) {
+                set_runtime_allocator(true);
+            }
+
             runtime.jit_module.ptr->name = "MainShared";
         } else {
             runtime.jit_module.ptr->name = "GPU";
@@ -810,5 +1179,60 @@ void JITSharedRuntime::memoization_cache_set_size(int64_t size) {
     }
 }
 
+void JITSharedRuntime::memoization_cache_set_eviction_policy(int policy) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    if (policy != default_eviction_policy) {
+        default_eviction_policy = policy;
+        shared_runtimes(MainShared).memoization_cache_set_eviction_policy(policy);
+    }
+}
+
+int JITSharedRuntime::memoization_cache_set_file(const std::string &path, int64_t size) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    default_cache_file = path;
+    default_cache_file_size = size;
+    if (shared_runtimes(MainShared).compiled()) {
+        return shared_runtimes(MainShared).memoization_cache_set_file(path, size);
+    }
+    return 0;
+}
+
+std::vector<halide_memoization_cache_func_stats> JITSharedRuntime::memoization_cache_stats() {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+    return shared_runtimes(MainShared).memoization_cache_stats();
+}
+
+void JITSharedRuntime::memoization_cache_reset_stats() {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+    shared_runtimes(MainShared).memoization_cache_reset_stats();
+}
+
+void JITSharedRuntime::memoization_cache_report() {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+    shared_runtimes(MainShared).memoization_cache_report();
+}
+
+void JITSharedRuntime::use_pooled_allocator(bool enable) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    if (enable != default_pooled_allocator) {
+        default_pooled_allocator = enable;
+        if (shared_runtimes(MainShared).compiled()) {
+            set_runtime_allocator(enable);
+        }
+    }
+}
+
+void JITSharedRuntime::set_num_threads(int n) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    if (n != default_num_threads) {
+        default_num_threads = n;
+        shared_runtimes(MainShared).set_num_threads(n);
+    }
+}
+
 }
 }
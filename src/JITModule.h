@@ -133,6 +133,12 @@ struct JITModule {
     EXPORT int copy_to_host(struct buffer_t *buf) const;
     EXPORT int device_free(struct buffer_t *buf) const;
     EXPORT void memoization_cache_set_size(int64_t size) const;
+    EXPORT void memoization_cache_set_eviction_policy(int policy) const;
+    EXPORT int memoization_cache_set_file(const std::string &path, int64_t size) const;
+    EXPORT std::vector<halide_memoization_cache_func_stats> memoization_cache_stats() const;
+    EXPORT void memoization_cache_reset_stats() const;
+    EXPORT void memoization_cache_report() const;
+    EXPORT void set_num_threads(int n) const;
 
     /** Return true if compile_module has been called on this module. */
     EXPORT bool compiled() const;
@@ -172,6 +178,50 @@ public:
      */
     EXPORT static void memoization_cache_set_size(int64_t size);
 
+    /** Set the policy used to evict memoized results, as one of
+     * halide_memoization_cache_eviction_policy. If you are compiling
+     * statically, you should include HalideRuntime.h and call
+     * halide_memoization_cache_set_eviction_policy() instead.
+     */
+    EXPORT static void memoization_cache_set_eviction_policy(int policy);
+
+    /** Back the memoization cache with a file shared between
+     * processes. An empty path stops using a file. Returns zero on
+     * success. If you are compiling statically, you should include
+     * HalideRuntime.h and call halide_memoization_cache_set_file()
+     * instead.
+     */
+    EXPORT static int memoization_cache_set_file(const std::string &path, int64_t size = 0);
+
+    /** Get the memoization cache's counters for each memoized Func,
+     * reset them, or print them. If you are compiling statically, you
+     * should include HalideRuntime.h and call
+     * halide_memoization_cache_get_stats(),
+     * halide_memoization_cache_reset_stats() or
+     * halide_memoization_cache_report() instead.
+     */
+    // @{
+    EXPORT static std::vector<halide_memoization_cache_func_stats> memoization_cache_stats();
+    EXPORT static void memoization_cache_reset_stats();
+    EXPORT static void memoization_cache_report();
+    // @}
+
+    /** Make JIT-compiled code allocate with halide_pooled_malloc and
+     * halide_pooled_free, or go back to the default allocator. This
+     * doesn't affect Funcs with a custom allocator. If you are
+     * compiling statically, you should include HalideRuntime.h and
+     * pass those functions to halide_set_custom_malloc() and
+     * halide_set_custom_free() instead.
+     */
+    EXPORT static void use_pooled_allocator(bool enable);
+
+    /** Set the number of threads in the thread pool used by JIT
+     * compiled code. The pool is resized in place if it is already
+     * running. If you are compiling statically, you should include
+     * HalideRuntime.h and call halide_set_num_threads() instead.
+     */
+    EXPORT static void set_num_threads(int n);
+
     EXPORT static void release_all();
 };
 
@@ -75,16 +75,26 @@ DECLARE_CPP_INITMOD(android_clock)
 DECLARE_CPP_INITMOD(android_host_cpu_count)
 DECLARE_CPP_INITMOD(android_io)
 DECLARE_CPP_INITMOD(android_opengl_context)
+DECLARE_CPP_INITMOD(arm_spin_pause)
 DECLARE_CPP_INITMOD(ios_io)
 DECLARE_CPP_INITMOD(cuda)
 DECLARE_CPP_INITMOD(destructors)
 DECLARE_CPP_INITMOD(windows_cuda)
+DECLARE_CPP_INITMOD(fake_futex)
+DECLARE_CPP_INITMOD(fake_huge_pages)
+DECLARE_CPP_INITMOD(fake_perf_counters)
+DECLARE_CPP_INITMOD(fake_shared_file)
+DECLARE_CPP_INITMOD(fake_spin_pause)
 DECLARE_CPP_INITMOD(fake_thread_pool)
 DECLARE_CPP_INITMOD(float16_t)
 DECLARE_CPP_INITMOD(gcd_thread_pool)
 DECLARE_CPP_INITMOD(linux_clock)
+DECLARE_CPP_INITMOD(linux_futex)
 DECLARE_CPP_INITMOD(linux_host_cpu_count)
+DECLARE_CPP_INITMOD(linux_huge_pages)
 DECLARE_CPP_INITMOD(linux_opengl_context)
+DECLARE_CPP_INITMOD(linux_perf_counters)
+DECLARE_CPP_INITMOD(linux_shared_file)
 DECLARE_CPP_INITMOD(osx_opengl_context)
 DECLARE_CPP_INITMOD(opencl)
 DECLARE_CPP_INITMOD(windows_opencl)
@@ -120,6 +130,7 @@ DECLARE_CPP_INITMOD(osx_get_symbol)
 DECLARE_CPP_INITMOD(windows_get_symbol)
 DECLARE_CPP_INITMOD(renderscript)
 DECLARE_CPP_INITMOD(profiler)
+DECLARE_CPP_INITMOD(x86_spin_pause)
 DECLARE_CPP_INITMOD(profiler_inlined)
 DECLARE_CPP_INITMOD(runtime_api)
 #ifdef WITH_METAL
@@ -184,6 +195,18 @@ DECLARE_NO_INITMOD(powerpc)
 
 namespace {
 
+// The spin-wait hint used by the thread pool is an instruction that
+// depends on the architecture.
+std::unique_ptr<llvm::Module> get_initmod_spin_pause(llvm::LLVMContext *c, const Target &t, bool bits_64, bool debug) {
+    if (t.arch == Target::X86) {
+        return get_initmod_x86_spin_pause(c, bits_64, debug);
+    } else if (t.arch == Target::ARM) {
+        return get_initmod_arm_spin_pause(c, bits_64, debug);
+    } else {
+        return get_initmod_fake_spin_pause(c, bits_64, debug);
+    }
+}
+
 llvm::DataLayout get_data_layout_for_target(Target target) {
     if (target.arch == Target::X86) {
         if (target.bits == 32) {
@@ -624,11 +647,18 @@ std::unique_ptr<llvm::Module> get_initial_module_for_target(Target t, llvm::LLVM
             if (t.os == Target::Linux) {
                 if (t.arch == Target::X86) {
                     modules.push_back(get_initmod_linux_clock(c, bits_64, debug));
+                    modules.push_back(get_initmod_linux_futex(c, bits_64, debug));
+                    modules.push_back(get_initmod_linux_perf_counters(c, bits_64, debug));
                 } else {
                     modules.push_back(get_initmod_posix_clock(c, bits_64, debug));
+                    modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
+                    modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
                 }
                 modules.push_back(get_initmod_posix_io(c, bits_64, debug));
                 modules.push_back(get_initmod_linux_host_cpu_count(c, bits_64, debug));
+                modules.push_back(get_initmod_linux_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_linux_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_spin_pause(c, t, bits_64, debug));
                 modules.push_back(get_initmod_posix_thread_pool(c, bits_64, debug));
                 modules.push_back(get_initmod_posix_get_symbol(c, bits_64, debug));
             } else if (t.os == Target::OSX) {
@@ -636,6 +666,10 @@ std::unique_ptr<llvm::Module> get_initial_module_for_target(Target t, llvm::LLVM
                 modules.push_back(get_initmod_posix_io(c, bits_64, debug));
                 modules.push_back(get_initmod_gcd_thread_pool(c, bits_64, debug));
                 modules.push_back(get_initmod_osx_get_symbol(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
             } else if (t.os == Target::Android) {
                 if (t.arch == Target::ARM) {
                     modules.push_back(get_initmod_android_clock(c, bits_64, debug));
@@ -644,6 +678,11 @@ std::unique_ptr<llvm::Module> get_initial_module_for_target(Target t, llvm::LLVM
                 }
                 modules.push_back(get_initmod_android_io(c, bits_64, debug));
                 modules.push_back(get_initmod_android_host_cpu_count(c, bits_64, debug));
+                modules.push_back(get_initmod_linux_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_linux_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
+                modules.push_back(get_initmod_spin_pause(c, t, bits_64, debug));
                 modules.push_back(get_initmod_posix_thread_pool(c, bits_64, debug));
                 modules.push_back(get_initmod_posix_get_symbol(c, bits_64, debug));
             } else if (t.os == Target::Windows) {
@@ -651,6 +690,10 @@ std::unique_ptr<llvm::Module> get_initial_module_for_target(Target t, llvm::LLVM
                 modules.push_back(get_initmod_windows_io(c, bits_64, debug));
                 modules.push_back(get_initmod_windows_thread_pool(c, bits_64, debug));
                 modules.push_back(get_initmod_windows_get_symbol(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
                 if (t.has_feature(Target::MinGW)) {
                     modules.push_back(get_initmod_mingw_math(c, bits_64, debug));
                 }
@@ -658,10 +701,19 @@ std::unique_ptr<llvm::Module> get_initial_module_for_target(Target t, llvm::LLVM
                 modules.push_back(get_initmod_posix_clock(c, bits_64, debug));
                 modules.push_back(get_initmod_ios_io(c, bits_64, debug));
                 modules.push_back(get_initmod_gcd_thread_pool(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
             } else if (t.os == Target::NaCl) {
                 modules.push_back(get_initmod_posix_clock(c, bits_64, debug));
                 modules.push_back(get_initmod_posix_io(c, bits_64, debug));
                 modules.push_back(get_initmod_nacl_host_cpu_count(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_shared_file(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_huge_pages(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_perf_counters(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_futex(c, bits_64, debug));
+                modules.push_back(get_initmod_fake_spin_pause(c, bits_64, debug));
                 modules.push_back(get_initmod_posix_thread_pool(c, bits_64, debug));
                 modules.push_back(get_initmod_ssp(c, bits_64, debug));
             }
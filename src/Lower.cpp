@@ -18,6 +18,7 @@
 #include "FindCalls.h"
 #include "Function.h"
 #include "FuseGPUThreadLoops.h"
+#include "HoistAllocations.h"
 #include "InjectHostDevBufferCopies.h"
 #include "InjectImageIntrinsics.h"
 #include "InjectOpenGLIntrinsics.h"
@@ -26,6 +27,7 @@
 #include "IROperator.h"
 #include "IRPrinter.h"
 #include "Memoization.h"
+#include "MemoryPlanning.h"
 #include "PartitionLoops.h"
 #include "Profiling.h"
 #include "Qualify.h"
@@ -223,10 +225,34 @@ Stmt lower(const vector<Function> &outputs, const string &pipeline_name, const T
     s = simplify(s);
     debug(2) << "Lowering after partitioning loops:\n" << s << "\n\n";
 
+    debug(1) << "Hoisting loop-invariant allocations...\n";
+    s = hoist_allocations(s);
+    debug(2) << "Lowering after hoisting allocations:\n" << s << "\n\n";
+
     debug(1) << "Injecting early frees...\n";
     s = inject_early_frees(s);
     debug(2) << "Lowering after injecting early frees:\n" << s << "\n\n";
 
+    // Memory profiling counts each Func's own allocations, so it goes
+    // before any of them are made to share storage.
+    if (t.has_feature(Target::Profile)) {
+        debug(1) << "Injecting memory profiling...\n";
+        s = inject_memory_profiling(s);
+        debug(2) << "Lowering after injecting memory profiling:\n" << s << "\n\n";
+    }
+
+    // Device buffers are tracked by name, so only plan memory for
+    // pipelines that run entirely on the host.
+    if (t.has_feature(Target::PlanMemory) &&
+        !t.has_gpu_feature() &&
+        !t.has_feature(Target::OpenGLCompute) &&
+        !t.has_feature(Target::OpenGL) &&
+        !t.has_feature(Target::Renderscript)) {
+        debug(1) << "Planning memory...\n";
+        s = plan_memory(s);
+        debug(2) << "Lowering after planning memory:\n" << s << "\n\n";
+    }
+
     debug(1) << "Simplifying...\n";
     s = common_subexpression_elimination(s);
 
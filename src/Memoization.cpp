@@ -8,6 +8,7 @@
 #include "Var.h"
 
 #include <map>
+#include <sstream>
 
 namespace Halide {
 namespace Internal {
@@ -140,11 +141,27 @@ public:
 
 typedef std::pair<FindParameterDependencies::DependencyKey, FindParameterDependencies::DependencyInfo> DependencyKeyInfoPair;
 
+// A 64-bit FNV-1a hash of the printed lowered computation of a
+// memoized Func.
+uint64_t hash_definition(Stmt produce, Stmt update) {
+    std::ostringstream text;
+    text << produce;
+    if (update.defined()) {
+        text << update;
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : text.str()) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
 class KeyInfo {
     FindParameterDependencies dependencies;
     Expr key_size_expr;
     const std::string &top_level_name;
     const std::string &function_name;
+    uint64_t definition_hash;
 
     size_t parameters_alignment() {
         int32_t max_alignment = 0;
@@ -175,6 +192,13 @@ class KeyInfo {
 // There is a plan to change the hash function used in the cache and
 // after that happens, we'll measure performance again and maybe decide
 // to choose one path or the other here and remove the #ifdef.
+//
+// The pointer and counter only mean something within one process, so
+// the memoization cache file (see halide_memoization_cache_set_file)
+// replaces them with the pipeline and Func names. Keep them as the
+// first Handle().bytes() + 4 bytes of the key. Names don't change when
+// the Func's definition or schedule does, so they are followed by a
+// hash of its lowered computation, which the file keeps.
 #define USE_FULL_NAMES_IN_KEY 0
 #if USE_FULL_NAMES_IN_KEY
     Stmt call_copy_memory(const std::string &key_name, const std::string &value, Expr index) {
@@ -190,8 +214,8 @@ class KeyInfo {
 #endif
 
 public:
-  KeyInfo(const Function &function, const std::string &name)
-        : top_level_name(name), function_name(function.name())
+  KeyInfo(const Function &function, const std::string &name, uint64_t definition_hash)
+        : top_level_name(name), function_name(function.name()), definition_hash(definition_hash)
     {
         dependencies.visit_function(function);
         size_t size_so_far = 0;
@@ -202,6 +226,8 @@ public:
 #else
         size_so_far += Handle().bytes() + 4;
 #endif
+        size_so_far = (size_so_far + 3) & ~3;
+        size_so_far += 8;
 
         size_t needed_alignment = parameters_alignment();
         if (needed_alignment > 1) {
@@ -276,6 +302,19 @@ public:
         index += 4;
 #endif
 
+        while (alignment % 4) {
+            writes.push_back(Store::make(key_name, Cast::make(UInt(8), 0), index));
+            index = index + 1;
+            alignment++;
+        }
+        for (int i = 0; i < 2; i++) {
+            writes.push_back(Store::make(key_name,
+                                         (int32_t)(uint32_t)(definition_hash >> (32 * i)),
+                                         (index / Int(32).bytes())));
+            alignment += 4;
+            index += 4;
+        }
+
         size_t needed_alignment = parameters_alignment();
         if (needed_alignment > 1) {
             while (alignment % needed_alignment) {
@@ -321,13 +360,15 @@ public:
             }
         }
         args.push_back(Call::make(type_of<buffer_t **>(), Call::make_struct, buffers, Call::Intrinsic));
+        args.push_back(StringImm::make(top_level_name));
+        args.push_back(StringImm::make(function_name));
 
-        return Call::make(Int(32), "halide_memoization_cache_lookup", args, Call::Extern);
+        return Call::make(Int(32), "halide_memoization_cache_lookup_v2", args, Call::Extern);
     }
 
     // Returns a statement which will store the result of a computation under this key
     Stmt store_computation(std::string key_allocation_name, std::string computed_bounds_name,
-                           int32_t tuple_count, std::string storage_base_name) {
+                           int32_t tuple_count, std::string storage_base_name, Expr compute_time) {
         std::vector<Expr> args;
         args.push_back(Call::make(type_of<uint8_t *>(), Call::address_of,
                                   {Load::make(type_of<uint8_t>(), key_allocation_name, Expr(0), Buffer(), Parameter())},
@@ -344,9 +385,12 @@ public:
             }
         }
         args.push_back(Call::make(type_of<buffer_t **>(), Call::make_struct, buffers, Call::Intrinsic));
+        args.push_back(compute_time);
+        args.push_back(StringImm::make(top_level_name));
+        args.push_back(StringImm::make(function_name));
 
         // This is actually a void call. How to indicate that? Look at Extern_ stuff.
-        return Evaluate::make(Call::make(Bool(), "halide_memoization_cache_store", args, Call::Extern));
+        return Evaluate::make(Call::make(Bool(), "halide_memoization_cache_store_v2", args, Call::Extern));
     }
 };
 
@@ -395,17 +439,25 @@ private:
             Stmt update = mutate(op->update);
             Stmt consume = mutate(op->consume);
 
-            KeyInfo key_info(f, top_level_name);
+            KeyInfo key_info(f, top_level_name, hash_definition(op->produce, op->update));
 
             std::string cache_key_name = op->name + ".cache_key";
             std::string cache_result_name = op->name + ".cache_result";
             std::string cache_miss_name = op->name + ".cache_miss";
             std::string computed_bounds_name = op->name + ".computed_bounds.buffer";
+            std::string compute_start_name = op->name + ".compute_start";
 
             Expr cache_miss = Variable::make(Bool(), cache_miss_name);
 
+            // Time the computation on a miss, so the cache can weigh
+            // what an entry cost to compute when choosing what to
+            // evict.
+            Expr now = Call::make(Int(64), "halide_current_time_ns", {}, Call::Extern);
+            Expr compute_time = now - Variable::make(Int(64), compute_start_name);
+
             Stmt cache_store_back =
-                IfThenElse::make(cache_miss, key_info.store_computation(cache_key_name, computed_bounds_name, f.outputs(), op->name));
+                IfThenElse::make(cache_miss, key_info.store_computation(cache_key_name, computed_bounds_name,
+                                                                        f.outputs(), op->name, compute_time));
 
             Stmt mutated_produce = IfThenElse::make(cache_miss, produce);
             Stmt mutated_update =
@@ -414,6 +466,11 @@ private:
             Stmt mutated_consume = Block::make(cache_store_back, consume);
 
             Stmt mutated_pipeline = ProducerConsumer::make(op->name, mutated_produce, mutated_update, mutated_consume);
+            mutated_pipeline = LetStmt::make(compute_start_name,
+                                             Call::make(Int(64), Call::if_then_else,
+                                                        {cache_miss, now, make_zero(Int(64))},
+                                                        Call::Intrinsic),
+                                             mutated_pipeline);
             Stmt cache_miss_marker = LetStmt::make(cache_miss_name,
                                                    Cast::make(Bool(), Variable::make(Int(32), cache_result_name)),
                                                    mutated_pipeline);
@@ -549,7 +606,7 @@ private:
                 body = Allocate::make(allocation->name, allocation->type, allocation->extents, allocation->condition, body,
                                       Call::make(Handle(), Call::extract_buffer_host,
                                                  { Variable::make(Handle(), allocation->name + ".buffer") }, Call::Intrinsic),
-                                      "halide_memoization_cache_release");
+                                      "halide_memoization_cache_release", allocation->memory_type);
             }
 
             pending_memoized_allocations.erase(innermost_realization_name);
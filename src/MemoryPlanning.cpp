@@ -0,0 +1,459 @@
+#include <map>
+#include <set>
+
+#include "MemoryPlanning.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "IRPrinter.h"
+#include "IRVisitor.h"
+#include "Scope.h"
+#include "Simplify.h"
+#include "Substitute.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::pair;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Checks if an expression loads from memory or calls anything that
+// might not be pure. Either would make it unsafe to evaluate the
+// expression at another point in the program, or twice.
+class MayNotBeMoved : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Load *op) {
+        result = true;
+    }
+
+    void visit(const Call *op) {
+        // Only arithmetic intrinsics are known to be pure. Extern
+        // calls may have side effects, and image and Halide calls
+        // are loads.
+        if (op->call_type == Call::Intrinsic &&
+            (op->name == Call::bitwise_and ||
+             op->name == Call::bitwise_not ||
+             op->name == Call::bitwise_xor ||
+             op->name == Call::bitwise_or ||
+             op->name == Call::shift_left ||
+             op->name == Call::shift_right ||
+             op->name == Call::abs ||
+             op->name == Call::absd ||
+             op->name == Call::reinterpret ||
+             op->name == Call::popcount ||
+             op->name == Call::count_leading_zeros ||
+             op->name == Call::count_trailing_zeros)) {
+            IRVisitor::visit(op);
+        } else {
+            result = true;
+        }
+    }
+
+public:
+    bool result;
+    MayNotBeMoved() : result(false) {}
+};
+
+bool may_not_be_moved(Expr e) {
+    MayNotBeMoved c;
+    e.accept(&c);
+    return c.result;
+}
+
+// Rewrite an expression in terms of the first 'depth' of the given
+// lets, by substituting in the values of the rest, or return an
+// undefined Expr if that isn't safe.
+Expr substitute_lets(Expr e, const vector<pair<string, Expr>> &lets, size_t depth) {
+    for (size_t i = lets.size(); i > depth; i--) {
+        if (!lets[i - 1].second.defined()) {
+            // A loop variable.
+            return Expr();
+        }
+        e = substitute(lets[i - 1].first, lets[i - 1].second, e);
+    }
+    if (may_not_be_moved(e)) {
+        return Expr();
+    }
+    return simplify(e);
+}
+
+// Walk the allocations in execution order, and decide which ones can
+// reuse the storage of an earlier allocation that has already been
+// freed.
+class PlanAllocations : public IRVisitor {
+    // A heap allocation that other allocations may reuse.
+    struct Backing {
+        string name;
+        // The size in bytes of each allocation that uses this
+        // backing, in terms of the variables in scope at the
+        // backing's Allocate node.
+        vector<Expr> sizes;
+        // How many lets were in scope at the backing's Allocate node.
+        size_t let_depth;
+        // Whether one of the allocations using this backing is still
+        // in use.
+        bool live;
+        // The allocation currently using it.
+        string user;
+        // The indices into 'events' of the allocation and the last
+        // free.
+        int start, end;
+        // The lets in scope at the backing's Allocate node, for
+        // backings outside of any loop.
+        vector<pair<string, Expr>> lets;
+    };
+
+    // The backings available at this point, innermost last. Hidden
+    // when entering a loop or a branch.
+    vector<Backing *> pool;
+
+    // Every backing allocated outside of any loop or branch, for
+    // computing the peak footprint.
+    vector<Backing *> top_level;
+    int events;
+    int loop_depth;
+
+    // The lets in scope, in order.
+    vector<pair<string, Expr>> lets;
+
+    using IRVisitor::visit;
+
+    // Stack allocations are already reused by codegen.
+    bool may_share(const Allocate *op) {
+        return (!op->new_expr.defined() &&
+                op->free_function.empty() &&
+                is_one(op->condition) &&
+                !op->type.is_handle() &&
+                !is_stack_allocation(op));
+    }
+
+    // The size of an allocation in bytes. Codegen pads heap
+    // allocations with one extra element, because we may load one
+    // scalar past the end, so we do the same here in case a backing
+    // has a smaller element type than the allocations using it.
+    Expr size_in_bytes(const Allocate *op) {
+        Expr size = make_const(Int(64), op->type.bytes());
+        for (Expr e : op->extents) {
+            size *= cast<int64_t>(e);
+        }
+        return size + op->type.bytes();
+    }
+
+    void visit(const LetStmt *op) {
+        op->value.accept(this);
+        lets.push_back({op->name, op->value});
+        if (op->name == "profiler_state") {
+            profiler_depth = (int)lets.size();
+        }
+        op->body.accept(this);
+        lets.pop_back();
+    }
+
+    void visit_hidden(Stmt s) {
+        vector<Backing *> old_pool;
+        old_pool.swap(pool);
+        loop_depth++;
+        s.accept(this);
+        loop_depth--;
+        old_pool.swap(pool);
+    }
+
+    void visit(const For *op) {
+        op->min.accept(this);
+        op->extent.accept(this);
+        lets.push_back({op->name, Expr()});
+        visit_hidden(op->body);
+        lets.pop_back();
+    }
+
+    void visit(const IfThenElse *op) {
+        op->condition.accept(this);
+        visit_hidden(op->then_case);
+        if (op->else_case.defined()) {
+            visit_hidden(op->else_case);
+        }
+    }
+
+    void visit(const Allocate *op) {
+        for (Expr e : op->extents) {
+            e.accept(this);
+        }
+
+        if (!may_share(op)) {
+            op->body.accept(this);
+            return;
+        }
+
+        Expr size = size_in_bytes(op);
+
+        // Look for a dead backing, innermost first.
+        Backing *backing = nullptr;
+        Expr backing_size;
+        for (size_t i = pool.size(); i > 0 && !backing; i--) {
+            Backing *b = pool[i - 1];
+            if (b->live) continue;
+            // For loops bind a name to an undefined Expr, but the
+            // pool is hidden across loops so we never substitute
+            // one.
+            backing_size = substitute_lets(size, lets, b->let_depth);
+            if (backing_size.defined()) {
+                backing = b;
+            }
+        }
+
+        if (backing) {
+            debug(3) << "Allocation " << op->name << " reuses the storage of " << backing->name << "\n";
+            backing->sizes.push_back(backing_size);
+            backing->live = true;
+            backing->user = op->name;
+            aliases[op->name] = backing->name;
+            freed_early.insert(backing->name);
+            op->body.accept(this);
+            if (backing->live) {
+                // We didn't see the free, so it must be inside a loop
+                // or a branch. It is still the last one.
+                backing->live = false;
+                backing->end = events++;
+                last_free[backing->name] = op->name;
+            }
+            return;
+        }
+
+        Backing *b = new Backing;
+        b->name = op->name;
+        b->sizes.push_back(size);
+        b->let_depth = lets.size();
+        b->live = true;
+        b->user = op->name;
+        b->start = b->end = events++;
+        backings.push_back(b);
+        pool.push_back(b);
+        if (loop_depth == 0) {
+            b->lets = lets;
+            top_level.push_back(b);
+        }
+
+        op->body.accept(this);
+
+        internal_assert(pool.back() == b);
+        pool.pop_back();
+        if (b->live) {
+            b->live = false;
+            b->end = events++;
+        }
+    }
+
+    void visit(const Free *op) {
+        for (Backing *b : pool) {
+            if (b->live && b->user == op->name) {
+                b->live = false;
+                b->end = events++;
+                // Only the last free of each backing stays.
+                last_free[b->name] = op->name;
+            }
+        }
+    }
+
+public:
+    vector<Backing *> backings;
+    map<string, string> aliases;
+    set<string> freed_early;
+    map<string, string> last_free;
+
+    // How many lets are in scope inside the one that defines
+    // profiler_state, or -1 if the pipeline isn't being profiled.
+    int profiler_depth;
+
+    PlanAllocations() : events(0), loop_depth(0), profiler_depth(-1) {}
+
+    ~PlanAllocations() {
+        for (Backing *b : backings) {
+            delete b;
+        }
+    }
+
+    // The capacity of a backing in bytes.
+    Expr capacity(const string &name) {
+        for (Backing *b : backings) {
+            if (b->name == name) {
+                Expr size = b->sizes[0];
+                for (size_t i = 1; i < b->sizes.size(); i++) {
+                    size = max(size, b->sizes[i]);
+                }
+                return simplify(size);
+            }
+        }
+        return Expr();
+    }
+
+    // The largest total size of the backings outside of any loop
+    // that are allocated at the same time, in terms of the first
+    // 'depth' lets in scope at the top of the pipeline. Undefined if
+    // it can't be written that way.
+    Expr peak_footprint(size_t depth) {
+        vector<Expr> sizes;
+        for (Backing *b : top_level) {
+            if (b->let_depth < depth) {
+                return Expr();
+            }
+            Expr size = substitute_lets(capacity(b->name), b->lets, depth);
+            if (!size.defined()) {
+                return Expr();
+            }
+            sizes.push_back(size);
+        }
+        Expr peak = make_zero(Int(64));
+        for (size_t i = 0; i < top_level.size(); i++) {
+            Expr total = make_zero(Int(64));
+            for (size_t j = 0; j < top_level.size(); j++) {
+                Backing *other = top_level[j];
+                if (other->start <= top_level[i]->start && top_level[i]->start <= other->end) {
+                    total += sizes[j];
+                }
+            }
+            peak = max(peak, total);
+        }
+        return simplify(peak);
+    }
+};
+
+// Report the planned peak footprint to the profiler at the start of
+// the pipeline.
+class ReportPeakFootprint : public IRMutator {
+    Expr peak;
+
+    using IRMutator::visit;
+
+    void visit(const LetStmt *op) {
+        if (op->name != "profiler_state") {
+            IRMutator::visit(op);
+            return;
+        }
+        Expr profiler_token = Variable::make(Int(32), "profiler_token");
+        Expr profiler_state = Variable::make(Handle(), "profiler_state");
+        Stmt report = Evaluate::make(Call::make(Int(32), "halide_profiler_memory_planned",
+                                                {profiler_state, profiler_token, cast<uint64_t>(peak)},
+                                                Call::Extern));
+        stmt = LetStmt::make(op->name, op->value, Block::make(report, op->body));
+    }
+
+public:
+    ReportPeakFootprint(Expr p) : peak(p) {}
+};
+
+// Apply the plan: rename each aliased allocation to its backing,
+// remove its Allocate node, keep only the last free of each backing,
+// and grow each backing to fit everything that uses it.
+class ShareAllocations : public IRMutator {
+    PlanAllocations &plan;
+
+    using IRMutator::visit;
+
+    string backing_of(const string &name) {
+        map<string, string>::const_iterator iter = plan.aliases.find(name);
+        if (iter == plan.aliases.end()) {
+            return name;
+        }
+        return iter->second;
+    }
+
+    void visit(const Allocate *op) {
+        Stmt body = mutate(op->body);
+        if (plan.aliases.count(op->name)) {
+            stmt = body;
+        } else if (plan.freed_early.count(op->name)) {
+            // Round the capacity up to a whole number of elements.
+            Expr bytes = plan.capacity(op->name);
+            int elem_size = op->type.bytes();
+            Expr extent = simplify((bytes + (elem_size - 1)) / elem_size);
+            stmt = Allocate::make(op->name, op->type, {extent}, op->condition, body,
+                                  op->new_expr, op->free_function, op->memory_type);
+        } else if (body.same_as(op->body)) {
+            stmt = op;
+        } else {
+            stmt = Allocate::make(op->name, op->type, op->extents, op->condition, body,
+                                  op->new_expr, op->free_function, op->memory_type);
+        }
+    }
+
+    void visit(const Free *op) {
+        string backing = backing_of(op->name);
+        if (backing == op->name && !plan.freed_early.count(op->name)) {
+            stmt = op;
+        } else if (plan.last_free[backing] == op->name) {
+            stmt = Free::make(backing);
+        } else {
+            stmt = Evaluate::make(0);
+        }
+    }
+
+    void visit(const Load *op) {
+        string backing = backing_of(op->name);
+        Expr index = mutate(op->index);
+        if (backing == op->name && index.same_as(op->index)) {
+            expr = op;
+        } else {
+            expr = Load::make(op->type, backing, index, op->image, op->param);
+        }
+    }
+
+    void visit(const Store *op) {
+        string backing = backing_of(op->name);
+        Expr value = mutate(op->value);
+        Expr index = mutate(op->index);
+        if (backing == op->name && value.same_as(op->value) && index.same_as(op->index)) {
+            stmt = op;
+        } else {
+            stmt = Store::make(backing, value, index);
+        }
+    }
+
+    void visit(const Variable *op) {
+        if (ends_with(op->name, ".host")) {
+            string name = op->name.substr(0, op->name.size() - 5);
+            string backing = backing_of(name);
+            if (backing != name) {
+                expr = Variable::make(op->type, backing + ".host");
+                return;
+            }
+        }
+        expr = op;
+    }
+
+public:
+    ShareAllocations(PlanAllocations &p) : plan(p) {}
+};
+
+}
+
+Stmt plan_memory(Stmt s) {
+    PlanAllocations plan;
+    s.accept(&plan);
+
+    debug(1) << "Memory planning: " << plan.aliases.size() << " of "
+             << plan.aliases.size() + plan.backings.size()
+             << " heap allocations reuse the storage of an earlier one\n";
+    Expr peak = plan.peak_footprint(0);
+    if (peak.defined()) {
+        debug(1) << "Planned peak footprint in bytes: " << peak << "\n";
+    }
+
+    if (!plan.aliases.empty()) {
+        s = ShareAllocations(plan).mutate(s);
+    }
+    if (plan.profiler_depth >= 0) {
+        peak = plan.peak_footprint(plan.profiler_depth);
+        if (peak.defined()) {
+            s = ReportPeakFootprint(peak).mutate(s);
+        }
+    }
+    return s;
+}
+
+}
+}
@@ -0,0 +1,35 @@
+#ifndef HALIDE_MEMORY_PLANNING_H
+#define HALIDE_MEMORY_PLANNING_H
+
+/** \file
+ * Defines the lowering pass that lets heap allocations with
+ * non-overlapping live ranges share storage.
+ */
+
+#include "IR.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Find heap allocations that begin after an enclosing heap
+ * allocation has been marked dead by inject_early_frees, and make them
+ * reuse the enclosing allocation's storage instead of calling malloc
+ * again. The enclosing allocation is grown to fit every buffer that
+ * reuses it, and is freed after the last of them. Allocations are
+ * never shared across a loop or if-then-else boundary. Must be called
+ * after inject_early_frees, and after inject_memory_profiling so that
+ * the profiler still attributes each allocation to its own Func. Only
+ * runs for targets with the PlanMemory feature.
+ *
+ * Sizes are only moved to an earlier allocation when they can be
+ * computed there without loads or calls that might have side
+ * effects. The planned peak footprint of the allocations outside of
+ * any loop is reported at debug level 1, and if the pipeline is being
+ * profiled, it is passed to halide_profiler_memory_planned when the
+ * pipeline starts. */
+Stmt plan_memory(Stmt s);
+
+}
+}
+
+#endif
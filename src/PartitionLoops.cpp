@@ -666,7 +666,8 @@ class RenormalizeGPULoops : public IRMutator {
                 IRMutator::visit(op);
             } else {
                 Stmt inner = LetStmt::make(op->name, op->value, a->body);
-                inner = Allocate::make(a->name, a->type, a->extents, a->condition, inner);
+                inner = Allocate::make(a->name, a->type, a->extents, a->condition, inner,
+                                       a->new_expr, a->free_function, a->memory_type);
                 stmt = mutate(inner);
             }
         } else {
@@ -6,6 +6,8 @@
 #include "Profiling.h"
 #include "IRMutator.h"
 #include "IROperator.h"
+#include "IRVisitor.h"
+#include "Simplify.h"
 
 namespace Halide {
 namespace Internal {
@@ -20,7 +22,7 @@ public:
 
     vector<int> stack; // What produce nodes are we currently inside of.
 
-    InjectProfiling() {
+    InjectProfiling() : in_task(false) {
         indices["overhead"] = 0;
         stack.push_back(0);
     }
@@ -28,6 +30,28 @@ public:
 private:
     using IRMutator::visit;
 
+    // Are we inside the body of a parallel loop. If so, the current
+    // func is tracked in a per-thread slot.
+    bool in_task;
+
+    // Make a statement that sets the current func to the given
+    // value. This call gets inlined and becomes a single store
+    // instruction, plus a check of whether the timeline is enabled.
+    Stmt set_current_func(Expr t) {
+        Expr profiler_token = Variable::make(Int(32), "profiler_token");
+        Expr profiler_state = Variable::make(Handle(), "profiler_state");
+        Expr call;
+        if (in_task) {
+            Expr slot = Variable::make(Handle(), "profiler_thread_slot");
+            call = Call::make(Int(32), "halide_profiler_set_thread_func",
+                              {profiler_state, slot, profiler_token, t}, Call::Extern);
+        } else {
+            call = Call::make(Int(32), "halide_profiler_set_current_func",
+                              {profiler_state, profiler_token, t}, Call::Extern);
+        }
+        return Evaluate::make(call);
+    }
+
     void visit(const ProducerConsumer *op) {
         int idx;
         map<string, int>::iterator iter = indices.find(op->name);
@@ -45,26 +69,133 @@ private:
 
         Stmt consume = mutate(op->consume);
 
+        // At the beginning of the consume step, set the current task
+        // back to the outer one.
+        produce = Block::make(set_current_func(idx), produce);
+        consume = Block::make(set_current_func(stack.back()), consume);
+
+        stmt = ProducerConsumer::make(op->name, produce, update, consume);
+    }
+
+    void visit(const For *op) {
+        // We profile by storing a token to global memory, so don't enter GPU loops
+        if (op->device_api != DeviceAPI::Parent &&
+            op->device_api != DeviceAPI::Host) {
+            stmt = op;
+        } else if (op->for_type == ForType::Parallel) {
+            bool old_in_task = in_task;
+            in_task = true;
+            Stmt body = mutate(op->body);
+            in_task = old_in_task;
+
+            // Each task claims a slot of its own for the duration,
+            // so that the sampling thread can see what every thread
+            // is doing.
+            Expr profiler_token = Variable::make(Int(32), "profiler_token");
+            Expr profiler_state = Variable::make(Handle(), "profiler_state");
+            Expr slot = Variable::make(Handle(), "profiler_thread_slot");
+            Expr acquire = Call::make(Handle(), "halide_profiler_acquire_thread_slot",
+                                      {profiler_state, profiler_token + stack.back()}, Call::Extern);
+            Expr release = Call::make(Int(32), Call::register_destructor,
+                                      {Expr("halide_profiler_release_thread_slot"), slot}, Call::Intrinsic);
+            body = LetStmt::make("profiler_thread_slot", acquire,
+                                 Block::make(Evaluate::make(release), body));
+            Stmt loop = For::make(op->name, op->min, op->extent, op->for_type, op->device_api, body);
+
+            // While the tasks run, this thread is waiting on them
+            // rather than running the current func itself.
+            Expr waiting = (halide_profiler_waiting - (profiler_token + stack.back())) - profiler_token;
+            stmt = Block::make(set_current_func(waiting),
+                               Block::make(loop, set_current_func(stack.back())));
+        } else {
+            IRMutator::visit(op);
+        }
+    }
+};
+
+// Recover the mapping from func names to profiler ids from the
+// stores to the array of func names made by inject_profiling.
+class FindProfilerIndices : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Store *op) {
+        if (op->name == "profiling_func_names") {
+            const StringImm *name = op->value.as<StringImm>();
+            const IntImm *idx = op->index.as<IntImm>();
+            if (name && idx) {
+                indices[name->value] = (int)idx->value;
+            }
+        }
+        IRVisitor::visit(op);
+    }
+
+public:
+    map<string, int> indices;
+};
+
+class InjectMemoryProfiling : public IRMutator {
+    const map<string, int> &indices;
+
+    // The profiler id and size in bytes of the heap allocations in
+    // scope.
+    map<string, std::pair<int, Expr>> allocations;
+
+    using IRMutator::visit;
+
+    // Find the profiler id of the func an allocation belongs to. The
+    // buffers of Funcs that return Tuples have the index of the
+    // tuple element appended to their name.
+    int find_index(const string &name) {
+        map<string, int>::const_iterator iter = indices.find(name);
+        if (iter == indices.end()) {
+            size_t dot = name.rfind('.');
+            if (dot != string::npos) {
+                iter = indices.find(name.substr(0, dot));
+            }
+        }
+        return iter == indices.end() ? -1 : iter->second;
+    }
+
+    Stmt record(const string &fn, int idx, Expr size) {
         Expr profiler_token = Variable::make(Int(32), "profiler_token");
         Expr profiler_state = Variable::make(Handle(), "profiler_state");
+        return Evaluate::make(Call::make(Int(32), fn, {profiler_state, profiler_token + idx, size},
+                                         Call::Extern));
+    }
 
-        // This call gets inlined and becomes a single store instruction.
-        Expr set_task = Call::make(Int(32), "halide_profiler_set_current_func",
-                                   {profiler_state, profiler_token, idx}, Call::Extern);
+    void visit(const Allocate *op) {
+        int idx = find_index(op->name);
+        if (idx < 0 || op->new_expr.defined() || is_stack_allocation(op)) {
+            IRMutator::visit(op);
+            return;
+        }
 
-        // At the beginning of the consume step, set the current task
-        // back to the outer one.
-        Expr set_outer_task = Call::make(Int(32), "halide_profiler_set_current_func",
-                                         {profiler_state, profiler_token, stack.back()}, Call::Extern);
+        Expr size = make_const(UInt(64), op->type.bytes());
+        for (Expr e : op->extents) {
+            size *= cast<uint64_t>(e);
+        }
+        size = simplify(select(op->condition, size, make_zero(UInt(64))));
 
-        produce = Block::make(Evaluate::make(set_task), produce);
-        consume = Block::make(Evaluate::make(set_outer_task), consume);
+        allocations[op->name] = {idx, size};
+        Stmt body = mutate(op->body);
+        allocations.erase(op->name);
 
-        stmt = ProducerConsumer::make(op->name, produce, update, consume);
+        body = Block::make(record("halide_profiler_memory_allocate", idx, size), body);
+        stmt = Allocate::make(op->name, op->type, op->extents, op->condition, body,
+                              op->new_expr, op->free_function, op->memory_type);
+    }
+
+    void visit(const Free *op) {
+        map<string, std::pair<int, Expr>>::const_iterator iter = allocations.find(op->name);
+        if (iter == allocations.end()) {
+            stmt = op;
+        } else {
+            stmt = Block::make(op, record("halide_profiler_memory_free", iter->second.first, iter->second.second));
+        }
     }
 
     void visit(const For *op) {
-        // We profile by storing a token to global memory, so don't enter GPU loops
+        // Don't enter GPU loops.
         if (op->device_api == DeviceAPI::Parent ||
             op->device_api == DeviceAPI::Host) {
             IRMutator::visit(op);
@@ -72,6 +203,9 @@ private:
             stmt = op;
         }
     }
+
+public:
+    InjectMemoryProfiling(const map<string, int> &i) : indices(i) {}
 };
 
 Stmt inject_profiling(Stmt s, string pipeline_name) {
@@ -111,5 +245,11 @@ Stmt inject_profiling(Stmt s, string pipeline_name) {
     return s;
 }
 
+Stmt inject_memory_profiling(Stmt s) {
+    FindProfilerIndices find;
+    s.accept(&find);
+    return InjectMemoryProfiling(find.indices).mutate(s);
+}
+
 }
 }
@@ -19,6 +19,15 @@ namespace Internal {
  */
 Stmt inject_profiling(Stmt, std::string);
 
+/** Take a statement that has already been through inject_profiling
+ * and storage flattening, and record each heap allocation made for a
+ * Func, and the matching free, with the profiler, so that the report
+ * includes allocation counts and peak memory use per Func. Should be
+ * done after allocations are hoisted and their frees injected, but
+ * before memory planning, which merges the allocations of different
+ * Funcs into shared ones that can't be attributed to a single Func. */
+Stmt inject_memory_profiling(Stmt);
+
 }
 }
 
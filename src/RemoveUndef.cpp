@@ -367,7 +367,7 @@ private:
             new_expr.same_as(op->new_expr)) {
             stmt = op;
         } else {
-            stmt = Allocate::make(op->name, op->type, new_extents, condition, body, new_expr, op->free_function);
+            stmt = Allocate::make(op->name, op->type, new_extents, condition, body, new_expr, op->free_function, op->memory_type);
         }
     }
 
@@ -21,8 +21,10 @@ struct ScheduleContents {
     bool memoized;
     bool touched;
     bool allow_race_conditions;
+    MemoryType memory_type;
 
-    ScheduleContents() : memoized(false), touched(false), allow_race_conditions(false) {};
+    ScheduleContents() : memoized(false), touched(false), allow_race_conditions(false),
+                         memory_type(MemoryType::Auto) {};
 };
 
 
@@ -106,6 +108,7 @@ const Specialization &Schedule::add_specialization(Expr condition) {
     s.schedule.ptr->memoized         = contents.ptr->memoized;
     s.schedule.ptr->touched          = contents.ptr->touched;
     s.schedule.ptr->allow_race_conditions = contents.ptr->allow_race_conditions;
+    s.schedule.ptr->memory_type      = contents.ptr->memory_type;
 
     contents.ptr->specializations.push_back(s);
     return contents.ptr->specializations.back();
@@ -144,6 +147,14 @@ bool Schedule::allow_race_conditions() const {
     return contents.ptr->allow_race_conditions;
 }
 
+MemoryType &Schedule::memory_type() {
+    return contents.ptr->memory_type;
+}
+
+MemoryType Schedule::memory_type() const {
+    return contents.ptr->memory_type;
+}
+
 void Schedule::accept(IRVisitor *visitor) const {
     for (const Split &s : splits()) {
         if (s.factor.defined()) {
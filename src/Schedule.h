@@ -192,6 +192,12 @@ public:
     LoopLevel &compute_level();
     // @}
 
+    /** Where the storage for this function goes. See \ref Func::store_in */
+    // @{
+    MemoryType memory_type() const;
+    MemoryType &memory_type();
+    // @}
+
     /** Are race conditions permitted? */
     // @{
     bool allow_race_conditions() const;
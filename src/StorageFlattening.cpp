@@ -111,9 +111,11 @@ private:
         realizations.pop(realize->name);
 
         vector<int> storage_permutation;
+        MemoryType memory_type;
         {
             map<string, Function>::const_iterator iter = env.find(realize->name);
             internal_assert(iter != env.end()) << "Realize node refers to function not in environment.\n";
+            memory_type = iter->second.schedule().memory_type();
             const vector<string> &storage_dims = iter->second.schedule().storage_dims();
             const vector<string> &args = iter->second.args();
             for (size_t i = 0; i < storage_dims.size(); i++) {
@@ -172,7 +174,8 @@ private:
                                  stmt);
 
             // Make the allocation node
-            stmt = Allocate::make(buffer_name, t, extents, condition, stmt);
+            stmt = Allocate::make(buffer_name, t, extents, condition, stmt,
+                                  Expr(), std::string(), memory_type);
 
             // Compute the strides
             for (int i = (int)realize->bounds.size()-1; i > 0; i--) {
@@ -231,6 +231,7 @@ const std::map<std::string, Target::Feature> feature_name_map = {
     {"no_runtime", Target::NoRuntime},
     {"metal", Target::Metal},
     {"mingw", Target::MinGW},
+    {"plan_memory", Target::PlanMemory},
 };
 
 bool lookup_feature(const std::string &tok, Target::Feature &result) {
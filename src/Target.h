@@ -79,6 +79,7 @@ struct Target {
 
         Metal, ///< Enable the (Apple) Metal runtime.
         MinGW, ///< For Windows compile to MinGW toolset rather then Visual Studio
+        PlanMemory, ///< Let heap allocations with non-overlapping lifetimes share storage. See MemoryPlanning.h
         FeatureEnd ///< A sentinel. Every target is considered to have this feature, and setting this feature does nothing.
     };
 
@@ -1,6 +1,7 @@
 #include "Tracing.h"
 #include "IRMutator.h"
 #include "IROperator.h"
+#include "Random.h"
 #include "runtime/HalideRuntime.h"
 
 namespace Halide {
@@ -27,6 +28,25 @@ public:
 private:
     using IRMutator::visit;
 
+    // Get the condition under which an event at the given
+    // coordinates passes a trace filter, or an undefined Expr if
+    // every event does.
+    Expr filter_condition(const TraceFilter &filter, const vector<Expr> &coords) {
+        Expr cond;
+        for (size_t i = 0; i < filter.region.size() && i < coords.size(); i++) {
+            Expr min = filter.region[i].first, extent = filter.region[i].second;
+            Expr inside = coords[i] >= min && coords[i] < min + extent;
+            cond = cond.defined() ? (cond && inside) : inside;
+        }
+        if (filter.sample_rate > 1 && !coords.empty()) {
+            // Hash the coordinates, so that the same events are
+            // sampled every time.
+            Expr sampled = random_int(coords) % make_const(UInt(32), filter.sample_rate) == 0;
+            cond = cond.defined() ? (cond && sampled) : sampled;
+        }
+        return cond;
+    }
+
     void visit(const Call *op) {
 
         // Calls inside of an address_of don't count, but we want to
@@ -75,13 +95,16 @@ private:
         internal_assert(op);
 
         bool trace_it = false;
-        Expr trace_parent;
+        Expr trace_parent, condition;
         if (op->call_type == Call::Halide) {
             Function f = op->func;
             bool inlined = f.schedule().compute_level().is_inline();
             if (f.has_update_definition()) inlined = false;
             trace_it = f.is_tracing_loads() || (global_level > 2 && !inlined);
             trace_parent = Variable::make(Int(32), op->name + ".trace_id");
+            if (f.is_tracing_loads()) {
+                condition = filter_condition(f.load_trace_filter(), op->args);
+            }
         } else if (op->call_type == Call::Image) {
             trace_it = global_level > 2;
             trace_parent = Variable::make(Int(32), "pipeline.trace_id");
@@ -98,6 +121,11 @@ private:
             args.insert(args.end(), op->args.begin(), op->args.end());
 
             expr = Call::make(op->type, Call::trace_expr, args, Call::Intrinsic);
+
+            if (condition.defined()) {
+                // Only trace the load if it passes the filter.
+                expr = Call::make(op->type, Call::if_then_else, {condition, expr, op}, Call::Intrinsic);
+            }
         }
 
     }
@@ -119,15 +147,35 @@ private:
             const vector<Expr> &values = op->values;
             vector<Expr> traces(op->values.size());
 
+            Expr condition;
+            if (f.is_tracing_stores()) {
+                condition = filter_condition(f.store_trace_filter(), op->args);
+            }
+
             for (size_t i = 0; i < values.size(); i++) {
+                // If there's a filter, the value is needed on both
+                // sides of it, so compute it once.
+                Expr value = values[i];
+                string value_name;
+                if (condition.defined()) {
+                    value_name = unique_name('t');
+                    value = Variable::make(values[i].type(), value_name);
+                }
+
                 vector<Expr> args;
                 args.push_back(f.name());
                 args.push_back(halide_trace_store);
                 args.push_back(Variable::make(Int(32), op->name + ".trace_id"));
                 args.push_back((int)i);
-                args.push_back(values[i]);
+                args.push_back(value);
                 args.insert(args.end(), op->args.begin(), op->args.end());
                 traces[i] = Call::make(values[i].type(), Call::trace_expr, args, Call::Intrinsic);
+
+                if (condition.defined()) {
+                    traces[i] = Call::make(values[i].type(), Call::if_then_else,
+                                           {condition, traces[i], value}, Call::Intrinsic);
+                    traces[i] = Let::make(value_name, values[i], traces[i]);
+                }
             }
 
             stmt = Provide::make(op->name, traces, op->args);
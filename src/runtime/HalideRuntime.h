@@ -118,11 +118,81 @@ extern halide_do_task_t halide_set_custom_do_task(halide_do_task_t do_task);
 /** Spawn a thread, independent of halide's thread pool. */
 extern void halide_spawn_thread(void *user_context, void (*f)(void *), void *closure);
 
-/** Set the number of threads used by Halide's thread pool. No effect
- * on OS X or iOS. If changed after the first use of a parallel Halide
- * routine, shuts down and then reinitializes the thread pool. */
+/** Set the number of threads used by Halide's thread pool, including
+ * the thread that calls into Halide. There is no upper limit. Zero
+ * means use the default (HL_NUM_THREADS, or the number of cores). No
+ * effect on OS X or iOS. If changed after the first use of a parallel
+ * Halide routine, the running pool grows or shrinks in place; this
+ * must not be done while a parallel Halide routine is running. */
 extern void halide_set_num_threads(int n);
 
+/** Select the scheduler used by Halide's own thread pool. When
+ * enabled, each thread in the pool keeps its own deque of task
+ * ranges and idle threads steal from each other, instead of all
+ * threads claiming tasks from one shared job stack under a single
+ * lock. This helps pipelines with many small parallel tasks on
+ * machines with many cores. It can also be enabled by setting the
+ * environment variable HL_WORK_STEALING=1. No effect on OS X, iOS or
+ * Windows. If changed after the first use of a parallel Halide
+ * routine, shuts down and then reinitializes the thread pool. */
+extern void halide_set_work_stealing(bool enable);
+
+/** Pin the threads of Halide's thread pool to cores, ordered so that
+ * consecutive threads share a NUMA node, and deal out the indices of
+ * outermost parallel loops to threads in contiguous blocks, so that
+ * the same part of the output is computed on the same core on every
+ * call. Implies the work-stealing scheduler. It can also be enabled
+ * by setting the environment variable HL_THREAD_AFFINITY=1. Only has
+ * an effect on Linux. If changed after the first use of a parallel
+ * Halide routine, shuts down and then reinitializes the thread
+ * pool. */
+extern void halide_set_thread_affinity(bool enable);
+
+/** Set how many times an idle thread in Halide's thread pool polls
+ * for new work before going to sleep. Spinning costs CPU time, but
+ * avoids the latency of waking sleeping threads when parallel Halide
+ * routines are called back to back. Zero, the default, means sleep
+ * right away. It can also be set with the environment variable
+ * HL_SPIN_COUNT. No effect on OS X, iOS or Windows. */
+extern void halide_set_thread_pool_spin_count(int count);
+
+/** While the thread pool is hot, idle threads never go to sleep; they
+ * keep polling for new work, yielding the core between polls. Use this
+ * around a burst of calls to short parallel Halide routines (e.g. one
+ * per video frame) and turn it off afterwards. No effect on OS X, iOS
+ * or Windows. */
+extern void halide_set_thread_pool_hot(bool hot);
+
+/** An opaque handle to a thread pool separate from Halide's default
+ * one, e.g. so that a latency-critical pipeline isn't queued behind a
+ * background one. */
+struct halide_thread_pool;
+
+/** Make a new thread pool. num_threads counts the thread that calls
+ * into Halide, and zero means the default (as for
+ * halide_set_num_threads). priority is a nice value applied to each of
+ * the pool's threads; zero leaves them at the default priority. The
+ * threads are started the first time the pool is used. Parallel loops
+ * are sent to the pool by binding it to a user_context with
+ * halide_use_thread_pool; nested parallel loops stay in the pool that
+ * is running them. Returns NULL on failure, or on platforms where
+ * %Halide does not manage its own threads (OS X, iOS, Windows). */
+extern struct halide_thread_pool *halide_create_thread_pool(const char *name, int num_threads, int priority);
+
+/** Find a pool made by halide_create_thread_pool by name. Returns NULL
+ * if there is no such pool. */
+extern struct halide_thread_pool *halide_find_thread_pool(const char *name);
+
+/** Run the parallel loops of all pipelines called with the given
+ * user_context in the given pool. Passing a NULL pool sends them back
+ * to the default pool. Returns zero on success. */
+extern int halide_use_thread_pool(void *user_context, struct halide_thread_pool *pool);
+
+/** Stop the threads of a pool made by halide_create_thread_pool, unbind
+ * it from any user_context, and free it. Must not be called while a
+ * parallel loop is running in the pool. */
+extern void halide_destroy_thread_pool(struct halide_thread_pool *pool);
+
 /** Halide calls these functions to allocate and free memory. To
  * replace in AOT code, use the halide_set_custom_malloc and
  * halide_set_custom_free, or (on platforms that support weak
@@ -145,6 +215,69 @@ extern halide_malloc_t halide_set_custom_malloc(halide_malloc_t user_malloc);
 extern halide_free_t halide_set_custom_free(halide_free_t user_free);
 //@}
 
+/** Make the default halide_malloc map allocations of at least the
+ * given number of bytes directly from the OS, and ask for them to be
+ * backed by transparent huge pages, which cuts down on TLB misses in
+ * pipelines with very large intermediates. Zero, the default, turns
+ * this off. The default can also be set with the environment variable
+ * HL_HUGE_PAGE_THRESHOLD, in megabytes. Only has an effect on Linux
+ * and Android. */
+extern void halide_set_huge_page_threshold(int64_t bytes);
+
+/** An alternative to the default halide_malloc and halide_free, for
+ * pipelines that allocate and free many intermediate buffers, e.g. in
+ * parallel loops. Requests are rounded up to one of a set of size
+ * classes, and freed blocks are kept to be reused instead of being
+ * returned to the system. They are kept in 32 caches, each with its
+ * own lock, and each thread uses the cache picked by a hash of its
+ * stack address. These are not true per-thread caches: threads can
+ * share a cache and contend for it, especially with more than 32
+ * threads. Install it with
+ * halide_set_custom_malloc(halide_pooled_malloc) and
+ * halide_set_custom_free(halide_pooled_free). Blocks from the default
+ * allocator may be freed with halide_pooled_free and vice versa. */
+//@{
+extern void *halide_pooled_malloc(void *user_context, size_t x);
+extern void halide_pooled_free(void *user_context, void *ptr);
+//@}
+
+/** Set the most memory the pooled allocator keeps for reuse, across
+ * all threads. The default is 64MB. Freed blocks beyond it are
+ * returned to the system. */
+extern void halide_pooled_allocator_set_max_retained(int64_t bytes);
+
+/** Return all the memory the pooled allocator keeps for reuse to the
+ * system. */
+extern void halide_pooled_allocator_release(void *user_context);
+
+/** An opaque handle to an arena of allocations, kept alive between
+ * calls to a pipeline so that they can be reused. */
+struct halide_arena;
+
+/** Make a new, empty arena. Returns NULL on failure. */
+extern struct halide_arena *halide_create_arena();
+
+/** Allocate through the given arena in all calls to halide_malloc and
+ * halide_free with the given user_context, including those for the
+ * intermediate buffers of pipelines called with it. Blocks freed with
+ * that user_context aren't freed, but kept in the arena, and reused by
+ * later allocations they are large enough for (and not more than twice
+ * as large as). Passing a NULL arena stops using an arena. Returns zero
+ * on success. Not available in JIT-compiled code, which uses its own
+ * user_context. Finding the arena for a user_context takes no lock,
+ * but each user_context ever bound keeps a few bytes of bookkeeping
+ * for the life of the process. */
+extern int halide_use_arena(void *user_context, struct halide_arena *arena);
+
+/** Free the blocks kept by an arena that aren't in use. */
+extern void halide_release_arena(void *user_context, struct halide_arena *arena);
+
+/** Unbind an arena from any user_context, free the blocks it keeps,
+ * and free the arena. Blocks that are still in use are freed as usual
+ * when the pipeline that allocated them is done with them. Must not be
+ * called while another thread may be allocating from the arena. */
+extern void halide_destroy_arena(void *user_context, struct halide_arena *arena);
+
 /** Called when debug_to_file is used inside %Halide code.  See
  * Func::debug_to_file for how this is called
  *
@@ -189,9 +322,12 @@ struct halide_trace_event {
  * implementation either prints events via halide_printf, or if
  * HL_TRACE_FILE is defined, dumps the trace to that file in a
  * yet-to-be-documented binary format (see src/runtime/tracing.cpp to
- * reverse engineer the format). If the trace is going to be large,
- * you may want to make the file a named pipe, and then read from that
- * pipe into gzip.
+ * reverse engineer the format). Binary trace packets are collected in
+ * large in-memory buffers and written to the file by a background
+ * thread, so the file is only complete once halide_shutdown_trace
+ * has been called (which happens automatically at process exit). If
+ * the trace is going to be large, you may want to make the file a
+ * named pipe, and then read from that pipe into gzip.
  *
  * halide_trace returns a unique ID which will be passed to future
  * events that "belong" to the earlier event as the parent id. The
@@ -236,8 +372,9 @@ extern void halide_set_trace_file(int fd);
  * information to stdout. */
 extern int halide_get_trace_file(void *user_context);
 
-/** If tracing is writing to a file. This call closes that file
- * (flushing the trace). Returns zero on success. */
+/** If tracing is writing to a file. This call writes out any
+ * buffered trace packets and closes that file. Returns zero on
+ * success. */
 extern int halide_shutdown_trace();
 
 /** All Halide GPU or device backend implementations much provide an interface
@@ -293,6 +430,35 @@ extern int halide_get_gpu_device(void *user_context);
  */
 extern void halide_memoization_cache_set_size(int64_t size);
 
+/** Policies for choosing which memoized result to evict when the
+ * cache is over its size. */
+enum halide_memoization_cache_eviction_policy {
+    /** Evict the least recently used result first. */
+    halide_memoization_cache_lru = 0,
+    /** GreedyDual-Size: evict the result that took the least time to
+     * compute per byte first, while aging results out as others are
+     * evicted, so that cheap results don't push out expensive ones. */
+    halide_memoization_cache_greedy_dual_size = 1
+};
+
+/** Set the policy used to evict results from the memoization
+ * cache. Takes a value of halide_memoization_cache_eviction_policy. The
+ * default is halide_memoization_cache_lru. */
+extern void halide_memoization_cache_set_eviction_policy(int policy);
+
+/** Back the memoization cache with a memory-mapped file at the given
+ * path, which is created if it doesn't exist. Results that aren't in
+ * memory are looked for in the file, and new results are written to
+ * it, so they can be shared between processes and kept across
+ * runs. The file is size bytes long (256MB if size is zero or
+ * negative), or keeps its existing size. The oldest results are
+ * evicted from the file first. A NULL path stops using a file. If not
+ * called, the file is taken from the environment variables
+ * HL_MEMOIZATION_CACHE_FILE and HL_MEMOIZATION_CACHE_FILE_SIZE (in
+ * megabytes). Only supported on Linux and Android. Returns zero on
+ * success. */
+extern int halide_memoization_cache_set_file(void *user_context, const char *path, int64_t size);
+
 /** Given a cache key for a memoized result, currently constructed
  *  from the Func name and top-level Func name plus the arguments of
  *  the computation, determine if the result is in the cache and
@@ -305,10 +471,21 @@ extern void halide_memoization_cache_set_size(int64_t size);
  *  return a Tuple, there will only be one buffer_t in the list. The
  *  tuple_count parameters determines the length of the list.
  *
+ * A lookup also hits if the cache holds the result for the same key
+ * over a larger region. The buffers then either point into the cached
+ * result, if their strides match it, or get a copy of the region they
+ * need.
+ *
  * The return values are:
  * -1: Signals an error.
  *  0: Success and cache hit.
  *  1: Success and cache miss.
+ *
+ * Code generated by this version of Halide doesn't call this; it calls
+ * halide_memoization_cache_lookup_v2 below. A custom cache that only
+ * overrides this function is bypassed by newly compiled pipelines,
+ * which use the default cache instead. Override
+ * halide_memoization_cache_lookup_v2 too.
  */
 extern int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
                                            buffer_t *realized_bounds, int32_t tuple_count, buffer_t **tuple_buffers);
@@ -326,10 +503,39 @@ extern int halide_memoization_cache_lookup(void *user_context, const uint8_t *ca
  *
  * If there is a memory allocation failure, the store does not store
  * the data into the cache.
+ *
+ * As with halide_memoization_cache_lookup, newly compiled pipelines
+ * call halide_memoization_cache_store_v2 instead, so a custom cache
+ * must override that too.
  */
 extern void halide_memoization_cache_store(void *user_context, const uint8_t *cache_key, int32_t size,
                                            buffer_t *realized_bounds, int32_t tuple_count, buffer_t **tuple_buffers);
 
+/** Versions of halide_memoization_cache_lookup and
+ * halide_memoization_cache_store that also say which Func the result
+ * belongs to and how long it took to compute. Code generated by this
+ * version of Halide calls these; code from older versions calls the
+ * functions above, which the default cache implements in terms of
+ * these with no names and an unknown compute time. The defaults of
+ * these don't call the functions above, so a custom cache
+ * implementation must override both pairs, or pipelines compiled by
+ * this version of Halide silently use the default cache.
+ *
+ * pipeline_name and func_name identify the memoized Func for the
+ * cache's statistics. They are global constant strings, and may be
+ * NULL. compute_time is the time in nanoseconds it took to compute
+ * the result. It is used by the greedy dual size eviction policy, and
+ * may be zero if unknown.
+ */
+// @{
+extern int halide_memoization_cache_lookup_v2(void *user_context, const uint8_t *cache_key, int32_t size,
+                                              buffer_t *realized_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                                              const char *pipeline_name, const char *func_name);
+extern void halide_memoization_cache_store_v2(void *user_context, const uint8_t *cache_key, int32_t size,
+                                              buffer_t *realized_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                                              int64_t compute_time, const char *pipeline_name, const char *func_name);
+// @}
+
 /** If halide_memoization_cache_lookup succeeds,
  * halide_memoization_cache_release must be called to signal the
  * storage is no longer being used by the caller. It will be passed
@@ -352,6 +558,39 @@ extern void halide_memoization_cache_release(void *user_context, void *host);
  */
 extern void halide_memoization_cache_cleanup();
 
+/** Counters kept by the memoization cache for each memoized Func. */
+struct halide_memoization_cache_func_stats {
+    /** The pipeline and Func these counters are for. Global constant
+     * strings. */
+    const char *pipeline_name;
+    const char *func_name;
+
+    /** The number of lookups that found a result in the cache, and
+     * that didn't. */
+    uint64_t hits, misses;
+
+    /** The number of results evicted to keep the cache within its
+     * size. */
+    uint64_t evictions;
+
+    /** The number of results in the cache right now, and the bytes
+     * they occupy. */
+    uint64_t entries, bytes;
+};
+
+/** Copy the counters of each Func that has used the memoization cache
+ * into stats, which has room for max_funcs entries. Returns the number
+ * of Funcs with counters. */
+extern int halide_memoization_cache_get_stats(struct halide_memoization_cache_func_stats *stats,
+                                              int max_funcs);
+
+/** Reset the hit, miss and eviction counts of the memoization
+ * cache. */
+extern void halide_memoization_cache_reset_stats();
+
+/** Print out the memoization cache's counters, grouped by pipeline. */
+extern void halide_memoization_cache_report(void *user_context);
+
 /** The error codes that may be returned by a Halide pipeline. */
 enum halide_error_code_t {
     /** There was no error. This is the value returned by Halide on success. */
@@ -732,11 +971,40 @@ extern int halide_enumerate_registered_filters(void *user_context, void* enumera
  * the -profile target flag, which runs a sampling profiler thread
  * alongside the pipeline. */
 
+/** The number of performance counters the profiler can attribute to
+ * Funcs. */
+#define HALIDE_PROFILER_NUM_COUNTERS 3
+
 /** Per-Func state tracked by the sampling profiler. */
 struct halide_profiler_func_stats {
-    /** Total time taken evaluating this Func (in nanoseconds). */
+    /** Total wall-clock time taken evaluating this Func (in
+     * nanoseconds). When several threads are busy at once, each
+     * sample is split evenly between the Funcs they are running, so
+     * that the times of all the Funcs add up to the time of the
+     * pipeline. */
     uint64_t time;
 
+    /** Total CPU time taken evaluating this Func, summed across all
+     * the threads running it (in nanoseconds). */
+    uint64_t cpu_time;
+
+    /** The heap memory currently allocated for this Func, the most
+     * that has been allocated at any one time, and the total
+     * allocated over all runs (in bytes). */
+    uint64_t memory_current, memory_peak, memory_total;
+
+    /** The number of heap allocations made for this Func over all
+     * runs. */
+    int num_allocs;
+
+    /** The performance counters billed to this Func over all runs, if
+     * enabled with the environment variable HL_PROFILER_COUNTERS. On
+     * Linux these are cycles, instructions and last-level cache
+     * misses, or software counters where the hardware ones aren't
+     * available. Like time, they are sampled rather than measured
+     * exactly. */
+    uint64_t counters[HALIDE_PROFILER_NUM_COUNTERS];
+
     /** The name of this Func. A global constant string. */
     const char *name;
 };
@@ -747,6 +1015,28 @@ struct halide_profiler_pipeline_stats {
     /** Total time spent inside this pipeline (in nanoseconds) */
     uint64_t time;
 
+    /** Total CPU time spent inside this pipeline, summed across all
+     * threads (in nanoseconds) */
+    uint64_t cpu_time;
+
+    /** The heap memory currently allocated by this pipeline, the most
+     * that has been allocated at any one time, and the total
+     * allocated over all runs (in bytes) */
+    uint64_t memory_current, memory_peak, memory_total;
+
+    /** The largest peak heap footprint planned at compile time over
+     * all runs, or zero if memory planning was off (in bytes). The
+     * real peak is lower when allocations share storage. */
+    uint64_t memory_planned_peak;
+
+    /** The number of heap allocations made by this pipeline over all
+     * runs. */
+    int num_allocs;
+
+    /** The performance counters billed to this pipeline over all
+     * runs. */
+    uint64_t counters[HALIDE_PROFILER_NUM_COUNTERS];
+
     /** The name of this pipeline. A global constant string. */
     const char *name;
 
@@ -768,8 +1058,20 @@ struct halide_profiler_pipeline_stats {
 
     /** The total number of samples taken inside of this pipeline. */
     int samples;
+
+    /** The number of times a thread running a task of a parallel loop
+     * in this pipeline could not be sampled, because all of the
+     * profiler's per-thread slots were in use. */
+    int dropped_samples;
 };
 
+/** The number of threads of parallel loops that the profiler can
+ * attribute time to separately. Tasks that start while this many
+ * others are running are not sampled, so the time and performance
+ * counters of the Funcs they run are undercounted. Each sample they
+ * miss is counted in the pipeline's dropped_samples, and reported. */
+#define HALIDE_PROFILER_MAX_THREADS 64
+
 /** The global state of the profiler. */
 struct halide_profiler_state {
     /** Guards access to the fields below. If not locked, the sampling
@@ -791,8 +1093,26 @@ struct halide_profiler_state {
      * periodically by the profiler thread. */
     int current_func;
 
+    /** The id of the Func running on each thread executing a task of
+     * a parallel loop, or halide_profiler_outside_of_halide if the
+     * slot is unused. Each task claims a slot for its duration, sets
+     * it as it moves between Funcs, and releases it at the end. Read
+     * periodically by the profiler thread. */
+    int thread_funcs[HALIDE_PROFILER_MAX_THREADS];
+
     /** Is the profiler thread running. */
     bool started;
+
+    /** The ring buffers recording when each thread starts and stops
+     * running each Func, or NULL if the timeline is disabled. Enabled
+     * by setting the environment variable HL_PROFILER_TRACE_FILE to
+     * the name of a file, to which the timeline is written in Chrome
+     * trace format (viewable in chrome://tracing) at process exit. */
+    void *timeline;
+
+    /** The number of tasks of parallel loops currently running
+     * without a per-thread slot. */
+    int unsampled_threads;
 };
 
 /** Profiler func ids with special meanings. */
@@ -802,7 +1122,12 @@ enum {
     /// Set current_func to this value to tell the profiling thread to
     /// halt. It will start up again next time you run a pipeline with
     /// profiling enabled.
-    halide_profiler_please_stop = -2
+    halide_profiler_please_stop = -2,
+    /// A thread waiting on a parallel loop launched from within the
+    /// Func with id f sets its current func to
+    /// halide_profiler_waiting - f, so that it isn't billed for the
+    /// time the loop's tasks spend on other threads.
+    halide_profiler_waiting = -3
 };
 
 /** Get a pointer to the global profiler state for programmatic
@@ -816,6 +1141,141 @@ extern void halide_profiler_reset();
  * reset. Also happens at process exit. */
 extern void halide_profiler_report(void *user_context);
 
+/** Record a heap allocation of the given size for the Func with the
+ * given id. Called by generated code. */
+extern int halide_profiler_memory_allocate(halide_profiler_state *state, int func, uint64_t bytes);
+
+/** Record that a heap allocation of the given size for the Func with
+ * the given id has been freed. Called by generated code. */
+extern int halide_profiler_memory_free(halide_profiler_state *state, int func, uint64_t bytes);
+
+/** Record the peak heap footprint planned for a run of the pipeline
+ * with the given token, when its heap allocations share storage. See
+ * Target::PlanMemory. Called by generated code. */
+extern int halide_profiler_memory_planned(halide_profiler_state *state, int pipeline, uint64_t bytes);
+
+/** Record in the timeline that the thread using the given slot (or
+ * the thread running the pipeline, if the slot is NULL) has started
+ * running the Func with the given id. Only called if the timeline is
+ * enabled. */
+extern void halide_profiler_record_func(halide_profiler_state *state, int *slot, int func);
+
+/** Claim a per-thread slot for a task of a parallel loop, and set it
+ * to the given Func id. Returns a pointer to the slot, which the task
+ * updates as it moves between Funcs. Called by generated code. */
+extern int *halide_profiler_acquire_thread_slot(halide_profiler_state *state, int func);
+
+/** Release a slot claimed by halide_profiler_acquire_thread_slot at
+ * the end of the task. Called by generated code. */
+extern void halide_profiler_release_thread_slot(void *user_context, void *slot);
+
+/** The functions below here report where the threads of Halide's own
+ * thread pools spend their time, to help diagnose poor parallel
+ * scaling. Nothing is recorded unless enabled with
+ * halide_set_thread_pool_stats or the environment variable
+ * HL_THREAD_POOL_STATS=1. Not available on OS X, iOS or Windows. */
+
+/** Per-thread counters kept by a thread pool. Times are in
+ * nanoseconds. */
+struct halide_thread_pool_worker_stats {
+    /** The number of tasks this thread has run. */
+    uint64_t tasks;
+
+    /** Time spent running tasks. This includes any parallel loops
+     * called from inside those tasks. */
+    uint64_t busy_time;
+
+    /** Time spent waiting (spinning or asleep) for something to do. */
+    uint64_t idle_time;
+
+    /** Time spent waiting to acquire the lock on the pool's shared job
+     * stack. */
+    uint64_t lock_wait_time;
+};
+
+/** Counters kept by a thread pool for each parallel loop, identified by
+ * the task function that implements its body. Times are in
+ * nanoseconds. */
+struct halide_thread_pool_loop_stats {
+    /** The loop body. NULL for the entry that collects all loops once
+     * the pool's table of loops is full; that entry is only present
+     * if such loops have run, and always comes last. */
+    halide_task_t task;
+
+    /** The number of calls to halide_do_par_for for this loop, and how
+     * many of them came from inside another parallel loop. */
+    uint64_t calls, nested_calls;
+
+    /** The total number of tasks run across all calls. */
+    uint64_t tasks;
+
+    /** Wall-clock time from the start to the end of each call, summed
+     * over all calls. */
+    uint64_t time;
+
+    /** Time spent running tasks of this loop, summed over all threads
+     * and calls. busy_time / time is the average number of threads the
+     * loop kept busy. */
+    uint64_t busy_time;
+};
+
+/** Counters kept by a thread pool for one call to halide_do_par_for.
+ * Times are in nanoseconds. */
+struct halide_thread_pool_call_stats {
+    /** The loop body. */
+    halide_task_t task;
+
+    /** The range of indices the loop ran. */
+    int min, size;
+
+    /** Whether the call came from inside another parallel loop. */
+    bool nested;
+
+    /** When the call started, as returned by halide_current_time_ns. */
+    uint64_t start;
+
+    /** Wall-clock time from the start to the end of the call. */
+    uint64_t time;
+
+    /** Time spent running tasks of this call, summed over all
+     * threads. */
+    uint64_t busy_time;
+};
+
+/** Turn thread pool instrumentation on or off. */
+extern void halide_set_thread_pool_stats(bool enable);
+
+/** Reset the counters of all thread pools. */
+extern void halide_thread_pool_reset_stats();
+
+/** Copy the per-thread counters of a pool (NULL for the default pool)
+ * into stats, which has room for max_workers entries. Entry zero is
+ * shared by all threads that call into the pool; entry i is the pool's
+ * worker thread i-1. Returns the number of entries the pool has. */
+extern int halide_thread_pool_get_worker_stats(struct halide_thread_pool *pool,
+                                               struct halide_thread_pool_worker_stats *stats,
+                                               int max_workers);
+
+/** Copy the per-loop counters of a pool (NULL for the default pool)
+ * into stats, which has room for max_loops entries. Returns the number
+ * of entries the pool has. */
+extern int halide_thread_pool_get_loop_stats(struct halide_thread_pool *pool,
+                                             struct halide_thread_pool_loop_stats *stats,
+                                             int max_loops);
+
+/** Copy the counters of the most recent calls to halide_do_par_for in
+ * a pool (NULL for the default pool) into stats, oldest first, which
+ * has room for max_calls entries. Only the last 256 calls are kept;
+ * the calls field of the per-loop counters counts all of them. Returns
+ * the number of entries the pool has. */
+extern int halide_thread_pool_get_call_stats(struct halide_thread_pool *pool,
+                                             struct halide_thread_pool_call_stats *stats,
+                                             int max_calls);
+
+/** Print out the counters of all thread pools. Also happens at process
+ * exit if instrumentation is on. */
+extern void halide_thread_pool_report(void *user_context);
+
 /// \name "Float16" functions
 /// These functions operate of bits (``uint16_t``) representing a half
 /// precision floating point number (IEEE-754 2008 binary16).
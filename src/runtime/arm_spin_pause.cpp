@@ -0,0 +1,11 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Hint that we're in a spin-wait loop, so that a core running several
+// hardware threads can favour the others.
+WEAK void halide_spin_pause() {
+    __asm__ __volatile__("yield" ::: "memory");
+}
+
+}
@@ -3,12 +3,10 @@
 #include "printer.h"
 #include "scoped_mutex_lock.h"
 
-// This is temporary code. In particular, the hash table is stupid and
-// currently thread safety is accomplished via large granularity spin
-// locks. It is mainly intended to prove the programming model and
-// runtime interface for memoization. We'll improve the implementation
-// later. In the meantime, on some platforms it can be replaced by a
-// platform specific LRU cache such as libcache from Apple.
+// The cache is a hash table split into shards, each with its own
+// lock, so that threads looking up different keys rarely contend. On
+// some platforms it can be replaced by a platform specific LRU cache
+// such as libcache from Apple.
 
 namespace Halide { namespace Runtime { namespace Internal {
 
@@ -79,6 +77,52 @@ WEAK bool keys_equal(const uint8_t *key1, const uint8_t *key2, size_t key_size)
     return memcmp(key1, key2, key_size) == 0;
 }
 
+// Does the computed region of outer contain that of inner? The extents
+// of computed bounds hold max - min rather than the number of
+// elements.
+WEAK bool bounds_contain(const buffer_t &outer, const buffer_t &inner) {
+    if (outer.elem_size != inner.elem_size)
+        return false;
+    for (size_t i = 0; i < 4; i++) {
+        if (outer.min[i] > inner.min[i] ||
+            outer.min[i] + outer.extent[i] < inner.min[i] + inner.extent[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copy the computed region given by region from src to dst, which have
+// the same elem_size but may have different bounds and strides.
+WEAK void copy_region(uint8_t *dst, const buffer_t &dst_buf,
+                      const uint8_t *src, const buffer_t &src_buf, const buffer_t &region) {
+    size_t elem_size = dst_buf.elem_size;
+    for (int32_t i3 = region.min[3]; i3 <= region.min[3] + region.extent[3]; i3++) {
+        for (int32_t i2 = region.min[2]; i2 <= region.min[2] + region.extent[2]; i2++) {
+            for (int32_t i1 = region.min[1]; i1 <= region.min[1] + region.extent[1]; i1++) {
+                int64_t dst_off = ((int64_t)(i3 - dst_buf.min[3]) * dst_buf.stride[3] +
+                                   (int64_t)(i2 - dst_buf.min[2]) * dst_buf.stride[2] +
+                                   (int64_t)(i1 - dst_buf.min[1]) * dst_buf.stride[1] +
+                                   (int64_t)(region.min[0] - dst_buf.min[0]) * dst_buf.stride[0]);
+                int64_t src_off = ((int64_t)(i3 - src_buf.min[3]) * src_buf.stride[3] +
+                                   (int64_t)(i2 - src_buf.min[2]) * src_buf.stride[2] +
+                                   (int64_t)(i1 - src_buf.min[1]) * src_buf.stride[1] +
+                                   (int64_t)(region.min[0] - src_buf.min[0]) * src_buf.stride[0]);
+                int32_t count = region.extent[0] + 1;
+                if (dst_buf.stride[0] == 1 && src_buf.stride[0] == 1) {
+                    memcpy(dst + dst_off * elem_size, src + src_off * elem_size, count * elem_size);
+                } else {
+                    for (int32_t i0 = 0; i0 < count; i0++) {
+                        memcpy(dst + (dst_off + (int64_t)i0 * dst_buf.stride[0]) * elem_size,
+                               src + (src_off + (int64_t)i0 * src_buf.stride[0]) * elem_size,
+                               elem_size);
+                    }
+                }
+            }
+        }
+    }
+}
+
 WEAK bool bounds_equal(const buffer_t &buf1, const buffer_t &buf2) {
     if (buf1.elem_size != buf2.elem_size)
         return false;
@@ -102,6 +146,75 @@ WEAK bool bounds_equal(const buffer_t &buf1, const buffer_t &buf2) {
 // to operate.
 const size_t extra_bytes_host_bytes = 16;
 
+// Counters for one memoized Func. These live in a list that only grows
+// (until halide_memoization_cache_cleanup), so it can be searched
+// without a lock. The counters are updated atomically.
+struct CacheFuncStats {
+    halide_memoization_cache_func_stats counters;
+    CacheFuncStats *next;
+};
+
+WEAK CacheFuncStats *volatile func_stats_list = NULL;
+WEAK halide_mutex func_stats_lock;
+
+WEAK bool names_equal(const char *a, const char *b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+// Find the counters for a Func, creating them if necessary. Returns
+// NULL if they couldn't be allocated, in which case nothing is
+// counted.
+WEAK CacheFuncStats *find_func_stats(const char *pipeline_name, const char *func_name) {
+    // The same pipeline will usually deliver the same global constant
+    // strings, so try comparing by pointer first.
+    for (CacheFuncStats *s = func_stats_list; s != NULL; s = s->next) {
+        if (s->counters.pipeline_name == pipeline_name &&
+            s->counters.func_name == func_name) {
+            return s;
+        }
+    }
+
+    ScopedMutexLock lock(&func_stats_lock);
+    for (CacheFuncStats *s = func_stats_list; s != NULL; s = s->next) {
+        if (names_equal(s->counters.pipeline_name, pipeline_name) &&
+            names_equal(s->counters.func_name, func_name)) {
+            return s;
+        }
+    }
+    CacheFuncStats *s = (CacheFuncStats *)halide_malloc(NULL, sizeof(CacheFuncStats));
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(CacheFuncStats));
+    s->counters.pipeline_name = pipeline_name;
+    s->counters.func_name = func_name;
+    s->next = func_stats_list;
+    __sync_synchronize();
+    func_stats_list = s;
+    return s;
+}
+
+__attribute__((always_inline)) void count(uint64_t *counter, int64_t delta) {
+    __sync_fetch_and_add(counter, delta);
+}
+
+struct CacheEntry;
+
+// A lookup of a region contained in a cached realization may be given
+// a pointer into the middle of the cached buffer. There's no room
+// before such a pointer to say which entry it belongs to, so these are
+// tracked here until they are released.
+struct CacheView {
+    uint8_t *host;
+    CacheEntry *entry;
+    uint32_t count;
+    CacheView *next;
+};
+
+WEAK CacheView *cache_views = NULL;
+WEAK halide_mutex view_lock;
+WEAK volatile int32_t outstanding_views = 0;
+
 struct CacheEntry {
     CacheEntry *next;
     CacheEntry *more_recent;
@@ -111,6 +224,12 @@ struct CacheEntry {
     uint32_t hash;
     uint32_t in_use_count; // 0 if none returned from halide_cache_lookup
     uint32_t tuple_count;
+    uint64_t last_used;    // Value of use_clock when last stored or looked up
+    uint64_t size;         // Sum of full_extent over the buffers
+    uint64_t cost;         // Time taken to compute the buffers, in nanoseconds
+    uint64_t priority;     // GreedyDual-Size priority as of the last store or lookup
+    size_t heap_index;     // Position in the shard's priority heap
+    CacheFuncStats *stats; // Counters for the Func this entry belongs to, or NULL
     buffer_t computed_bounds;
     buffer_t buf[1];
     // ADDITIONAL buffer_t STRUCTS HERE
@@ -171,34 +290,387 @@ WEAK uint32_t djb_hash(const uint8_t *key, size_t key_size)  {
     return h;
 }
 
-WEAK halide_mutex memoization_lock;
+// Every shard has its own hash table and LRU list, guarded by its
+// own lock. Each shard's table starts small and doubles whenever its
+// chains get long, so lookups stay fast as the number of entries
+// grows. A key's shard is picked by the low bits of its hash, and its
+// bucket within the shard by the remaining bits. Each shard also keeps
+// its entries in a binary min-heap on priority, so GreedyDual-Size
+// eviction doesn't have to look at every entry.
+const uint32_t kNumShards = 16;
+const size_t kInitialBucketsPerShard = 16;
+const size_t kMaxEntriesPerBucket = 2;
+
+struct CacheShard {
+    halide_mutex lock;
+    CacheEntry **buckets;
+    size_t num_buckets; // Zero or a power of two.
+    size_t num_entries;
+    CacheEntry *most_recently_used;
+    CacheEntry *least_recently_used;
+    CacheEntry **heap;  // num_entries long
+    size_t heap_capacity;
+    // Keep neighbouring shards' locks off each other's cache lines.
+    char padding[64];
+
+    CacheEntry *&bucket(uint32_t h) {
+        return buckets[(h / kNumShards) & (num_buckets - 1)];
+    }
 
-const size_t kHashTableSize = 256;
+    CacheEntry *find(const uint8_t *cache_key, int32_t size, uint32_t h,
+                     const buffer_t &computed_bounds, int32_t tuple_count);
+    CacheEntry *find_containing(const uint8_t *cache_key, int32_t size, uint32_t h,
+                                const buffer_t &computed_bounds, int32_t tuple_count,
+                                buffer_t **tuple_buffers);
+    bool insert(CacheEntry *entry);
+    void make_most_recent(CacheEntry *entry);
+    CacheEntry *eviction_candidate();
+    void remove(CacheEntry *entry);
+
+    void heap_place(CacheEntry *entry, size_t i);
+    void heap_sift_up(size_t i);
+    void heap_sift_down(size_t i);
+    CacheEntry *heap_min_unused(size_t i, CacheEntry *best);
+};
 
-WEAK CacheEntry *cache_entries[kHashTableSize];
+WEAK CacheShard cache_shards[kNumShards];
 
-WEAK CacheEntry *most_recently_used = NULL;
-WEAK CacheEntry *least_recently_used = NULL;
+__attribute__((always_inline)) CacheShard &shard_for(uint32_t h) {
+    return cache_shards[h % kNumShards];
+}
 
 const uint64_t kDefaultCacheSize = 1 << 20;
 WEAK int64_t max_cache_size = kDefaultCacheSize;
-WEAK int64_t current_cache_size = 0;
+// Updated atomically, as entries are added and removed under
+// different shard locks.
+WEAK volatile int64_t current_cache_size = 0;
+
+// Entries are stamped from this clock when stored or looked up, so
+// that pruning can compare the recency of entries in different shards
+// without a global LRU list.
+WEAK volatile uint64_t use_clock = 0;
+
+// Only one thread prunes at a time, so that threads storing
+// concurrently don't all evict to make room for the same overflow.
+WEAK halide_mutex prune_lock;
+
+WEAK int eviction_policy = halide_memoization_cache_lru;
+
+// With GreedyDual-Size eviction, an entry's priority is set to the
+// inflation value plus its cost per unit of size whenever it is stored
+// or looked up, and the entry with the lowest priority is evicted
+// first. Evicting an entry raises the inflation value to its
+// priority, so entries that haven't been used for a while age out even
+// if they were expensive to compute. Priorities are fixed point, with
+// kPriorityFractionBits bits after the point, so that the inflation
+// value can be read atomically while shard locks are held. Only
+// modified under prune_lock.
+const int kPriorityFractionBits = 16;
+WEAK volatile uint64_t gds_inflation = 0;
+
+// Record a use of an entry. Its priority may change, so the caller
+// must fix up the shard's heap.
+WEAK void stamp(CacheEntry *entry) {
+    entry->last_used = __sync_add_and_fetch(&use_clock, 1);
+    uint64_t cost = entry->cost;
+    if (cost > ((uint64_t)-1 >> kPriorityFractionBits)) {
+        cost = (uint64_t)-1 >> kPriorityFractionBits;
+    }
+    uint64_t inflation = __sync_fetch_and_add(&gds_inflation, 0);
+    entry->priority = inflation + (cost << kPriorityFractionBits) / (entry->size ? entry->size : 1);
+}
+
+// Entries with lower ranks are evicted first.
+__attribute__((always_inline)) uint64_t eviction_rank(const CacheEntry *entry) {
+    if (eviction_policy == halide_memoization_cache_greedy_dual_size) {
+        return entry->priority;
+    } else {
+        return entry->last_used;
+    }
+}
+
+// Find an entry with the given key and computed bounds. Must be
+// called with the shard lock held.
+WEAK CacheEntry *CacheShard::find(const uint8_t *cache_key, int32_t size, uint32_t h,
+                                  const buffer_t &computed_bounds, int32_t tuple_count) {
+    if (num_buckets == 0) {
+        return NULL;
+    }
+    CacheEntry *entry = bucket(h);
+    while (entry != NULL) {
+        if (entry->hash == h && entry->key_size == (size_t)size &&
+            keys_equal(entry->key, cache_key, size) &&
+            bounds_equal(entry->computed_bounds, computed_bounds) &&
+            entry->tuple_count == (uint32_t)tuple_count) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+// Find an entry with the given key whose computed bounds contain the
+// given ones. Must be called with the shard lock held.
+WEAK CacheEntry *CacheShard::find_containing(const uint8_t *cache_key, int32_t size, uint32_t h,
+                                             const buffer_t &computed_bounds, int32_t tuple_count,
+                                             buffer_t **tuple_buffers) {
+    if (num_buckets == 0) {
+        return NULL;
+    }
+    for (CacheEntry *entry = bucket(h); entry != NULL; entry = entry->next) {
+        if (entry->hash == h && entry->key_size == (size_t)size &&
+            entry->tuple_count == (uint32_t)tuple_count &&
+            keys_equal(entry->key, cache_key, size) &&
+            bounds_contain(entry->computed_bounds, computed_bounds)) {
+            bool elem_sizes_equal = true;
+            for (int32_t i = 0; elem_sizes_equal && i < tuple_count; i++) {
+                elem_sizes_equal = entry->buffer(i).elem_size == tuple_buffers[i]->elem_size;
+            }
+            if (elem_sizes_equal) {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Add an entry to the hash table, growing it if necessary, and make it
+// the most recently used. Returns false if the table needed to grow
+// and couldn't. Must be called with the shard lock held.
+WEAK bool CacheShard::insert(CacheEntry *entry) {
+    if (num_entries + 1 > heap_capacity) {
+        size_t new_capacity = heap_capacity ? heap_capacity * 2 : kInitialBucketsPerShard;
+        CacheEntry **new_heap = (CacheEntry **)halide_malloc(NULL, new_capacity * sizeof(CacheEntry *));
+        if (new_heap == NULL) {
+            return false;
+        }
+        for (size_t i = 0; i < num_entries; i++) {
+            new_heap[i] = heap[i];
+        }
+        if (heap != NULL) {
+            halide_free(NULL, heap);
+        }
+        heap = new_heap;
+        heap_capacity = new_capacity;
+    }
+
+    if (num_entries + 1 > num_buckets * kMaxEntriesPerBucket) {
+        size_t new_num_buckets = num_buckets ? num_buckets * 2 : kInitialBucketsPerShard;
+        CacheEntry **new_buckets = (CacheEntry **)halide_malloc(NULL, new_num_buckets * sizeof(CacheEntry *));
+        if (new_buckets == NULL) {
+            if (num_buckets == 0) {
+                return false;
+            }
+            // Carry on with longer chains.
+        } else {
+            memset(new_buckets, 0, new_num_buckets * sizeof(CacheEntry *));
+            CacheEntry **old_buckets = buckets;
+            size_t old_num_buckets = num_buckets;
+            buckets = new_buckets;
+            num_buckets = new_num_buckets;
+            for (size_t i = 0; i < old_num_buckets; i++) {
+                CacheEntry *e = old_buckets[i];
+                while (e != NULL) {
+                    CacheEntry *next = e->next;
+                    e->next = bucket(e->hash);
+                    bucket(e->hash) = e;
+                    e = next;
+                }
+            }
+            if (old_buckets != NULL) {
+                halide_free(NULL, old_buckets);
+            }
+        }
+    }
+
+    entry->next = bucket(entry->hash);
+    bucket(entry->hash) = entry;
+    num_entries++;
+
+    entry->more_recent = NULL;
+    entry->less_recent = most_recently_used;
+    if (most_recently_used != NULL) {
+        most_recently_used->more_recent = entry;
+    }
+    most_recently_used = entry;
+    if (least_recently_used == NULL) {
+        least_recently_used = entry;
+    }
+    stamp(entry);
+    heap_place(entry, num_entries - 1);
+    heap_sift_up(num_entries - 1);
+    return true;
+}
+
+// Must be called with the shard lock held.
+WEAK void CacheShard::make_most_recent(CacheEntry *entry) {
+    stamp(entry);
+    // The inflation value never goes down, so neither does the
+    // priority of an entry that's used again.
+    heap_sift_down(entry->heap_index);
+    if (entry == most_recently_used) {
+        return;
+    }
+    halide_assert(NULL, entry->more_recent != NULL);
+    if (entry->less_recent != NULL) {
+        entry->less_recent->more_recent = entry->more_recent;
+    } else {
+        halide_assert(NULL, least_recently_used == entry);
+        least_recently_used = entry->more_recent;
+    }
+    entry->more_recent->less_recent = entry->less_recent;
+
+    entry->more_recent = NULL;
+    entry->less_recent = most_recently_used;
+    if (most_recently_used != NULL) {
+        most_recently_used->more_recent = entry;
+    }
+    most_recently_used = entry;
+}
+
+// Put an entry at position i of the heap. Must be called with the
+// shard lock held, as must the other heap methods.
+WEAK void CacheShard::heap_place(CacheEntry *entry, size_t i) {
+    heap[i] = entry;
+    entry->heap_index = i;
+}
+
+// Move the entry at position i of the heap towards the root until its
+// parent has no higher priority.
+WEAK void CacheShard::heap_sift_up(size_t i) {
+    CacheEntry *entry = heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap[parent]->priority <= entry->priority) {
+            break;
+        }
+        heap_place(heap[parent], i);
+        i = parent;
+    }
+    heap_place(entry, i);
+}
+
+// Move the entry at position i of the heap towards the leaves until
+// neither child has a lower priority.
+WEAK void CacheShard::heap_sift_down(size_t i) {
+    CacheEntry *entry = heap[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= num_entries) {
+            break;
+        }
+        if (child + 1 < num_entries && heap[child + 1]->priority < heap[child]->priority) {
+            child++;
+        }
+        if (entry->priority <= heap[child]->priority) {
+            break;
+        }
+        heap_place(heap[child], i);
+        i = child;
+    }
+    heap_place(entry, i);
+}
+
+// The entry nobody is using with the lowest priority in the subtree of
+// the heap rooted at position i, if it's lower than best's. Only the
+// entries in use with a lower priority than the result, and their
+// children, are looked at, so this is cheap unless lots of entries are
+// in use.
+WEAK CacheEntry *CacheShard::heap_min_unused(size_t i, CacheEntry *best) {
+    if (i >= num_entries || (best != NULL && heap[i]->priority >= best->priority)) {
+        return best;
+    }
+    if (heap[i]->in_use_count == 0) {
+        return heap[i];
+    }
+    best = heap_min_unused(2 * i + 1, best);
+    return heap_min_unused(2 * i + 2, best);
+}
+
+// The entry nobody is using with the lowest eviction rank, if
+// any. Must be called with the shard lock held.
+WEAK CacheEntry *CacheShard::eviction_candidate() {
+    if (eviction_policy == halide_memoization_cache_greedy_dual_size) {
+        return heap_min_unused(0, NULL);
+    }
+
+    CacheEntry *entry = least_recently_used;
+    while (entry != NULL && entry->in_use_count != 0) {
+        entry = entry->more_recent;
+    }
+    return entry;
+}
+
+// Remove an entry from the hash table and LRU list and free it. Must
+// be called with the shard lock held.
+WEAK void CacheShard::remove(CacheEntry *entry) {
+    // Remove from hash table
+    CacheEntry **prev = &bucket(entry->hash);
+    while (*prev != NULL && *prev != entry) {
+        prev = &((*prev)->next);
+    }
+    halide_assert(NULL, *prev != NULL);
+    *prev = entry->next;
+
+    // Remove from the heap, filling the hole with the last entry.
+    size_t i = entry->heap_index;
+    num_entries--;
+    if (i < num_entries) {
+        CacheEntry *last = heap[num_entries];
+        heap_place(last, i);
+        if (last->priority < entry->priority) {
+            heap_sift_up(i);
+        } else {
+            heap_sift_down(i);
+        }
+    }
+
+    // Remove from less recent chain.
+    if (least_recently_used == entry) {
+        least_recently_used = entry->more_recent;
+    }
+    if (entry->more_recent != NULL) {
+        entry->more_recent->less_recent = entry->less_recent;
+    }
+
+    // Remove from more recent chain.
+    if (most_recently_used == entry) {
+        most_recently_used = entry->less_recent;
+    }
+    if (entry->less_recent != NULL) {
+        entry->less_recent->more_recent = entry->more_recent;
+    }
+
+    // Decrease cache used amount.
+    int64_t removed_size = 0;
+    int64_t removed_bytes = 0;
+    for (uint32_t i = 0; i < entry->tuple_count; i++) {
+        removed_size += full_extent(entry->buffer(i));
+        removed_bytes += full_extent(entry->buffer(i)) * entry->buffer(i).elem_size;
+    }
+    __sync_fetch_and_sub(&current_cache_size, removed_size);
+    if (entry->stats != NULL) {
+        count(&entry->stats->counters.entries, -1);
+        count(&entry->stats->counters.bytes, -removed_bytes);
+    }
+
+    // Deallocate the entry.
+    entry->destroy();
+    halide_free(NULL, entry);
+}
 
 #if CACHE_DEBUGGING
-WEAK void validate_cache() {
-    print(NULL) << "validating cache, "
-                << "current size " << current_cache_size
-                << " of maximum " << max_cache_size << "\n";
+WEAK void validate_shard(CacheShard &shard) {
     int entries_in_hash_table = 0;
-    for (int i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
+    for (size_t i = 0; i < shard.num_buckets; i++) {
+        CacheEntry *entry = shard.buckets[i];
         while (entry != NULL) {
             entries_in_hash_table++;
-            if (entry->more_recent == NULL && entry != most_recently_used) {
+            if (entry->more_recent == NULL && entry != shard.most_recently_used) {
                 halide_print(NULL, "cache invalid case 1\n");
                 __builtin_trap();
             }
-            if (entry->less_recent == NULL && entry != least_recently_used) {
+            if (entry->less_recent == NULL && entry != shard.least_recently_used) {
                 halide_print(NULL, "cache invalid case 2\n");
                 __builtin_trap();
             }
@@ -206,13 +678,13 @@ WEAK void validate_cache() {
         }
     }
     int entries_from_mru = 0;
-    CacheEntry *mru_chain = most_recently_used;
+    CacheEntry *mru_chain = shard.most_recently_used;
     while (mru_chain != NULL) {
         entries_from_mru++;
         mru_chain = mru_chain->less_recent;
     }
     int entries_from_lru = 0;
-    CacheEntry *lru_chain = least_recently_used;
+    CacheEntry *lru_chain = shard.least_recently_used;
     while (lru_chain != NULL) {
         entries_from_lru++;
         lru_chain = lru_chain->more_recent;
@@ -228,65 +700,651 @@ WEAK void validate_cache() {
         halide_print(NULL, "cache invalid case 4\n");
         __builtin_trap();
     }
+    if ((size_t)entries_in_hash_table != shard.num_entries) {
+        halide_print(NULL, "cache invalid case 5\n");
+        __builtin_trap();
+    }
+}
+
+WEAK void validate_cache() {
+    print(NULL) << "validating cache, "
+                << "current size " << current_cache_size
+                << " of maximum " << max_cache_size << "\n";
+    for (uint32_t s = 0; s < kNumShards; s++) {
+        ScopedMutexLock lock(&cache_shards[s].lock);
+        validate_shard(cache_shards[s]);
+    }
 }
 #endif
 
+// Evict entries until the cache fits in max_cache_size or everything
+// left is in use. Each shard picks its own eviction candidate, and the
+// victim is the one with the lowest rank among all the shards. Must be
+// called with no shard lock held.
 WEAK void prune_cache() {
+    if (current_cache_size <= max_cache_size) {
+        return;
+    }
+
+    ScopedMutexLock prune(&prune_lock);
 #if CACHE_DEBUGGING
     validate_cache();
 #endif
-    CacheEntry *prune_candidate = least_recently_used;
-    while (current_cache_size > max_cache_size &&
-           prune_candidate != NULL) {
-        CacheEntry *more_recent = prune_candidate->more_recent;
-        
-        if (prune_candidate->in_use_count == 0) {
-            uint32_t h = prune_candidate->hash;
-            uint32_t index = h % kHashTableSize;
-
-            // Remove from hash table
-            CacheEntry *prev_hash_entry = cache_entries[index];
-            if (prev_hash_entry == prune_candidate) {
-                cache_entries[index] = prune_candidate->next;
-            } else {
-                while (prev_hash_entry != NULL && prev_hash_entry->next != prune_candidate) {
-                    prev_hash_entry = prev_hash_entry->next;
+    while (current_cache_size > max_cache_size) {
+        int victim_shard = -1;
+        uint64_t lowest = 0;
+        for (uint32_t s = 0; s < kNumShards; s++) {
+            ScopedMutexLock lock(&cache_shards[s].lock);
+            CacheEntry *candidate = cache_shards[s].eviction_candidate();
+            if (candidate != NULL && (victim_shard < 0 || eviction_rank(candidate) < lowest)) {
+                victim_shard = s;
+                lowest = eviction_rank(candidate);
+            }
+        }
+        if (victim_shard < 0) {
+            // Everything is in use.
+            break;
+        }
+
+        // The shard may have changed since we looked. Its candidate
+        // now is still a fine choice.
+        CacheShard &shard = cache_shards[victim_shard];
+        ScopedMutexLock lock(&shard.lock);
+        CacheEntry *victim = shard.eviction_candidate();
+        if (victim != NULL) {
+            uint64_t inflation = __sync_fetch_and_add(&gds_inflation, 0);
+            if (victim->priority > inflation) {
+                __sync_fetch_and_add(&gds_inflation, victim->priority - inflation);
+            }
+            if (victim->stats != NULL) {
+                count(&victim->stats->counters.evictions, 1);
+            }
+            shard.remove(victim);
+        }
+    }
+#if CACHE_DEBUGGING
+    validate_cache();
+#endif
+}
+
+const int32_t kMaxSubregionTupleCount = 16;
+
+// Can buf be given a pointer into cached, rather than a copy of the
+// region it needs?
+WEAK bool can_view(const buffer_t &cached, const buffer_t &buf) {
+    for (int i = 0; i < 4; i++) {
+        if (buf.extent[i] != 0 &&
+            (buf.stride[i] != cached.stride[i] ||
+             buf.min[i] < cached.min[i] ||
+             buf.min[i] + buf.extent[i] > cached.min[i] + cached.extent[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Satisfy a lookup from an entry whose computed bounds contain the
+// requested ones. Each buffer either gets a view into the cached
+// buffer, if the strides match, or a copy of the region it needs. The
+// entry must be pinned by the caller with one use per buffer, which
+// this drops for the buffers that get copies. Returns false if out of
+// memory, in which case the entry is unpinned and the buffers are
+// unchanged.
+WEAK bool lookup_subregion(void *user_context, CacheShard &shard, CacheEntry *entry,
+                           const buffer_t &computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
+    uint8_t *hosts[kMaxSubregionTupleCount];
+    bool copied[kMaxSubregionTupleCount];
+    int32_t copies = 0;
+    for (int32_t i = 0; i < tuple_count; i++) {
+        const buffer_t &cached = entry->buffer(i);
+        buffer_t *buf = tuple_buffers[i];
+        hosts[i] = NULL;
+        copied[i] = false;
+        if (can_view(cached, *buf)) {
+            int64_t offset = 0;
+            for (int d = 0; d < 4; d++) {
+                offset += (int64_t)(buf->min[d] - cached.min[d]) * cached.stride[d];
+            }
+            hosts[i] = cached.host + offset * cached.elem_size;
+            if (offset == 0) {
+                // Same pointer as the entry itself, which release
+                // handles already.
+                continue;
+            }
+            CacheView *view = (CacheView *)halide_malloc(user_context, sizeof(CacheView));
+            if (view != NULL) {
+                ScopedMutexLock lock(&view_lock);
+                view->host = hosts[i];
+                view->entry = entry;
+                view->count = 1;
+                view->next = cache_views;
+                cache_views = view;
+                __sync_fetch_and_add(&outstanding_views, 1);
+                continue;
+            }
+            // Fall back to copying.
+        }
+
+        size_t buffer_size = full_extent(*buf);
+        uint8_t *base = (uint8_t *)halide_malloc(user_context, buffer_size * buf->elem_size + extra_bytes_host_bytes);
+        if (base == NULL) {
+            // Undo the views and copies made so far, and unpin the
+            // entry for all the buffers that don't have views.
+            for (int32_t j = 0; j < i; j++) {
+                if (copied[j]) {
+                    halide_free(user_context, hosts[j] - extra_bytes_host_bytes);
+                } else {
+                    halide_memoization_cache_release(user_context, hosts[j]);
                 }
-                halide_assert(NULL, prev_hash_entry != NULL);
-                prev_hash_entry->next = prune_candidate->next;
             }
+            ScopedMutexLock lock(&shard.lock);
+            entry->in_use_count -= copies + (tuple_count - i);
+            return false;
+        }
+        // Not part of any entry, so release just frees it.
+        *(CacheEntry **)base = NULL;
+        hosts[i] = base + extra_bytes_host_bytes;
+        copy_region(hosts[i], *buf, cached.host, cached, computed_bounds);
+        copied[i] = true;
+        copies++;
+    }
+
+    for (int32_t i = 0; i < tuple_count; i++) {
+        tuple_buffers[i]->host = hosts[i];
+        tuple_buffers[i]->dev = 0;
+        tuple_buffers[i]->host_dirty = false;
+        tuple_buffers[i]->dev_dirty = false;
+    }
 
-            // Remove from less recent chain.
-            if (least_recently_used == prune_candidate) {
-                least_recently_used = more_recent;
+    if (copies > 0) {
+        ScopedMutexLock lock(&shard.lock);
+        entry->in_use_count -= copies;
+    }
+    return true;
+}
+
+// Add the buffers returned by a lookup that missed to the in-memory
+// cache. Returns true if a new entry was added.
+WEAK bool store_entry(void *user_context, const uint8_t *cache_key, int32_t size,
+                      buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                      int64_t compute_time, CacheFuncStats *stats) {
+    uint32_t h = *(uint32_t *)(tuple_buffers[0]->host - extra_bytes_host_bytes);
+    CacheShard &shard = shard_for(h);
+
+    {
+        ScopedMutexLock lock(&shard.lock);
+
+        CacheEntry *entry = shard.find(cache_key, size, h, *computed_bounds, tuple_count);
+        if (entry != NULL) {
+            bool all_bounds_equal = true;
+            bool no_host_pointers_equal = true;
+            {
+                for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
+                    buffer_t *buf = tuple_buffers[i];
+                    all_bounds_equal = bounds_equal(entry->buffer(i), *buf);
+                    if (entry->buffer(i).host == buf->host) {
+                        no_host_pointers_equal = false;
+                    }
+                }
+            }
+            if (all_bounds_equal) {
+                halide_assert(user_context, no_host_pointers_equal);
+                // This entry is still in use by the caller. Mark it as having no cache entry
+                // so halide_memoization_cache_release can free the buffer.
+                for (int32_t i = 0; i < tuple_count; i++) {
+                    *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
+                }
+                return false;
             }
-            if (more_recent != NULL) {
-                more_recent->less_recent = prune_candidate->less_recent;
+        }
+
+        uint64_t added_size = 0;
+        uint64_t added_bytes = 0;
+        {
+            for (int32_t i = 0; i < tuple_count; i++) {
+                buffer_t *buf = tuple_buffers[i];
+                added_size += full_extent(*buf);
+                added_bytes += full_extent(*buf) * buf->elem_size;
             }
+        }
 
-            // Remove from more recent chain.
-            if (most_recently_used == prune_candidate) {
-                most_recently_used = prune_candidate->less_recent;
+        void *entry_storage = halide_malloc(NULL, sizeof(CacheEntry) + sizeof(buffer_t) * (tuple_count - 1));
+        if (entry_storage == NULL) {
+            // This entry is still in use by the caller. Mark it as having no cache entry
+            // so halide_memoization_cache_release can free the buffer.
+            for (int32_t i = 0; i < tuple_count; i++) {
+                *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
             }
-            if (prune_candidate->less_recent != NULL) {
-                prune_candidate->less_recent = more_recent;
+            return false;
+        }
+
+        CacheEntry *new_entry = (CacheEntry *)entry_storage;
+        bool inited = new_entry->init(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers);
+        new_entry->size = added_size;
+        new_entry->cost = compute_time > 0 ? compute_time : 0;
+        new_entry->stats = stats;
+        if (!inited || !shard.insert(new_entry)) {
+            // This entry is still in use by the caller. Mark it as having no cache entry
+            // so halide_memoization_cache_release can free the buffer.
+            for (int32_t i = 0; i < tuple_count; i++) {
+                *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
             }
 
-            // Decrease cache used amount.
-            for (uint32_t i = 0; i < prune_candidate->tuple_count; i++) {
-                current_cache_size -= full_extent(prune_candidate->buffer(i));
+            if (inited) {
+                halide_free(user_context, new_entry->key);
             }
+            halide_free(user_context, new_entry);
+            return false;
+        }
 
-            // Deallocate the entry.
-            prune_candidate->destroy();
-            halide_free(NULL, prune_candidate);
+        new_entry->in_use_count = tuple_count;
+        __sync_fetch_and_add(&current_cache_size, added_size);
+        if (new_entry->stats != NULL) {
+            count(&new_entry->stats->counters.entries, 1);
+            count(&new_entry->stats->counters.bytes, added_bytes);
         }
 
-        prune_candidate = more_recent;
+        for (int32_t i = 0; i < tuple_count; i++) {
+            *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = new_entry;
+        }
     }
-#if CACHE_DEBUGGING
-    validate_cache();
-#endif
+
+
+    // The new entry is in use, so this won't evict it.
+    prune_cache();
+    return true;
+}
+
+// The cache can also be backed by a memory-mapped file, shared by all
+// the processes on a host that use it, and kept across restarts. It is
+// checked when an entry isn't in memory, and new entries are written
+// through to it. The file holds a small open-addressed index, and a
+// log of records that wraps around, so the oldest records are evicted
+// first. Writers advance the log before writing over old records, and
+// readers check each record's position and checksum, so a process
+// that crashes part way through a write leaves at worst a record that
+// is never found. Each process serializes its own threads with a
+// mutex, and the processes take an advisory lock on the file.
+//
+// The first bytes of a cache key identify the memoized Func within
+// this process (see Memoization.cpp), and aren't meaningful in other
+// processes. Records are keyed by the pipeline and Func names and the
+// rest of the key instead. The rest starts with a hash of the Func's
+// lowered computation, so a process running a different definition or
+// schedule of a Func with the same names doesn't find its results.
+const size_t kProcessLocalKeyPrefix = sizeof(void *) + 4;
+
+const uint32_t kFileCacheMagic = 0x434d4c48; // "HLMC"
+// Version 1 keys didn't have the hash.
+const uint32_t kFileCacheVersion = 2;
+const int64_t kDefaultFileCacheSize = 256 << 20;
+const int64_t kMinFileCacheSize = 1 << 20;
+const uint32_t kFileCacheProbes = 8;
+const uint64_t kFileCachePageSize = 4096;
+
+struct FileCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    uint64_t num_slots;
+    uint64_t data_offset;
+    uint64_t data_size;
+    // The end of the log. Everything in the last data_size bytes
+    // before it is intact.
+    uint64_t write_pos;
+};
+
+struct FileCacheSlot {
+    uint64_t position; // Of the record in the log
+    uint32_t hash;
+    uint32_t length;   // Zero if the slot is empty
+};
+
+struct FileCacheBounds {
+    int32_t min[4], extent[4], stride[4];
+    int32_t elem_size;
+    int32_t padding;
+};
+
+struct FileCacheRecord {
+    uint64_t position;
+    uint64_t length;
+    uint64_t checksum; // Of everything after this field
+    int64_t compute_time;
+    uint32_t hash;
+    int32_t key_size;
+    int32_t tuple_count;
+    int32_t padding;
+    FileCacheBounds computed_bounds;
+    // FileCacheBounds for each buffer, then the key, then the contents
+    // of each buffer, each padded to a multiple of 8 bytes.
+};
+
+WEAK uint8_t *file_cache = NULL;
+WEAK int64_t file_cache_size = 0;
+WEAK int file_cache_fd = -1;
+WEAK halide_mutex file_cache_lock;
+WEAK volatile bool file_cache_env_checked = false;
+
+__attribute__((always_inline)) uint64_t pad8(uint64_t x) {
+    return (x + 7) & ~(uint64_t)7;
+}
+
+WEAK FileCacheBounds file_bounds(const buffer_t &buf) {
+    FileCacheBounds b;
+    for (int i = 0; i < 4; i++) {
+        b.min[i] = buf.min[i];
+        b.extent[i] = buf.extent[i];
+        b.stride[i] = buf.stride[i];
+    }
+    b.elem_size = buf.elem_size;
+    b.padding = 0;
+    return b;
+}
+
+WEAK uint64_t fnv_hash(const uint8_t *data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Build the process-independent key for a record in the file. Returns
+// its size, or zero if there isn't one.
+WEAK size_t file_cache_key(uint8_t *dst, size_t dst_size, const uint8_t *cache_key, int32_t size,
+                           const char *pipeline_name, const char *func_name) {
+    if (pipeline_name == NULL || func_name == NULL || (size_t)size < kProcessLocalKeyPrefix) {
+        return 0;
+    }
+    size_t p = strlen(pipeline_name) + 1, f = strlen(func_name) + 1;
+    size_t rest = size - kProcessLocalKeyPrefix;
+    if (p + f + rest > dst_size) {
+        return 0;
+    }
+    memcpy(dst, pipeline_name, p);
+    memcpy(dst + p, func_name, f);
+    memcpy(dst + p + f, cache_key + kProcessLocalKeyPrefix, rest);
+    return p + f + rest;
+}
+
+__attribute__((always_inline)) FileCacheHeader *file_cache_header() {
+    return (FileCacheHeader *)file_cache;
+}
+
+__attribute__((always_inline)) FileCacheSlot *file_cache_slots() {
+    return (FileCacheSlot *)(file_cache + kFileCachePageSize);
+}
+
+// Find the record a slot refers to, if it is still intact.
+WEAK FileCacheRecord *file_cache_record(const FileCacheSlot &slot) {
+    FileCacheHeader *header = file_cache_header();
+    if (slot.length == 0 ||
+        slot.position + header->data_size < header->write_pos ||
+        slot.position + slot.length > header->write_pos) {
+        return NULL;
+    }
+    FileCacheRecord *rec = (FileCacheRecord *)(file_cache + header->data_offset +
+                                               slot.position % header->data_size);
+    if (rec->position != slot.position || rec->length != slot.length ||
+        rec->checksum != fnv_hash((uint8_t *)&rec->compute_time, rec->length - 3 * sizeof(uint64_t))) {
+        return NULL;
+    }
+    return rec;
+}
+
+// Set up the header and index if the file doesn't have a valid one,
+// e.g. because it was just created. Must be called with the file
+// locked exclusively.
+WEAK bool init_file_cache() {
+    FileCacheHeader *header = file_cache_header();
+    if (header->magic == kFileCacheMagic &&
+        header->version == kFileCacheVersion &&
+        header->file_size == (uint64_t)file_cache_size) {
+        return true;
+    }
+
+    uint64_t num_slots = file_cache_size / 16384;
+    uint64_t data_offset = kFileCachePageSize + num_slots * sizeof(FileCacheSlot);
+    data_offset = (data_offset + kFileCachePageSize - 1) & ~(kFileCachePageSize - 1);
+    if (file_cache_size < kMinFileCacheSize || data_offset >= (uint64_t)file_cache_size) {
+        return false;
+    }
+
+    // Make the header invalid until the index is cleared.
+    header->magic = 0;
+    __sync_synchronize();
+    memset(file_cache_slots(), 0, num_slots * sizeof(FileCacheSlot));
+    header->version = kFileCacheVersion;
+    header->file_size = file_cache_size;
+    header->num_slots = num_slots;
+    header->data_offset = data_offset;
+    header->data_size = file_cache_size - data_offset;
+    header->write_pos = 0;
+    __sync_synchronize();
+    header->magic = kFileCacheMagic;
+    return true;
+}
+
+// Must be called with file_cache_lock held.
+WEAK void close_file_cache(void *user_context) {
+    if (file_cache != NULL) {
+        halide_unmap_shared_file(user_context, file_cache, file_cache_size, file_cache_fd);
+        file_cache = NULL;
+        file_cache_size = 0;
+        file_cache_fd = -1;
+    }
+}
+
+// Must be called with file_cache_lock held.
+WEAK int open_file_cache(void *user_context, const char *path, int64_t size) {
+    close_file_cache(user_context);
+    if (path == NULL) {
+        return 0;
+    }
+
+    file_cache_size = size > 0 ? size : kDefaultFileCacheSize;
+    file_cache = (uint8_t *)halide_map_shared_file(user_context, path, &file_cache_size, &file_cache_fd);
+    if (file_cache == NULL) {
+        error(user_context) << "Could not map memoization cache file " << path << "\n";
+        file_cache_size = 0;
+        return -1;
+    }
+
+    halide_lock_shared_file(file_cache_fd, true);
+    bool ok = init_file_cache();
+    halide_unlock_shared_file(file_cache_fd);
+    if (!ok) {
+        error(user_context) << "Memoization cache file " << path << " is too small\n";
+        close_file_cache(user_context);
+        return -1;
+    }
+    return 0;
+}
+
+WEAK void open_file_cache_from_env(void *user_context) {
+    ScopedMutexLock lock(&file_cache_lock);
+    if (file_cache_env_checked) {
+        return;
+    }
+    const char *path = getenv("HL_MEMOIZATION_CACHE_FILE");
+    if (path != NULL && path[0] != 0) {
+        int64_t size = 0;
+        const char *size_str = getenv("HL_MEMOIZATION_CACHE_FILE_SIZE");
+        if (size_str != NULL) {
+            // In megabytes.
+            size = (int64_t)atoi(size_str) << 20;
+        }
+        open_file_cache(user_context, path, size);
+    }
+    file_cache_env_checked = true;
+}
+
+// Fill in the buffers returned by a lookup that missed from the file,
+// if it has a record for exactly the same bounds.
+WEAK bool file_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
+                            const buffer_t &computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                            const char *pipeline_name, const char *func_name, int64_t *compute_time) {
+    uint8_t key[1024];
+    size_t key_size = file_cache_key(key, sizeof(key), cache_key, size, pipeline_name, func_name);
+    if (key_size == 0) {
+        return false;
+    }
+    uint32_t h = djb_hash(key, key_size);
+    FileCacheBounds computed = file_bounds(computed_bounds);
+
+    ScopedMutexLock lock(&file_cache_lock);
+    if (file_cache == NULL) {
+        return false;
+    }
+    halide_lock_shared_file(file_cache_fd, false);
+    FileCacheHeader *header = file_cache_header();
+    bool found = false;
+    for (uint32_t probe = 0; !found && probe < kFileCacheProbes; probe++) {
+        FileCacheSlot &slot = file_cache_slots()[(h + probe) % header->num_slots];
+        if (slot.hash != h) continue;
+        FileCacheRecord *rec = file_cache_record(slot);
+        if (rec == NULL || rec->key_size != (int32_t)key_size || rec->tuple_count != tuple_count ||
+            memcmp(&rec->computed_bounds, &computed, sizeof(computed)) != 0) {
+            continue;
+        }
+        FileCacheBounds *bounds = (FileCacheBounds *)(rec + 1);
+        uint8_t *p = (uint8_t *)(bounds + tuple_count);
+        if (memcmp(p, key, key_size) != 0) {
+            continue;
+        }
+        bool all_bounds_equal = true;
+        for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
+            FileCacheBounds b = file_bounds(*tuple_buffers[i]);
+            all_bounds_equal = memcmp(&bounds[i], &b, sizeof(b)) == 0;
+        }
+        if (!all_bounds_equal) {
+            continue;
+        }
+        p += pad8(key_size);
+        for (int32_t i = 0; i < tuple_count; i++) {
+            size_t bytes = full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size;
+            memcpy(tuple_buffers[i]->host, p, bytes);
+            p += pad8(bytes);
+        }
+        *compute_time = rec->compute_time;
+        found = true;
+    }
+    halide_unlock_shared_file(file_cache_fd);
+    return found;
+}
+
+// Append the result of a computation to the file.
+WEAK void file_cache_store(void *user_context, const uint8_t *cache_key, int32_t size,
+                           const buffer_t &computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                           int64_t compute_time, const char *pipeline_name, const char *func_name) {
+    uint8_t key[1024];
+    size_t key_size = file_cache_key(key, sizeof(key), cache_key, size, pipeline_name, func_name);
+    if (key_size == 0) {
+        return;
+    }
+    uint32_t h = djb_hash(key, key_size);
+
+    uint64_t length = sizeof(FileCacheRecord) + tuple_count * sizeof(FileCacheBounds) + pad8(key_size);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        length += pad8(full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size);
+    }
+
+    ScopedMutexLock lock(&file_cache_lock);
+    if (file_cache == NULL) {
+        return;
+    }
+    FileCacheHeader *header = file_cache_header();
+    // Don't let one result flush most of the file.
+    if (length > header->data_size / 4 || length > 0xffffffff) {
+        return;
+    }
+
+    halide_lock_shared_file(file_cache_fd, true);
+
+    // Pick a slot: one with the same key, else an empty or stale one,
+    // else the one with the oldest record.
+    FileCacheSlot *victim = NULL;
+    for (uint32_t probe = 0; probe < kFileCacheProbes; probe++) {
+        FileCacheSlot *slot = &file_cache_slots()[(h + probe) % header->num_slots];
+        FileCacheRecord *rec = file_cache_record(*slot);
+        if (rec == NULL) {
+            if (victim == NULL || file_cache_record(*victim) != NULL) {
+                victim = slot;
+            }
+        } else if (slot->hash == h && rec->key_size == (int32_t)key_size &&
+                   memcmp((uint8_t *)((FileCacheBounds *)(rec + 1) + rec->tuple_count), key, key_size) == 0 &&
+                   rec->tuple_count == tuple_count) {
+            FileCacheBounds computed = file_bounds(computed_bounds);
+            if (memcmp(&rec->computed_bounds, &computed, sizeof(computed)) == 0) {
+                victim = slot;
+                break;
+            }
+        } else if (victim == NULL ||
+                   (file_cache_record(*victim) != NULL && slot->position < victim->position)) {
+            victim = slot;
+        }
+    }
+
+    // Records don't wrap around the end of the log. Advance the end of
+    // the log before writing, so that a crash part way through leaves
+    // the overwritten records invalid rather than corrupt.
+    uint64_t position = header->write_pos;
+    if (position % header->data_size + length > header->data_size) {
+        position += header->data_size - position % header->data_size;
+    }
+    header->write_pos = position + length;
+    __sync_synchronize();
+
+    FileCacheRecord *rec = (FileCacheRecord *)(file_cache + header->data_offset + position % header->data_size);
+    rec->position = position;
+    rec->length = length;
+    rec->compute_time = compute_time;
+    rec->hash = h;
+    rec->key_size = key_size;
+    rec->tuple_count = tuple_count;
+    rec->padding = 0;
+    rec->computed_bounds = file_bounds(computed_bounds);
+    FileCacheBounds *bounds = (FileCacheBounds *)(rec + 1);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        bounds[i] = file_bounds(*tuple_buffers[i]);
+    }
+    uint8_t *p = (uint8_t *)(bounds + tuple_count);
+    memcpy(p, key, key_size);
+    p += pad8(key_size);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        size_t bytes = full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size;
+        memcpy(p, tuple_buffers[i]->host, bytes);
+        p += pad8(bytes);
+    }
+    rec->checksum = fnv_hash((uint8_t *)&rec->compute_time, length - 3 * sizeof(uint64_t));
+    __sync_synchronize();
+
+    victim->position = position;
+    victim->hash = h;
+    victim->length = length;
+
+    halide_unlock_shared_file(file_cache_fd);
+}
+
+WEAK void print_cache_stats(void *user_context, const char *name,
+                            const halide_memoization_cache_func_stats &c) {
+    char line_buf[160];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+    sstr << name << ": ";
+    while (sstr.size() < 25) sstr << " ";
+    sstr << "hits: " << c.hits;
+    while (sstr.size() < 42) sstr << " ";
+    sstr << "misses: " << c.misses;
+    while (sstr.size() < 60) sstr << " ";
+    uint64_t lookups = c.hits + c.misses;
+    int percent = lookups ? (int)((c.hits * 100) / lookups) : 0;
+    sstr << "(" << percent << "% hits)";
+    while (sstr.size() < 73) sstr << " ";
+    sstr << "evictions: " << c.evictions
+         << "  entries: " << c.entries
+         << "  bytes: " << c.bytes << "\n";
+    halide_print(user_context, sstr.str());
 }
 
 }}} // namespace Halide::Runtime::Internal
@@ -298,18 +1356,20 @@ WEAK void halide_memoization_cache_set_size(int64_t size) {
         size = kDefaultCacheSize;
     }
 
-    ScopedMutexLock lock(&memoization_lock);
-
     max_cache_size = size;
     prune_cache();
 }
 
-WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
-                                         buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
-    uint32_t h = djb_hash(cache_key, size);
-    uint32_t index = h % kHashTableSize;
+WEAK void halide_memoization_cache_set_eviction_policy(int policy) {
+    eviction_policy = policy;
+}
 
-    ScopedMutexLock lock(&memoization_lock);
+WEAK int halide_memoization_cache_lookup_v2(void *user_context, const uint8_t *cache_key, int32_t size,
+                                            buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                                            const char *pipeline_name, const char *func_name) {
+    uint32_t h = djb_hash(cache_key, size);
+    CacheShard &shard = shard_for(h);
+    CacheFuncStats *stats = find_func_stats(pipeline_name, func_name);
 
 #if CACHE_DEBUGGING
     debug_print_key(user_context, "halide_memoization_cache_lookup", cache_key, size);
@@ -324,13 +1384,12 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
     }
 #endif
 
-    CacheEntry *entry = cache_entries[index];
-    while (entry != NULL) {
-        if (entry->hash == h && entry->key_size == (size_t)size &&
-            keys_equal(entry->key, cache_key, size) &&
-            bounds_equal(entry->computed_bounds, *computed_bounds) &&
-            entry->tuple_count == (uint32_t)tuple_count) {
+    CacheEntry *entry = NULL;
+    {
+        ScopedMutexLock lock(&shard.lock);
 
+        entry = shard.find(cache_key, size, h, *computed_bounds, tuple_count);
+        if (entry != NULL) {
             bool all_bounds_equal = true;
 
             {
@@ -341,24 +1400,7 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
             }
 
             if (all_bounds_equal) {
-                if (entry != most_recently_used) {
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    if (entry->less_recent != NULL) {
-                        entry->less_recent->more_recent = entry->more_recent;
-                    } else {
-                        halide_assert(user_context, least_recently_used == entry);
-                        least_recently_used = entry->more_recent;
-                    }
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    entry->more_recent->less_recent = entry->less_recent;
-
-                    entry->more_recent = NULL;
-                    entry->less_recent = most_recently_used;
-                    if (most_recently_used != NULL) {
-                        most_recently_used->more_recent = entry;
-                    }
-                    most_recently_used = entry;
-                }
+                shard.make_most_recent(entry);
 
                 for (int32_t i = 0; i < tuple_count; i++) {
                     buffer_t *buf = tuple_buffers[i];
@@ -366,11 +1408,40 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
                 }
 
                 entry->in_use_count += tuple_count;
+                if (stats != NULL) {
+                    count(&stats->counters.hits, 1);
+                }
 
                 return 0;
             }
         }
-        entry = entry->next;
+
+        // A cached realization of a larger region may contain the
+        // requested one.
+        entry = NULL;
+        if (tuple_count <= kMaxSubregionTupleCount) {
+            entry = shard.find_containing(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers);
+        }
+        if (entry != NULL) {
+            shard.make_most_recent(entry);
+            entry->in_use_count += tuple_count;
+        }
+    }
+
+    if (entry != NULL) {
+        // The entry is pinned, so it's safe to copy out of it without
+        // the lock.
+        if (!lookup_subregion(user_context, shard, entry, *computed_bounds, tuple_count, tuple_buffers)) {
+            return -1;
+        }
+        if (stats != NULL) {
+            count(&stats->counters.hits, 1);
+        }
+        return 0;
+    }
+
+    if (!file_cache_env_checked) {
+        open_file_cache_from_env(user_context);
     }
 
     for (int32_t i = 0; i < tuple_count; i++) {
@@ -390,6 +1461,26 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
         *(uint32_t *)(buf->host - extra_bytes_host_bytes) = h;
     }
 
+    // Another process, or an earlier run, may have computed it.
+    int64_t compute_time = 0;
+    if (file_cache != NULL &&
+        file_cache_lookup(user_context, cache_key, size, *computed_bounds, tuple_count, tuple_buffers,
+                          pipeline_name, func_name, &compute_time)) {
+        store_entry(user_context, cache_key, size, computed_bounds, tuple_count, tuple_buffers, compute_time, stats);
+        if (stats != NULL) {
+            count(&stats->counters.hits, 1);
+        }
+        return 0;
+    }
+
+    if (stats != NULL) {
+        count(&stats->counters.misses, 1);
+    }
+
+    // The generated code times the computation of a missed entry
+    // and passes that to halide_memoization_cache_store_v2.
+    halide_start_clock(user_context);
+
 #if CACHE_DEBUGGING
     validate_cache();
 #endif
@@ -397,15 +1488,11 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
     return 1;
 }
 
-WEAK void halide_memoization_cache_store(void *user_context, const uint8_t *cache_key, int32_t size,
-                                        buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
+WEAK void halide_memoization_cache_store_v2(void *user_context, const uint8_t *cache_key, int32_t size,
+                                            buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                                            int64_t compute_time, const char *pipeline_name, const char *func_name) {
     debug(user_context) << "halide_memoization_cache_store\n";
 
-    uint32_t h = *(uint32_t *)(tuple_buffers[0]->host - extra_bytes_host_bytes);
-    uint32_t index = h % kHashTableSize;
-
-    ScopedMutexLock lock(&memoization_lock);
-
 #if CACHE_DEBUGGING
     debug_print_key(user_context, "halide_memoization_cache_store", cache_key, size);
 
@@ -419,89 +1506,11 @@ WEAK void halide_memoization_cache_store(void *user_context, const uint8_t *cach
     }
 #endif
 
-    CacheEntry *entry = cache_entries[index];
-    while (entry != NULL) {
-        if (entry->hash == h && entry->key_size == (size_t)size &&
-            keys_equal(entry->key, cache_key, size) &&
-            bounds_equal(entry->computed_bounds, *computed_bounds) &&
-            entry->tuple_count == (uint32_t)tuple_count) {
-
-            bool all_bounds_equal = true;
-            bool no_host_pointers_equal = true;
-            {
-                for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
-                    buffer_t *buf = tuple_buffers[i];
-                    all_bounds_equal = bounds_equal(entry->buffer(i), *buf);
-                    if (entry->buffer(i).host == buf->host) {
-                        no_host_pointers_equal = false;
-                    }
-                }
-            }
-            if (all_bounds_equal) {
-                halide_assert(user_context, no_host_pointers_equal);
-                // This entry is still in use by the caller. Mark it as having no cache entry
-                // so halide_memoization_cache_release can free the buffer.
-                for (int32_t i = 0; i < tuple_count; i++) {
-                    *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
-                }
-                return;
-            }
-        }
-        entry = entry->next;
-    }
-
-    uint64_t added_size = 0;
-    {
-        for (int32_t i = 0; i < tuple_count; i++) {
-            buffer_t *buf = tuple_buffers[i];
-            added_size += full_extent(*buf);
-        }
-    }
-    current_cache_size += added_size;
-    prune_cache();
-
-    void *entry_storage = halide_malloc(NULL, sizeof(CacheEntry) + sizeof(buffer_t) * (tuple_count - 1));
-    if (entry_storage == NULL) {
-        current_cache_size -= added_size;
-
-        // This entry is still in use by the caller. Mark it as having no cache entry
-        // so halide_memoization_cache_release can free the buffer.
-        for (int32_t i = 0; i < tuple_count; i++) {
-            *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
-        }
-        return;
-    }
-
-    CacheEntry *new_entry = (CacheEntry *)entry_storage;
-    bool inited = new_entry->init(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers);
-    if (!inited) {
-        current_cache_size -= added_size;
-
-        // This entry is still in use by the caller. Mark it as having no cache entry
-        // so halide_memoization_cache_release can free the buffer.
-        for (int32_t i = 0; i < tuple_count; i++) {
-            *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = NULL;
-        }
-
-        halide_free(user_context, new_entry);
-        return;
-    }
-
-    new_entry->next = cache_entries[index];
-    new_entry->less_recent = most_recently_used;
-    if (most_recently_used != NULL) {
-        most_recently_used->more_recent = new_entry;
-    }
-    most_recently_used = new_entry;
-    if (least_recently_used == NULL) {
-        least_recently_used = new_entry;
-    }
-    cache_entries[index] = new_entry;
-
-    new_entry->in_use_count = tuple_count;
-
-    for (int32_t i = 0; i < tuple_count; i++) {
-        *(CacheEntry **)(tuple_buffers[i]->host - extra_bytes_host_bytes) = new_entry;
+    CacheFuncStats *stats = find_func_stats(pipeline_name, func_name);
+    if (store_entry(user_context, cache_key, size, computed_bounds, tuple_count, tuple_buffers, compute_time, stats) &&
+        file_cache != NULL) {
+        file_cache_store(user_context, cache_key, size, *computed_bounds, tuple_count, tuple_buffers,
+                         compute_time, pipeline_name, func_name);
     }
 
 #if CACHE_DEBUGGING
@@ -510,40 +1519,184 @@ WEAK void halide_memoization_cache_store(void *user_context, const uint8_t *cach
     debug(user_context) << "Exiting halide_memoization_cache_store\n";
 }
 
+WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
+                                         buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
+    return halide_memoization_cache_lookup_v2(user_context, cache_key, size, computed_bounds,
+                                              tuple_count, tuple_buffers, NULL, NULL);
+}
+
+WEAK void halide_memoization_cache_store(void *user_context, const uint8_t *cache_key, int32_t size,
+                                        buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
+    halide_memoization_cache_store_v2(user_context, cache_key, size, computed_bounds,
+                                      tuple_count, tuple_buffers, 0, NULL, NULL);
+}
+
 WEAK void halide_memoization_cache_release(void *user_context, void *host) {
     uint8_t *base = (uint8_t *)host - extra_bytes_host_bytes;
     debug(user_context) << "halide_memoization_cache_release\n";
+
+    if (outstanding_views > 0) {
+        CacheEntry *entry = NULL;
+        {
+            ScopedMutexLock lock(&view_lock);
+            CacheView **prev = &cache_views;
+            while (*prev != NULL && (*prev)->host != host) {
+                prev = &(*prev)->next;
+            }
+            CacheView *view = *prev;
+            if (view != NULL) {
+                entry = view->entry;
+                if (--view->count == 0) {
+                    *prev = view->next;
+                    halide_free(user_context, view);
+                }
+                __sync_fetch_and_sub(&outstanding_views, 1);
+            }
+        }
+        if (entry != NULL) {
+            ScopedMutexLock lock(&shard_for(entry->hash).lock);
+            halide_assert(user_context, entry->in_use_count > 0);
+            entry->in_use_count--;
+            return;
+        }
+    }
+
     CacheEntry *entry = *(CacheEntry **)(base);
 
     if (entry == NULL) {
         halide_free(user_context, base);
     } else {
-        ScopedMutexLock lock(&memoization_lock);
+        ScopedMutexLock lock(&shard_for(entry->hash).lock);
 
         halide_assert(user_context, entry->in_use_count > 0);
         entry->in_use_count--;
+    }
+
 #if CACHE_DEBUGGING
-        validate_cache();
+    validate_cache();
 #endif
-    }
 
     debug(user_context) << "Exited halide_memoization_cache_release.\n";
 }
 
 WEAK void halide_memoization_cache_cleanup() {
     debug(NULL) << "halide_memoization_cache_cleanup\n";
-    for (size_t i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
-        cache_entries[i] = NULL;
-        while (entry != NULL) {
-            CacheEntry *next = entry->next;
-            entry->destroy();
-            halide_free(NULL, entry);
-            entry = next;
+    for (uint32_t s = 0; s < kNumShards; s++) {
+        CacheShard &shard = cache_shards[s];
+        for (size_t i = 0; i < shard.num_buckets; i++) {
+            CacheEntry *entry = shard.buckets[i];
+            while (entry != NULL) {
+                CacheEntry *next = entry->next;
+                entry->destroy();
+                halide_free(NULL, entry);
+                entry = next;
+            }
+        }
+        if (shard.buckets != NULL) {
+            halide_free(NULL, shard.buckets);
+        }
+        if (shard.heap != NULL) {
+            halide_free(NULL, shard.heap);
         }
+        shard.buckets = NULL;
+        shard.num_buckets = 0;
+        shard.heap = NULL;
+        shard.heap_capacity = 0;
+        shard.num_entries = 0;
+        shard.most_recently_used = NULL;
+        shard.least_recently_used = NULL;
+        halide_mutex_cleanup(&shard.lock);
     }
     current_cache_size = 0;
-    halide_mutex_cleanup(&memoization_lock);
+    halide_mutex_cleanup(&prune_lock);
+
+    while (cache_views != NULL) {
+        CacheView *view = cache_views;
+        cache_views = view->next;
+        halide_free(NULL, view);
+    }
+    outstanding_views = 0;
+    halide_mutex_cleanup(&view_lock);
+
+    while (func_stats_list != NULL) {
+        CacheFuncStats *s = func_stats_list;
+        func_stats_list = s->next;
+        halide_free(NULL, s);
+    }
+    halide_mutex_cleanup(&func_stats_lock);
+
+    {
+        ScopedMutexLock lock(&file_cache_lock);
+        close_file_cache(NULL);
+        file_cache_env_checked = false;
+    }
+    halide_mutex_cleanup(&file_cache_lock);
+}
+
+WEAK int halide_memoization_cache_set_file(void *user_context, const char *path, int64_t size) {
+    ScopedMutexLock lock(&file_cache_lock);
+    // An explicit setting overrides the environment.
+    file_cache_env_checked = true;
+    return open_file_cache(user_context, path, size);
+}
+
+WEAK int halide_memoization_cache_get_stats(halide_memoization_cache_func_stats *stats, int max_funcs) {
+    int n = 0;
+    for (CacheFuncStats *s = func_stats_list; s != NULL; s = s->next) {
+        if (n < max_funcs) {
+            stats[n] = s->counters;
+        }
+        n++;
+    }
+    return n;
+}
+
+WEAK void halide_memoization_cache_reset_stats() {
+    // Entries and bytes describe what is in the cache now, so only the
+    // event counts are reset.
+    for (CacheFuncStats *s = func_stats_list; s != NULL; s = s->next) {
+        s->counters.hits = 0;
+        s->counters.misses = 0;
+        s->counters.evictions = 0;
+    }
+}
+
+WEAK void halide_memoization_cache_report(void *user_context) {
+    char line_buf[160];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+    sstr << "memoization cache: " << current_cache_size
+         << " of " << max_cache_size << " elements in use\n";
+    halide_print(user_context, sstr.str());
+
+    // Group the Funcs by pipeline, in the order the pipelines first
+    // appear in the list.
+    for (CacheFuncStats *p = func_stats_list; p != NULL; p = p->next) {
+        bool seen = false;
+        for (CacheFuncStats *q = func_stats_list; q != p && !seen; q = q->next) {
+            seen = names_equal(q->counters.pipeline_name, p->counters.pipeline_name);
+        }
+        if (seen) continue;
+
+        halide_memoization_cache_func_stats total;
+        memset(&total, 0, sizeof(total));
+        for (CacheFuncStats *s = p; s != NULL; s = s->next) {
+            if (names_equal(s->counters.pipeline_name, p->counters.pipeline_name)) {
+                total.hits += s->counters.hits;
+                total.misses += s->counters.misses;
+                total.evictions += s->counters.evictions;
+                total.entries += s->counters.entries;
+                total.bytes += s->counters.bytes;
+            }
+        }
+        print_cache_stats(user_context, p->counters.pipeline_name ? p->counters.pipeline_name : "(unknown)", total);
+        for (CacheFuncStats *s = p; s != NULL; s = s->next) {
+            if (names_equal(s->counters.pipeline_name, p->counters.pipeline_name)) {
+                sstr.clear();
+                sstr << "  " << (s->counters.func_name ? s->counters.func_name : "(unknown)");
+                print_cache_stats(user_context, sstr.str(), s->counters);
+            }
+        }
+    }
 }
 
 namespace {
@@ -0,0 +1,16 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Futexes aren't available. Callers should fall back to condition
+// variables when these return -1.
+
+WEAK int halide_futex_wait(volatile int *addr, int val) {
+    return -1;
+}
+
+WEAK int halide_futex_wake(volatile int *addr, int count) {
+    return -1;
+}
+
+}
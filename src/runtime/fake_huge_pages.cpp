@@ -0,0 +1,16 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Huge pages aren't supported. Callers should fall back to
+// halide_malloc's usual allocator when halide_map_huge_pages returns
+// NULL.
+
+WEAK void *halide_map_huge_pages(void *user_context, size_t *size) {
+    return NULL;
+}
+
+WEAK void halide_unmap_huge_pages(void *user_context, void *addr, size_t size) {
+}
+
+}
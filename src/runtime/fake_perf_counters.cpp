@@ -0,0 +1,28 @@
+#include "runtime_internal.h"
+#include "HalideRuntime.h"
+
+extern "C" {
+
+// Performance counters aren't supported. The profiler reports time
+// only.
+
+WEAK int halide_current_thread_id() {
+    return 0;
+}
+
+WEAK int halide_open_perf_counters(int tid, bool software_only, int *fds, const char **names) {
+    for (int i = 0; i < HALIDE_PROFILER_NUM_COUNTERS; i++) {
+        fds[i] = -1;
+        names[i] = NULL;
+    }
+    return 0;
+}
+
+WEAK bool halide_read_perf_counter(int fd, uint64_t *value) {
+    return false;
+}
+
+WEAK void halide_close_perf_counter(int fd) {
+}
+
+}
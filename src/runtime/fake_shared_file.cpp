@@ -0,0 +1,22 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Files shared between processes aren't supported. Callers should
+// carry on without them when halide_map_shared_file returns NULL.
+
+WEAK void *halide_map_shared_file(void *user_context, const char *path, int64_t *size, int *fd) {
+    *fd = -1;
+    return NULL;
+}
+
+WEAK void halide_unmap_shared_file(void *user_context, void *addr, int64_t size, int fd) {
+}
+
+WEAK void halide_lock_shared_file(int fd, bool exclusive) {
+}
+
+WEAK void halide_unlock_shared_file(int fd) {
+}
+
+}
@@ -0,0 +1,11 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// No spin-wait hint available. Just stop the compiler from hoisting
+// loads out of the polling loop.
+WEAK void halide_spin_pause() {
+    __asm__ __volatile__("" ::: "memory");
+}
+
+}
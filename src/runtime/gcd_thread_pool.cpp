@@ -114,6 +114,54 @@ WEAK void halide_shutdown_thread_pool() {
 WEAK void halide_set_num_threads(int) {
 }
 
+WEAK void halide_set_work_stealing(bool) {
+}
+
+WEAK void halide_set_thread_affinity(bool) {
+}
+
+WEAK void halide_set_thread_pool_spin_count(int) {
+}
+
+WEAK void halide_set_thread_pool_hot(bool) {
+}
+
+WEAK halide_thread_pool *halide_create_thread_pool(const char *, int, int) {
+    return NULL;
+}
+
+WEAK halide_thread_pool *halide_find_thread_pool(const char *) {
+    return NULL;
+}
+
+WEAK int halide_use_thread_pool(void *, halide_thread_pool *) {
+    return 0;
+}
+
+WEAK void halide_destroy_thread_pool(halide_thread_pool *) {
+}
+
+WEAK void halide_set_thread_pool_stats(bool) {
+}
+
+WEAK void halide_thread_pool_reset_stats() {
+}
+
+WEAK int halide_thread_pool_get_worker_stats(halide_thread_pool *, halide_thread_pool_worker_stats *, int) {
+    return 0;
+}
+
+WEAK int halide_thread_pool_get_loop_stats(halide_thread_pool *, halide_thread_pool_loop_stats *, int) {
+    return 0;
+}
+
+WEAK int halide_thread_pool_get_call_stats(halide_thread_pool *, halide_thread_pool_call_stats *, int) {
+    return 0;
+}
+
+WEAK void halide_thread_pool_report(void *) {
+}
+
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
     halide_do_task_t result = custom_do_task;
     custom_do_task = f;
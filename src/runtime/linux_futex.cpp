@@ -0,0 +1,34 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// The syscall number for futex varies across platforms:
+// -- i386 and android x86 is 240
+// -- x64 is 202
+
+#ifndef SYS_FUTEX
+
+#ifdef BITS_64
+#define SYS_FUTEX 202
+#endif
+
+#ifdef BITS_32
+#define SYS_FUTEX 240
+#endif
+
+#endif
+
+#define FUTEX_WAIT_PRIVATE 128
+#define FUTEX_WAKE_PRIVATE 129
+
+extern int syscall(int num, ...);
+
+WEAK int halide_futex_wait(volatile int *addr, int val) {
+    return syscall(SYS_FUTEX, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+WEAK int halide_futex_wake(volatile int *addr, int count) {
+    return syscall(SYS_FUTEX, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+}
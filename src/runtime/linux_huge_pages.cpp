@@ -0,0 +1,46 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED ((void *)-1)
+#define MADV_HUGEPAGE 14
+
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+extern int munmap(void *addr, size_t length);
+extern int madvise(void *addr, size_t length, int advice);
+
+WEAK void *halide_map_huge_pages(void *user_context, size_t *size) {
+    const size_t huge_page_size = 2 << 20;
+    size_t length = (*size + huge_page_size - 1) & ~(huge_page_size - 1);
+
+    // Over-allocate by a huge page, and trim the ends so that the
+    // mapping starts on a huge page boundary.
+    uint8_t *base = (uint8_t *)mmap(NULL, length + huge_page_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void *)base == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t *aligned = (uint8_t *)(((size_t)base + huge_page_size - 1) & ~(huge_page_size - 1));
+    if (aligned > base) {
+        munmap(base, aligned - base);
+    }
+    if (aligned + length < base + length + huge_page_size) {
+        munmap(aligned + length, (base + length + huge_page_size) - (aligned + length));
+    }
+
+    // This is only a hint. It fails harmlessly on kernels without
+    // transparent huge pages.
+    madvise(aligned, length, MADV_HUGEPAGE);
+    *size = length;
+    return aligned;
+}
+
+WEAK void halide_unmap_huge_pages(void *user_context, void *addr, size_t size) {
+    munmap(addr, size);
+}
+
+}
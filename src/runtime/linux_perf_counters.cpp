@@ -0,0 +1,125 @@
+#include "runtime_internal.h"
+#include "HalideRuntime.h"
+
+extern "C" {
+
+// The syscall numbers vary across platforms:
+// -- perf_event_open is 336 on i386 and 298 on x64
+// -- gettid is 224 on i386 and 186 on x64
+
+#ifndef SYS_PERF_EVENT_OPEN
+
+#ifdef BITS_64
+#define SYS_PERF_EVENT_OPEN 298
+#define SYS_GETTID 186
+#endif
+
+#ifdef BITS_32
+#define SYS_PERF_EVENT_OPEN 336
+#define SYS_GETTID 224
+#endif
+
+#endif
+
+#define PERF_TYPE_HARDWARE 0
+#define PERF_TYPE_SOFTWARE 1
+
+#define PERF_COUNT_HW_CPU_CYCLES 0
+#define PERF_COUNT_HW_INSTRUCTIONS 1
+#define PERF_COUNT_HW_CACHE_MISSES 3
+
+#define PERF_COUNT_SW_PAGE_FAULTS 2
+#define PERF_COUNT_SW_CONTEXT_SWITCHES 3
+#define PERF_COUNT_SW_TASK_CLOCK 1
+
+#define PERF_FLAG_FD_CLOEXEC 8
+
+// The first version of struct perf_event_attr, which every kernel
+// with perf events accepts.
+struct perf_event_attr {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+};
+
+// Bits of perf_event_attr::flags.
+#define PERF_ATTR_EXCLUDE_KERNEL (1 << 5)
+#define PERF_ATTR_EXCLUDE_HV (1 << 6)
+
+extern int syscall(int num, ...);
+extern ssize_t read(int fd, void *buf, size_t bytes);
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+struct perf_counter_event {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+};
+
+// The hardware counters, and the software counters to use for each
+// where the hardware ones aren't available (e.g. inside most virtual
+// machines).
+WEAK perf_counter_event perf_counter_events[HALIDE_PROFILER_NUM_COUNTERS][2] = {
+    {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task clock ns"}},
+    {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context switches"}},
+    {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc misses"},
+     {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page faults"}}
+};
+
+WEAK int open_perf_counter(int tid, const perf_counter_event &e) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = e.type;
+    attr.size = sizeof(attr);
+    attr.config = e.config;
+    // Counting user code only works with the default
+    // perf_event_paranoid setting, and is all we want anyway.
+    attr.flags = PERF_ATTR_EXCLUDE_KERNEL | PERF_ATTR_EXCLUDE_HV;
+    return syscall(SYS_PERF_EVENT_OPEN, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+}}}
+
+extern "C" {
+
+WEAK int halide_current_thread_id() {
+    return syscall(SYS_GETTID);
+}
+
+WEAK int halide_open_perf_counters(int tid, bool software_only, int *fds, const char **names) {
+    int opened = 0;
+    for (int i = 0; i < HALIDE_PROFILER_NUM_COUNTERS; i++) {
+        fds[i] = -1;
+        names[i] = NULL;
+        for (int j = software_only ? 1 : 0; j < 2 && fds[i] < 0; j++) {
+            fds[i] = open_perf_counter(tid, perf_counter_events[i][j]);
+            if (fds[i] >= 0) {
+                names[i] = perf_counter_events[i][j].name;
+                opened++;
+            }
+        }
+    }
+    return opened;
+}
+
+WEAK bool halide_read_perf_counter(int fd, uint64_t *value) {
+    return read(fd, value, sizeof(uint64_t)) == sizeof(uint64_t);
+}
+
+WEAK void halide_close_perf_counter(int fd) {
+    close(fd);
+}
+
+}
@@ -0,0 +1,64 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+#define O_RDWR 2
+#define O_CREAT 64
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_SHARED 1
+#define MAP_FAILED ((void *)-1)
+#define SEEK_END 2
+#define LOCK_SH 1
+#define LOCK_EX 2
+#define LOCK_UN 8
+
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+extern int munmap(void *addr, size_t length);
+extern int ftruncate(int fd, long length);
+extern long lseek(int fd, long offset, int whence);
+extern int flock(int fd, int operation);
+
+WEAK void *halide_map_shared_file(void *user_context, const char *path, int64_t *size, int *fd) {
+    *fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (*fd < 0) {
+        return NULL;
+    }
+
+    // Whoever creates the file sets its size. Everyone else uses the
+    // size it already has.
+    flock(*fd, LOCK_EX);
+    long existing_size = lseek(*fd, 0, SEEK_END);
+    if (existing_size > 0) {
+        *size = existing_size;
+    } else if (ftruncate(*fd, *size) != 0) {
+        existing_size = -1;
+    }
+    flock(*fd, LOCK_UN);
+
+    void *addr = MAP_FAILED;
+    if (existing_size >= 0) {
+        addr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        close(*fd);
+        *fd = -1;
+        return NULL;
+    }
+    return addr;
+}
+
+WEAK void halide_unmap_shared_file(void *user_context, void *addr, int64_t size, int fd) {
+    munmap(addr, size);
+    close(fd);
+}
+
+WEAK void halide_lock_shared_file(int fd, bool exclusive) {
+    flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+}
+
+WEAK void halide_unlock_shared_file(int fd) {
+    flock(fd, LOCK_UN);
+}
+
+}
@@ -1,6 +1,8 @@
 #include "runtime_internal.h"
 
 #include "HalideRuntime.h"
+#include "scoped_mutex_lock.h"
+#include "scoped_spin_lock.h"
 
 extern "C" {
 
@@ -11,7 +13,7 @@ extern void free(void *);
 
 namespace Halide { namespace Runtime { namespace Internal {
 
-WEAK void *default_malloc(void *user_context, size_t x) {
+WEAK void *heap_malloc(void *user_context, size_t x) {
     // Allocate enough space for aligning the pointer we return.
     const size_t alignment = 128;
     void *orig = malloc(x + alignment);
@@ -22,16 +24,284 @@ WEAK void *default_malloc(void *user_context, size_t x) {
     // We want to store the original pointer prior to the pointer we return.
     void *ptr = (void *)(((size_t)orig + alignment + sizeof(void*) - 1) & ~(alignment - 1));
     ((void **)ptr)[-1] = orig;
+    // Mark it as not coming from the pool (see pool_tag below).
+    ((void **)ptr)[-2] = NULL;
     return ptr;
 }
 
+// Allocations of at least this many bytes are mapped directly, backed
+// by transparent huge pages where the OS supports them, to cut down on
+// TLB misses when walking over large buffers. Zero means never.
+WEAK int64_t huge_page_threshold = 0;
+WEAK volatile bool huge_page_env_checked = false;
+const uintptr_t kHugePageTag = 0x6a6e9e00;
+
+WEAK void *huge_page_malloc(void *user_context, size_t x) {
+    // The first 128 bytes of the mapping hold the usual header, plus
+    // its length.
+    const size_t header = 128;
+    size_t length = x + header;
+    uint8_t *base = (uint8_t *)halide_map_huge_pages(user_context, &length);
+    if (base == NULL) {
+        return NULL;
+    }
+    void **ptr = (void **)(base + header);
+    ptr[-1] = base;
+    ptr[-2] = (void *)kHugePageTag;
+    ptr[-3] = (void *)length;
+    return ptr;
+}
+
+WEAK void *default_malloc(void *user_context, size_t x) {
+    if (!huge_page_env_checked) {
+        const char *threshold = getenv("HL_HUGE_PAGE_THRESHOLD");
+        if (threshold) {
+            // In megabytes.
+            huge_page_threshold = (int64_t)atoi(threshold) << 20;
+        }
+        huge_page_env_checked = true;
+    }
+    if (huge_page_threshold > 0 && (int64_t)x >= huge_page_threshold) {
+        void *ptr = huge_page_malloc(user_context, x);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    return heap_malloc(user_context, x);
+}
+
 WEAK void default_free(void *user_context, void *ptr) {
-    free(((void**)ptr)[-1]);
+    void **header = (void **)ptr;
+    if ((uintptr_t)header[-2] == kHugePageTag) {
+        halide_unmap_huge_pages(user_context, header[-1], (size_t)header[-3]);
+    } else {
+        free(header[-1]);
+    }
+}
+
+// The pooled allocator rounds requests up to a size class, and keeps
+// freed blocks on free lists to hand out again, instead of returning
+// them to the system. There are four size classes per power of two, so
+// at most a fifth of a block is wasted. Blocks are laid out like those
+// of default_malloc, so default_free can free them, and
+// halide_pooled_free can free blocks from default_malloc.
+//
+// The free lists are split into a fixed number of caches, each with its
+// own spin lock, to spread out contention. These are not true
+// thread-local caches: the runtime has no portable thread-local
+// storage, so a thread picks its cache by hashing its stack address
+// (see current_thread_cache). Two threads can land on the same cache
+// and contend for its lock, and with more than kNumThreadCaches threads
+// some always will.
+const int kNumSizeClasses = 64;
+const int kNumThreadCaches = 32;
+// The most that one cache holds.
+const int64_t kThreadCacheBytes = 4 << 20;
+const int64_t kDefaultMaxRetainedBytes = 64 << 20;
+const uintptr_t kPoolTag = 0x9001ed00;
+
+struct ThreadCache {
+    volatile int lock;
+    int64_t bytes;
+    void *free_list[kNumSizeClasses];
+};
+
+WEAK ThreadCache thread_caches[kNumThreadCaches];
+WEAK int64_t retained_bytes = 0;
+WEAK int64_t max_retained_bytes = kDefaultMaxRetainedBytes;
+
+__attribute__((always_inline)) size_t size_class_bytes(int c) {
+    return (size_t)(4 + (c & 3)) << ((c >> 2) + 5);
+}
+
+// The smallest size class that holds x bytes, or kNumSizeClasses if
+// none does.
+__attribute__((always_inline)) int size_class(size_t x) {
+    if (x <= size_class_bytes(0)) {
+        return 0;
+    }
+    uint64_t n = x - 1;
+    int b = 63 - __builtin_clzll(n);
+    int e = b - 2;
+    int c = (e - 5) * 4 + (int)((n >> e) & 3) + 1;
+    return c < kNumSizeClasses ? c : kNumSizeClasses;
+}
+
+__attribute__((always_inline)) void *&pool_tag(void *ptr) {
+    return ((void **)ptr)[-2];
+}
+
+// Threads don't share stacks, so the address of a local picks a cache
+// that other running threads are unlikely to be using. This is only a
+// hash of the stack address in 64k units, so a thread moves to another
+// cache when its stack crosses one of those boundaries. That's
+// harmless, as any cache can free any pooled block, but a block freed
+// deeper in the stack than it was allocated may go to another cache.
+__attribute__((always_inline)) ThreadCache &current_thread_cache() {
+    int local;
+    uint32_t x = (uint32_t)((uintptr_t)&local >> 16);
+    return thread_caches[(x * 2654435761u) >> 27];
+}
+
+WEAK void *pooled_malloc(void *user_context, size_t x) {
+    int c = size_class(x);
+    if (c == kNumSizeClasses) {
+        return default_malloc(user_context, x);
+    }
+    size_t bytes = size_class_bytes(c);
+
+    ThreadCache &cache = current_thread_cache();
+    void *ptr = NULL;
+    {
+        ScopedSpinLock lock(&cache.lock);
+        ptr = cache.free_list[c];
+        if (ptr != NULL) {
+            cache.free_list[c] = *(void **)ptr;
+            cache.bytes -= bytes;
+        }
+    }
+    if (ptr != NULL) {
+        __sync_fetch_and_sub(&retained_bytes, (int64_t)bytes);
+        return ptr;
+    }
+
+    ptr = heap_malloc(user_context, bytes);
+    if (ptr != NULL) {
+        pool_tag(ptr) = (void *)(kPoolTag | c);
+    }
+    return ptr;
+}
+
+WEAK void pooled_free(void *user_context, void *ptr) {
+    uintptr_t tag = (uintptr_t)pool_tag(ptr);
+    if ((tag & ~(uintptr_t)(kNumSizeClasses - 1)) != kPoolTag) {
+        default_free(user_context, ptr);
+        return;
+    }
+    int c = (int)(tag & (kNumSizeClasses - 1));
+    int64_t bytes = size_class_bytes(c);
+
+    if (__sync_add_and_fetch(&retained_bytes, bytes) <= max_retained_bytes) {
+        ThreadCache &cache = current_thread_cache();
+        ScopedSpinLock lock(&cache.lock);
+        if (cache.bytes + bytes <= kThreadCacheBytes) {
+            *(void **)ptr = cache.free_list[c];
+            cache.free_list[c] = ptr;
+            cache.bytes += bytes;
+            return;
+        }
+    }
+    __sync_fetch_and_sub(&retained_bytes, bytes);
+    default_free(user_context, ptr);
 }
 
 WEAK halide_malloc_t custom_malloc = default_malloc;
 WEAK halide_free_t custom_free = default_free;
 
+// An arena remembers the blocks allocated with the user_contexts bound
+// to it. When they are freed it keeps them, and hands them out again to
+// requests that fit, so a pipeline called over and over with the same
+// shapes stops calling malloc after the first call.
+struct arena_block {
+    void *ptr;
+    size_t size;
+    bool in_use;
+    arena_block *next;
+};
+
+struct arena_t {
+    halide_mutex mutex;
+    arena_block *blocks;
+};
+
+// The user_contexts bound to arenas. Lookups don't take any lock, so
+// that threads allocating with different user_contexts don't contend.
+// Changes are serialized by arena_registry_mutex. A binding is pushed
+// onto the front of the list once it's filled in, is never removed,
+// and never changes user_context; unbinding just sets its arena to
+// NULL. num_bound_arenas is checked first, so that calls that don't use
+// arenas never walk the list.
+struct arena_binding {
+    void *user_context;
+    arena_t *volatile arena;
+    arena_binding *next;
+};
+WEAK halide_mutex arena_registry_mutex;
+WEAK arena_binding *volatile arena_bindings = NULL;
+WEAK volatile int num_bound_arenas = 0;
+
+WEAK arena_t *find_arena(void *user_context) {
+    for (arena_binding *b = arena_bindings; b; b = b->next) {
+        if (b->user_context == user_context) {
+            return b->arena;
+        }
+    }
+    return NULL;
+}
+
+WEAK void *arena_malloc(void *user_context, arena_t *arena, size_t x) {
+    {
+        ScopedMutexLock lock(&arena->mutex);
+        // Take the smallest free block that holds x bytes, but don't
+        // waste more than half of a block.
+        arena_block *best = NULL;
+        for (arena_block *b = arena->blocks; b; b = b->next) {
+            if (!b->in_use && b->size >= x && b->size / 2 <= x &&
+                (best == NULL || b->size < best->size)) {
+                best = b;
+            }
+        }
+        if (best) {
+            best->in_use = true;
+            return best->ptr;
+        }
+    }
+
+    void *ptr = custom_malloc(user_context, x);
+    arena_block *block = ptr ? (arena_block *)malloc(sizeof(arena_block)) : NULL;
+    if (block) {
+        // If this isn't recorded, the block is simply freed as usual.
+        block->ptr = ptr;
+        block->size = x;
+        block->in_use = true;
+        ScopedMutexLock lock(&arena->mutex);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    return ptr;
+}
+
+// Returns false if the block didn't come from the arena.
+WEAK bool arena_free(arena_t *arena, void *ptr) {
+    ScopedMutexLock lock(&arena->mutex);
+    for (arena_block *b = arena->blocks; b; b = b->next) {
+        if (b->ptr == ptr && b->in_use) {
+            b->in_use = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Free the blocks that aren't in use. If forget_in_use is set, stop
+// tracking the others too; they'll be freed normally.
+WEAK void arena_release(void *user_context, arena_t *arena, bool forget_in_use) {
+    ScopedMutexLock lock(&arena->mutex);
+    arena_block **b = &arena->blocks;
+    while (*b) {
+        arena_block *block = *b;
+        if (!block->in_use || forget_in_use) {
+            if (!block->in_use) {
+                custom_free(user_context, block->ptr);
+            }
+            *b = block->next;
+            free(block);
+        } else {
+            b = &block->next;
+        }
+    }
+}
+
 }}} // namespace Halide::Runtime::Internal
 
 extern "C" {
@@ -49,11 +319,123 @@ WEAK halide_free_t halide_set_custom_free(halide_free_t user_free) {
 }
 
 WEAK void *halide_malloc(void *user_context, size_t x) {
+    if (num_bound_arenas) {
+        arena_t *arena = find_arena(user_context);
+        if (arena) {
+            return arena_malloc(user_context, arena, x);
+        }
+    }
     return custom_malloc(user_context, x);
 }
 
 WEAK void halide_free(void *user_context, void *ptr) {
+    if (num_bound_arenas) {
+        arena_t *arena = find_arena(user_context);
+        if (arena && arena_free(arena, ptr)) {
+            return;
+        }
+    }
     custom_free(user_context, ptr);
 }
 
+WEAK halide_arena *halide_create_arena() {
+    arena_t *arena = (arena_t *)malloc(sizeof(arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    memset(arena, 0, sizeof(arena_t));
+    return (halide_arena *)arena;
+}
+
+WEAK int halide_use_arena(void *user_context, halide_arena *arena) {
+    ScopedMutexLock lock(&arena_registry_mutex);
+    arena_binding *b = arena_bindings;
+    while (b && b->user_context != user_context) {
+        b = b->next;
+    }
+    if (!b) {
+        if (!arena) {
+            return 0;
+        }
+        b = (arena_binding *)malloc(sizeof(arena_binding));
+        if (!b) {
+            return -1;
+        }
+        b->user_context = user_context;
+        b->arena = NULL;
+        b->next = arena_bindings;
+        // Make sure the binding is filled in before anyone can find it.
+        __sync_synchronize();
+        arena_bindings = b;
+    }
+    if (arena && !b->arena) {
+        __sync_fetch_and_add(&num_bound_arenas, 1);
+    } else if (!arena && b->arena) {
+        __sync_fetch_and_sub(&num_bound_arenas, 1);
+    }
+    b->arena = (arena_t *)arena;
+    return 0;
+}
+
+WEAK void halide_release_arena(void *user_context, halide_arena *arena) {
+    if (arena) {
+        arena_release(user_context, (arena_t *)arena, false);
+    }
+}
+
+WEAK void halide_destroy_arena(void *user_context, halide_arena *arena) {
+    if (!arena) {
+        return;
+    }
+    arena_t *a = (arena_t *)arena;
+    {
+        ScopedMutexLock lock(&arena_registry_mutex);
+        for (arena_binding *b = arena_bindings; b; b = b->next) {
+            if (b->arena == a) {
+                b->arena = NULL;
+                __sync_fetch_and_sub(&num_bound_arenas, 1);
+            }
+        }
+    }
+    arena_release(user_context, a, true);
+    halide_mutex_cleanup(&a->mutex);
+    free(a);
+}
+
+WEAK void halide_set_huge_page_threshold(int64_t bytes) {
+    huge_page_threshold = bytes;
+    huge_page_env_checked = true;
+}
+
+WEAK void *halide_pooled_malloc(void *user_context, size_t x) {
+    return pooled_malloc(user_context, x);
+}
+
+WEAK void halide_pooled_free(void *user_context, void *ptr) {
+    pooled_free(user_context, ptr);
+}
+
+WEAK void halide_pooled_allocator_set_max_retained(int64_t bytes) {
+    max_retained_bytes = bytes;
+    if (retained_bytes > bytes) {
+        halide_pooled_allocator_release(NULL);
+    }
+}
+
+WEAK void halide_pooled_allocator_release(void *user_context) {
+    for (int i = 0; i < kNumThreadCaches; i++) {
+        ThreadCache &cache = thread_caches[i];
+        ScopedSpinLock lock(&cache.lock);
+        for (int c = 0; c < kNumSizeClasses; c++) {
+            while (cache.free_list[c] != NULL) {
+                void *ptr = cache.free_list[c];
+                cache.free_list[c] = *(void **)ptr;
+                __sync_fetch_and_sub(&retained_bytes, (int64_t)size_class_bytes(c));
+                default_free(user_context, ptr);
+            }
+        }
+        cache.bytes = 0;
+    }
+}
+
 }
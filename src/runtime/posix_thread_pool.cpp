@@ -1,6 +1,8 @@
 #include "runtime_internal.h"
 
 #include "HalideRuntime.h"
+#include "printer.h"
+#include "scoped_spin_lock.h"
 
 // TODO: This code currently doesn't work on OS X (Darwin) as we do
 // not initialize the pthread_mutex_t using PTHREAD_MUTEX_INITIALIZER
@@ -40,14 +42,31 @@ extern int pthread_join(pthread_t thread, void **retval);
 extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
 extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 extern int pthread_cond_broadcast(pthread_cond_t *cond);
+extern int pthread_cond_signal(pthread_cond_t *cond);
 extern int pthread_cond_destroy(pthread_cond_t *cond);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
 extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
+typedef unsigned int pthread_key_t;
+extern int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+extern void *pthread_getspecific(pthread_key_t key);
+extern int pthread_setspecific(pthread_key_t key, const void *value);
 
 extern char *getenv(const char *);
 extern int atoi(const char *);
+extern ssize_t read(int fd, void *buf, size_t count);
+extern int sched_yield();
+
+// Used to pin worker threads to cores. These are Linux-specific, so
+// they're weak to let the thread pool link on other posix platforms.
+extern int sched_getaffinity(int pid, size_t cpusetsize, void *mask) __attribute__((weak));
+extern int sched_setaffinity(int pid, size_t cpusetsize, const void *mask) __attribute__((weak));
+
+// Used to apply a pool's priority to its worker threads. On Linux
+// PRIO_PROCESS with who == 0 affects just the calling thread.
+#define PRIO_PROCESS 0
+extern int setpriority(int which, unsigned int who, int prio) __attribute__((weak));
 
 extern int halide_host_cpu_count();
 
@@ -58,22 +77,218 @@ WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
 
 namespace Halide { namespace Runtime { namespace Internal {
 
-WEAK int num_threads;
-WEAK bool thread_pool_initialized = false;
+// Whether the next pool to be initialized should use the
+// work-stealing scheduler below instead of the shared job stack. -1
+// means not yet decided; HL_WORK_STEALING is consulted at init time.
+WEAK int use_work_stealing = -1;
+
+// Whether the next initialization of the default pool should pin
+// worker threads to cores. -1 means not yet decided;
+// HL_THREAD_AFFINITY is consulted at init time. Affinity implies the
+// work-stealing scheduler, as it's the one that can place work on a
+// particular thread.
+WEAK int use_thread_affinity = -1;
+
+// How many times an idle thread polls for new work before going to
+// sleep. Waking a sleeping thread costs tens of microseconds, which
+// matters for short pipelines called back to back, but spinning burns
+// CPU time that other processes may want, so it's off by default. -1
+// means not yet decided; HL_SPIN_COUNT is consulted at init time.
+#define DEFAULT_SPIN_COUNT 0
+WEAK int spin_count = -1;
+
+// While the pool is hot, idle threads keep polling for work (yielding
+// the core between polls) instead of going to sleep.
+WEAK volatile bool thread_pool_hot = false;
+
+// Whether the pools record where their threads spend their time (see
+// halide_thread_pool_report). -1 means not yet decided;
+// HL_THREAD_POOL_STATS is consulted at init time. Every measurement
+// is guarded by a check of this flag, so instrumentation costs a load
+// and a branch per event when it's off.
+WEAK volatile int record_thread_pool_stats = -1;
+
+__attribute__((always_inline)) bool recording_stats() {
+    return record_thread_pool_stats > 0;
+}
+
+// Called once per iteration of a polling loop. Also stops the
+// compiler from hoisting loads out of the loop.
+__attribute__((always_inline)) void spin_pause() {
+    halide_spin_pause();
+}
 
 struct work {
     work *next_job;
     int (*f)(void *, int, uint8_t *);
     void *user_context;
-    int next, max;
+    // Task indices are claimed by atomically advancing next, without
+    // holding the work queue mutex. All other fields are protected
+    // by the mutex.
+    volatile int next;
+    int max;
     uint8_t *closure;
     int active_workers;
     int exit_status;
+    // Time spent running tasks of this job, summed over threads. Only
+    // maintained while recording stats.
+    volatile int64_t busy_time;
+    bool exhausted() { return next >= max; }
     bool running() { return next < max || active_workers > 0; }
 };
 
-// The work queue and thread pool is weak, so one big work queue is shared by all halide functions
-#define MAX_THREADS 64
+// An alternative scheduler in which each thread owns a deque of
+// ranges of task indices. Threads push and pop ranges at the bottom
+// of their own deque, and idle threads steal from the top of other
+// threads' deques. Each deque has its own spin lock, so claiming
+// tasks never touches a lock shared by the whole pool. Ranges are
+// split lazily: a thread that takes a range pushes its upper half
+// back onto its own deque (where it can be stolen) until a single
+// index remains, so the oldest and largest ranges are the ones that
+// get stolen.
+struct ws_job {
+    halide_task_t f;
+    void *user_context;
+    uint8_t *closure;
+    // Number of task indices that have not yet completed. The job is
+    // done, and may be destroyed by its owner, once this reaches zero.
+    volatile int remaining;
+    volatile int exit_status;
+    // As for work::busy_time.
+    volatile int64_t busy_time;
+};
+
+struct ws_range {
+    ws_job *job;
+    int min, max;
+};
+
+// Per-thread state is kept in blocks of doubling size (block b holds
+// elements 2^b - 1 to 2^(b+1) - 2), so that growing a pool never moves
+// an element another thread may be looking at.
+#define MAX_BLOCKS 32
+
+__attribute__((always_inline)) int block_index(int i) {
+    return 31 - __builtin_clz(i + 1);
+}
+
+// Make sure elements 0 to n-1 exist. New blocks are zero-filled.
+WEAK void ensure_blocks(void **blocks, size_t element_size, int n) {
+    for (int b = 0; b < MAX_BLOCKS && (1 << b) - 1 < n; b++) {
+        if (!blocks[b]) {
+            size_t bytes = element_size << b;
+            blocks[b] = malloc(bytes);
+            memset(blocks[b], 0, bytes);
+        }
+    }
+    // Publish the new blocks before anyone can index them.
+    __sync_synchronize();
+}
+
+WEAK void free_blocks(void **blocks) {
+    for (int b = 0; b < MAX_BLOCKS; b++) {
+        free(blocks[b]);
+        blocks[b] = NULL;
+    }
+}
+
+#define WS_DEQUE_SIZE 256
+struct ws_deque {
+    volatile int lock;
+    // Ranges live in [top, bottom), indexed modulo WS_DEQUE_SIZE. The
+    // owning thread works at the bottom, thieves take from the top.
+    volatile int top, bottom;
+    ws_range ranges[WS_DEQUE_SIZE];
+    // Keep neighbouring deques off each other's cache lines.
+    char padding[64];
+
+    __attribute__((always_inline)) bool empty() const {
+        return top == bottom;
+    }
+
+    bool push(const ws_range &r) {
+        ScopedSpinLock l(&lock);
+        if (bottom - top == WS_DEQUE_SIZE) return false;
+        ranges[bottom % WS_DEQUE_SIZE] = r;
+        bottom = bottom + 1;
+        return true;
+    }
+
+    bool pop(ws_range *r) {
+        if (empty()) return false;
+        ScopedSpinLock l(&lock);
+        if (empty()) return false;
+        bottom = bottom - 1;
+        *r = ranges[bottom % WS_DEQUE_SIZE];
+        return true;
+    }
+
+    bool steal(ws_range *r) {
+        if (empty()) return false;
+        ScopedSpinLock l(&lock);
+        if (empty()) return false;
+        *r = ranges[top % WS_DEQUE_SIZE];
+        top = top + 1;
+        return true;
+    }
+};
+
+struct work_stealing_pool_t {
+    // One deque per thread in the pool. Deque zero is shared by all
+    // threads that are not workers of this pool (i.e. the threads
+    // that call into Halide), deque i is owned by worker thread
+    // i-1. num_deques only grows; deques of retired workers stay
+    // around (empty) until shutdown.
+    ws_deque *blocks[MAX_BLOCKS];
+    volatile int num_deques;
+
+    // Threads that find nothing to do spin for a while, then sleep.
+    // sleepers is maintained atomically so that threads pushing work
+    // only need to wake anyone when someone is asleep. On Linux
+    // sleeping threads wait on a futex on wake_seq, which is bumped
+    // to wake them. Elsewhere they sleep on wakeup, guarded by
+    // sleep_mutex.
+    bool use_futex;
+    volatile int wake_seq;
+    pthread_mutex_t sleep_mutex;
+    pthread_cond_t wakeup;
+    volatile int sleepers;
+};
+
+// Instrumentation for a pool. Per-thread counters are indexed like
+// the deques: slot zero is shared by the threads that call into the
+// pool, slot i belongs to worker thread i-1. They live as long as the
+// pool, so the counters of retired workers are kept. Per-loop
+// counters are keyed by the loop's task function and guarded by
+// loops_lock. Once the table fills up, further loops are lumped into
+// other_loops, which has a NULL task. The most recent calls to
+// halide_do_par_for are also kept individually, in a ring buffer
+// guarded by the same lock.
+#define MAX_LOOP_STATS 64
+#define MAX_CALL_STATS 256
+struct thread_pool_stats_t {
+    halide_thread_pool_worker_stats *worker_blocks[MAX_BLOCKS];
+    volatile int num_workers;
+    volatile int loops_lock;
+    halide_thread_pool_loop_stats loops[MAX_LOOP_STATS];
+    int num_loops;
+    halide_thread_pool_loop_stats other_loops;
+    halide_thread_pool_call_stats calls[MAX_CALL_STATS];
+    uint64_t num_calls;
+};
+
+// A condition variable for the job stack scheduler. On Linux, waiters
+// sleep on a futex on seq, which wakers bump, and wakers skip the
+// syscall when nobody is waiting. Elsewhere it's just cond.
+struct pool_cond_t {
+    pthread_cond_t cond;
+    volatile int seq;
+    volatile int waiters;
+};
+
+// A thread pool. The default pool is weak, so one big work queue is
+// shared by all halide functions, unless they are routed to a pool
+// made with halide_create_thread_pool.
 struct work_queue_t {
     // all fields are protected by this mutex.
     pthread_mutex_t mutex;
@@ -90,21 +305,51 @@ struct work_queue_t {
     int a_team_size, target_a_team_size;
 
     // Broadcast when a job completes.
-    pthread_cond_t wakeup_owners;
+    pool_cond_t wakeup_owners;
 
     // Broadcast whenever items are added to the work queue.
-    pthread_cond_t wakeup_a_team;
+    pool_cond_t wakeup_a_team;
 
     // May also be broadcast when items are added to the work queue if
     // more threads are required than are currently in the A team.
-    pthread_cond_t wakeup_b_team;
+    pool_cond_t wakeup_b_team;
+
+    // Whether the condition variables above use futexes.
+    bool use_futex;
 
-    // Keep track of threads so they can be joined at shutdown
-    pthread_t threads[MAX_THREADS];
+    // Keep track of threads so they can be joined at shutdown, or
+    // when the pool shrinks. Worker i runs in threads[i]. Grown as
+    // needed, so there's no fixed cap on the size of the pool.
+    pthread_t *threads;
+    int threads_capacity;
 
     // Global flag indicating
     bool shutdown;
 
+    // The number of threads in the pool, including the thread that
+    // calls do_par_for. Before the pool is initialized, the requested
+    // size, or zero for the default.
+    int num_threads;
+    bool initialized;
+
+    // Which scheduler the running pool uses, and whether its workers
+    // are pinned to cores.
+    bool work_stealing;
+    bool affinity;
+
+    // Nice value applied to each worker thread. Zero leaves it alone.
+    int priority;
+
+    // Pools made with halide_create_thread_pool are kept on a list so
+    // they can be found by name and shut down with the default pool.
+    char name[64];
+    work_queue_t *next_pool;
+
+    // State for the work-stealing scheduler.
+    work_stealing_pool_t ws;
+
+    thread_pool_stats_t stats;
+
     bool running() {
         return !shutdown;
     }
@@ -112,66 +357,369 @@ struct work_queue_t {
 };
 WEAK work_queue_t work_queue;
 
+// Pool worker threads record which pool they belong to, and their
+// index in it (deque index for the work-stealing scheduler, one more
+// than their index in threads). Both are unset (zero) for threads
+// outside any pool. While recording stats, every thread also tracks
+// how many tasks it is nested inside.
+WEAK pthread_key_t current_pool_key;
+WEAK pthread_key_t current_index_key;
+WEAK pthread_key_t task_depth_key;
+WEAK volatile bool thread_keys_initialized = false;
+WEAK volatile int thread_keys_lock = 0;
+
+WEAK void init_thread_keys() {
+    if (thread_keys_initialized) {
+        return;
+    }
+    ScopedSpinLock lock(&thread_keys_lock);
+    if (!thread_keys_initialized) {
+        pthread_key_create(&current_pool_key, NULL);
+        pthread_key_create(&current_index_key, NULL);
+        pthread_key_create(&task_depth_key, NULL);
+        __sync_synchronize();
+        thread_keys_initialized = true;
+    }
+}
+
+// The pools made with halide_create_thread_pool, and the user_context
+// values bound to them with halide_use_thread_pool. Both lists are
+// protected by pool_registry_mutex. pool_bindings is checked without
+// the lock first, so that calls that don't use bindings never touch
+// the mutex.
+struct pool_binding {
+    void *user_context;
+    work_queue_t *pool;
+    pool_binding *next;
+};
+WEAK pthread_mutex_t pool_registry_mutex;
+WEAK work_queue_t *created_pools = NULL;
+WEAK pool_binding *volatile pool_bindings = NULL;
+
+// Pick the pool that should run a parallel loop. Nested parallel
+// loops stay in the pool of the worker thread that runs them. Other
+// calls go to the pool bound to their user_context, if any, and to
+// the default pool otherwise.
+WEAK work_queue_t *choose_pool(void *user_context) {
+    if (thread_keys_initialized) {
+        work_queue_t *q = (work_queue_t *)pthread_getspecific(current_pool_key);
+        if (q) {
+            return q;
+        }
+    }
+    if (pool_bindings) {
+        work_queue_t *q = NULL;
+        pthread_mutex_lock(&pool_registry_mutex);
+        for (pool_binding *b = pool_bindings; b; b = b->next) {
+            if (b->user_context == user_context) {
+                q = b->pool;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool_registry_mutex);
+        if (q) {
+            return q;
+        }
+    }
+    return &work_queue;
+}
+
+__attribute__((always_inline)) halide_thread_pool_worker_stats *worker_stats(work_queue_t *q, int i) {
+    int b = block_index(i);
+    return q->stats.worker_blocks[b] + (i + 1 - (1 << b));
+}
+
+// Make sure there are counters for threads 0 to n-1 of the pool.
+WEAK void ensure_worker_stats(work_queue_t *q, int n) {
+    ensure_blocks((void **)q->stats.worker_blocks, sizeof(halide_thread_pool_worker_stats), n);
+    if (n > q->stats.num_workers) {
+        q->stats.num_workers = n;
+    }
+}
+
+// The slot of the calling thread in pool q's counters.
+WEAK int current_stats_slot(work_queue_t *q) {
+    if (!thread_keys_initialized || pthread_getspecific(current_pool_key) != q) {
+        return 0;
+    }
+    return (int)(intptr_t)pthread_getspecific(current_index_key);
+}
+
+// Returns a timestamp to pass to the add_*_time functions below, or
+// zero if we're not recording stats.
+__attribute__((always_inline)) int64_t stats_clock() {
+    return recording_stats() ? halide_current_time_ns(NULL) : 0;
+}
+
+WEAK void add_idle_time(work_queue_t *q, int slot, int64_t start) {
+    if (start && recording_stats()) {
+        __sync_fetch_and_add(&worker_stats(q, slot)->idle_time, halide_current_time_ns(NULL) - start);
+    }
+}
+
+// Record that a thread spent the time since start running tasks of a
+// job. Returns the elapsed time.
+WEAK int64_t add_busy_time(work_queue_t *q, int slot, int64_t start, int tasks) {
+    if (!start || !recording_stats()) {
+        return 0;
+    }
+    int64_t elapsed = halide_current_time_ns(NULL) - start;
+    halide_thread_pool_worker_stats *stats = worker_stats(q, slot);
+    __sync_fetch_and_add(&stats->busy_time, elapsed);
+    __sync_fetch_and_add(&stats->tasks, (uint64_t)tasks);
+    return elapsed;
+}
+
+// Lock the work queue mutex, recording how long that took. The
+// counters don't exist until the pool is first initialized.
+WEAK void lock_work_queue(work_queue_t *q, int slot) {
+    if (!recording_stats() || slot >= q->stats.num_workers) {
+        pthread_mutex_lock(&q->mutex);
+        return;
+    }
+    int64_t start = halide_current_time_ns(NULL);
+    pthread_mutex_lock(&q->mutex);
+    __sync_fetch_and_add(&worker_stats(q, slot)->lock_wait_time, halide_current_time_ns(NULL) - start);
+}
+
+// Bracket running tasks, so that parallel loops called from inside a
+// task can be counted as nested.
+WEAK void enter_task() {
+    intptr_t depth = (intptr_t)pthread_getspecific(task_depth_key);
+    pthread_setspecific(task_depth_key, (void *)(depth + 1));
+}
+
+WEAK void leave_task() {
+    intptr_t depth = (intptr_t)pthread_getspecific(task_depth_key);
+    pthread_setspecific(task_depth_key, (void *)(depth - 1));
+}
+
+// Add a completed call to halide_do_par_for to the pool's per-loop
+// counters and to its record of recent calls.
+WEAK void record_loop(work_queue_t *q, halide_task_t f, int min, int size, bool nested,
+                      int64_t start, int64_t busy_time) {
+    int64_t elapsed = halide_current_time_ns(NULL) - start;
+    ScopedSpinLock lock(&q->stats.loops_lock);
+    halide_thread_pool_loop_stats *l = NULL;
+    for (int i = 0; i < q->stats.num_loops; i++) {
+        if (q->stats.loops[i].task == f) {
+            l = q->stats.loops + i;
+            break;
+        }
+    }
+    if (!l) {
+        if (q->stats.num_loops < MAX_LOOP_STATS) {
+            l = q->stats.loops + q->stats.num_loops++;
+            l->task = f;
+        } else {
+            l = &q->stats.other_loops;
+        }
+    }
+    l->calls++;
+    if (nested) {
+        l->nested_calls++;
+    }
+    l->tasks += size;
+    l->time += elapsed;
+    l->busy_time += busy_time;
+
+    halide_thread_pool_call_stats *c = q->stats.calls + (q->stats.num_calls++ % MAX_CALL_STATS);
+    c->task = f;
+    c->min = min;
+    c->size = size;
+    c->nested = nested;
+    c->start = start;
+    c->time = elapsed;
+    c->busy_time = busy_time;
+}
+
 WEAK int default_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure) {
     return f(user_context, idx, closure);
 }
 
-WEAK void *worker_thread(void *void_arg) {
-    work *owned_job = (work *)void_arg;
+WEAK void pool_cond_init(pool_cond_t *c) {
+    pthread_cond_init(&c->cond, NULL);
+    c->seq = 0;
+    c->waiters = 0;
+}
+
+WEAK void pool_cond_destroy(pool_cond_t *c) {
+    pthread_cond_destroy(&c->cond);
+}
+
+// Wait on a condition variable of a pool. Must be called with the
+// pool's mutex held, which is released while waiting. The caller
+// rechecks its condition afterwards, so spurious wakeups are fine.
+WEAK void pool_cond_wait(work_queue_t *q, pool_cond_t *c) {
+    if (q->use_futex) {
+        // Read the sequence number before releasing the mutex, so that
+        // any broadcast after the caller's last check changes it and
+        // the futex wait returns immediately.
+        int seq = c->seq;
+        __sync_fetch_and_add(&c->waiters, 1);
+        pthread_mutex_unlock(&q->mutex);
+        halide_futex_wait(&c->seq, seq);
+        pthread_mutex_lock(&q->mutex);
+        __sync_fetch_and_sub(&c->waiters, 1);
+    } else {
+        pthread_cond_wait(&c->cond, &q->mutex);
+    }
+}
+
+// Wake everyone waiting on a condition variable of a pool. May be
+// called with or without the pool's mutex held, after changing the
+// state the waiters check under it.
+WEAK void pool_cond_broadcast(work_queue_t *q, pool_cond_t *c) {
+    if (q->use_futex) {
+        // The full barrier orders the state change against the load
+        // of waiters. A waiter does the converse, so at least one
+        // side observes the other.
+        __sync_synchronize();
+        if (c->waiters) {
+            __sync_fetch_and_add(&c->seq, 1);
+            halide_futex_wake(&c->seq, 0x7fffffff);
+        }
+    } else {
+        pthread_cond_broadcast(&c->cond);
+    }
+}
+
+// Claim batches of task indices from a job and run them until every
+// index has been claimed. Batches are sized like guided scheduling: a
+// fraction of the remaining indices, so they start large to amortize
+// the cost of claiming and shrink towards single tasks as the job
+// nears completion to keep the threads load balanced. The unit of
+// work is still a single task, so the task size chosen in the
+// schedule (e.g. Func::parallel(var, task_size)) is respected.
+WEAK int claim_and_run_tasks(work_queue_t *q, work *job, int slot) {
+    int exit_status = 0;
+    while (true) {
+        int next = job->next;
+        int remaining = job->max - next;
+        if (remaining <= 0) {
+            break;
+        }
+        int batch = remaining / (2 * q->num_threads);
+        if (batch < 1) {
+            batch = 1;
+        }
+        if (!__sync_bool_compare_and_swap(&job->next, next, next + batch)) {
+            // Someone else claimed some tasks first. Try again.
+            continue;
+        }
+        int64_t start = stats_clock();
+        if (start) enter_task();
+        for (int i = next; i < next + batch; i++) {
+            int result = halide_do_task(job->user_context, job->f, i, job->closure);
+            if (result) {
+                exit_status = result;
+            }
+        }
+        if (start) {
+            leave_task();
+            __sync_fetch_and_add(&job->busy_time, add_busy_time(q, slot, start, batch));
+        }
+    }
+    return exit_status;
+}
+
+// Whether an idle thread in worker_thread_loop has a reason to stop
+// waiting: new jobs, its own job finishing, or the pool shutting down
+// or shrinking to exclude it.
+WEAK bool worker_should_wake(work_queue_t *q, work *owned_job, int worker_index) {
+    return q->jobs != NULL || q->shutdown ||
+        (owned_job != NULL ? !owned_job->running() : worker_index >= q->num_threads - 1);
+}
+
+// Poll for a reason to wake up for a while before sleeping. Must be
+// called with the work queue mutex held, which is released while
+// spinning. Returns true (with the mutex held) if there's no need to
+// sleep.
+WEAK bool spin_before_sleeping(work_queue_t *q, work *owned_job, int worker_index) {
+    if (spin_count <= 0 && !thread_pool_hot) {
+        return false;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    int spins = 0;
+    while (!worker_should_wake(q, owned_job, worker_index)) {
+        if (spins < spin_count) {
+            spins++;
+        } else if (thread_pool_hot) {
+            sched_yield();
+        } else {
+            break;
+        }
+        spin_pause();
+    }
+    pthread_mutex_lock(&q->mutex);
+    return worker_should_wake(q, owned_job, worker_index);
+}
+
+WEAK void worker_thread_loop(work_queue_t *q, work *owned_job, int worker_index) {
+    // Where to record stats for this thread.
+    int slot = owned_job ? (recording_stats() ? current_stats_slot(q) : 0) : worker_index + 1;
 
     // Grab the lock
-    pthread_mutex_lock(&work_queue.mutex);
+    lock_work_queue(q, slot);
 
     // If I'm a job owner, then I was the thread that called
     // do_par_for, and I should only stay in this function until my
     // job is complete. If I'm a lowly worker thread, I should stay in
-    // this function as long as the work queue is running.
+    // this function as long as the work queue is running and the
+    // pool hasn't been shrunk to exclude me.
     while (owned_job != NULL ? owned_job->running()
-           : work_queue.running()) {
+           : (q->running() && worker_index < q->num_threads - 1)) {
+
+        // Jobs whose tasks have all been claimed (but maybe not
+        // finished) have nothing more to offer. Pop them off the
+        // stack.
+        while (q->jobs != NULL && q->jobs->exhausted()) {
+            q->jobs = q->jobs->next_job;
+        }
+
+        if (q->jobs == NULL) {
+            // Owners and A team members spin a little before
+            // sleeping. Surplus A team members head straight for the
+            // B team.
+            bool surplus = !owned_job && q->a_team_size > q->target_a_team_size;
+            int64_t idle_start = stats_clock();
+            if (!surplus && spin_before_sleeping(q, owned_job, worker_index)) {
+                add_idle_time(q, slot, idle_start);
+                continue;
+            }
 
-        if (work_queue.jobs == NULL) {
             if (owned_job) {
                 // There are no jobs pending. Wait for the last worker
                 // to signal that the job is finished.
-                pthread_cond_wait(&work_queue.wakeup_owners, &work_queue.mutex);
-            } else if (work_queue.a_team_size <= work_queue.target_a_team_size) {
+                pool_cond_wait(q, &q->wakeup_owners);
+            } else if (q->a_team_size <= q->target_a_team_size) {
                 // There are no jobs pending. Wait until more jobs are enqueued.
-                pthread_cond_wait(&work_queue.wakeup_a_team, &work_queue.mutex);
+                pool_cond_wait(q, &q->wakeup_a_team);
             } else {
                 // There are no jobs pending, and there are too many
                 // threads in the A team. Transition to the B team
                 // until the wakeup_b_team condition is fired.
-                work_queue.a_team_size--;
-                pthread_cond_wait(&work_queue.wakeup_b_team, &work_queue.mutex);
-                work_queue.a_team_size++;
+                q->a_team_size--;
+                pool_cond_wait(q, &q->wakeup_b_team);
+                q->a_team_size++;
             }
+            add_idle_time(q, slot, idle_start);
         } else {
             // Grab the next job.
-            work *job = work_queue.jobs;
-
-            // Claim a task from it.
-            work myjob = *job;
-            job->next++;
-
-            // If there were no more tasks pending for this job,
-            // remove it from the stack.
-            if (job->next == job->max) {
-                work_queue.jobs = job->next_job;
-            }
+            work *job = q->jobs;
 
             // Increment the active_worker count so that other threads
             // are aware that this job is still in progress even
-            // though there are no outstanding tasks for it.
+            // though there may be no outstanding tasks for it.
             job->active_workers++;
 
-            // Release the lock and do the task.
-            pthread_mutex_unlock(&work_queue.mutex);
-            int result = halide_do_task(myjob.user_context, myjob.f, myjob.next,
-                                        myjob.closure);
-            pthread_mutex_lock(&work_queue.mutex);
+            // Release the lock and claim tasks until there are none left.
+            pthread_mutex_unlock(&q->mutex);
+            int result = claim_and_run_tasks(q, job, slot);
+            lock_work_queue(q, slot);
 
-            // If this task failed, set the exit status on the job.
+            // If a task failed, set the exit status on the job.
             if (result) {
                 job->exit_status = result;
             }
@@ -182,55 +730,586 @@ WEAK void *worker_thread(void *void_arg) {
             // If the job is done and I'm not the owner of it, wake up
             // the owner.
             if (!job->running() && job != owned_job) {
-                pthread_cond_broadcast(&work_queue.wakeup_owners);
+                pool_cond_broadcast(q, &q->wakeup_owners);
             }
         }
     }
-    pthread_mutex_unlock(&work_queue.mutex);
+
+    // An exhausted job is only popped once it reaches the top of the
+    // stack, so a finished job may still be buried under jobs pushed
+    // later. Unlink it before the owner's stack frame goes away.
+    if (owned_job) {
+        for (work **j = &q->jobs; *j != NULL; j = &((*j)->next_job)) {
+            if (*j == owned_job) {
+                *j = owned_job->next_job;
+                break;
+            }
+        }
+    } else {
+        // Workers leave from the A team.
+        q->a_team_size--;
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+}
+
+__attribute__((always_inline)) ws_deque *ws_get_deque(work_queue_t *q, int i) {
+    int b = block_index(i);
+    return q->ws.blocks[b] + (i + 1 - (1 << b));
+}
+
+// Make sure deques 0 to n-1 exist.
+WEAK void ws_ensure_deques(work_queue_t *q, int n) {
+    ensure_blocks((void **)q->ws.blocks, sizeof(ws_deque), n);
+    if (n > q->ws.num_deques) {
+        q->ws.num_deques = n;
+    }
+}
+
+WEAK int ws_current_deque(work_queue_t *q) {
+    if (pthread_getspecific(current_pool_key) != q) {
+        return 0;
+    }
+    return (int)(intptr_t)pthread_getspecific(current_index_key);
+}
+
+WEAK bool ws_any_work(work_queue_t *q) {
+    for (int i = 0; i < q->ws.num_deques; i++) {
+        if (!ws_get_deque(q, i)->empty()) return true;
+    }
+    return false;
+}
+
+// Wake sleeping threads after publishing new work or completing a
+// job. The full barrier orders the store that published the work
+// against the load of sleepers; a thread going to sleep does the
+// converse, so at least one side observes the other.
+WEAK void ws_notify(work_queue_t *q, bool everyone) {
+    __sync_synchronize();
+    if (q->ws.sleepers) {
+        if (q->ws.use_futex) {
+            __sync_fetch_and_add(&q->ws.wake_seq, 1);
+            halide_futex_wake(&q->ws.wake_seq, everyone ? 0x7fffffff : 1);
+        } else {
+            pthread_mutex_lock(&q->ws.sleep_mutex);
+            if (everyone) {
+                pthread_cond_broadcast(&q->ws.wakeup);
+            } else {
+                pthread_cond_signal(&q->ws.wakeup);
+            }
+            pthread_mutex_unlock(&q->ws.sleep_mutex);
+        }
+    }
+}
+
+// Whether a thread in ws_park has a reason to stop waiting other than
+// there being work to steal. If job is non-NULL, that's the job
+// completing. Otherwise this is worker thread me, which should stop
+// waiting when the pool shuts down or shrinks to exclude it.
+WEAK bool ws_should_wake(work_queue_t *q, ws_job *job, int me) {
+    return job ? job->remaining == 0 : (q->shutdown || me >= q->num_threads);
+}
+
+// Wait until there may be work to do or ws_should_wake.
+WEAK void ws_park(work_queue_t *q, ws_job *job, int me) {
+    int64_t idle_start = stats_clock();
+    int spins = 0;
+    while (!ws_should_wake(q, job, me) && !ws_any_work(q)) {
+        if (spins < spin_count) {
+            spins++;
+        } else if (thread_pool_hot) {
+            sched_yield();
+        } else {
+            break;
+        }
+        spin_pause();
+    }
+
+    if (q->ws.use_futex) {
+        // Read the sequence number before announcing we're asleep, so
+        // that any wakeup after our final check changes it and the
+        // futex wait returns immediately.
+        int seq = q->ws.wake_seq;
+        __sync_fetch_and_add(&q->ws.sleepers, 1);
+        if (!ws_should_wake(q, job, me) && !ws_any_work(q)) {
+            halide_futex_wait(&q->ws.wake_seq, seq);
+        }
+        __sync_fetch_and_sub(&q->ws.sleepers, 1);
+    } else {
+        pthread_mutex_lock(&q->ws.sleep_mutex);
+        __sync_fetch_and_add(&q->ws.sleepers, 1);
+        if (!ws_should_wake(q, job, me) && !ws_any_work(q)) {
+            pthread_cond_wait(&q->ws.wakeup, &q->ws.sleep_mutex);
+        }
+        __sync_fetch_and_sub(&q->ws.sleepers, 1);
+        pthread_mutex_unlock(&q->ws.sleep_mutex);
+    }
+    add_idle_time(q, me, idle_start);
+}
+
+// Find a range to work on, first from our own deque, then by
+// stealing from the others starting at a pseudo-random victim.
+WEAK bool ws_find_work(work_queue_t *q, int me, uint32_t *seed, ws_range *r) {
+    if (ws_get_deque(q, me)->pop(r)) return true;
+    int n = q->ws.num_deques;
+    *seed = *seed * 1664525 + 1013904223;
+    int victim = (int)((*seed >> 16) % n);
+    for (int i = 0; i < n; i++) {
+        if (victim != me && ws_get_deque(q, victim)->steal(r)) return true;
+        if (++victim == n) victim = 0;
+    }
+    return false;
+}
+
+WEAK void ws_run_range(work_queue_t *q, int me, ws_range r) {
+    // Split off upper halves for other threads to steal until we're
+    // left with a single index (or our deque is full).
+    bool pushed = false;
+    while (r.max - r.min > 1) {
+        int mid = r.min + (r.max - r.min) / 2;
+        ws_range upper = {r.job, mid, r.max};
+        if (!ws_get_deque(q, me)->push(upper)) break;
+        r.max = mid;
+        pushed = true;
+    }
+    if (pushed) {
+        ws_notify(q, false);
+    }
+
+    ws_job *job = r.job;
+    int64_t start = stats_clock();
+    if (start) enter_task();
+    for (int i = r.min; i < r.max; i++) {
+        int result = halide_do_task(job->user_context, job->f, i, job->closure);
+        if (result) {
+            job->exit_status = result;
+        }
+    }
+    if (start) {
+        leave_task();
+        __sync_fetch_and_add(&job->busy_time, add_busy_time(q, me, start, r.max - r.min));
+    }
+
+    // The job may be destroyed by its owner as soon as remaining hits
+    // zero, so it must not be touched after this.
+    if (__sync_sub_and_fetch(&job->remaining, r.max - r.min) == 0) {
+        ws_notify(q, true);
+    }
+}
+
+// When thread affinity is enabled, thread i of the pool (the owner of
+// deque i) is pinned to cpu_order[i % num_cpus]. The cores this
+// process may run on are ordered NUMA node by node, so threads with
+// neighbouring indices share a node.
+#define AFFINITY_MAX_CPUS 1024
+struct thread_affinity_t {
+    int cpu_order[AFFINITY_MAX_CPUS];
+    int num_cpus;
+};
+WEAK thread_affinity_t thread_affinity;
+
+// Append cpu to the order if it's one we're allowed to run on and
+// haven't already added.
+WEAK void affinity_add_cpu(int cpu, uint64_t *allowed) {
+    if (cpu < 0 || cpu >= AFFINITY_MAX_CPUS) {
+        return;
+    }
+    uint64_t bit = (uint64_t)1 << (cpu % 64);
+    if (allowed[cpu / 64] & bit) {
+        allowed[cpu / 64] &= ~bit;
+        thread_affinity.cpu_order[thread_affinity.num_cpus++] = cpu;
+    }
+}
+
+// Append the cores in a sysfs cpulist file (e.g. "0-7,16-23"). Returns
+// false if the file can't be read.
+WEAK bool affinity_add_cpulist(const char *path, uint64_t *allowed) {
+    int fd = open(path, 0, 0);
+    if (fd < 0) {
+        return false;
+    }
+    char buf[1024];
+    ssize_t bytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (bytes < 0) {
+        return false;
+    }
+    buf[bytes] = 0;
+
+    const char *p = buf;
+    while (*p >= '0' && *p <= '9') {
+        int first = atoi(p), last = first;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p == '-') {
+            p++;
+            last = atoi(p);
+            while (*p >= '0' && *p <= '9') p++;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            affinity_add_cpu(cpu, allowed);
+        }
+        if (*p == ',') p++;
+    }
+    return true;
+}
+
+WEAK void init_thread_affinity() {
+    thread_affinity.num_cpus = 0;
+    uint64_t allowed[AFFINITY_MAX_CPUS / 64];
+    if (!sched_getaffinity || sched_getaffinity(0, sizeof(allowed), allowed) != 0) {
+        return;
+    }
+
+    // Group the cores by NUMA node...
+    for (int node = 0; node < AFFINITY_MAX_CPUS; node++) {
+        char path[64];
+        char *end = path + sizeof(path);
+        char *dst = halide_string_to_string(path, end, "/sys/devices/system/node/node");
+        dst = halide_int64_to_string(dst, end, node, 1);
+        halide_string_to_string(dst, end, "/cpulist");
+        if (!affinity_add_cpulist(path, allowed)) break;
+    }
+
+    // ...then add any cores we didn't find a node for.
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; cpu++) {
+        affinity_add_cpu(cpu, allowed);
+    }
+}
+
+WEAK void pin_thread_to_cpu(int i) {
+    if (!sched_setaffinity || thread_affinity.num_cpus == 0) {
+        return;
+    }
+    int cpu = thread_affinity.cpu_order[i % thread_affinity.num_cpus];
+    uint64_t mask[AFFINITY_MAX_CPUS / 64];
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / 64] = (uint64_t)1 << (cpu % 64);
+    sched_setaffinity(0, sizeof(mask), mask);
+}
+
+WEAK void ws_worker_thread_loop(work_queue_t *q, int me) {
+    uint32_t seed = me;
+    while (!q->shutdown) {
+        ws_range r;
+        if (ws_find_work(q, me, &seed, &r)) {
+            ws_run_range(q, me, r);
+        } else if (me >= q->num_threads) {
+            // The pool has shrunk, and we've drained our deque.
+            break;
+        } else {
+            ws_park(q, NULL, me);
+        }
+    }
+}
+
+struct worker_thread_arg {
+    work_queue_t *pool;
+    int index;
+};
+
+WEAK void *worker_thread(void *void_arg) {
+    worker_thread_arg *arg = (worker_thread_arg *)void_arg;
+    work_queue_t *q = arg->pool;
+    int i = arg->index;
+    free(arg);
+
+    pthread_setspecific(current_pool_key, q);
+    pthread_setspecific(current_index_key, (void *)(intptr_t)(i + 1));
+    if (q->priority && setpriority) {
+        // Failure (e.g. raising priority without permission) just
+        // leaves the thread at the default priority.
+        setpriority(PRIO_PROCESS, 0, q->priority);
+    }
+
+    if (q->work_stealing) {
+        if (q->affinity) {
+            pin_thread_to_cpu(i + 1);
+        }
+        ws_worker_thread_loop(q, i + 1);
+    } else {
+        worker_thread_loop(q, NULL, i);
+    }
     return NULL;
 }
 
-WEAK int default_do_par_for(void *user_context, halide_task_t f,
-                            int min, int size, uint8_t *closure) {
-    // Grab the lock. If it hasn't been initialized yet, then the
-    // field will be zero-initialized because it's a static
-    // global. pthreads helpfully interprets zero-valued mutex objects
-    // as uninitialized and initializes them for you (see PTHREAD_MUTEX_INITIALIZER).
-    pthread_mutex_lock(&work_queue.mutex);
+WEAK int work_stealing_do_par_for(work_queue_t *q, void *user_context, halide_task_t f,
+                                  int min, int size, uint8_t *closure, int64_t *busy_time) {
+    if (size <= 0) {
+        return 0;
+    }
 
-    if (!thread_pool_initialized) {
-        work_queue.shutdown = false;
-        pthread_cond_init(&work_queue.wakeup_owners, NULL);
-        pthread_cond_init(&work_queue.wakeup_a_team, NULL);
-        pthread_cond_init(&work_queue.wakeup_b_team, NULL);
-        work_queue.jobs = NULL;
-
-        if (!num_threads) {
-            char *threads_str = getenv("HL_NUM_THREADS");
-            if (!threads_str) {
-                // Legacy name for HL_NUM_THREADS
-                threads_str = getenv("HL_NUMTHREADS");
+    ws_job job;
+    job.f = f;
+    job.user_context = user_context;
+    job.closure = closure;
+    job.remaining = size;
+    job.exit_status = 0;
+    job.busy_time = 0;
+
+    int me = ws_current_deque(q);
+    ws_range r = {&job, min, min + size};
+
+    if (q->affinity && me == 0) {
+        // This is an outermost parallel loop. Deal out one contiguous
+        // block of indices to each thread's deque, so that the same
+        // indices run on the same core on every call, and
+        // neighbouring blocks run on the same NUMA node. Anything
+        // left unbalanced gets stolen as usual.
+        int n = q->num_threads;
+        for (int i = 0; i < n; i++) {
+            ws_range block = {&job,
+                              min + (int)(((int64_t)size * i) / n),
+                              min + (int)(((int64_t)size * (i + 1)) / n)};
+            if (block.min == block.max) continue;
+            if (!ws_get_deque(q, i)->push(block)) {
+                ws_run_range(q, me, block);
             }
-            if (threads_str) {
-                num_threads = atoi(threads_str);
-            } else {
-                num_threads = halide_host_cpu_count();
-                // halide_printf(user_context, "HL_NUM_THREADS not defined. Defaulting to %d threads.\n", num_threads);
+        }
+        ws_notify(q, true);
+    } else if (ws_get_deque(q, me)->push(r)) {
+        // Publish the whole range so that idle threads can start
+        // stealing from it right away, then help out until it's
+        // done.
+        ws_notify(q, false);
+    } else {
+        // Our deque is full. Just run the range ourselves.
+        ws_run_range(q, me, r);
+    }
+
+    // Ranges we pop here may belong to other jobs (e.g. an enclosing
+    // parallel loop). Running them is harmless and keeps this thread
+    // busy.
+    uint32_t seed = (uint32_t)(uintptr_t)&job;
+    while (job.remaining > 0) {
+        if (ws_find_work(q, me, &seed, &r)) {
+            ws_run_range(q, me, r);
+        } else {
+            ws_park(q, &job, me);
+        }
+    }
+
+    *busy_time = job.busy_time;
+    return job.exit_status;
+}
+
+WEAK void init_work_stealing_pool(work_queue_t *q) {
+    pthread_mutex_init(&q->ws.sleep_mutex, NULL);
+    pthread_cond_init(&q->ws.wakeup, NULL);
+    q->ws.sleepers = 0;
+    q->ws.wake_seq = 0;
+    q->ws.use_futex = halide_futex_wake(&q->ws.wake_seq, 0) >= 0;
+    ws_ensure_deques(q, 1);
+}
+
+// Wake every sleeping thread, so that they notice a shutdown or resize.
+WEAK void ws_wake_all(work_queue_t *q) {
+    if (q->ws.use_futex) {
+        __sync_fetch_and_add(&q->ws.wake_seq, 1);
+        halide_futex_wake(&q->ws.wake_seq, 0x7fffffff);
+    } else {
+        pthread_mutex_lock(&q->ws.sleep_mutex);
+        pthread_cond_broadcast(&q->ws.wakeup);
+        pthread_mutex_unlock(&q->ws.sleep_mutex);
+    }
+}
+
+WEAK void destroy_work_stealing_pool(work_queue_t *q) {
+    pthread_mutex_destroy(&q->ws.sleep_mutex);
+    pthread_cond_destroy(&q->ws.wakeup);
+    free_blocks((void **)q->ws.blocks);
+    q->ws.num_deques = 0;
+}
+
+WEAK int default_num_threads() {
+    char *threads_str = getenv("HL_NUM_THREADS");
+    if (!threads_str) {
+        // Legacy name for HL_NUM_THREADS
+        threads_str = getenv("HL_NUMTHREADS");
+    }
+    if (threads_str) {
+        return atoi(threads_str);
+    } else {
+        // halide_printf(user_context, "HL_NUM_THREADS not defined. Defaulting to %d threads.\n", halide_host_cpu_count());
+        return halide_host_cpu_count();
+    }
+}
+
+// Grow or shrink the pool to n threads, counting the thread that
+// calls do_par_for. Must be called with the work queue mutex held. The
+// mutex is released while waiting for retiring workers to finish, so
+// this should only be called when no parallel loop is in flight.
+WEAK void resize_thread_pool(work_queue_t *q, int n) {
+    if (n < 1) {
+        n = 1;
+    }
+    int old_num_threads = q->num_threads;
+    if (n == old_num_threads) {
+        return;
+    }
+    q->num_threads = n;
+
+    if (n > old_num_threads) {
+        if (n - 1 > q->threads_capacity) {
+            int capacity = max(n - 1, 2 * q->threads_capacity);
+            pthread_t *threads = (pthread_t *)malloc(capacity * sizeof(pthread_t));
+            if (q->threads) {
+                memcpy(threads, q->threads, (old_num_threads - 1) * sizeof(pthread_t));
+                free(q->threads);
             }
+            q->threads = threads;
+            q->threads_capacity = capacity;
         }
-        if (num_threads > MAX_THREADS) {
-            num_threads = MAX_THREADS;
-        } else if (num_threads < 1) {
-            num_threads = 1;
+        if (q->work_stealing) {
+            ws_ensure_deques(q, n);
         }
-        for (int i = 0; i < num_threads-1; i++) {
+        ensure_worker_stats(q, n);
+        for (int i = old_num_threads - 1; i < n - 1; i++) {
             //fprintf(stderr, "Creating thread %d\n", i);
-            pthread_create(work_queue.threads + i, NULL, worker_thread, NULL);
+            worker_thread_arg *arg = (worker_thread_arg *)malloc(sizeof(worker_thread_arg));
+            arg->pool = q;
+            arg->index = i;
+            pthread_create(q->threads + i, NULL, worker_thread, arg);
+        }
+        // New threads start on the A team.
+        q->a_team_size += n - old_num_threads;
+    } else {
+        // Wake everyone up so that the workers we no longer need
+        // notice, then wait for them to leave.
+        pool_cond_broadcast(q, &q->wakeup_a_team);
+        pool_cond_broadcast(q, &q->wakeup_b_team);
+        if (q->work_stealing) {
+            ws_wake_all(q);
+        }
+        pthread_mutex_unlock(&q->mutex);
+        for (int i = n - 1; i < old_num_threads - 1; i++) {
+            void *retval;
+            pthread_join(q->threads[i], &retval);
         }
-        // Everyone starts on the a team.
-        work_queue.a_team_size = num_threads;
+        pthread_mutex_lock(&q->mutex);
+    }
+}
+
+// Start up a pool's threads. Must be called with its mutex held.
+WEAK void init_thread_pool(work_queue_t *q) {
+    q->shutdown = false;
+    pool_cond_init(&q->wakeup_owners);
+    pool_cond_init(&q->wakeup_a_team);
+    pool_cond_init(&q->wakeup_b_team);
+    q->use_futex = halide_futex_wake(&q->wakeup_owners.seq, 0) >= 0;
+    q->jobs = NULL;
+    init_thread_keys();
+
+    if (use_work_stealing < 0) {
+        char *ws_str = getenv("HL_WORK_STEALING");
+        use_work_stealing = (ws_str && atoi(ws_str)) ? 1 : 0;
+    }
+    if (spin_count < 0) {
+        char *spin_str = getenv("HL_SPIN_COUNT");
+        spin_count = spin_str ? atoi(spin_str) : DEFAULT_SPIN_COUNT;
+    }
+    if (use_thread_affinity < 0) {
+        char *affinity_str = getenv("HL_THREAD_AFFINITY");
+        use_thread_affinity = (affinity_str && atoi(affinity_str)) ? 1 : 0;
+    }
+    if (record_thread_pool_stats < 0) {
+        char *stats_str = getenv("HL_THREAD_POOL_STATS");
+        record_thread_pool_stats = (stats_str && atoi(stats_str)) ? 1 : 0;
+    }
+    if (recording_stats()) {
+        halide_start_clock(NULL);
+    }
+    ensure_worker_stats(q, 1);
+    // Only the default pool is pinned to cores. Additional pools
+    // would compete with it for the same cores.
+    q->affinity = use_thread_affinity && q == &work_queue;
+    if (q->affinity) {
+        init_thread_affinity();
+    }
+    q->work_stealing = use_work_stealing || q->affinity;
+    if (q->work_stealing) {
+        init_work_stealing_pool(q);
+    }
+
+    // Start with just the calling thread, then grow the pool to
+    // the requested size.
+    int n = q->num_threads ? q->num_threads : default_num_threads();
+    q->num_threads = 1;
+    q->a_team_size = 1;
+    resize_thread_pool(q, n);
+
+    q->initialized = true;
+}
+
+// Stop a pool's threads and release its resources. It's started up
+// again the next time it's used.
+WEAK void shutdown_thread_pool(work_queue_t *q) {
+    if (!q->initialized) return;
+
+    // Wake everyone up and tell them the party's over and it's time
+    // to go home
+    pthread_mutex_lock(&q->mutex);
+    q->shutdown = true;
+    pool_cond_broadcast(q, &q->wakeup_owners);
+    pool_cond_broadcast(q, &q->wakeup_a_team);
+    pool_cond_broadcast(q, &q->wakeup_b_team);
+    pthread_mutex_unlock(&q->mutex);
+    if (q->work_stealing) {
+        ws_wake_all(q);
+    }
+
+    // Wait until they leave
+    for (int i = 0; i < q->num_threads-1; i++) {
+        //fprintf(stderr, "Waiting for thread %d to exit\n", i);
+        void *retval;
+        pthread_join(q->threads[i], &retval);
+    }
+
+    //fprintf(stderr, "All threads have quit. Destroying mutex and condition variable.\n");
+    // Tidy up
+    pthread_mutex_destroy(&q->mutex);
+    // Reinitialize in case we call another do_par_for
+    pthread_mutex_init(&q->mutex, NULL);
+    pool_cond_destroy(&q->wakeup_owners);
+    pool_cond_destroy(&q->wakeup_a_team);
+    pool_cond_destroy(&q->wakeup_b_team);
+    if (q->work_stealing) {
+        destroy_work_stealing_pool(q);
+    }
+    free(q->threads);
+    q->threads = NULL;
+    q->threads_capacity = 0;
+    q->initialized = false;
+}
+
+WEAK int default_do_par_for(void *user_context, halide_task_t f,
+                            int min, int size, uint8_t *closure) {
+    work_queue_t *q = choose_pool(user_context);
+    int64_t start = stats_clock();
+    int slot = start ? current_stats_slot(q) : 0;
+
+    // Grab the lock. If it hasn't been initialized yet, then the
+    // field will be zero-initialized because it's a static
+    // global. pthreads helpfully interprets zero-valued mutex objects
+    // as uninitialized and initializes them for you (see PTHREAD_MUTEX_INITIALIZER).
+    lock_work_queue(q, slot);
+
+    if (!q->initialized) {
+        init_thread_pool(q);
+    }
 
-        thread_pool_initialized = true;
+    // A parallel loop called from inside a task.
+    bool nested = start && pthread_getspecific(task_depth_key) != NULL;
+
+    if (q->work_stealing) {
+        // The work-stealing scheduler doesn't use the shared job
+        // stack at all.
+        pthread_mutex_unlock(&q->mutex);
+        int64_t busy_time = 0;
+        int result = work_stealing_do_par_for(q, user_context, f, min, size, closure, &busy_time);
+        if (start && recording_stats()) {
+            record_loop(q, f, min, size, nested, start, busy_time);
+        }
+        return result;
     }
 
     // Make the job.
@@ -242,43 +1321,113 @@ WEAK int default_do_par_for(void *user_context, halide_task_t f,
     job.closure = closure;   // Use this closure.
     job.exit_status = 0;     // The job hasn't failed yet
     job.active_workers = 0;  // Nobody is working on this yet
+    job.busy_time = 0;
 
-    if (!work_queue.jobs && size < num_threads) {
+    if (!q->jobs && size < q->num_threads) {
         // If there's no nested parallelism happening and there are
         // fewer tasks to do than threads, then set the target A team
         // size so that some threads will put themselves to sleep
         // until a larger job arrives.
-        work_queue.target_a_team_size = size;
+        q->target_a_team_size = size;
     } else {
-        work_queue.target_a_team_size = num_threads;
+        q->target_a_team_size = q->num_threads;
     }
 
     // If there are more tasks than threads in the A team, we should
     // wake up everyone.
-    bool wake_b_team = size > work_queue.a_team_size;
+    bool wake_b_team = size > q->a_team_size;
 
     // Push the job onto the stack.
-    job.next_job = work_queue.jobs;
-    work_queue.jobs = &job;
+    job.next_job = q->jobs;
+    q->jobs = &job;
 
-    pthread_mutex_unlock(&work_queue.mutex);
+    pthread_mutex_unlock(&q->mutex);
 
     // Wake up our A team.
-    pthread_cond_broadcast(&work_queue.wakeup_a_team);
+    pool_cond_broadcast(q, &q->wakeup_a_team);
 
     if (wake_b_team) {
         // We need the B team too.
-        pthread_cond_broadcast(&work_queue.wakeup_b_team);
+        pool_cond_broadcast(q, &q->wakeup_b_team);
     }
 
     // Do some work myself.
-    worker_thread((void *)(&job));
+    worker_thread_loop(q, &job, -1);
+
+    if (start && recording_stats()) {
+        record_loop(q, f, min, size, nested, start, job.busy_time);
+    }
 
     // Return zero if the job succeeded, otherwise return the exit
     // status of one of the failing jobs (whichever one failed last).
     return job.exit_status;
 }
 
+WEAK void reset_thread_pool_stats(work_queue_t *q) {
+    for (int i = 0; i < q->stats.num_workers; i++) {
+        memset(worker_stats(q, i), 0, sizeof(halide_thread_pool_worker_stats));
+    }
+    ScopedSpinLock lock(&q->stats.loops_lock);
+    q->stats.num_loops = 0;
+    memset(q->stats.loops, 0, sizeof(q->stats.loops));
+    memset(&q->stats.other_loops, 0, sizeof(q->stats.other_loops));
+    q->stats.num_calls = 0;
+}
+
+WEAK void report_thread_pool_stats(void *user_context, work_queue_t *q, const char *name) {
+    if (q->stats.num_workers == 0) {
+        // Never used.
+        return;
+    }
+
+    char line_buf[160];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+
+    sstr << "thread pool " << name << ": " << q->num_threads << " threads\n";
+    halide_print(user_context, sstr.str());
+
+    for (int i = 0; i < q->stats.num_workers; i++) {
+        halide_thread_pool_worker_stats *w = worker_stats(q, i);
+        if (i > 0 && w->tasks == 0 && w->idle_time == 0) continue;
+        sstr.clear();
+        if (i == 0) {
+            sstr << "  callers: ";
+        } else {
+            sstr << "  worker " << i - 1 << ": ";
+        }
+        while (sstr.size() < 16) sstr << " ";
+        sstr << "tasks: " << w->tasks;
+        while (sstr.size() < 36) sstr << " ";
+        sstr << "busy: " << w->busy_time / 1000000.0f << " ms"
+             << "  idle: " << w->idle_time / 1000000.0f << " ms"
+             << "  lock wait: " << w->lock_wait_time / 1000000.0f << " ms\n";
+        halide_print(user_context, sstr.str());
+    }
+
+    ScopedSpinLock lock(&q->stats.loops_lock);
+    for (int i = 0; i <= q->stats.num_loops; i++) {
+        halide_thread_pool_loop_stats *l = (i < q->stats.num_loops) ? q->stats.loops + i : &q->stats.other_loops;
+        if (l->calls == 0) continue;
+        sstr.clear();
+        if (l->task) {
+            sstr << "  loop " << (const void *)l->task << ": ";
+        } else {
+            sstr << "  other loops: ";
+        }
+        sstr << "calls: " << l->calls
+             << "  nested: " << l->nested_calls
+             << "  tasks: " << l->tasks
+             << "  time per call: " << l->time / (l->calls * 1000000.0f) << " ms";
+        if (l->time) {
+            // The average number of threads kept busy by the loop
+            // while it ran.
+            sstr << "  parallelism: " << (float)l->busy_time / l->time;
+        }
+        sstr << "\n";
+        halide_print(user_context, sstr.str());
+    }
+}
+
 WEAK halide_do_task_t custom_do_task = default_do_task;
 WEAK halide_do_par_for_t custom_do_par_for = default_do_par_for;
 
@@ -330,52 +1479,225 @@ WEAK void halide_mutex_unlock(halide_mutex *mutex_arg) {
 
 
 WEAK void halide_shutdown_thread_pool() {
-    if (!thread_pool_initialized) return;
+    shutdown_thread_pool(&work_queue);
 
-    // Wake everyone up and tell them the party's over and it's time
-    // to go home
-    pthread_mutex_lock(&work_queue.mutex);
-    work_queue.shutdown = true;
-    pthread_cond_broadcast(&work_queue.wakeup_owners);
-    pthread_cond_broadcast(&work_queue.wakeup_a_team);
-    pthread_cond_broadcast(&work_queue.wakeup_b_team);
-    pthread_mutex_unlock(&work_queue.mutex);
-
-    // Wait until they leave
-    for (int i = 0; i < num_threads-1; i++) {
-        //fprintf(stderr, "Waiting for thread %d to exit\n", i);
-        void *retval;
-        pthread_join(work_queue.threads[i], &retval);
+    // Pools made with halide_create_thread_pool stay registered, and
+    // start up again if they're used.
+    pthread_mutex_lock(&pool_registry_mutex);
+    for (work_queue_t *q = created_pools; q; q = q->next_pool) {
+        shutdown_thread_pool(q);
     }
-
-    //fprintf(stderr, "All threads have quit. Destroying mutex and condition variable.\n");
-    // Tidy up
-    pthread_mutex_destroy(&work_queue.mutex);
-    // Reinitialize in case we call another do_par_for
-    pthread_mutex_init(&work_queue.mutex, NULL);
-    pthread_cond_destroy(&work_queue.wakeup_owners);
-    pthread_cond_destroy(&work_queue.wakeup_a_team);
-    pthread_cond_destroy(&work_queue.wakeup_b_team);
-    thread_pool_initialized = false;
+    pthread_mutex_unlock(&pool_registry_mutex);
 }
 
 namespace {
 __attribute__((destructor))
 WEAK void halide_posix_thread_pool_cleanup() {
+    if (recording_stats()) {
+        halide_thread_pool_report(NULL);
+    }
     halide_shutdown_thread_pool();
 }
 }
 
 WEAK void halide_set_num_threads(int n) {
-    if (num_threads == n) {
+    pthread_mutex_lock(&work_queue.mutex);
+    if (work_queue.initialized) {
+        // Resize the running pool in place.
+        resize_thread_pool(&work_queue, n ? n : default_num_threads());
+    } else {
+        // Takes effect when the pool is first used.
+        work_queue.num_threads = n;
+    }
+    pthread_mutex_unlock(&work_queue.mutex);
+}
+
+WEAK void halide_set_work_stealing(bool enable) {
+    if (use_work_stealing == (int)enable) {
+        return;
+    }
+
+    shutdown_thread_pool(&work_queue);
+
+    use_work_stealing = enable ? 1 : 0;
+}
+
+WEAK void halide_set_thread_affinity(bool enable) {
+    if (use_thread_affinity == (int)enable) {
         return;
     }
 
-    if (thread_pool_initialized) {
-        halide_shutdown_thread_pool();
+    shutdown_thread_pool(&work_queue);
+
+    use_thread_affinity = enable ? 1 : 0;
+}
+
+WEAK void halide_set_thread_pool_spin_count(int count) {
+    spin_count = count;
+}
+
+WEAK void halide_set_thread_pool_hot(bool hot) {
+    thread_pool_hot = hot;
+}
+
+WEAK void halide_set_thread_pool_stats(bool enable) {
+    if (enable) {
+        halide_start_clock(NULL);
+    }
+    record_thread_pool_stats = enable ? 1 : 0;
+}
+
+WEAK void halide_thread_pool_reset_stats() {
+    reset_thread_pool_stats(&work_queue);
+    pthread_mutex_lock(&pool_registry_mutex);
+    for (work_queue_t *q = created_pools; q; q = q->next_pool) {
+        reset_thread_pool_stats(q);
+    }
+    pthread_mutex_unlock(&pool_registry_mutex);
+}
+
+WEAK int halide_thread_pool_get_worker_stats(halide_thread_pool *pool,
+                                             halide_thread_pool_worker_stats *stats,
+                                             int max_workers) {
+    work_queue_t *q = pool ? (work_queue_t *)pool : &work_queue;
+    int n = q->stats.num_workers;
+    for (int i = 0; i < n && i < max_workers; i++) {
+        stats[i] = *worker_stats(q, i);
+    }
+    return n;
+}
+
+WEAK int halide_thread_pool_get_loop_stats(halide_thread_pool *pool,
+                                           halide_thread_pool_loop_stats *stats,
+                                           int max_loops) {
+    work_queue_t *q = pool ? (work_queue_t *)pool : &work_queue;
+    ScopedSpinLock lock(&q->stats.loops_lock);
+    int n = q->stats.num_loops;
+    for (int i = 0; i < n && i < max_loops; i++) {
+        stats[i] = q->stats.loops[i];
+    }
+    if (q->stats.other_loops.calls) {
+        if (n < max_loops) {
+            stats[n] = q->stats.other_loops;
+        }
+        n++;
+    }
+    return n;
+}
+
+WEAK int halide_thread_pool_get_call_stats(halide_thread_pool *pool,
+                                           halide_thread_pool_call_stats *stats,
+                                           int max_calls) {
+    work_queue_t *q = pool ? (work_queue_t *)pool : &work_queue;
+    ScopedSpinLock lock(&q->stats.loops_lock);
+    uint64_t first = q->stats.num_calls > MAX_CALL_STATS ? q->stats.num_calls - MAX_CALL_STATS : 0;
+    int n = (int)(q->stats.num_calls - first);
+    for (int i = 0; i < n && i < max_calls; i++) {
+        stats[i] = q->stats.calls[(first + i) % MAX_CALL_STATS];
+    }
+    return n;
+}
+
+WEAK void halide_thread_pool_report(void *user_context) {
+    report_thread_pool_stats(user_context, &work_queue, "default");
+    pthread_mutex_lock(&pool_registry_mutex);
+    for (work_queue_t *q = created_pools; q; q = q->next_pool) {
+        report_thread_pool_stats(user_context, q, q->name[0] ? q->name : "(unnamed)");
+    }
+    pthread_mutex_unlock(&pool_registry_mutex);
+}
+
+WEAK halide_thread_pool *halide_create_thread_pool(const char *name, int num_threads, int priority) {
+    work_queue_t *q = (work_queue_t *)malloc(sizeof(work_queue_t));
+    if (!q) {
+        return NULL;
+    }
+    memset(q, 0, sizeof(work_queue_t));
+    pthread_mutex_init(&q->mutex, NULL);
+    q->num_threads = num_threads;
+    q->priority = priority;
+    if (name) {
+        strncpy(q->name, name, sizeof(q->name) - 1);
+    }
+
+    pthread_mutex_lock(&pool_registry_mutex);
+    q->next_pool = created_pools;
+    created_pools = q;
+    pthread_mutex_unlock(&pool_registry_mutex);
+
+    return (halide_thread_pool *)q;
+}
+
+WEAK halide_thread_pool *halide_find_thread_pool(const char *name) {
+    work_queue_t *result = NULL;
+    pthread_mutex_lock(&pool_registry_mutex);
+    for (work_queue_t *q = created_pools; q; q = q->next_pool) {
+        if (name && strcmp(q->name, name) == 0) {
+            result = q;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_registry_mutex);
+    return (halide_thread_pool *)result;
+}
+
+WEAK int halide_use_thread_pool(void *user_context, halide_thread_pool *pool) {
+    pthread_mutex_lock(&pool_registry_mutex);
+    pool_binding **b = (pool_binding **)&pool_bindings;
+    while (*b && (*b)->user_context != user_context) {
+        b = &((*b)->next);
+    }
+    if (pool) {
+        if (!*b) {
+            pool_binding *binding = (pool_binding *)malloc(sizeof(pool_binding));
+            if (!binding) {
+                pthread_mutex_unlock(&pool_registry_mutex);
+                return -1;
+            }
+            binding->user_context = user_context;
+            binding->next = NULL;
+            *b = binding;
+        }
+        (*b)->pool = (work_queue_t *)pool;
+    } else if (*b) {
+        pool_binding *binding = *b;
+        *b = binding->next;
+        free(binding);
+    }
+    pthread_mutex_unlock(&pool_registry_mutex);
+    return 0;
+}
+
+WEAK void halide_destroy_thread_pool(halide_thread_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    work_queue_t *q = (work_queue_t *)pool;
+
+    // Forget the pool and anything bound to it, then stop its threads.
+    pthread_mutex_lock(&pool_registry_mutex);
+    for (work_queue_t **p = &created_pools; *p; p = &((*p)->next_pool)) {
+        if (*p == q) {
+            *p = q->next_pool;
+            break;
+        }
+    }
+    pool_binding **b = (pool_binding **)&pool_bindings;
+    while (*b) {
+        if ((*b)->pool == q) {
+            pool_binding *binding = *b;
+            *b = binding->next;
+            free(binding);
+        } else {
+            b = &((*b)->next);
+        }
     }
+    pthread_mutex_unlock(&pool_registry_mutex);
 
-    num_threads = n;
+    shutdown_thread_pool(q);
+    pthread_mutex_destroy(&q->mutex);
+    free_blocks((void **)q->stats.worker_blocks);
+    free(q);
 }
 
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
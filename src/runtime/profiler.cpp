@@ -10,13 +10,125 @@
 extern "C" {
 // Returns the address of the global halide_profiler state
 WEAK halide_profiler_state *halide_profiler_get_state() {
-    static halide_profiler_state s = {{{0}}, NULL, 1, 0, 0, false};
+    static halide_profiler_state s = {{{0}}, NULL, 1, 0, 0, {0}, false, NULL, 0};
     return &s;
 }
 }
 
 namespace Halide { namespace Runtime { namespace Internal {
 
+// Whether the per-thread slots have been marked as unused. Guarded by
+// the profiler state's lock.
+WEAK bool thread_slots_initialized = false;
+
+// The slot handed to tasks that start when all the per-thread slots
+// are in use. It's written by all of them and never sampled.
+WEAK int unsampled_slot;
+
+// The timeline has a ring buffer for the threads running pipelines,
+// and one for each per-thread slot. A slot's ring is only written to
+// by the thread that holds the slot. The pipeline ring is written to
+// by every thread that runs a pipeline, so its events also record the
+// thread id, and each thread's events are written out as a separate
+// track. Events claim their place in a ring atomically, so recording
+// one needs no lock. If a ring fills up the oldest events are
+// overwritten.
+#define TIMELINE_RING_SIZE (1 << 15)
+
+enum {
+    timeline_func,
+    timeline_task_begin,
+    timeline_task_end,
+    timeline_pipeline_begin,
+    timeline_pipeline_end
+};
+
+struct timeline_event {
+    uint64_t time;
+    int kind;
+    int func;
+    // The id of the thread that recorded the event, for events in the
+    // pipeline ring. Zero on platforms without thread ids, in which
+    // case all the pipeline threads share one track.
+    int tid;
+};
+
+struct timeline_ring {
+    uint32_t count;
+    timeline_event events[TIMELINE_RING_SIZE];
+};
+
+struct timeline {
+    int fd;
+    timeline_ring *rings[HALIDE_PROFILER_MAX_THREADS + 1];
+};
+
+// Whether we have checked the environment for a timeline file.
+// Guarded by the profiler state's lock.
+WEAK bool timeline_initialized = false;
+
+// Get the ring with the given index, creating it if need be. Safe to
+// call without the lock.
+WEAK timeline_ring *get_ring(timeline *tl, int ring) {
+    timeline_ring *r = tl->rings[ring];
+    if (!r) {
+        r = (timeline_ring *)malloc(sizeof(timeline_ring));
+        if (!r) return NULL;
+        r->count = 0;
+        if (!__sync_bool_compare_and_swap(tl->rings + ring, (timeline_ring *)NULL, r)) {
+            free(r);
+            r = tl->rings[ring];
+        }
+    }
+    return r;
+}
+
+// The index of the ring for a per-thread slot, or of the pipeline's
+// ring if the slot is NULL. Returns -1 for the unsampled slot.
+WEAK int ring_of_slot(halide_profiler_state *s, int *slot) {
+    if (!slot) return 0;
+    int i = (int)(slot - s->thread_funcs);
+    if (i < 0 || i >= HALIDE_PROFILER_MAX_THREADS) return -1;
+    return i + 1;
+}
+
+WEAK void record_event(halide_profiler_state *s, int ring, int kind, int func) {
+    timeline *tl = (timeline *)s->timeline;
+    if (!tl || ring < 0) return;
+    timeline_ring *r = get_ring(tl, ring);
+    if (!r) return;
+    uint32_t i = __sync_fetch_and_add(&r->count, 1) & (TIMELINE_RING_SIZE - 1);
+    r->events[i].time = halide_current_time_ns(NULL);
+    r->events[i].kind = kind;
+    r->events[i].func = func;
+    r->events[i].tid = (ring == 0) ? halide_current_thread_id() : 0;
+}
+
+#define O_CREAT 64
+#define O_TRUNC 512
+#define O_WRONLY 1
+// Check the environment to see if the timeline should be
+// recorded. Must be called with the lock held.
+WEAK void init_timeline(halide_profiler_state *s) {
+    if (timeline_initialized) return;
+    timeline_initialized = true;
+
+    const char *file_name = getenv("HL_PROFILER_TRACE_FILE");
+    if (!file_name) return;
+
+    timeline *tl = (timeline *)malloc(sizeof(timeline));
+    if (!tl) return;
+    tl->fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (tl->fd <= 0) {
+        free(tl);
+        return;
+    }
+    for (int i = 0; i <= HALIDE_PROFILER_MAX_THREADS; i++) {
+        tl->rings[i] = NULL;
+    }
+    s->timeline = tl;
+}
+
 WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipeline_name, int num_funcs, const uint64_t *func_names) {
     halide_profiler_state *s = halide_profiler_get_state();
 
@@ -39,7 +151,17 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
     p->num_funcs = num_funcs;
     p->runs = 0;
     p->time = 0;
+    p->cpu_time = 0;
+    p->memory_current = 0;
+    p->memory_peak = 0;
+    p->memory_total = 0;
+    p->memory_planned_peak = 0;
+    p->num_allocs = 0;
+    for (int j = 0; j < HALIDE_PROFILER_NUM_COUNTERS; j++) {
+        p->counters[j] = 0;
+    }
     p->samples = 0;
+    p->dropped_samples = 0;
     p->funcs = (halide_profiler_func_stats *)malloc(num_funcs * sizeof(halide_profiler_func_stats));
     if (!p->funcs) {
         free(p);
@@ -47,32 +169,194 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
     }
     for (int i = 0; i < num_funcs; i++) {
         p->funcs[i].time = 0;
+        p->funcs[i].cpu_time = 0;
+        p->funcs[i].memory_current = 0;
+        p->funcs[i].memory_peak = 0;
+        p->funcs[i].memory_total = 0;
+        p->funcs[i].num_allocs = 0;
+        for (int j = 0; j < HALIDE_PROFILER_NUM_COUNTERS; j++) {
+            p->funcs[i].counters[j] = 0;
+        }
         p->funcs[i].name = (const char *)(func_names[i]);
     }
     s->first_free_id += num_funcs;
+    // Finish writing the entry before it can be found by threads that
+    // don't hold the lock.
+    __sync_synchronize();
     s->pipelines = p;
     return p;
 }
 
-WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time) {
-    halide_profiler_pipeline_stats *p_prev = NULL;
+// Find the pipeline a func id belongs to. Pipelines are only ever
+// added to the front of the list, and only removed by
+// halide_profiler_reset, so this may be called without the lock by
+// running pipelines.
+WEAK halide_profiler_pipeline_stats *find_pipeline_of_func(halide_profiler_state *s, int func_id) {
     for (halide_profiler_pipeline_stats *p = s->pipelines; p;
          p = (halide_profiler_pipeline_stats *)(p->next)) {
         if (func_id >= p->first_func_id && func_id < p->first_func_id + p->num_funcs) {
-            if (p_prev) {
-                // Bubble the pipeline to the top to speed up future queries.
-                p_prev->next = (halide_profiler_pipeline_stats *)(p->next);
-                p->next = s->pipelines;
-                s->pipelines = p;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Raise a peak to at least the given value, atomically.
+WEAK void raise_peak(uint64_t *peak, uint64_t value) {
+    uint64_t old_peak = *peak;
+    while (value > old_peak) {
+        uint64_t seen = __sync_val_compare_and_swap(peak, old_peak, value);
+        if (seen == old_peak) break;
+        old_peak = seen;
+    }
+}
+
+// Count an allocation of some bytes, atomically, so that threads
+// allocating in parallel don't serialize on the lock.
+WEAK void count_allocation(uint64_t *current, uint64_t *peak, uint64_t *total,
+                           int *num_allocs, uint64_t bytes) {
+    raise_peak(peak, __sync_add_and_fetch(current, bytes));
+    __sync_fetch_and_add(total, bytes);
+    __sync_fetch_and_add(num_allocs, 1);
+}
+
+// Count a free of some bytes, atomically. Stats may have been reset
+// while the allocation was live, so don't go below zero.
+WEAK void count_free(uint64_t *current, uint64_t bytes) {
+    uint64_t old_current = *current;
+    while (true) {
+        uint64_t new_current = old_current - ((bytes < old_current) ? bytes : old_current);
+        uint64_t seen = __sync_val_compare_and_swap(current, old_current, new_current);
+        if (seen == old_current) break;
+        old_current = seen;
+    }
+}
+
+WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time, uint64_t cpu_time, bool new_sample) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(s, func_id);
+    if (!p) {
+        // Someone must have called reset_state while a kernel was running. Do nothing.
+        return;
+    }
+    p->funcs[func_id - p->first_func_id].time += time;
+    p->funcs[func_id - p->first_func_id].cpu_time += cpu_time;
+    p->time += time;
+    p->cpu_time += cpu_time;
+    if (new_sample) {
+        p->samples++;
+    }
+}
+
+// Performance counters are read by the sampling thread, which opens
+// them for each thread it sees running a Func, and bills what they
+// counted since the last sample to that Func.
+WEAK bool counters_initialized = false;
+WEAK bool counters_enabled = false;
+WEAK bool counters_software_only = false;
+
+// The ids of the thread running the pipeline, and of the thread
+// holding each per-thread slot, or zero if not known.
+WEAK int counter_tids[HALIDE_PROFILER_MAX_THREADS + 1];
+
+// The names of the counters opened, or NULL if they couldn't be.
+WEAK const char *counter_names[HALIDE_PROFILER_NUM_COUNTERS];
+
+// The counters opened for each thread. Only used by the sampling
+// thread.
+struct thread_counters {
+    int tid;
+    int fds[HALIDE_PROFILER_NUM_COUNTERS];
+    uint64_t last[HALIDE_PROFILER_NUM_COUNTERS];
+    // The func this thread was running at the last sample and at this
+    // one, or a negative value if none.
+    int last_func, func;
+};
+
+WEAK thread_counters counter_threads[HALIDE_PROFILER_MAX_THREADS + 1];
+WEAK int num_counter_threads = 0;
+
+// Check the environment to see if performance counters should be
+// read. Must be called with the lock held.
+WEAK void init_counters() {
+    if (counters_initialized) return;
+    counters_initialized = true;
+    // HL_PROFILER_COUNTERS=software skips the hardware counters, to
+    // get the same counters everywhere.
+    const char *env = getenv("HL_PROFILER_COUNTERS");
+    counters_software_only = env && !strcmp(env, "software");
+    counters_enabled = env && (atoi(env) != 0 || counters_software_only);
+}
+
+WEAK thread_counters *find_or_open_counters(int tid) {
+    for (int i = 0; i < num_counter_threads; i++) {
+        if (counter_threads[i].tid == tid) {
+            return counter_threads + i;
+        }
+    }
+    if (num_counter_threads == HALIDE_PROFILER_MAX_THREADS + 1) {
+        return NULL;
+    }
+    thread_counters *c = counter_threads + num_counter_threads;
+    const char *names[HALIDE_PROFILER_NUM_COUNTERS];
+    if (halide_open_perf_counters(tid, counters_software_only, c->fds, names) == 0) {
+        // There's no point trying again for other threads.
+        counters_enabled = false;
+        return NULL;
+    }
+    for (int i = 0; i < HALIDE_PROFILER_NUM_COUNTERS; i++) {
+        if (!counter_names[i]) {
+            counter_names[i] = names[i];
+        }
+        c->last[i] = 0;
+    }
+    c->tid = tid;
+    c->last_func = c->func = halide_profiler_outside_of_halide;
+    num_counter_threads++;
+    return c;
+}
+
+WEAK void bill_counters(halide_profiler_state *s, int func_id, const uint64_t *counts) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(s, func_id);
+    if (!p) return;
+    for (int i = 0; i < HALIDE_PROFILER_NUM_COUNTERS; i++) {
+        p->funcs[func_id - p->first_func_id].counters[i] += counts[i];
+        p->counters[i] += counts[i];
+    }
+}
+
+// Read the counters of every thread we know about, and bill what
+// they counted since the last sample to the func the thread is
+// running, or to the one it was running at the last sample if it has
+// since finished. Must be called with the lock held.
+WEAK void sample_counters(halide_profiler_state *s) {
+    for (int i = 0; i < num_counter_threads; i++) {
+        counter_threads[i].func = halide_profiler_outside_of_halide;
+    }
+    for (int i = 0; i <= HALIDE_PROFILER_MAX_THREADS; i++) {
+        int tid = ((volatile int *)counter_tids)[i];
+        int func = (i == 0) ? s->current_func : ((volatile int *)s->thread_funcs)[i - 1];
+        if (tid == 0 || func < 0) continue;
+        thread_counters *c = find_or_open_counters(tid);
+        if (!c) continue;
+        c->func = func;
+    }
+    for (int i = 0; i < num_counter_threads; i++) {
+        thread_counters *c = counter_threads + i;
+        uint64_t counts[HALIDE_PROFILER_NUM_COUNTERS];
+        for (int j = 0; j < HALIDE_PROFILER_NUM_COUNTERS; j++) {
+            uint64_t value;
+            counts[j] = 0;
+            if (c->fds[j] >= 0 && halide_read_perf_counter(c->fds[j], &value)) {
+                counts[j] = value - c->last[j];
+                c->last[j] = value;
             }
-            p->funcs[func_id - p->first_func_id].time += time;
-            p->time += time;
-            p->samples++;
-            return;
         }
-        p_prev = p;
+        int func = (c->func >= 0) ? c->func : c->last_func;
+        if (func >= 0) {
+            bill_counters(s, func, counts);
+        }
+        c->last_func = c->func;
     }
-    // Someone must have called reset_state while a kernel was running. Do nothing.
 }
 
 WEAK void sampling_profiler_thread(void *) {
@@ -90,13 +374,53 @@ WEAK void sampling_profiler_thread(void *) {
             int func = s->current_func;
             if (func == halide_profiler_please_stop) {
                 break;
-            } else if (func >= 0) {
-                // Assume all time since I was last awake is due to
-                // the currently running func.
-                bill_func(s, func, t_now - t);
+            }
+
+            // Find the funcs running on every thread.
+            int running[HALIDE_PROFILER_MAX_THREADS + 1];
+            int num_running = 0;
+            if (func >= 0) {
+                running[num_running++] = func;
+            }
+            for (int i = 0; i < HALIDE_PROFILER_MAX_THREADS; i++) {
+                int f = ((volatile int *)s->thread_funcs)[i];
+                if (f >= 0) {
+                    running[num_running++] = f;
+                }
+            }
+
+            // Assume all time since I was last awake is due to the
+            // currently running funcs. Each busy thread spent all of
+            // it in its func, and the wall time is split between
+            // them.
+            uint64_t dt = t_now - t;
+            if (num_running > 0) {
+                for (int i = 0; i < num_running; i++) {
+                    bill_func(s, running[i], dt / num_running, dt, i == 0);
+                }
+            } else if (func <= halide_profiler_waiting) {
+                // The pipeline is waiting on a parallel loop whose
+                // tasks haven't started yet. Bill the wall time to
+                // the func that launched it.
+                bill_func(s, halide_profiler_waiting - func, dt, 0, true);
             }
             t = t_now;
 
+            // Count the samples missed on threads without a slot
+            // against the pipeline.
+            int unsampled = s->unsampled_threads;
+            if (unsampled > 0) {
+                int owner = (num_running > 0) ? running[0] : halide_profiler_waiting - func;
+                halide_profiler_pipeline_stats *p = find_pipeline_of_func(s, owner);
+                if (p) {
+                    p->dropped_samples += unsampled;
+                }
+            }
+
+            if (counters_enabled) {
+                sample_counters(s);
+            }
+
             // Release the lock, sleep, reacquire.
             int sleep_ms = s->sleep_time;
             halide_mutex_unlock(&s->lock);
@@ -110,6 +434,168 @@ WEAK void sampling_profiler_thread(void *) {
     halide_mutex_unlock(&s->lock);
 }
 
+WEAK const char *name_of_func(halide_profiler_state *s, int func_id) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(s, func_id);
+    return p ? p->funcs[func_id - p->first_func_id].name : "unknown";
+}
+
+WEAK const char *name_of_pipeline(halide_profiler_state *s, int first_func_id) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(s, first_func_id);
+    return p ? p->name : "unknown";
+}
+
+typedef Printer<StringStreamPrinter, 256> timeline_printer;
+
+// Write one event to the timeline file in Chrome trace format. Times
+// are in microseconds.
+WEAK void write_timeline_event(timeline *tl, bool *first, const char *phase,
+                               const char *prefix, const char *name,
+                               int tid, uint64_t ns) {
+    char buf[256];
+    timeline_printer sstr(NULL, buf);
+    uint64_t frac = ns % 1000;
+    sstr << (*first ? "" : ",\n")
+         << "{\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":" << tid
+         << ",\"ts\":" << ns / 1000 << (frac < 100 ? ".0" : ".") << (frac < 10 ? "0" : "") << frac;
+    if (name) {
+        sstr << ",\"name\":\"" << prefix << name << "\"";
+    }
+    sstr << "}";
+    write(tl->fd, sstr.str(), sstr.size());
+    *first = false;
+}
+
+// Write the name of a track of the timeline.
+WEAK void write_timeline_track_name(timeline *tl, bool *first, int track, const char *name, int n) {
+    char buf[256];
+    timeline_printer sstr(NULL, buf);
+    sstr << (*first ? "" : ",\n")
+         << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+         << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << name;
+    if (n >= 0) {
+        sstr << n;
+    }
+    sstr << "\"}}";
+    write(tl->fd, sstr.str(), sstr.size());
+    *first = false;
+}
+
+// Replay the events in one ring recorded by the thread with the given
+// id as nested begin and end events on the given track.
+WEAK void write_timeline_ring(halide_profiler_state *s, timeline *tl, int ring, int tid, int track, bool *first) {
+    timeline_ring *r = tl->rings[ring];
+    uint32_t count = r->count;
+    uint32_t start = count > TIMELINE_RING_SIZE ? count - TIMELINE_RING_SIZE : 0;
+
+    // The kinds of the spans that are open, innermost last.
+    const int max_depth = 16;
+    int open[max_depth];
+    int depth = 0;
+
+    uint64_t t = 0;
+    for (uint32_t i = start; i != count; i++) {
+        const timeline_event &e = r->events[i & (TIMELINE_RING_SIZE - 1)];
+        if (e.tid != tid) continue;
+        t = e.time;
+        const char *prefix = "";
+        const char *name = NULL;
+        int kind = e.kind;
+        switch (e.kind) {
+        case timeline_func:
+            if (depth > 0 && open[depth - 1] == timeline_func) {
+                write_timeline_event(tl, first, "E", NULL, NULL, track, t);
+                depth--;
+            }
+            if (e.func >= 0) {
+                name = name_of_func(s, e.func);
+            } else if (e.func <= halide_profiler_waiting) {
+                prefix = "waiting in ";
+                name = name_of_func(s, halide_profiler_waiting - e.func);
+            }
+            break;
+        case timeline_task_begin:
+            if (depth < max_depth) {
+                write_timeline_event(tl, first, "B", "task of ", name_of_func(s, e.func), track, t);
+                open[depth++] = timeline_task_begin;
+            }
+            kind = timeline_func;
+            name = name_of_func(s, e.func);
+            break;
+        case timeline_pipeline_begin:
+            name = name_of_pipeline(s, e.func);
+            break;
+        case timeline_task_end:
+        case timeline_pipeline_end: {
+            // Close everything up to the matching begin, if it's
+            // still in the ring.
+            int begin = (e.kind == timeline_task_end) ? timeline_task_begin : timeline_pipeline_begin;
+            int d = depth;
+            while (d > 0 && open[d - 1] != begin) d--;
+            while (d > 0 && depth >= d) {
+                write_timeline_event(tl, first, "E", NULL, NULL, track, t);
+                depth--;
+            }
+            break;
+        }
+        }
+        if (name && depth < max_depth) {
+            write_timeline_event(tl, first, "B", prefix, name, track, t);
+            open[depth++] = kind;
+        }
+    }
+    while (depth > 0) {
+        write_timeline_event(tl, first, "E", NULL, NULL, track, t);
+        depth--;
+    }
+}
+
+// Write the timeline to the file named by HL_PROFILER_TRACE_FILE.
+WEAK void write_timeline(halide_profiler_state *s) {
+    timeline *tl = (timeline *)s->timeline;
+    if (!tl) return;
+
+    const char *header = "{\"traceEvents\":[\n";
+    write(tl->fd, header, strlen(header));
+    bool first = true;
+    for (int i = 0; i <= HALIDE_PROFILER_MAX_THREADS; i++) {
+        if (!tl->rings[i] || !tl->rings[i]->count) continue;
+        if (i > 0) {
+            write_timeline_track_name(tl, &first, i, "thread slot ", i - 1);
+            write_timeline_ring(s, tl, i, 0, i, &first);
+            continue;
+        }
+        // Give each thread that ran a pipeline its own track, after
+        // the ones for the slots.
+        timeline_ring *r = tl->rings[0];
+        uint32_t count = r->count;
+        uint32_t start = count > TIMELINE_RING_SIZE ? count - TIMELINE_RING_SIZE : 0;
+        const int max_tids = 64;
+        int tids[max_tids];
+        int num_tids = 0;
+        for (uint32_t j = start; j != count && num_tids < max_tids; j++) {
+            int tid = r->events[j & (TIMELINE_RING_SIZE - 1)].tid;
+            int k = 0;
+            while (k < num_tids && tids[k] != tid) k++;
+            if (k == num_tids) {
+                tids[num_tids++] = tid;
+            }
+        }
+        for (int k = 0; k < num_tids; k++) {
+            int track = (k == 0) ? 0 : HALIDE_PROFILER_MAX_THREADS + k;
+            if (num_tids == 1) {
+                write_timeline_track_name(tl, &first, track, "pipeline", -1);
+            } else {
+                write_timeline_track_name(tl, &first, track, "pipeline on thread ", tids[k]);
+            }
+            write_timeline_ring(s, tl, 0, tids[k], track, &first);
+        }
+    }
+    const char *footer = "\n]}\n";
+    write(tl->fd, footer, strlen(footer));
+    close(tl->fd);
+    tl->fd = 0;
+}
+
 }}}
 
 extern "C" {
@@ -123,6 +609,13 @@ WEAK int halide_profiler_pipeline_start(void *user_context,
 
     ScopedMutexLock lock(&s->lock);
 
+    if (!thread_slots_initialized) {
+        for (int i = 0; i < HALIDE_PROFILER_MAX_THREADS; i++) {
+            s->thread_funcs[i] = halide_profiler_outside_of_halide;
+        }
+        thread_slots_initialized = true;
+    }
+
     if (!s->started) {
         halide_start_clock(user_context);
         halide_spawn_thread(user_context, sampling_profiler_thread, NULL);
@@ -137,24 +630,137 @@ WEAK int halide_profiler_pipeline_start(void *user_context,
     }
     p->runs++;
 
+    init_counters();
+    if (counters_enabled) {
+        counter_tids[0] = halide_current_thread_id();
+    }
+
+    init_timeline(s);
+    record_event(s, 0, timeline_pipeline_begin, p->first_func_id);
+
     return p->first_func_id;
 }
 
+WEAK int halide_profiler_memory_allocate(halide_profiler_state *state, int func, uint64_t bytes) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(state, func);
+    if (!p) return 0;
+    halide_profiler_func_stats *fs = p->funcs + (func - p->first_func_id);
+    count_allocation(&fs->memory_current, &fs->memory_peak, &fs->memory_total, &fs->num_allocs, bytes);
+    count_allocation(&p->memory_current, &p->memory_peak, &p->memory_total, &p->num_allocs, bytes);
+    return 0;
+}
+
+WEAK int halide_profiler_memory_free(halide_profiler_state *state, int func, uint64_t bytes) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(state, func);
+    if (!p) return 0;
+    halide_profiler_func_stats *fs = p->funcs + (func - p->first_func_id);
+    count_free(&fs->memory_current, bytes);
+    count_free(&p->memory_current, bytes);
+    return 0;
+}
+
+WEAK int halide_profiler_memory_planned(halide_profiler_state *state, int pipeline, uint64_t bytes) {
+    halide_profiler_pipeline_stats *p = find_pipeline_of_func(state, pipeline);
+    if (!p) return 0;
+    raise_peak(&p->memory_planned_peak, bytes);
+    return 0;
+}
+
+WEAK int *halide_profiler_acquire_thread_slot(halide_profiler_state *state, int func) {
+    for (int i = 0; i < HALIDE_PROFILER_MAX_THREADS; i++) {
+        if (__sync_bool_compare_and_swap(state->thread_funcs + i, halide_profiler_outside_of_halide, func)) {
+            if (counters_enabled) {
+                counter_tids[i + 1] = halide_current_thread_id();
+            }
+            record_event(state, i + 1, timeline_task_begin, func);
+            return state->thread_funcs + i;
+        }
+    }
+    // All the slots are taken. This thread won't be sampled, but the
+    // samples it misses are counted.
+    __sync_fetch_and_add(&state->unsampled_threads, 1);
+    return &unsampled_slot;
+}
+
+WEAK void halide_profiler_release_thread_slot(void *user_context, void *slot) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    if (slot == &unsampled_slot) {
+        __sync_fetch_and_sub(&s->unsampled_threads, 1);
+        return;
+    }
+    // Record the end of the task before another task can claim the slot.
+    record_event(s, ring_of_slot(s, (int *)slot), timeline_task_end, 0);
+    volatile int *ptr = (volatile int *)slot;
+    __sync_synchronize();
+    *ptr = halide_profiler_outside_of_halide;
+}
+
+WEAK void halide_profiler_record_func(halide_profiler_state *state, int *slot, int func) {
+    record_event(state, ring_of_slot(state, slot), timeline_func, func);
+}
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// Print the counters per run, and the instructions per cycle and
+// cache misses per thousand instructions if we have the hardware
+// counters needed to compute them.
+template<typename Stream>
+WEAK void report_counters(Stream &sstr, const uint64_t *counters, int runs) {
+    for (int i = 0; i < HALIDE_PROFILER_NUM_COUNTERS; i++) {
+        if (counter_names[i]) {
+            sstr << "  " << counter_names[i] << ": " << counters[i] / runs;
+        }
+    }
+    bool have_cycles = counter_names[0] && !strcmp(counter_names[0], "cycles");
+    bool have_instructions = counter_names[1] && !strcmp(counter_names[1], "instructions");
+    bool have_misses = counter_names[2] && !strcmp(counter_names[2], "llc misses");
+    if (have_cycles && have_instructions && counters[0]) {
+        sstr << "  ipc: " << (float)counters[1] / counters[0];
+    }
+    if (have_instructions && have_misses && counters[1]) {
+        sstr << "  misses per 1k instructions: " << (float)counters[2] * 1000 / counters[1];
+    }
+}
+
+}}}
+
+extern "C" {
+
 WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_state *s) {
 
-    char line_buf[160];
+    char line_buf[512];
     Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
 
     for (halide_profiler_pipeline_stats *p = s->pipelines; p;
          p = (halide_profiler_pipeline_stats *)(p->next)) {
         float t = p->time / 1000000.0f;
+        float cpu_t = p->cpu_time / 1000000.0f;
         if (!p->runs) continue;
         sstr.clear();
         sstr << p->name
              << "  total time: " << t << " ms"
+             << "  cpu time: " << cpu_t << " ms"
              << "  samples: " << p->samples
              << "  runs: " << p->runs
-             << "  time per run: " << t / p->runs << " ms\n";
+             << "  time per run: " << t / p->runs << " ms";
+        if (p->dropped_samples) {
+            // Some threads ran without a per-thread slot, so the
+            // times below are too low.
+            sstr << "  dropped samples: " << p->dropped_samples;
+        }
+        if (p->num_allocs) {
+            sstr << "  heap allocations per run: " << p->num_allocs / p->runs
+                 << "  peak heap usage: " << p->memory_peak << " bytes";
+        }
+        if (p->memory_planned_peak) {
+            sstr << "  planned peak heap usage: " << p->memory_planned_peak << " bytes";
+        }
+        if (counters_enabled) {
+            report_counters(sstr, p->counters, p->runs);
+        }
+        sstr << "\n";
         halide_print(user_context, sstr.str());
         if (p->time) {
             for (int i = 0; i < p->num_funcs; i++) {
@@ -173,7 +779,23 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
                 while (sstr.size() < 40) sstr << " ";
 
                 int percent = fs->time / (p->time / 100);
-                sstr << "(" << percent << "%)\n";
+                sstr << "(" << percent << "%)";
+                while (sstr.size() < 48) sstr << " ";
+
+                float cpu_ft = fs->cpu_time / (p->runs * 1000000.0f);
+                sstr << "cpu: " << cpu_ft << "ms";
+
+                if (fs->num_allocs) {
+                    while (sstr.size() < 64) sstr << " ";
+                    sstr << "allocs: " << fs->num_allocs / p->runs
+                         << "  peak: " << fs->memory_peak
+                         << "  bytes per run: " << fs->memory_total / p->runs;
+                }
+
+                if (counters_enabled) {
+                    report_counters(sstr, fs->counters, p->runs);
+                }
+                sstr << "\n";
 
                 halide_print(user_context, sstr.str());
             }
@@ -200,6 +822,16 @@ WEAK void halide_profiler_reset() {
         free(p);
     }
     s->first_free_id = 0;
+
+    // The func ids in the timeline are about to be reused.
+    timeline *tl = (timeline *)s->timeline;
+    if (tl) {
+        for (int i = 0; i <= HALIDE_PROFILER_MAX_THREADS; i++) {
+            if (tl->rings[i]) {
+                tl->rings[i]->count = 0;
+            }
+        }
+    }
 }
 
 namespace {
@@ -218,6 +850,7 @@ WEAK void halide_profiler_shutdown() {
     // Print results. No need to lock anything because we just shut
     // down the thread.
     halide_profiler_report_unlocked(NULL, s);
+    write_timeline(s);
 
     // Leak the memory. Not all implementations of ScopedMutexLock may
     // be safe to use at static destruction time (windows).
@@ -226,7 +859,9 @@ WEAK void halide_profiler_shutdown() {
 }
 
 WEAK void halide_profiler_pipeline_end(void *user_context, void *state) {
-    ((halide_profiler_state *)state)->current_func = halide_profiler_outside_of_halide;
+    halide_profiler_state *s = (halide_profiler_state *)state;
+    s->current_func = halide_profiler_outside_of_halide;
+    record_event(s, 0, timeline_pipeline_end, 0);
 }
 
 }
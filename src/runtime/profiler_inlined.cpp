@@ -10,6 +10,21 @@ WEAK __attribute__((always_inline)) int halide_profiler_set_current_func(halide_
     asm volatile ("":::);
     *ptr = tok + t;
     asm volatile ("":::);
+    if (state->timeline) {
+        halide_profiler_record_func(state, NULL, tok + t);
+    }
+    return 0;
+}
+
+WEAK __attribute__((always_inline)) int halide_profiler_set_thread_func(halide_profiler_state *state, int *slot, int tok, int t) {
+    // As above, but for the slot claimed by a task of a parallel loop.
+    volatile int *ptr = slot;
+    asm volatile ("":::);
+    *ptr = tok + t;
+    asm volatile ("":::);
+    if (state->timeline) {
+        halide_profiler_record_func(state, slot, tok + t);
+    }
     return 0;
 }
 
@@ -18,6 +18,8 @@ namespace {
 __attribute__((used)) void *runtime_api_functions[] = {
     (void *)&halide_copy_to_device,
     (void *)&halide_copy_to_host,
+    (void *)&halide_create_arena,
+    (void *)&halide_create_thread_pool,
     (void *)&halide_cuda_detach_device_ptr,
     (void *)&halide_cuda_device_interface,
     (void *)&halide_cuda_get_device_ptr,
@@ -26,6 +28,8 @@ __attribute__((used)) void *runtime_api_functions[] = {
     (void *)&halide_cuda_wrap_device_ptr,
     (void *)&halide_current_time_ns,
     (void *)&halide_debug_to_file,
+    (void *)&halide_destroy_arena,
+    (void *)&halide_destroy_thread_pool,
     (void *)&halide_device_free,
     (void *)&halide_device_free_as_destructor,
     (void *)&halide_device_malloc,
@@ -53,6 +57,7 @@ __attribute__((used)) void *runtime_api_functions[] = {
     (void *)&halide_error_param_too_small_f64,
     (void *)&halide_error_param_too_small_i64,
     (void *)&halide_error_param_too_small_u64,
+    (void *)&halide_find_thread_pool,
     (void *)&halide_float16_bits_to_double,
     (void *)&halide_float16_bits_to_float,
     (void *)&halide_free,
@@ -65,10 +70,17 @@ __attribute__((used)) void *runtime_api_functions[] = {
     (void *)&halide_malloc,
     (void *)&halide_matlab_call_pipeline,
     (void *)&halide_memoization_cache_cleanup,
+    (void *)&halide_memoization_cache_get_stats,
     (void *)&halide_memoization_cache_lookup,
+    (void *)&halide_memoization_cache_lookup_v2,
     (void *)&halide_memoization_cache_release,
+    (void *)&halide_memoization_cache_report,
+    (void *)&halide_memoization_cache_reset_stats,
+    (void *)&halide_memoization_cache_set_eviction_policy,
+    (void *)&halide_memoization_cache_set_file,
     (void *)&halide_memoization_cache_set_size,
     (void *)&halide_memoization_cache_store,
+    (void *)&halide_memoization_cache_store_v2,
     (void *)&halide_metal_acquire_context,
     (void *)&halide_metal_detach_buffer,
     (void *)&halide_metal_device_interface,
@@ -104,27 +116,51 @@ __attribute__((used)) void *runtime_api_functions[] = {
     (void *)&halide_openglcompute_initialize_kernels,
     (void *)&halide_openglcompute_run,
     (void *)&halide_pointer_to_string,
+    (void *)&halide_pooled_allocator_release,
+    (void *)&halide_pooled_allocator_set_max_retained,
+    (void *)&halide_pooled_free,
+    (void *)&halide_pooled_malloc,
     (void *)&halide_print,
+    (void *)&halide_profiler_acquire_thread_slot,
     (void *)&halide_profiler_get_state,
+    (void *)&halide_profiler_memory_allocate,
+    (void *)&halide_profiler_memory_free,
+    (void *)&halide_profiler_memory_planned,
     (void *)&halide_profiler_pipeline_start,
+    (void *)&halide_profiler_record_func,
+    (void *)&halide_profiler_release_thread_slot,
     (void *)&halide_profiler_report,
     (void *)&halide_profiler_reset,
+    (void *)&halide_release_arena,
     (void *)&halide_release_jit_module,
     (void *)&halide_renderscript_device_interface,
     (void *)&halide_renderscript_initialize_kernels,
     (void *)&halide_renderscript_run,
     (void *)&halide_runtime_internal_register_metadata,
     (void *)&halide_set_gpu_device,
+    (void *)&halide_set_huge_page_threshold,
     (void *)&halide_set_num_threads,
+    (void *)&halide_set_thread_affinity,
+    (void *)&halide_set_thread_pool_hot,
+    (void *)&halide_set_thread_pool_spin_count,
+    (void *)&halide_set_thread_pool_stats,
     (void *)&halide_set_trace_file,
+    (void *)&halide_set_work_stealing,
     (void *)&halide_shutdown_thread_pool,
     (void *)&halide_shutdown_trace,
     (void *)&halide_sleep_ms,
     (void *)&halide_spawn_thread,
     (void *)&halide_start_clock,
     (void *)&halide_string_to_string,
+    (void *)&halide_thread_pool_get_call_stats,
+    (void *)&halide_thread_pool_get_loop_stats,
+    (void *)&halide_thread_pool_get_worker_stats,
+    (void *)&halide_thread_pool_report,
+    (void *)&halide_thread_pool_reset_stats,
     (void *)&halide_trace,
     (void *)&halide_uint64_to_string,
+    (void *)&halide_use_arena,
     (void *)&halide_use_jit_module,
+    (void *)&halide_use_thread_pool,
 };
 }
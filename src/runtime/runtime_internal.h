@@ -98,6 +98,49 @@ WEAK void *halide_load_library(const char *name);
 // If lib is NULL, this call should be equivalent to halide_get_symbol(name).
 WEAK void *halide_get_library_symbol(void *lib, const char *name);
 
+// Block while *addr == val, or wake up to count threads blocked on
+// addr. Return the result of the futex system call: for wait, zero
+// once woken and -1 otherwise (e.g. *addr != val, or a signal), and
+// for wake, the number of threads woken. Both return -1 if futexes
+// aren't supported on this platform.
+WEAK int halide_futex_wait(volatile int *addr, int val);
+WEAK int halide_futex_wake(volatile int *addr, int count);
+
+// Called on each iteration of a spin-wait loop. Issues the CPU's
+// spin-wait hint (e.g. pause on x86), and is a compiler memory
+// barrier.
+WEAK void halide_spin_pause();
+
+// Map a file into memory, shared with any other process that maps
+// it. If the file is empty it is grown to *size bytes; otherwise *size
+// is set to its size. Returns NULL if the file can't be mapped or
+// shared files aren't supported on this platform. The lock functions
+// take an advisory lock on the file, which excludes other processes
+// but not other threads of this one.
+WEAK void *halide_map_shared_file(void *user_context, const char *path, int64_t *size, int *fd);
+WEAK void halide_unmap_shared_file(void *user_context, void *addr, int64_t size, int fd);
+WEAK void halide_lock_shared_file(int fd, bool exclusive);
+WEAK void halide_unlock_shared_file(int fd);
+
+// Map at least *size bytes of anonymous memory aligned to a huge page,
+// and ask for it to be backed by transparent huge pages. *size is set
+// to the length of the mapping. Returns NULL on failure or if huge
+// pages aren't supported on this platform.
+WEAK void *halide_map_huge_pages(void *user_context, size_t *size);
+WEAK void halide_unmap_huge_pages(void *user_context, void *addr, size_t size);
+
+// Open the performance counters the profiler attributes to Funcs, for
+// the thread with the given id. Sets fds[i] to a file descriptor, or
+// to -1 if neither the hardware counter nor its software fallback is
+// available, and names[i] to the name of the counter opened. If
+// software_only is true, only the software fallbacks are tried.
+// Returns the number of counters opened, which is zero on platforms
+// without performance counters.
+WEAK int halide_open_perf_counters(int tid, bool software_only, int *fds, const char **names);
+WEAK bool halide_read_perf_counter(int fd, uint64_t *value);
+WEAK void halide_close_perf_counter(int fd);
+WEAK int halide_current_thread_id();
+
 WEAK int halide_start_clock(void *user_context);
 WEAK int64_t halide_current_time_ns(void *user_context);
 WEAK void halide_sleep_ms(void *user_context, int ms);
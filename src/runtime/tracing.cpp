@@ -16,6 +16,267 @@ WEAK int halide_trace_file_lock = 0;
 WEAK bool halide_trace_file_initialized = false;
 WEAK bool halide_trace_file_internally_opened = false;
 
+// A spin lock that any number of threads can hold in shared mode at
+// once, or one thread can hold in exclusive mode.
+struct SharedExclusiveSpinLock {
+    volatile uint32_t state;
+
+    // The top bit is set while a thread holds or is waiting for the
+    // exclusive lock. The rest count the threads holding the shared
+    // lock.
+    static const uint32_t exclusive_bit = 0x80000000;
+
+    void acquire_shared() {
+        while (1) {
+            uint32_t x = state & ~exclusive_bit;
+            if (__sync_bool_compare_and_swap(&state, x, x + 1)) {
+                return;
+            }
+        }
+    }
+
+    void release_shared() {
+        __sync_fetch_and_sub(&state, 1);
+    }
+
+    void acquire_exclusive() {
+        // Keep new threads from taking the shared lock, then wait for
+        // the ones that have it to finish.
+        while (1) {
+            uint32_t x = state & ~exclusive_bit;
+            if (__sync_bool_compare_and_swap(&state, x, x | exclusive_bit)) {
+                break;
+            }
+        }
+        while (state != exclusive_bit) { }
+    }
+
+    void release_exclusive() {
+        __sync_fetch_and_and(&state, ~exclusive_bit);
+    }
+};
+
+// Binary trace packets are written to one of two large buffers
+// instead of straight to the trace file. Writers reserve space in the
+// current buffer with an atomic add, so they don't contend on a lock
+// or make a syscall per packet. When the current buffer fills up, the
+// writers move on to the other one, and a background thread writes
+// the full one to the file.
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+struct TraceBuffer {
+    // Held in shared mode by threads writing packets, and in exclusive
+    // mode by the thread writing the buffer to the file.
+    SharedExclusiveSpinLock lock;
+
+    // The number of bytes reserved, and the number of those reserved
+    // by packets that didn't fit.
+    uint32_t cursor, overage;
+
+    uint8_t buf[TRACE_BUFFER_SIZE];
+};
+
+WEAK TraceBuffer *trace_buffers[2] = {NULL, NULL};
+
+// The buffer packets are currently written to.
+WEAK volatile int current_trace_buffer = 0;
+
+// A full buffer waiting for the background thread, or -1.
+WEAK volatile int pending_trace_buffer = -1;
+
+// The file packets are buffered for, or zero if the buffers aren't
+// in use. Packets for other files are written directly. Writers check
+// it again while holding a buffer's lock, so once it has been cleared
+// and both buffers written out, no more packets go in the buffers.
+WEAK volatile int trace_buffer_fd = 0;
+WEAK int trace_buffer_lock = 0;
+
+// The file the background thread writes the buffers to. Unlike
+// trace_buffer_fd, it stays set until the thread has stopped.
+WEAK volatile int trace_writer_fd = 0;
+
+WEAK volatile bool trace_writer_running = false;
+WEAK volatile bool trace_writer_stop = false;
+
+// The background thread sleeps on trace_writer_work_seq until a buffer
+// is pending or it is asked to stop, and threads waiting for it to
+// finish a buffer or stop sleep on trace_writer_done_seq. Each is
+// bumped after the state it guards changes, so a waiter that reads it
+// before checking that state can't miss the wakeup. Where futexes
+// aren't available, the waiters poll instead.
+WEAK volatile int trace_writer_work_seq = 0;
+WEAK volatile int trace_writer_done_seq = 0;
+WEAK bool trace_writer_use_futex = false;
+
+WEAK void trace_writer_wait(volatile int *seq, int old) {
+    if (trace_writer_use_futex) {
+        halide_futex_wait(seq, old);
+    } else {
+        halide_sleep_ms(NULL, 1);
+    }
+}
+
+WEAK void trace_writer_signal(volatile int *seq) {
+    __sync_fetch_and_add(seq, 1);
+    if (trace_writer_use_futex) {
+        halide_futex_wake(seq, 0x7fffffff);
+    }
+}
+
+WEAK void write_trace_buffer(TraceBuffer *b, int fd) {
+    b->lock.acquire_exclusive();
+    uint32_t size = b->cursor - b->overage;
+    bool success = true;
+    if (size) {
+        success = (write(fd, b->buf, size) == (ssize_t)size);
+    }
+    b->cursor = 0;
+    b->overage = 0;
+    b->lock.release_exclusive();
+    halide_assert(NULL, success && "Can't write to trace file");
+}
+
+WEAK void trace_writer_thread(void *) {
+    while (1) {
+        int seq = trace_writer_work_seq;
+        __sync_synchronize();
+        int idx = pending_trace_buffer;
+        if (idx >= 0) {
+            write_trace_buffer(trace_buffers[idx], trace_writer_fd);
+            __sync_synchronize();
+            pending_trace_buffer = -1;
+            trace_writer_signal(&trace_writer_done_seq);
+        } else if (trace_writer_stop) {
+            break;
+        } else {
+            trace_writer_wait(&trace_writer_work_seq, seq);
+        }
+    }
+    __sync_synchronize();
+    trace_writer_running = false;
+    trace_writer_signal(&trace_writer_done_seq);
+}
+
+// Hand the buffer with the given index, which is full, to the
+// background thread, and make the other one current.
+WEAK void swap_trace_buffers(int full) {
+    while (1) {
+        int seq = trace_writer_done_seq;
+        {
+            ScopedSpinLock lock(&trace_buffer_lock);
+            if (current_trace_buffer != full) {
+                // Another thread got here first.
+                return;
+            }
+            if (!trace_buffer_fd) {
+                // The buffers have been flushed and the background
+                // thread stopped. The caller will write its packet
+                // directly.
+                return;
+            }
+            if (pending_trace_buffer < 0) {
+                pending_trace_buffer = full;
+                __sync_synchronize();
+                current_trace_buffer = 1 - full;
+                trace_writer_signal(&trace_writer_work_seq);
+                return;
+            }
+        }
+        // The background thread is still writing out the other
+        // one. Wait for it without holding the lock, so that a flush
+        // isn't held up behind us.
+        trace_writer_wait(&trace_writer_done_seq, seq);
+    }
+}
+
+// Reserve space for a packet of the given size in the current buffer,
+// and take the buffer's lock in shared mode. The lock must be
+// released with release_shared once the packet is written. Returns
+// NULL if packets for the given file are no longer buffered.
+WEAK uint8_t *acquire_trace_packet(int fd, uint32_t size, TraceBuffer **buffer) {
+    while (1) {
+        int idx = current_trace_buffer;
+        TraceBuffer *b = trace_buffers[idx];
+        b->lock.acquire_shared();
+        if (trace_buffer_fd != fd) {
+            // The buffers were flushed since we checked. Holding the
+            // lock means they can't be flushed again under us.
+            b->lock.release_shared();
+            return NULL;
+        }
+        if (idx == current_trace_buffer) {
+            uint32_t start = __sync_fetch_and_add(&b->cursor, size);
+            if (start + size <= TRACE_BUFFER_SIZE) {
+                *buffer = b;
+                return b->buf + start;
+            }
+            // Don't try to back out the reservation. It and every
+            // later one will fail, so the bytes to write are the
+            // cursor minus the overage.
+            __sync_fetch_and_add(&b->overage, size);
+        }
+        b->lock.release_shared();
+        swap_trace_buffers(idx);
+    }
+}
+
+// Write the buffered packets to the file, and stop the background
+// thread. Must be called with trace_buffer_lock held.
+WEAK void flush_trace_buffers() {
+    if (!trace_buffer_fd) return;
+    // Stop new packets going in the buffers first. Writers that
+    // already have space in one hold its lock, so writing it out
+    // below waits for them to finish.
+    trace_buffer_fd = 0;
+    __sync_synchronize();
+    trace_writer_stop = true;
+    trace_writer_signal(&trace_writer_work_seq);
+    while (1) {
+        int seq = trace_writer_done_seq;
+        __sync_synchronize();
+        if (!trace_writer_running) break;
+        trace_writer_wait(&trace_writer_done_seq, seq);
+    }
+    trace_writer_stop = false;
+    // The background thread wrote out any pending buffer before
+    // stopping, so the older packets are in the other buffer only if
+    // a writer was still finishing one there.
+    int current = current_trace_buffer;
+    write_trace_buffer(trace_buffers[1 - current], trace_writer_fd);
+    write_trace_buffer(trace_buffers[current], trace_writer_fd);
+    trace_writer_fd = 0;
+}
+
+// Start buffering the packets for the given file, if nothing else is
+// being buffered. Returns whether packets for this file should go in
+// the buffers.
+WEAK bool init_trace_buffers(int fd) {
+    ScopedSpinLock lock(&trace_buffer_lock);
+    if (trace_buffer_fd) {
+        return trace_buffer_fd == fd;
+    }
+    if (fd != halide_trace_file) {
+        // The trace file was changed or shut down since this packet's
+        // file was looked up.
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!trace_buffers[i]) {
+            trace_buffers[i] = (TraceBuffer *)malloc(sizeof(TraceBuffer));
+            if (!trace_buffers[i]) return false;
+            trace_buffers[i]->lock.state = 0;
+            trace_buffers[i]->cursor = 0;
+            trace_buffers[i]->overage = 0;
+        }
+    }
+    trace_writer_use_futex = halide_futex_wake(&trace_writer_work_seq, 0) >= 0;
+    trace_writer_fd = fd;
+    trace_buffer_fd = fd;
+    trace_writer_running = true;
+    halide_spawn_thread(NULL, trace_writer_thread, NULL);
+    return true;
+}
+
 WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
     static int32_t ids = 1;
 
@@ -38,9 +299,21 @@ WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
         size_t value_bytes = clamped_width * bytes;
         size_t int_arg_bytes = clamped_dimensions * sizeof(int32_t);
         size_t total_bytes = header_bytes + value_bytes + int_arg_bytes;
-        uint8_t buffer[4096];
         halide_assert(user_context, total_bytes <= 4096 && "Tracing packet too large");
 
+        // Build the packet in place in a trace buffer if we can, or
+        // on the stack if we're writing to a file that isn't being
+        // buffered.
+        uint8_t stack_buffer[4096];
+        uint8_t *buffer = stack_buffer;
+        TraceBuffer *trace_buffer = NULL;
+        if (trace_buffer_fd == fd || init_trace_buffers(fd)) {
+            uint8_t *packet = acquire_trace_packet(fd, total_bytes, &trace_buffer);
+            if (packet) {
+                buffer = packet;
+            }
+        }
+
         ((int32_t *)buffer)[0] = my_id;
         ((int32_t *)buffer)[1] = e->parent_id;
         buffer[8] = e->event;
@@ -71,7 +344,9 @@ WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
             buffer[header_bytes + value_bytes + i] = ((uint8_t *)(e->coordinates))[i];
         }
 
-        {
+        if (trace_buffer) {
+            trace_buffer->lock.release_shared();
+        } else {
             ScopedSpinLock lock(&halide_trace_file_lock);
             size_t written = write(fd, &buffer[0], total_bytes);
             halide_assert(user_context, written == total_bytes && "Can't write to trace file");
@@ -191,6 +466,11 @@ WEAK trace_fn halide_set_custom_trace(trace_fn t) {
 }
 
 WEAK void halide_set_trace_file(int fd) {
+    // Finish writing what was buffered for the old file. Switch files
+    // before releasing the lock, so that packets for the old one
+    // don't start being buffered again.
+    ScopedSpinLock lock(&trace_buffer_lock);
+    flush_trace_buffers();
     halide_trace_file = fd;
     halide_trace_file_initialized = true;
 }
@@ -223,6 +503,10 @@ WEAK int32_t halide_trace(void *user_context, const halide_trace_event *e) {
 }
 
 WEAK int halide_shutdown_trace() {
+    // As in halide_set_trace_file, hold the lock until the file is
+    // closed, so nothing is buffered for it in the meantime.
+    ScopedSpinLock lock(&trace_buffer_lock);
+    flush_trace_buffers();
     if (halide_trace_file_internally_opened) {
         int ret = close(halide_trace_file);
         halide_trace_file = 0;
@@ -0,0 +1,11 @@
+#include "runtime_internal.h"
+
+extern "C" {
+
+// Tell the core we're in a spin-wait loop, so it can save power and
+// avoid the memory-order mis-speculation penalty when the loop exits.
+WEAK void halide_spin_pause() {
+    __asm__ __volatile__("pause" ::: "memory");
+}
+
+}
@@ -0,0 +1,120 @@
+#include "Halide.h"
+#include <stdio.h>
+
+using namespace Halide;
+
+int heap_allocations = 0;
+
+extern "C" {
+    void *my_malloc(void *ctx, size_t sz) {
+        heap_allocations++;
+        return malloc(sz);
+    }
+
+    void my_free(void *ctx, void *ptr) {
+        free(ptr);
+    }
+}
+
+int main(int argc, char **argv) {
+    Var x, y, xi, yi;
+
+    {
+        // An intermediate that is too large for the stack, computed
+        // per tile. Its size doesn't depend on which tile we're in, so
+        // it should be allocated once instead of once per tile.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x - 1, y) + f(x + 1, y);
+
+        g.tile(x, y, xi, yi, 128, 64);
+        f.compute_at(g, x);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        heap_allocations = 0;
+        Image<int> out = g.realize(512, 512);
+        if (heap_allocations != 1) {
+            printf("There were %d heap allocations instead of 1\n", heap_allocations);
+            return -1;
+        }
+
+        for (int y = 0; y < 512; y++) {
+            for (int x = 0; x < 512; x++) {
+                int correct = 2 * (x + y);
+                if (out(x, y) != correct) {
+                    printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    {
+        // Each task of a parallel loop needs its own buffer, so these
+        // must not be hoisted out of it.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x - 1, y) + f(x + 1, y);
+
+        g.split(y, y, yi, 64).parallel(y);
+        f.compute_at(g, yi);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        heap_allocations = 0;
+        Image<int> out = g.realize(8192, 256);
+        if (heap_allocations != 4) {
+            printf("There were %d heap allocations instead of 4\n", heap_allocations);
+            return -1;
+        }
+
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 8192; x++) {
+                int correct = 2 * (x + y);
+                if (out(x, y) != correct) {
+                    printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    {
+        // A loop that runs zero times shouldn't allocate anything for
+        // its body, even once hoisted.
+        Param<int> n;
+        RDom r(0, n);
+        Func f, g;
+        f(x, y) = x + y;
+        g(x) = 0;
+        g(x) += f(x, r) + f(x + 1, r);
+
+        f.compute_at(g, r);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        for (int rows : {0, 5}) {
+            n.set(rows);
+            heap_allocations = 0;
+            Image<int> out = g.realize(1000);
+            int expected = rows > 0 ? 1 : 0;
+            if (heap_allocations != expected) {
+                printf("There were %d heap allocations instead of %d for %d rows\n",
+                       heap_allocations, expected, rows);
+                return -1;
+            }
+
+            for (int x = 0; x < 1000; x++) {
+                int correct = 0;
+                for (int y = 0; y < rows; y++) {
+                    correct += 2 * (x + y) + 1;
+                }
+                if (out(x) != correct) {
+                    printf("out(%d) = %d instead of %d\n", x, out(x), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace Halide;
+
+#ifndef _WIN32
+const char *cache_dir = "jit_cache_test_dir";
+
+// Count the entries in the cache directory, optionally removing them.
+// Also sum their inode numbers, which change whenever an entry is
+// written, because entries are renamed into place.
+int cache_entries(bool remove, ino_t *inodes = NULL) {
+    int entries = 0;
+    if (inodes) *inodes = 0;
+    DIR *dir = opendir(cache_dir);
+    if (!dir) return 0;
+    while (dirent *e = readdir(dir)) {
+        if (strncmp(e->d_name, "halide_jit_", 11) == 0) {
+            std::string path = std::string(cache_dir) + "/" + e->d_name;
+            struct stat st;
+            if (inodes && stat(path.c_str(), &st) == 0) {
+                *inodes += st.st_ino;
+            }
+            if (remove) {
+                unlink(path.c_str());
+            }
+            entries++;
+        }
+    }
+    closedir(dir);
+    return entries;
+}
+
+// In a new process, JIT-compile a pipeline that reads from an Image
+// filled with the given values, and check its output. If warm_up is
+// true, first compile another pipeline that uses some of the same
+// names without the cache, so that the names lowering makes for the
+// first pipeline differ from the ones it gets in a fresh process.
+bool check_in_new_process(int offset, bool warm_up) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (warm_up) {
+            unsetenv("HL_JIT_CACHE_DIR");
+            Func f("f"), h;
+            Var x("x"), y;
+            h(x, y) = x + y;
+            f(x, y) = h(x, y) * h(x, y) + h(x, y);
+            h.compute_root();
+            f.realize(10, 10);
+            setenv("HL_JIT_CACHE_DIR", cache_dir, 1);
+        }
+        Image<int> input(10, "input");
+        for (int i = 0; i < 10; i++) {
+            input(i) = i + offset;
+        }
+        Func f("f"), g("g");
+        Var x("x");
+        f(x) = x * x;
+        g(x) = f(x) + input(x % 10);
+        f.compute_root();
+        Image<int> result = g.realize(100);
+        for (int x = 0; x < 100; x++) {
+            int correct = x * x + x % 10 + offset;
+            if (result(x) != correct) {
+                printf("result(%d) = %d instead of %d\n", x, result(x), correct);
+                fflush(stdout);
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool check(Func g) {
+    Image<int> result = g.realize(100);
+    for (int x = 0; x < 100; x++) {
+        if (result(x) != x * x + 3) {
+            printf("result(%d) = %d instead of %d\n", x, result(x), x * x + 3);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    printf("Skipping test on Windows\n");
+#else
+    mkdir(cache_dir, 0755);
+    cache_entries(true);
+    setenv("HL_JIT_CACHE_DIR", cache_dir, 1);
+
+    // Compiling the same pipeline in a second process should load it
+    // from the cache, so the entry isn't written again.
+    if (!check_in_new_process(0, false)) return -1;
+    ino_t inodes, new_inodes;
+    int entries = cache_entries(false, &inodes);
+    if (!check_in_new_process(0, false)) return -1;
+    int new_entries = cache_entries(false, &new_inodes);
+    if (entries != 1 || new_entries != 1 || new_inodes != inodes) {
+        printf("Expected an identical pipeline to hit the one JIT cache entry, found %d entries\n",
+               new_entries);
+        return -1;
+    }
+
+    // It should also hit when it isn't the first pipeline compiled in
+    // the process.
+    if (!check_in_new_process(0, true)) return -1;
+    new_entries = cache_entries(false, &new_inodes);
+    if (new_entries != 1 || new_inodes != inodes) {
+        printf("Expected a pipeline compiled after another one to hit the one JIT cache entry, found %d entries\n",
+               new_entries);
+        return -1;
+    }
+
+    // Images are passed to JIT-compiled pipelines when they run rather
+    // than compiled in, so changing one should still hit the cache,
+    // and the result should use the new contents.
+    if (!check_in_new_process(100, false)) return -1;
+    new_entries = cache_entries(false, &new_inodes);
+    if (new_entries != 1 || new_inodes != inodes) {
+        printf("Expected a changed Image to hit the one JIT cache entry, found %d entries\n",
+               new_entries);
+        return -1;
+    }
+    cache_entries(true);
+
+    Func f("f"), g("g");
+    Var x("x");
+    f(x) = x * x;
+    g(x) = f(x) + 3;
+    f.compute_root();
+
+    // The first compilation should store the object code in the
+    // cache.
+    if (!check(g)) return -1;
+    entries = cache_entries(false);
+    if (entries != 1) {
+        printf("Expected one JIT cache entry, found %d\n", entries);
+        return -1;
+    }
+
+    // A different schedule lowers to a different Stmt, so it should
+    // get its own entry.
+    g.vectorize(x, 4);
+    if (!check(g)) return -1;
+    entries = cache_entries(false);
+    if (entries != 2) {
+        printf("Expected two JIT cache entries, found %d\n", entries);
+        return -1;
+    }
+
+    unsetenv("HL_JIT_CACHE_DIR");
+    cache_entries(true);
+    rmdir(cache_dir);
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
@@ -42,6 +42,22 @@ extern "C" DLLEXPORT int count_calls_with_arg(uint8_t val, buffer_t *out) {
     return 0;
 }
 
+int call_count_with_coords = 0;
+
+extern "C" DLLEXPORT int count_calls_with_coords(int32_t val, buffer_t *out) {
+    if (out->host) {
+        call_count_with_coords++;
+        int32_t *host = (int32_t *)out->host;
+        for (int32_t i = 0; i < out->extent[0]; i++) {
+            for (int32_t j = 0; j < out->extent[1]; j++) {
+                host[i * out->stride[0] + j * out->stride[1]] =
+                    val + (out->min[0] + i) + 100 * (out->min[1] + j);
+            }
+        }
+    }
+    return 0;
+}
+
 int call_count_with_arg_parallel[8];
 
 extern "C" DLLEXPORT int count_calls_with_arg_parallel(uint8_t val, buffer_t *out) {
@@ -96,7 +112,31 @@ void record_error(void *user_context, const char *msg) {
     error_occured = true;
 }
 
+#ifdef __linux__
+// Two builds of a pipeline with the same names but different
+// definitions, for testing the memoization cache file.
+Image<int> realize_redeployed(int version) {
+    Param<int> val("memoize_redeploy_val");
+    Func f("memoize_redeploy_f"), g("memoize_redeploy_g");
+    Var x("x"), y("y");
+    f(x, y) = x * y + val * version;
+    f.compute_root().memoize();
+    g(x, y) = f(x, y) + 1;
+    val.set(3);
+    return g.realize(32, 32);
+}
+#endif
+
 int main(int argc, char **argv) {
+#ifdef __linux__
+    if (argc > 2 && std::string(argv[1]) == "memoize_redeploy_old") {
+        // Run the old build, storing its results in the given file.
+        int result = Internal::JITSharedRuntime::memoization_cache_set_file(argv[2], 16 << 20);
+        assert(result == 0);
+        realize_redeployed(1);
+        return 0;
+    }
+#endif
 
     {
         call_count = 0;
@@ -632,6 +672,135 @@ int main(int argc, char **argv) {
 
     }
 
+    {
+        // Test lookups of regions contained in a cached realization.
+        // The extern writes a different value at each coordinate, so
+        // the region must be found at the right place in the cached
+        // buffer.
+        Param<int> val;
+        Param<int> x_offset, y_offset;
+
+        Func count_calls;
+        count_calls.define_extern("count_calls_with_coords", {val}, Int(32), 2);
+        count_calls.compute_root().memoize();
+
+        Func f;
+        Var x, y;
+        f(x, y) = count_calls(x + x_offset, y + y_offset) + x;
+
+        val.set(23);
+        x_offset.set(0);
+        y_offset.set(0);
+        Image<int32_t> whole = f.realize(32, 32);
+
+        // A crop of the rows can point into the cached buffer, and a
+        // crop in both dimensions gets a copy.
+        int offsets[][2] = {{0, 8}, {8, 8}};
+        for (auto offset : offsets) {
+            x_offset.set(offset[0]);
+            y_offset.set(offset[1]);
+            Image<int32_t> out = f.realize(32 - offset[0] * 2, 16);
+            for (int32_t i = 0; i < out.width(); i++) {
+                for (int32_t j = 0; j < out.height(); j++) {
+                    assert(out(i, j) == 23 + (i + offset[0]) + 100 * (j + offset[1]) + i);
+                }
+            }
+        }
+        assert(call_count_with_coords == 1);
+    }
+
+    {
+        // Test the cache's statistics
+        Param<int> val;
+
+        Func f("memoize_stats_f"), g("memoize_stats_g");
+        Var x, y;
+        f(x, y) = x + y + val;
+        f.compute_root().memoize();
+        g(x, y) = f(x, y) * 2;
+
+        // Two misses, then a hit.
+        for (int i = 0; i < 3; i++) {
+            val.set(i % 2);
+            Image<int> out = g.realize(16, 16);
+            assert(out(3, 4) == (7 + i % 2) * 2);
+        }
+
+        bool found = false;
+        for (const halide_memoization_cache_func_stats &s : Internal::JITSharedRuntime::memoization_cache_stats()) {
+            if (s.func_name && std::string(s.func_name) == "memoize_stats_f") {
+                found = true;
+                assert(std::string(s.pipeline_name) == "memoize_stats_g");
+                assert(s.hits == 1 && s.misses == 2 && s.evictions == 0);
+                assert(s.entries == 2 && s.bytes == 2 * 16 * 16 * sizeof(int));
+            }
+        }
+        assert(found);
+        Internal::JITSharedRuntime::memoization_cache_report();
+    }
+
+#ifdef __linux__
+    {
+        // Test the memoization cache file
+        const char *path = "memoize_cache_file.bin";
+        remove(path);
+        int result = Internal::JITSharedRuntime::memoization_cache_set_file(path, 16 << 20);
+        assert(result == 0);
+
+        Param<int> val;
+        Func f("memoize_file_f"), g("memoize_file_g");
+        Var x, y;
+        f(x, y) = x * y + val;
+        f.compute_root().memoize();
+        g(x, y) = f(x, y) + 1;
+        val.set(3);
+
+        // Compute the result, then drop it from memory. The next
+        // realization should find it in the file.
+        Image<int> out1 = g.realize(32, 32);
+        Internal::JITSharedRuntime::memoization_cache_set_size(1);
+        Internal::JITSharedRuntime::memoization_cache_set_size(0);
+        Image<int> out2 = g.realize(32, 32);
+        for (int i = 0; i < 32; i++) {
+            for (int j = 0; j < 32; j++) {
+                assert(out2(i, j) == i * j + 4);
+            }
+        }
+
+        for (const halide_memoization_cache_func_stats &s : Internal::JITSharedRuntime::memoization_cache_stats()) {
+            if (s.func_name && std::string(s.func_name) == "memoize_file_f") {
+                assert(s.hits == 1 && s.misses == 1);
+            }
+        }
+
+        // Run an old build of a pipeline in another process, then a
+        // new build with the same names but a different definition in
+        // this one. The new build must compute its own results rather
+        // than find the old build's in the file.
+        std::string old_build = std::string(argv[0]) + " memoize_redeploy_old " + path;
+        int status = system(old_build.c_str());
+        assert(status == 0);
+        Image<int> out3 = realize_redeployed(2);
+        for (int i = 0; i < 32; i++) {
+            for (int j = 0; j < 32; j++) {
+                assert(out3(i, j) == i * j + 7);
+            }
+        }
+
+        bool found = false;
+        for (const halide_memoization_cache_func_stats &s : Internal::JITSharedRuntime::memoization_cache_stats()) {
+            if (s.func_name && std::string(s.func_name) == "memoize_redeploy_f") {
+                found = true;
+                assert(s.hits == 0 && s.misses == 1);
+            }
+        }
+        assert(found);
+
+        Internal::JITSharedRuntime::memoization_cache_set_file("");
+        remove(path);
+    }
+#endif
+
     fprintf(stderr, "Success!\n");
     return 0;
 }
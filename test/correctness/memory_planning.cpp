@@ -0,0 +1,104 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace Halide;
+
+int heap_allocations = 0;
+
+extern "C" {
+    void *my_malloc(void *ctx, size_t sz) {
+        heap_allocations++;
+        return malloc(sz);
+    }
+
+    void my_free(void *ctx, void *ptr) {
+        free(ptr);
+    }
+}
+
+// Parse the profiler report for the planned peak of the pipeline and
+// the number of allocations made by each Func.
+unsigned long long planned_peak = 0;
+int funcs_with_one_alloc = 0;
+void my_print(void *, const char *msg) {
+    const char *p = strstr(msg, "planned peak heap usage:");
+    if (p) {
+        sscanf(p, "planned peak heap usage: %llu", &planned_peak);
+    }
+    p = strstr(msg, "allocs:");
+    if (p) {
+        int allocs = 0;
+        sscanf(p, "allocs: %d", &allocs);
+        if (allocs == 1) {
+            funcs_with_one_alloc++;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // A long chain of compute_root stages. Each intermediate is dead
+    // once the next one has been computed, so two buffers should be
+    // enough for all of them.
+    Var x, y;
+    const int stages = 8;
+    Func f[stages];
+    f[0](x, y) = x + y;
+    for (int i = 1; i < stages; i++) {
+        f[i](x, y) = f[i - 1](x, y) * 2 + (i % 2 == 0 ? cast<int>(1) : cast<int>(0));
+        f[i - 1].compute_root();
+    }
+
+    f[stages - 1].set_custom_allocator(&my_malloc, &my_free);
+
+    // Memory planning is off by default, so every intermediate gets
+    // its own allocation.
+    Target t = get_jit_target_from_environment();
+    f[stages - 1].realize(256, 256, t);
+    if (heap_allocations != stages - 1) {
+        printf("There were %d heap allocations instead of %d without memory planning\n",
+               heap_allocations, stages - 1);
+        return -1;
+    }
+
+    heap_allocations = 0;
+    t = t.with_feature(Target::PlanMemory);
+    Image<int> out = f[stages - 1].realize(256, 256, t);
+    if (heap_allocations > 2) {
+        printf("There were %d heap allocations instead of 2\n", heap_allocations);
+        return -1;
+    }
+
+    for (int y = 0; y < 256; y++) {
+        for (int x = 0; x < 256; x++) {
+            int correct = x + y;
+            for (int i = 1; i < stages; i++) {
+                correct = correct * 2 + (i % 2 == 0 ? 1 : 0);
+            }
+            if (out(x, y) != correct) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    // With profiling on, the planned peak is reported, and the
+    // allocations that share storage are still counted for their
+    // own Funcs.
+    f[stages - 1].set_custom_print(&my_print);
+    f[stages - 1].realize(256, 256, t.with_feature(Target::Profile));
+    unsigned long long buffer_size = 256 * 256 * sizeof(int);
+    if (planned_peak < buffer_size || planned_peak > 2 * buffer_size) {
+        printf("Planned peak heap usage was %llu bytes, expected between %llu and %llu\n",
+               planned_peak, buffer_size, 2 * buffer_size);
+        return -1;
+    }
+    if (funcs_with_one_alloc != stages - 1) {
+        printf("%d Funcs reported one heap allocation instead of %d\n",
+               funcs_with_one_alloc, stages - 1);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "Halide.h"
+#include <stdio.h>
+
+using namespace Halide;
+
+int heap_allocations = 0;
+
+extern "C" {
+    void *my_malloc(void *ctx, size_t sz) {
+        heap_allocations++;
+        return malloc(sz);
+    }
+
+    void my_free(void *ctx, void *ptr) {
+        free(ptr);
+    }
+}
+
+int main(int argc, char **argv) {
+    Var x, y, xi, yi;
+
+    {
+        // A 64KB intermediate per tile would ordinarily go on the
+        // heap. Force it onto the stack.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x - 1, y) + f(x + 1, y);
+
+        g.tile(x, y, xi, yi, 128, 128);
+        f.compute_at(g, x).store_in(MemoryType::Stack);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        heap_allocations = 0;
+        Image<int> out = g.realize(256, 256);
+        if (heap_allocations != 0) {
+            printf("There were %d heap allocations for a Func stored on the stack\n",
+                   heap_allocations);
+            return -1;
+        }
+
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                int correct = 2 * (x + y);
+                if (out(x, y) != correct) {
+                    printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    {
+        // A tiny intermediate would ordinarily go on the stack. Force
+        // it onto the heap.
+        Func f, g;
+        f(x, y) = x + y;
+        g(x, y) = f(x - 1, y) + f(x + 1, y);
+
+        g.tile(x, y, xi, yi, 4, 4);
+        f.compute_at(g, x).store_in(MemoryType::Heap);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        heap_allocations = 0;
+        g.realize(16, 16);
+        // The allocation is hoisted out of the serial loops over tiles.
+        if (heap_allocations != 1) {
+            printf("There were %d heap allocations instead of 1 for a Func stored on the heap\n",
+                   heap_allocations);
+            return -1;
+        }
+    }
+
+    {
+        // A small intermediate only accessed in unrolled and
+        // vectorized loops can live in registers.
+        Func f, g;
+        f(x, y) = x * y;
+        g(x, y) = f(x, y) + f(x + 1, y);
+
+        g.tile(x, y, xi, yi, 8, 2).vectorize(xi).unroll(yi);
+        f.compute_at(g, x).vectorize(x).unroll(y).store_in(MemoryType::Register);
+
+        g.set_custom_allocator(&my_malloc, &my_free);
+        heap_allocations = 0;
+        Image<int> out = g.realize(64, 64);
+        if (heap_allocations != 0) {
+            printf("There were %d heap allocations for a Func stored in registers\n",
+                   heap_allocations);
+            return -1;
+        }
+
+        for (int y = 0; y < 64; y++) {
+            for (int x = 0; x < 64; x++) {
+                int correct = x * y + (x + 1) * y;
+                if (out(x, y) != correct) {
+                    printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
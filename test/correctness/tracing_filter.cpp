@@ -0,0 +1,67 @@
+#include "Halide.h"
+#include <stdio.h>
+
+using namespace Halide;
+
+int loads = 0, stores = 0, bad_loads = 0;
+
+int my_trace(void *user_context, const halide_trace_event *e) {
+    if (e->event == halide_trace_load && std::string(e->func) == "f") {
+        for (int i = 0; i < e->vector_width; i++) {
+            int x = e->coordinates[i], y = e->coordinates[e->vector_width + i];
+            if (x < 10 || x >= 30 || y < 5 || y >= 15) {
+                bad_loads++;
+            }
+            loads++;
+        }
+    } else if (e->event == halide_trace_store && std::string(e->func) == "g") {
+        stores += e->vector_width;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Func f("f"), g("g");
+    Var x, y;
+
+    f(x, y) = x + y;
+    g(x, y) = f(x, y) * 2;
+    f.compute_root();
+
+    // Only trace loads from f inside a 20x10 box.
+    f.trace_loads({{10, 20}, {5, 10}});
+
+    // Only trace a sample of one in 16 of the stores to g.
+    g.trace_stores(16);
+
+    g.set_custom_trace(&my_trace);
+    g.realize(100, 100);
+
+    if (bad_loads) {
+        printf("%d loads outside the region were traced\n", bad_loads);
+        return -1;
+    }
+
+    if (loads != 20 * 10) {
+        printf("Traced %d loads from f instead of %d\n", loads, 20 * 10);
+        return -1;
+    }
+
+    // The sample is pseudo-random, so allow some slack around 10000 / 16.
+    if (stores < 10000 / 32 || stores > 10000 / 8) {
+        printf("Traced %d of the 10000 stores to g, instead of about %d\n", stores, 10000 / 16);
+        return -1;
+    }
+
+    // The same stores should be traced every time.
+    int first_stores = stores;
+    stores = 0;
+    g.realize(100, 100);
+    if (stores != first_stores) {
+        printf("Traced %d stores the second time, and %d the first\n", stores, first_stores);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
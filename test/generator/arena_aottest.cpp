@@ -0,0 +1,166 @@
+#include <stdio.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "arena.h"
+
+using namespace Halide::Tools;
+
+// Count the blocks that reach the underlying allocator.
+halide_malloc_t default_malloc = NULL;
+halide_free_t default_free = NULL;
+int mallocs = 0, frees = 0;
+
+void *counting_malloc(void *user_context, size_t x) {
+    mallocs++;
+    return default_malloc(user_context, x);
+}
+
+void counting_free(void *user_context, void *ptr) {
+    frees++;
+    default_free(user_context, ptr);
+}
+
+bool check_output(void *user_context, Image<int> &out) {
+    int result = arena(user_context, out);
+    if (result != 0) {
+        printf("arena returned %d\n", result);
+        return false;
+    }
+    for (int y = 0; y < out.height(); y++) {
+        for (int x = 0; x < out.width(); x++) {
+            if (out(x, y) != 2 * (x + y) + 1) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), 2 * (x + y) + 1);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    default_malloc = halide_set_custom_malloc(counting_malloc);
+    default_free = halide_set_custom_free(counting_free);
+
+    Image<int> out(100, 100);
+    int ctx = 0, other_ctx = 0;
+
+    halide_arena *a = halide_create_arena();
+    if (!a || halide_use_arena(&ctx, a) != 0) {
+        printf("Failed to make an arena\n");
+        return -1;
+    }
+
+    // The first call allocates, later calls reuse its blocks.
+    if (!check_output(&ctx, out)) {
+        return -1;
+    }
+    if (mallocs == 0 || frees != 0) {
+        printf("First call with an arena: %d mallocs and %d frees\n", mallocs, frees);
+        return -1;
+    }
+    int first_mallocs = mallocs;
+    for (int i = 0; i < 3; i++) {
+        if (!check_output(&ctx, out)) {
+            return -1;
+        }
+    }
+    if (mallocs != first_mallocs || frees != 0) {
+        printf("Later calls with an arena: %d mallocs and %d frees\n",
+               mallocs - first_mallocs, frees);
+        return -1;
+    }
+
+    // A user_context that isn't bound doesn't use the arena.
+    mallocs = frees = 0;
+    if (!check_output(&other_ctx, out)) {
+        return -1;
+    }
+    if (mallocs == 0 || mallocs != frees) {
+        printf("Call without an arena: %d mallocs and %d frees\n", mallocs, frees);
+        return -1;
+    }
+
+    // A freed block is reused for requests it holds without wasting
+    // more than half of it.
+    mallocs = frees = 0;
+    void *p = halide_malloc(&ctx, 1 << 20);
+    halide_free(&ctx, p);
+    void *q = halide_malloc(&ctx, 3 << 18);
+    if (q != p) {
+        printf("A freed block of the arena wasn't reused\n");
+        return -1;
+    }
+    void *small = halide_malloc(&ctx, 1 << 10);
+    if (small == p) {
+        printf("A small request reused a large block\n");
+        return -1;
+    }
+    halide_free(&ctx, q);
+    halide_free(&ctx, small);
+    if (frees != 0) {
+        printf("The arena freed %d blocks\n", frees);
+        return -1;
+    }
+
+    // Releasing the arena frees the blocks it keeps, so the next call
+    // allocates again.
+    int blocks = mallocs + first_mallocs;
+    halide_release_arena(&ctx, a);
+    if (frees != blocks) {
+        printf("Releasing the arena freed %d blocks instead of %d\n", frees, blocks);
+        return -1;
+    }
+    mallocs = frees = 0;
+    if (!check_output(&ctx, out)) {
+        return -1;
+    }
+    if (mallocs != first_mallocs || frees != 0) {
+        printf("Call after release: %d mallocs and %d frees\n", mallocs, frees);
+        return -1;
+    }
+
+    // Destroying the arena frees the blocks it keeps. A block still in
+    // use is freed as usual later, and the user_context goes back to
+    // the default allocator.
+    mallocs = frees = 0;
+    void *in_use = halide_malloc(&ctx, 1 << 16);
+    halide_destroy_arena(&ctx, a);
+    if (frees != first_mallocs) {
+        printf("Destroying the arena freed %d blocks instead of %d\n", frees, first_mallocs);
+        return -1;
+    }
+    halide_free(&ctx, in_use);
+    if (frees != first_mallocs + 1) {
+        printf("A block in use when the arena was destroyed wasn't freed\n");
+        return -1;
+    }
+    mallocs = frees = 0;
+    if (!check_output(&ctx, out)) {
+        return -1;
+    }
+    if (mallocs == 0 || mallocs != frees) {
+        printf("Call after destroying the arena: %d mallocs and %d frees\n", mallocs, frees);
+        return -1;
+    }
+
+    // A user_context can be bound to a new arena, and unbound.
+    halide_arena *b = halide_create_arena();
+    if (halide_use_arena(&ctx, b) != 0 || !check_output(&ctx, out) ||
+        halide_use_arena(&ctx, NULL) != 0) {
+        printf("Failed to rebind the user_context\n");
+        return -1;
+    }
+    mallocs = frees = 0;
+    halide_destroy_arena(&ctx, b);
+    if (frees != first_mallocs) {
+        printf("Destroying the second arena freed %d blocks instead of %d\n", frees, first_mallocs);
+        return -1;
+    }
+
+    halide_set_custom_malloc(default_malloc);
+    halide_set_custom_free(default_free);
+
+    printf("Success!\n");
+    return 0;
+}
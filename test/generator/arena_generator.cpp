@@ -0,0 +1,25 @@
+#include "Halide.h"
+
+namespace {
+
+// A pipeline with an intermediate buffer on the heap.
+class Arena : public Halide::Generator<Arena> {
+public:
+    Func build() {
+        Var x, y;
+
+        Func f;
+        f(x, y) = x + y;
+
+        Func g;
+        g(x, y) = f(x, y) + f(x + 1, y);
+
+        f.compute_root();
+
+        return g;
+    }
+};
+
+Halide::RegisterGenerator<Arena> register_my_gen{"arena"};
+
+}  // namespace
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "huge_pages.h"
+
+using namespace Halide::Tools;
+
+// Blocks mapped for huge pages start 128 bytes into a 2MB-aligned
+// mapping.
+bool is_huge_page_block(void *ptr) {
+    const uintptr_t huge_page_size = 2 << 20;
+    return (((uintptr_t)ptr - 128) & (huge_page_size - 1)) == 0;
+}
+
+// Record the largest block the pipeline allocates.
+halide_malloc_t default_malloc = NULL;
+void *largest_block = NULL;
+size_t largest_size = 0;
+
+void *recording_malloc(void *user_context, size_t x) {
+    void *ptr = default_malloc(user_context, x);
+    if (x > largest_size) {
+        largest_block = ptr;
+        largest_size = x;
+    }
+    return ptr;
+}
+
+bool check_output(Image<int> &out) {
+    largest_block = NULL;
+    largest_size = 0;
+    int result = huge_pages(out);
+    if (result != 0) {
+        printf("huge_pages returned %d\n", result);
+        return false;
+    }
+    for (int y = 0; y < out.height(); y++) {
+        for (int x = 0; x < out.width(); x++) {
+            if (out(x, y) != 2 * (x + y) + 1) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), 2 * (x + y) + 1);
+                return false;
+            }
+        }
+    }
+    return largest_size > 0;
+}
+
+int main(int argc, char **argv) {
+    default_malloc = halide_set_custom_malloc(recording_malloc);
+
+    // The intermediate takes about 4MB.
+    Image<int> out(1024, 1024);
+
+    // With no threshold, nothing is mapped for huge pages.
+    halide_set_huge_page_threshold(0);
+    if (!check_output(out)) {
+        return -1;
+    }
+    if (is_huge_page_block(largest_block)) {
+        printf("Mapped a block for huge pages with no threshold\n");
+        return -1;
+    }
+
+    // Above the threshold, blocks are mapped directly on Linux and
+    // Android, and come from the usual allocator elsewhere.
+    halide_set_huge_page_threshold(1 << 20);
+    if (!check_output(out)) {
+        return -1;
+    }
+#ifdef __linux__
+    if (!is_huge_page_block(largest_block)) {
+        printf("Didn't map a block of %d bytes for huge pages\n", (int)largest_size);
+        return -1;
+    }
+#endif
+
+    // Blocks either side of the threshold are usable and can be freed.
+    size_t sizes[] = {1000, (1 << 20) - 1, 1 << 20, (3 << 20) + 5};
+    for (size_t size : sizes) {
+        uint8_t *ptr = (uint8_t *)halide_malloc(NULL, size);
+        if (ptr == NULL) {
+            printf("halide_malloc(%d) failed\n", (int)size);
+            return -1;
+        }
+#ifdef __linux__
+        if (is_huge_page_block(ptr) != (size >= (1 << 20))) {
+            printf("halide_malloc(%d) used the wrong allocator\n", (int)size);
+            return -1;
+        }
+#endif
+        memset(ptr, 1, size);
+        halide_free(NULL, ptr);
+    }
+
+    halide_set_huge_page_threshold(0);
+    halide_set_custom_malloc(default_malloc);
+
+    printf("Success!\n");
+    return 0;
+}
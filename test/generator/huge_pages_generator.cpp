@@ -0,0 +1,25 @@
+#include "Halide.h"
+
+namespace {
+
+// A pipeline with a large intermediate buffer on the heap.
+class HugePages : public Halide::Generator<HugePages> {
+public:
+    Func build() {
+        Var x, y;
+
+        Func f;
+        f(x, y) = x + y;
+
+        Func g;
+        g(x, y) = f(x, y) + f(x + 1, y);
+
+        f.compute_root();
+
+        return g;
+    }
+};
+
+Halide::RegisterGenerator<HugePages> register_my_gen{"huge_pages"};
+
+}  // namespace
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <set>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "thread_pool.h"
+
+using namespace Halide::Tools;
+
+const int max_tasks = 20000;
+std::atomic<int> runs[max_tasks];
+
+int count_task(void *user_context, int idx, uint8_t *closure) {
+    runs[idx]++;
+    return 0;
+}
+
+// Run a parallel loop directly, and check that every index ran
+// exactly once.
+bool check_indices(int min, int size) {
+    for (int i = 0; i < max_tasks; i++) {
+        runs[i] = 0;
+    }
+    int result = halide_do_par_for(NULL, count_task, min, size, NULL);
+    if (result != 0) {
+        printf("halide_do_par_for(%d, %d) returned %d\n", min, size, result);
+        return false;
+    }
+    for (int i = 0; i < max_tasks; i++) {
+        int expected = (i >= min && i < min + size) ? 1 : 0;
+        if (runs[i] != expected) {
+            printf("halide_do_par_for(%d, %d) ran index %d %d times\n",
+                   min, size, i, (int)runs[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int failing_task(void *user_context, int idx, uint8_t *closure) {
+    return idx == 777 ? 42 : 0;
+}
+
+// Count calls to each task function made by the pipeline.
+std::mutex tasks_mutex;
+std::map<halide_task_t, int> tasks_run;
+int counting_do_task(void *user_context, halide_task_t f, int idx, uint8_t *closure) {
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        tasks_run[f]++;
+    }
+    return f(user_context, idx, closure);
+}
+
+#ifdef __linux__
+// Record the cores each thread that runs a task may run on.
+pthread_t main_thread;
+std::mutex cpus_mutex;
+std::map<pthread_t, std::set<int>> worker_cpus;
+int record_cpus_task(void *user_context, int idx, uint8_t *closure) {
+    runs[idx]++;
+    if (pthread_equal(pthread_self(), main_thread)) {
+        return 0;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(cpus_mutex);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &mask)) {
+            worker_cpus[pthread_self()].insert(cpu);
+        }
+    }
+    return 0;
+}
+
+// With thread affinity on, every worker thread is pinned to one of
+// the cores we were allowed to run on, and no two workers share a
+// core unless there are more workers than cores.
+bool check_affinity() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return true;
+    }
+    int num_allowed = CPU_COUNT(&allowed);
+
+    main_thread = pthread_self();
+    halide_set_thread_affinity(true);
+    halide_set_num_threads(4);
+    for (int i = 0; i < max_tasks; i++) {
+        runs[i] = 0;
+    }
+    for (int iter = 0; iter < 20; iter++) {
+        int result = halide_do_par_for(NULL, record_cpus_task, 0, 1000, NULL);
+        if (result != 0) {
+            printf("halide_do_par_for with affinity returned %d\n", result);
+            return false;
+        }
+    }
+    for (int i = 0; i < max_tasks; i++) {
+        int expected = i < 1000 ? 20 : 0;
+        if (runs[i] != expected) {
+            printf("Index %d ran %d times with affinity\n", i, (int)runs[i]);
+            return false;
+        }
+    }
+
+    std::set<int> used;
+    for (auto w : worker_cpus) {
+        if (w.second.size() != 1) {
+            printf("A worker thread may run on %d cores\n", (int)w.second.size());
+            return false;
+        }
+        int cpu = *w.second.begin();
+        if (!CPU_ISSET(cpu, &allowed)) {
+            printf("A worker thread was pinned to core %d, which isn't allowed\n", cpu);
+            return false;
+        }
+        used.insert(cpu);
+    }
+    if ((int)worker_cpus.size() <= num_allowed && used.size() != worker_cpus.size()) {
+        printf("%d worker threads share %d cores\n", (int)worker_cpus.size(), (int)used.size());
+        return false;
+    }
+
+    halide_set_thread_affinity(false);
+    return true;
+}
+#endif
+
+bool check_output(void *user_context, Image<int> &out) {
+    int result = thread_pool(user_context, out);
+    if (result != 0) {
+        printf("thread_pool returned %d\n", result);
+        return false;
+    }
+    for (int y = 0; y < out.height(); y++) {
+        for (int x = 0; x < out.width(); x++) {
+            if (out(x, y) != (x + y) * 2) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), (x + y) * 2);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Record which threads run an outer parallel loop and the loops nested
+// inside it.
+struct pool_threads {
+    std::mutex mutex;
+    std::set<pthread_t> outer, nested;
+};
+
+int nested_task(void *user_context, int idx, uint8_t *closure) {
+    pool_threads *t = (pool_threads *)closure;
+    std::lock_guard<std::mutex> lock(t->mutex);
+    t->nested.insert(pthread_self());
+    return 0;
+}
+
+int outer_task(void *user_context, int idx, uint8_t *closure) {
+    pool_threads *t = (pool_threads *)closure;
+    {
+        std::lock_guard<std::mutex> lock(t->mutex);
+        t->outer.insert(pthread_self());
+    }
+    return halide_do_par_for(user_context, nested_task, 0, 100, closure);
+}
+
+bool run_in_pool(void *user_context, pool_threads *t) {
+    for (int iter = 0; iter < 20; iter++) {
+        int result = halide_do_par_for(user_context, outer_task, 0, 100, (uint8_t *)t);
+        if (result != 0) {
+            printf("halide_do_par_for in a pool returned %d\n", result);
+            return false;
+        }
+    }
+    t->outer.erase(pthread_self());
+    t->nested.erase(pthread_self());
+    return true;
+}
+
+bool disjoint(const std::set<pthread_t> &a, const std::set<pthread_t> &b) {
+    for (pthread_t t : a) {
+        if (b.count(t)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loops called with a user_context bound to a pool run on that pool's
+// threads only, as do the loops nested inside them.
+bool check_pools() {
+    halide_set_num_threads(4);
+    int ctx_a = 0, ctx_b = 0;
+    halide_thread_pool *pool_a = halide_create_thread_pool("a", 3, 0);
+    halide_thread_pool *pool_b = halide_create_thread_pool("b", 2, 0);
+    if (!pool_a || !pool_b) {
+        printf("halide_create_thread_pool failed\n");
+        return false;
+    }
+    if (halide_find_thread_pool("a") != pool_a ||
+        halide_find_thread_pool("b") != pool_b ||
+        halide_find_thread_pool("c") != NULL) {
+        printf("halide_find_thread_pool returned the wrong pool\n");
+        return false;
+    }
+    if (halide_use_thread_pool(&ctx_a, pool_a) != 0 ||
+        halide_use_thread_pool(&ctx_b, pool_b) != 0) {
+        printf("halide_use_thread_pool failed\n");
+        return false;
+    }
+
+    pool_threads default_threads, a_threads, b_threads;
+    if (!run_in_pool(NULL, &default_threads) ||
+        !run_in_pool(&ctx_a, &a_threads) ||
+        !run_in_pool(&ctx_b, &b_threads)) {
+        return false;
+    }
+
+    // Each pool's threads count the caller, which we've removed.
+    if (a_threads.outer.size() > 2 || b_threads.outer.size() > 1) {
+        printf("Pools ran loops on %d and %d threads\n",
+               (int)a_threads.outer.size(), (int)b_threads.outer.size());
+        return false;
+    }
+    for (pool_threads *t : {&default_threads, &a_threads, &b_threads}) {
+        for (pthread_t thread : t->nested) {
+            if (!t->outer.count(thread)) {
+                printf("A nested loop ran on a thread from another pool\n");
+                return false;
+            }
+        }
+    }
+    if (!disjoint(default_threads.outer, a_threads.outer) ||
+        !disjoint(default_threads.outer, b_threads.outer) ||
+        !disjoint(a_threads.outer, b_threads.outer)) {
+        printf("Two pools share a thread\n");
+        return false;
+    }
+
+    // A pipeline called with a bound user_context runs in the pool.
+    Image<int> out(64, 64);
+    if (!check_output(&ctx_a, out)) {
+        return false;
+    }
+
+    // Unbinding a user_context, or destroying its pool, sends its
+    // loops back to the default pool.
+    halide_use_thread_pool(&ctx_a, NULL);
+    halide_destroy_thread_pool(pool_b);
+    if (halide_find_thread_pool("b") != NULL) {
+        printf("Found a destroyed pool\n");
+        return false;
+    }
+    pool_threads a_unbound, b_destroyed;
+    if (!run_in_pool(&ctx_a, &a_unbound) ||
+        !run_in_pool(&ctx_b, &b_destroyed) ||
+        !disjoint(a_unbound.outer, a_threads.outer) ||
+        !disjoint(b_destroyed.outer, b_threads.outer)) {
+        printf("Loops ran in a pool after it was unbound or destroyed\n");
+        return false;
+    }
+    halide_destroy_thread_pool(pool_a);
+
+    return check_output(&ctx_b, out);
+}
+
+// A distinct task function for each i, so that each is counted as a
+// separate loop.
+template<int i>
+int numbered_task(void *user_context, int idx, uint8_t *closure) {
+    return 0;
+}
+
+template<int i>
+struct run_numbered_tasks {
+    static int run() {
+        int result = run_numbered_tasks<i - 1>::run();
+        return result ? result : halide_do_par_for(NULL, numbered_task<i - 1>, 0, 10, NULL);
+    }
+};
+
+template<>
+struct run_numbered_tasks<0> {
+    static int run() {
+        return 0;
+    }
+};
+
+// The pool counts each loop and keeps a record of recent calls. Loops
+// that don't fit in its table are counted together.
+bool check_stats() {
+    const int num_loops = 70;
+    halide_set_num_threads(4);
+    halide_set_thread_pool_stats(true);
+    halide_thread_pool_reset_stats();
+    if (run_numbered_tasks<num_loops>::run() != 0) {
+        printf("Running numbered tasks failed\n");
+        return false;
+    }
+
+    halide_thread_pool_loop_stats loops[num_loops];
+    int n = halide_thread_pool_get_loop_stats(NULL, loops, num_loops);
+    if (n != 65) {
+        printf("Got %d loop entries instead of 65\n", n);
+        return false;
+    }
+    std::set<halide_task_t> seen;
+    for (int i = 0; i < n; i++) {
+        uint64_t expected_calls = (i < 64) ? 1 : num_loops - 64;
+        if (loops[i].calls != expected_calls || loops[i].tasks != expected_calls * 10) {
+            printf("Loop entry %d has %d calls and %d tasks\n",
+                   i, (int)loops[i].calls, (int)loops[i].tasks);
+            return false;
+        }
+        if ((loops[i].task == NULL) != (i == 64) || !seen.insert(loops[i].task).second) {
+            printf("Loop entry %d has the wrong task\n", i);
+            return false;
+        }
+    }
+
+    // Only the most recent 256 calls are kept, oldest first.
+    halide_thread_pool_call_stats calls[256];
+    n = halide_thread_pool_get_call_stats(NULL, calls, 256);
+    if (n != num_loops || calls[0].task != loops[0].task) {
+        printf("Got %d call entries instead of %d\n", n, num_loops);
+        return false;
+    }
+    for (int i = 0; i < 300; i++) {
+        halide_do_par_for(NULL, count_task, i, 5, NULL);
+    }
+    n = halide_thread_pool_get_call_stats(NULL, calls, 256);
+    if (n != 256) {
+        printf("Got %d call entries instead of 256\n", n);
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        const halide_thread_pool_call_stats &c = calls[i];
+        if (c.task != count_task || c.min != 300 - 256 + i || c.size != 5 || c.nested ||
+            (i > 0 && c.start < calls[i - 1].start)) {
+            printf("Call entry %d is wrong: min %d size %d\n", i, c.min, c.size);
+            return false;
+        }
+    }
+
+    halide_thread_pool_reset_stats();
+    if (halide_thread_pool_get_loop_stats(NULL, loops, num_loops) != 0 ||
+        halide_thread_pool_get_call_stats(NULL, calls, 256) != 0) {
+        printf("Resetting the stats didn't clear them\n");
+        return false;
+    }
+    halide_set_thread_pool_stats(false);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Image<int> out(64, 64);
+
+    // Batches of indices claimed from the shared job stack must cover
+    // every index exactly once, whatever the number of threads and
+    // the size of the loop.
+    halide_set_work_stealing(false);
+    int threads[] = {1, 2, 3, 8, 16};
+    int sizes[] = {1, 2, 7, 100, 1000, 10007};
+    for (int t : threads) {
+        halide_set_num_threads(t);
+        for (int size : sizes) {
+            if (!check_indices(0, size) || !check_indices(1000, size / 2)) {
+                printf("Failed with %d threads\n", t);
+                return -1;
+            }
+        }
+
+        // A failing task in the middle of a batch still fails the loop.
+        int result = halide_do_par_for(NULL, failing_task, 0, 2000, NULL);
+        if (result != 42) {
+            printf("Failing loop returned %d instead of 42 with %d threads\n", result, t);
+            return -1;
+        }
+    }
+
+    if (!check_stats()) {
+        return -1;
+    }
+
+    if (!check_pools()) {
+        return -1;
+    }
+
+#ifdef __linux__
+    if (!check_affinity()) {
+        return -1;
+    }
+#endif
+
+    // The task size in the schedule still sets the granularity: 16
+    // tasks of four rows each, each running a nested loop of 64 tasks.
+    halide_set_num_threads(4);
+    halide_do_task_t old_do_task = halide_set_custom_do_task(counting_do_task);
+    if (!check_output(NULL, out)) {
+        return -1;
+    }
+    halide_set_custom_do_task(old_do_task);
+    bool found_outer = false, found_inner = false;
+    for (auto t : tasks_run) {
+        if (t.second == 16) {
+            found_outer = true;
+        } else if (t.second == 16 * 64) {
+            found_inner = true;
+        } else {
+            printf("Unexpected parallel loop with %d tasks\n", t.second);
+            return -1;
+        }
+    }
+    if (!found_outer || !found_inner) {
+        printf("Expected one loop with 16 tasks and one with %d\n", 16 * 64);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
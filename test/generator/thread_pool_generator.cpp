@@ -0,0 +1,27 @@
+#include "Halide.h"
+
+namespace {
+
+// A pipeline with an outer parallel loop, in tasks of four rows, and
+// a parallel loop nested inside it.
+class ThreadPool : public Halide::Generator<ThreadPool> {
+public:
+    Func build() {
+        Var x, y;
+
+        Func inner;
+        inner(x, y) = x + y;
+
+        Func f;
+        f(x, y) = inner(x, y) * 2;
+
+        f.parallel(y, 4);
+        inner.compute_at(f, y).parallel(x);
+
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<ThreadPool> register_my_gen{"thread_pool"};
+
+}  // namespace
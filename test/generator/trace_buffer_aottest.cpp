@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "trace_buffer.h"
+
+using namespace Halide::Tools;
+
+const int width = 1000, height = 100;
+
+// Make an empty temporary file to trace to.
+int make_trace_file(char *name) {
+    strcpy(name, "/tmp/trace_buffer_aottest_XXXXXX");
+    return mkstemp(name);
+}
+
+// Read back the binary trace packets in a file, and count the stores
+// to each site of f. Returns false if a packet is malformed or
+// stores the wrong value.
+bool read_trace(const char *name, std::vector<int> &stores) {
+    FILE *file = fopen(name, "rb");
+    if (!file) {
+        printf("Can't open %s\n", name);
+        return false;
+    }
+    uint8_t packet[4096];
+    while (fread(packet, 1, 48, file) == 48) {
+        int event = packet[8];
+        int bits = packet[10];
+        int vector_width = packet[11];
+        int dimensions = packet[13];
+        int bytes = 1;
+        while (bytes * 8 < bits) bytes <<= 1;
+        size_t rest = vector_width * bytes + dimensions * sizeof(int32_t);
+        if (fread(packet + 48, 1, rest, file) != rest) {
+            printf("Truncated packet in %s\n", name);
+            fclose(file);
+            return false;
+        }
+        const char *func = (const char *)(packet + 14);
+        if (event != 1 || strcmp(func, "f") != 0) continue;
+        if (vector_width != 1 || dimensions != 2 || bits != 32) {
+            printf("Unexpected store packet of %d x %d bits with %d coordinates\n",
+                   vector_width, bits, dimensions);
+            fclose(file);
+            return false;
+        }
+        int32_t value, x, y;
+        memcpy(&value, packet + 48, 4);
+        memcpy(&x, packet + 52, 4);
+        memcpy(&y, packet + 56, 4);
+        if (x < 0 || x >= width || y < 0 || y >= height || value != x + y * 1000) {
+            printf("Bad store of %d to f(%d, %d)\n", value, x, y);
+            fclose(file);
+            return false;
+        }
+        stores[x + y * width]++;
+    }
+    fclose(file);
+    return true;
+}
+
+// Check that every site of f was stored to the given number of times
+// across the traces.
+bool check_stores(const std::vector<int> &stores, int runs) {
+    for (int i = 0; i < width * height; i++) {
+        if (stores[i] != runs) {
+            printf("f(%d, %d) was stored %d times in the traces instead of %d\n",
+                   i % width, i / width, stores[i], runs);
+            return false;
+        }
+    }
+    return true;
+}
+
+volatile int runs_done = 0;
+
+void *run_pipeline(void *arg) {
+    int runs = *(int *)arg;
+    Image<int32_t> out(width, height);
+    for (int i = 0; i < runs; i++) {
+        if (trace_buffer(out) != 0) {
+            printf("trace_buffer failed\n");
+            exit(-1);
+        }
+        __sync_fetch_and_add(&runs_done, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    // Each run writes 100000 store packets of 60 bytes, which wraps
+    // around the 1MB trace buffers several times.
+    char name_a[64], name_b[64];
+    int fd_a = make_trace_file(name_a);
+    int fd_b = make_trace_file(name_b);
+    if (fd_a < 0 || fd_b < 0) {
+        printf("Can't make temporary trace files\n");
+        return -1;
+    }
+
+    // Two threads run the pipeline at once, and each runs a parallel
+    // loop, so there are many writers. Meanwhile, keep switching the
+    // trace between two files, which flushes the buffers while
+    // packets are being written. Every packet should end up in one of
+    // the two files.
+    halide_set_trace_file(fd_a);
+    const int runs = 4;
+    pthread_t threads[2];
+    int runs_per_thread = runs / 2;
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, run_pipeline, &runs_per_thread);
+    }
+    for (int i = 0; runs_done < runs; i++) {
+        halide_set_trace_file((i & 1) ? fd_a : fd_b);
+        usleep(100);
+    }
+    halide_set_trace_file(fd_b);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Once more on the second file alone, then flush it.
+    run_pipeline(&runs_per_thread);
+    halide_shutdown_trace();
+
+    std::vector<int> stores(width * height, 0);
+    if (!read_trace(name_a, stores) || !read_trace(name_b, stores)) {
+        return -1;
+    }
+    if (!check_stores(stores, runs + runs_per_thread)) {
+        return -1;
+    }
+
+    // Tracing to a file again after shutting down should work too.
+    int fd_c = open(name_a, O_WRONLY | O_TRUNC);
+    halide_set_trace_file(fd_c);
+    run_pipeline(&runs_per_thread);
+    halide_shutdown_trace();
+    std::fill(stores.begin(), stores.end(), 0);
+    if (!read_trace(name_a, stores) || !check_stores(stores, runs_per_thread)) {
+        return -1;
+    }
+
+    close(fd_a);
+    close(fd_b);
+    close(fd_c);
+    unlink(name_a);
+    unlink(name_b);
+
+    printf("Success!\n");
+    return 0;
+}
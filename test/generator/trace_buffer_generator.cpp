@@ -0,0 +1,22 @@
+#include "Halide.h"
+
+namespace {
+
+// A parallel pipeline that traces every store, so that many threads
+// write trace packets at once.
+class TraceBuffer : public Halide::Generator<TraceBuffer> {
+public:
+    Func build() {
+        Var x, y;
+
+        Func f("f");
+        f(x, y) = x + y * 1000;
+        f.parallel(y).trace_stores();
+
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<TraceBuffer> register_my_gen{"trace_buffer"};
+
+}  // namespace
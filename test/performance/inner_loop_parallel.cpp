@@ -11,30 +11,38 @@ int main(int argc, char **argv) {
     f(x, y) = x + y;
     f.parallel(x);
 
-    // Having more threads than tasks shouldn't hurt performance too much.
-    double correct_time = 0;
-
-    for (int t = 2; t <= 64; t *= 2) {
-        std::ostringstream ss;
-        ss << "HL_NUM_THREADS=" << t;
-        std::string str = ss.str();
-        char buf[32] = {0};
-        memcpy(buf, str.c_str(), str.size());
-        putenv(buf);
-        Halide::Internal::JITSharedRuntime::release_all();
-        f.compile_jit();
-        // Start the thread pool without giving any hints as to the
-        // number of tasks we'll be using.
-        f.realize(t, 1);
-        double min_time = benchmark(3, 1, [&]() { return f.realize(2, 1000000); });
-
-        printf("%d: %f ms\n", t, min_time * 1e3);
-        if (t == 2) {
-            correct_time = min_time;
-        } else if (min_time > correct_time * 5) {
-            printf("Unacceptable overhead when using %d threads for 2 tasks: %f ms vs %f ms\n",
-                   t, min_time, correct_time);
-            return -1;
+    // Having more threads than tasks shouldn't hurt performance too
+    // much, with either scheduler.
+    char ws_buf[32] = {0};
+    for (int work_stealing = 0; work_stealing < 2; work_stealing++) {
+        snprintf(ws_buf, sizeof(ws_buf), "HL_WORK_STEALING=%d", work_stealing);
+        putenv(ws_buf);
+        printf("%s\n", work_stealing ? "Work stealing:" : "Job stack:");
+
+        double correct_time = 0;
+
+        for (int t = 2; t <= 64; t *= 2) {
+            std::ostringstream ss;
+            ss << "HL_NUM_THREADS=" << t;
+            std::string str = ss.str();
+            char buf[32] = {0};
+            memcpy(buf, str.c_str(), str.size());
+            putenv(buf);
+            Halide::Internal::JITSharedRuntime::release_all();
+            f.compile_jit();
+            // Start the thread pool without giving any hints as to the
+            // number of tasks we'll be using.
+            f.realize(t, 1);
+            double min_time = benchmark(3, 1, [&]() { return f.realize(2, 1000000); });
+
+            printf("%d: %f ms\n", t, min_time * 1e3);
+            if (t == 2) {
+                correct_time = min_time;
+            } else if (min_time > correct_time * 5) {
+                printf("Unacceptable overhead when using %d threads for 2 tasks: %f ms vs %f ms\n",
+                       t, min_time, correct_time);
+                return -1;
+            }
         }
     }
 
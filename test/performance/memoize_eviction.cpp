@@ -0,0 +1,73 @@
+#include "Halide.h"
+#include <cstdio>
+#include <cmath>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    // A few results that are expensive to compute, interleaved with a
+    // stream of cheap ones that are never reused. With LRU eviction the
+    // cheap results push the expensive ones out of the cache; with
+    // greedy dual size eviction they shouldn't.
+    Param<int> expensive_key, cheap_key;
+    Var x, y;
+
+    Func expensive, expensive_out;
+    Expr math = cast<float>(x + y + expensive_key);
+    for (int i = 0; i < 20; i++) math = sqrt(cos(sin(math)) + 2.0f);
+    expensive(x, y) = math;
+    expensive_out(x, y) = expensive(x, y) * 2.0f;
+    expensive.compute_root().memoize();
+
+    Func cheap, cheap_out;
+    cheap(x, y) = cast<float>(x + y + cheap_key);
+    cheap_out(x, y) = cheap(x, y) * 2.0f;
+    cheap.compute_root().memoize();
+
+    const int size = 256;
+    Image<float> expensive_im(size, size), cheap_im(size, size);
+    expensive_out.compile_jit();
+    cheap_out.compile_jit();
+
+    // Room for eight results.
+    Internal::JITSharedRuntime::memoization_cache_set_size(size * size * 4 * 8);
+
+    const char *names[] = {"LRU", "Greedy dual size"};
+    int policies[] = {halide_memoization_cache_lru, halide_memoization_cache_greedy_dual_size};
+    for (int p = 0; p < 2; p++) {
+        Internal::JITSharedRuntime::memoization_cache_set_eviction_policy(policies[p]);
+        int next_cheap_key = 0;
+        double t = benchmark(1, 5, [&]() {
+            for (int k = 0; k < 4; k++) {
+                expensive_key.set(k);
+                expensive_out.realize(expensive_im);
+                for (int i = 0; i < 4; i++) {
+                    cheap_key.set(next_cheap_key++);
+                    cheap_out.realize(cheap_im);
+                }
+            }
+        });
+        printf("%s: %f ms per round\n", names[p], t * 1e3);
+
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                float correct = (float)(x + y + next_cheap_key - 1) * 2.0f;
+                if (cheap_im(x, y) != correct) {
+                    printf("cheap_im(%d, %d) = %f instead of %f\n", x, y, cheap_im(x, y), correct);
+                    return -1;
+                }
+            }
+        }
+
+        // Drop everything before trying the next policy.
+        Internal::JITSharedRuntime::memoization_cache_set_size(1);
+        Internal::JITSharedRuntime::memoization_cache_set_size(size * size * 4 * 8);
+    }
+
+    Internal::JITSharedRuntime::memoization_cache_set_eviction_policy(halide_memoization_cache_lru);
+    Internal::JITSharedRuntime::memoization_cache_set_size(0);
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "Halide.h"
+#include <cstdio>
+#include <cmath>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    // Many small memoized tiles, looked up from all the threads of the
+    // pool at once. Once the cache is warm, the runtime is dominated
+    // by the cost of cache lookups.
+    Param<int> offset;
+    Func f, g;
+    Var x, y;
+    f(x, y) = sqrt(cast<float>(x * y + offset));
+    g(x, y) = f(x, y) * 2.0f;
+    f.compute_at(g, y).memoize();
+    g.parallel(y);
+
+    const int width = 16, height = 20000;
+    Image<float> im(width, height);
+    Internal::JITSharedRuntime::memoization_cache_set_size(width * height * 4 * 8);
+
+    // Fill the cache, one entry per row, for a few different values
+    // of the parameter.
+    double cold = 0;
+    for (int i = 0; i < 4; i++) {
+        offset.set(i);
+        cold += benchmark(1, 1, [&]() { g.realize(im); });
+    }
+    printf("Cold cache: %f ms per realization\n", cold * 1e3 / 4);
+
+    // Now every row is a hit.
+    double warm = benchmark(5, 5, [&]() {
+        for (int i = 0; i < 4; i++) {
+            offset.set(i);
+            g.realize(im);
+        }
+    });
+    printf("Warm cache: %f ms per realization\n", warm * 1e3 / 4);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float correct = sqrtf((float)(x * y + 3)) * 2.0f;
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %f instead of %f\n", x, y, im(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    Internal::JITSharedRuntime::memoization_cache_set_size(0);
+
+    printf("Success!\n");
+    return 0;
+}
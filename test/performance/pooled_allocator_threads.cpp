@@ -0,0 +1,68 @@
+#include "Halide.h"
+#include <cstdio>
+#include <cmath>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    // Small intermediates computed per tile inside nested parallel
+    // loops, so that every task of the inner loop allocates and frees
+    // two heap buffers, on as many threads as the pool has.
+    ImageParam input(Float(32), 2);
+    Var x, y, xi, yi;
+
+    Func clamped = BoundaryConditions::repeat_edge(input);
+    Func blur_x, blur_y, out;
+    blur_x(x, y) = (clamped(x - 1, y) + clamped(x, y) + clamped(x + 1, y)) / 3;
+    blur_y(x, y) = (blur_x(x, y - 1) + blur_x(x, y) + blur_x(x, y + 1)) / 3;
+    out(x, y) = blur_y(x, y) * 2.0f;
+
+    out.tile(x, y, xi, yi, 64, 32).parallel(y).parallel(x).vectorize(xi, 8);
+    blur_x.compute_at(out, x).vectorize(x, 8);
+    blur_y.compute_at(out, x).vectorize(x, 8);
+
+    const int size = 2048;
+    Image<float> in(size, size), output(size, size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            in(x, y) = (float)((x * 17 + y * 31) % 256);
+        }
+    }
+    input.set(in);
+    out.compile_jit();
+
+    // Past 32 threads, threads must share the pooled allocator's caches.
+    const char *names[] = {"Default allocator", "Pooled allocator"};
+    int threads[] = {1, 4, 16, 64};
+    for (int t : threads) {
+        Internal::JITSharedRuntime::set_num_threads(t);
+        for (int p = 0; p < 2; p++) {
+            Internal::JITSharedRuntime::use_pooled_allocator(p == 1);
+            double time = benchmark(3, 5, [&]() { out.realize(output); });
+            printf("%s, %d threads: %f ms\n", names[p], t, time * 1e3);
+
+            for (int y = 1; y < size - 1; y++) {
+                for (int x = 1; x < size - 1; x++) {
+                    float correct = 0;
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            correct += in(x + dx, y + dy);
+                        }
+                    }
+                    correct = correct / 9 * 2;
+                    if (std::abs(output(x, y) - correct) > 0.01f) {
+                        printf("output(%d, %d) = %f instead of %f\n", x, y, output(x, y), correct);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    Internal::JITSharedRuntime::use_pooled_allocator(false);
+    Internal::JITSharedRuntime::set_num_threads(0);
+
+    printf("Success!\n");
+    return 0;
+}
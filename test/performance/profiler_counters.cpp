@@ -0,0 +1,66 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace Halide;
+
+bool saw_counters = false, saw_hardware = false;
+unsigned long long task_clock = 0;
+void my_print(void *, const char *msg) {
+    if (strstr(msg, "task clock ns:") || strstr(msg, "cycles:")) {
+        saw_counters = true;
+    }
+    if (strstr(msg, "cycles:") || strstr(msg, "instructions:")) {
+        saw_hardware = true;
+    }
+    const char *p = strstr(msg, "task clock ns:");
+    if (strncmp(msg, "  expensive:", 12) == 0 && p) {
+        sscanf(p, "task clock ns: %llu", &task_clock);
+    }
+}
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    printf("Skipping test on Windows\n");
+#else
+    // Use the software counters the profiler falls back to where
+    // there are no hardware counters, such as in most virtual
+    // machines.
+    setenv("HL_PROFILER_COUNTERS", "software", 1);
+
+    Func expensive("expensive"), consumer("consumer");
+    Var x, y;
+    Expr e = cast<float>(x + y);
+    for (int i = 0; i < 100; i++) {
+        e = sin(e);
+    }
+    expensive(x, y) = e;
+    consumer(x, y) = expensive(x, y) + 1.0f;
+    expensive.compute_root().parallel(y);
+
+    consumer.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    consumer.realize(1000, 1000, t);
+
+    if (!saw_counters) {
+        // Not Linux, or perf events aren't allowed here.
+        printf("Performance counters aren't available. Skipping test\n");
+        printf("Success!\n");
+        return 0;
+    }
+
+    if (saw_hardware) {
+        printf("Hardware counters were used although only software ones were asked for\n");
+        return -1;
+    }
+
+    if (task_clock == 0) {
+        printf("No task clock time was billed to expensive\n");
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace Halide;
+
+int dropped = -1;
+void my_print(void *, const char *msg) {
+    const char *p = strstr(msg, "dropped samples:");
+    if (p) {
+        sscanf(p, "dropped samples: %d", &dropped);
+    }
+}
+
+int main(int argc, char **argv) {
+    // Run more parallel tasks at once than the profiler has
+    // per-thread slots. The samples missed on the extra threads
+    // should be counted and reported.
+    setenv("HL_NUM_THREADS", "128", 1);
+
+    Func expensive("expensive");
+    Var x, y;
+    Expr e = cast<float>(x + y);
+    for (int i = 0; i < 200; i++) {
+        e = sin(e);
+    }
+    expensive(x, y) = e;
+    expensive.parallel(y);
+
+    expensive.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    expensive.realize(2000, 128, t);
+
+    if (dropped <= 0) {
+        printf("Expected the profiler to report dropped samples with 128 threads\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
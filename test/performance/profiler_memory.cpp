@@ -0,0 +1,44 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace Halide;
+
+int allocs = -1;
+unsigned long long peak = 0;
+void my_print(void *, const char *msg) {
+    const char *p = strstr(msg, "allocs:");
+    if (strncmp(msg, "  producer:", 11) == 0 && p) {
+        sscanf(p, "allocs: %d  peak: %llu", &allocs, &peak);
+    }
+}
+
+int main(int argc, char **argv) {
+    // A large intermediate that must go on the heap. The profiler
+    // should report one allocation of at least its size per run.
+    Func producer("producer"), consumer("consumer");
+    Var x, y;
+
+    producer(x, y) = x * y;
+    consumer(x, y) = producer(x, y) + producer(x + 1, y);
+    producer.compute_root();
+
+    consumer.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    consumer.realize(1000, 1000, t);
+
+    if (allocs != 1) {
+        printf("Expected one heap allocation for producer, got %d\n", allocs);
+        return -1;
+    }
+
+    unsigned long long expected = 1001 * 1000 * sizeof(int);
+    if (peak < expected) {
+        printf("Peak heap usage of producer is %llu bytes, expected at least %llu\n",
+               peak, expected);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace Halide;
+
+int heavy_percentage = -1, light_percentage = -1;
+float heavy_cpu_ms = 0, light_cpu_ms = 0;
+void my_print(void *, const char *msg) {
+    char name[64];
+    float this_ms, this_cpu_ms;
+    int this_percentage;
+    int val = sscanf(msg, " %63[^:]: %fms (%d%%) cpu: %fms", name, &this_ms, &this_percentage, &this_cpu_ms);
+    if (val == 4) {
+        if (strcmp(name, "heavy") == 0) {
+            heavy_percentage = this_percentage;
+            heavy_cpu_ms = this_cpu_ms;
+        } else if (strcmp(name, "light") == 0) {
+            light_percentage = this_percentage;
+            light_cpu_ms = this_cpu_ms;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // Two different Funcs computed per row of a parallel loop, so
+    // that at any moment some threads are computing one and some the
+    // other. heavy does ten times the work of light, so it should be
+    // billed for most of the time. A profiler that only tracked the
+    // Func most recently entered by any thread would split the time
+    // roughly evenly between them, because threads enter each of them
+    // equally often.
+    Func heavy("heavy"), light("light"), out("out");
+    Var x("x"), y("y");
+
+    Expr e = cast<float>(x + y);
+    for (int i = 0; i < 100; i++) {
+        e = sin(e);
+    }
+    heavy(x, y) = e;
+
+    e = heavy(x, y);
+    for (int i = 0; i < 10; i++) {
+        e = sin(e);
+    }
+    light(x, y) = e;
+    out(x, y) = light(x, y);
+
+    heavy.compute_at(out, y);
+    light.compute_at(out, y);
+    out.parallel(y);
+
+    Internal::JITSharedRuntime::set_num_threads(8);
+    out.set_custom_print(&my_print);
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    out.realize(1000, 400, t);
+
+    printf("heavy: %d%% of the time, %fms cpu\n"
+           "light: %d%% of the time, %fms cpu\n",
+           heavy_percentage, heavy_cpu_ms, light_percentage, light_cpu_ms);
+
+    if (heavy_percentage < 60 || light_percentage > 25) {
+        printf("heavy should get most of the time, and light a small share of it\n");
+        return -1;
+    }
+
+    if (light_percentage < 0 || heavy_cpu_ms < 4 * light_cpu_ms) {
+        printf("heavy should get about ten times the cpu time of light\n");
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "Halide.h"
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    printf("Skipping test on Windows\n");
+#else
+    const char *trace_file = "profiler_timeline_test.json";
+    remove(trace_file);
+    setenv("HL_PROFILER_TRACE_FILE", trace_file, 1);
+
+    {
+        // A parallel Func between two serial ones.
+        Func producer("producer"), expensive("expensive"), consumer("consumer");
+        Var x, y;
+        producer(x, y) = cast<float>(x + y);
+        Expr e = producer(x, y);
+        for (int i = 0; i < 20; i++) {
+            e = sin(e);
+        }
+        expensive(x, y) = e;
+        consumer(x, y) = expensive(x, y) + 1.0f;
+        producer.compute_root();
+        expensive.compute_root().parallel(y);
+
+        Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+        for (int i = 0; i < 3; i++) {
+            consumer.realize(500, 500, t);
+        }
+    }
+
+    // The timeline is written when the runtime shuts down.
+    Internal::JITSharedRuntime::release_all();
+
+    FILE *f = fopen(trace_file, "r");
+    if (!f) {
+        printf("The timeline wasn't written to %s\n", trace_file);
+        return -1;
+    }
+
+    // Every event is on a line of its own. Check that the begin and
+    // end events on each track nest properly and are in order.
+    std::map<int, int> depth;
+    std::map<int, double> last_time;
+    int tasks = 0, funcs = 0;
+    bool header = false, footer = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "{\"traceEvents\":[", 16) == 0) {
+            header = true;
+            continue;
+        }
+        if (strncmp(line, "]}", 2) == 0) {
+            footer = true;
+            continue;
+        }
+        char phase;
+        int tid;
+        if (sscanf(line, "{\"ph\":\"%c\",\"pid\":1,\"tid\":%d", &phase, &tid) != 2) {
+            printf("Could not parse timeline line: %s", line);
+            return -1;
+        }
+        if (phase == 'M') continue;
+        const char *ts = strstr(line, "\"ts\":");
+        if (!ts) {
+            printf("Timeline event without a time: %s", line);
+            return -1;
+        }
+        double time = atof(ts + 5);
+        if (last_time.count(tid) && time < last_time[tid]) {
+            printf("Timeline events on track %d are out of order: %s", tid, line);
+            return -1;
+        }
+        last_time[tid] = time;
+        if (phase == 'B') {
+            depth[tid]++;
+            if (strstr(line, "\"name\":\"task of expensive\"")) tasks++;
+            if (strstr(line, "\"name\":\"expensive\"")) funcs++;
+        } else if (phase == 'E') {
+            if (--depth[tid] < 0) {
+                printf("End event without a begin on track %d\n", tid);
+                return -1;
+            }
+        } else {
+            printf("Unexpected phase %c\n", phase);
+            return -1;
+        }
+    }
+    fclose(f);
+    remove(trace_file);
+
+    if (!header || !footer) {
+        printf("The timeline is missing its header or footer\n");
+        return -1;
+    }
+    for (std::pair<const int, int> &d : depth) {
+        if (d.second != 0) {
+            printf("Track %d has %d unclosed events\n", d.first, d.second);
+            return -1;
+        }
+    }
+    if (tasks == 0 || funcs < tasks) {
+        printf("Expected tasks of expensive in the timeline, found %d tasks and %d spans of expensive\n",
+               tasks, funcs);
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
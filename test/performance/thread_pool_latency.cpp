@@ -0,0 +1,50 @@
+#include "Halide.h"
+#include <cstdio>
+#include <cstring>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    // A small pipeline realized over and over again, as if once per
+    // video frame. Its runtime is dominated by the cost of waking up
+    // the thread pool.
+    Func f;
+    Var x, y;
+    f(x, y) = x * y;
+    f.parallel(y);
+
+    Image<int> im(64, 16);
+
+    // Compare workers that go straight to sleep between calls with
+    // workers that spin for a while first, with both schedulers.
+    const char *spin_counts[] = {"HL_SPIN_COUNT=0", "HL_SPIN_COUNT=100000"};
+    const char *schedulers[] = {"HL_WORK_STEALING=0", "HL_WORK_STEALING=1"};
+    char spin_buf[32] = {0}, scheduler_buf[32] = {0};
+    for (const char *scheduler : schedulers) {
+        for (const char *spin_count : spin_counts) {
+            strncpy(scheduler_buf, scheduler, sizeof(scheduler_buf) - 1);
+            strncpy(spin_buf, spin_count, sizeof(spin_buf) - 1);
+            putenv(scheduler_buf);
+            putenv(spin_buf);
+            Halide::Internal::JITSharedRuntime::release_all();
+            f.compile_jit();
+            f.realize(im);
+
+            double t = benchmark(10, 100, [&]() { f.realize(im); });
+            printf("%s %s: %f us per realization\n", scheduler, spin_count, t * 1e6);
+
+            for (int y = 0; y < im.height(); y++) {
+                for (int x = 0; x < im.width(); x++) {
+                    if (im(x, y) != x * y) {
+                        printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), x * y);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
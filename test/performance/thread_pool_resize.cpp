@@ -0,0 +1,40 @@
+#include "Halide.h"
+#include <cstdio>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    Var x, y;
+    Func f;
+
+    Expr math = cast<float>(x+y);
+    for (int i = 0; i < 20; i++) math = sqrt(cos(sin(math)));
+    f(x, y) = math;
+    f.parallel(y);
+
+    Image<float> im = f.realize(256, 1024);
+    Image<float> reference = f.realize(256, 1024);
+
+    // Grow and shrink the same thread pool in place, including sizes
+    // above 64 threads.
+    int sizes[] = {1, 2, 4, 8, 16, 32, 64, 96, 128, 256, 8, 1};
+    for (int t : sizes) {
+        Halide::Internal::JITSharedRuntime::set_num_threads(t);
+        double min_time = benchmark(3, 3, [&]() { f.realize(im); });
+        printf("%d threads: %f ms\n", t, min_time * 1e3);
+
+        for (int y = 0; y < im.height(); y++) {
+            for (int x = 0; x < im.width(); x++) {
+                if (im(x, y) != reference(x, y)) {
+                    printf("im(%d, %d) = %f instead of %f with %d threads\n",
+                           x, y, im(x, y), reference(x, y), t);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
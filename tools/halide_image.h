@@ -14,16 +14,38 @@
 
 #include "HalideRuntime.h"
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 namespace Halide {
 namespace Tools {
 
+// Images of at least this many bytes are mapped directly and backed by
+// transparent huge pages, like large allocations in the Halide runtime
+// (see halide_set_huge_page_threshold). Set with the environment
+// variable HL_HUGE_PAGE_THRESHOLD, in megabytes. Zero means never.
+inline size_t image_huge_page_threshold() {
+    static size_t threshold = 0;
+    static bool initialized = false;
+    if (!initialized) {
+        const char *value = getenv("HL_HUGE_PAGE_THRESHOLD");
+        threshold = value ? (size_t)atoi(value) << 20 : 0;
+        initialized = true;
+    }
+    return threshold;
+}
+
 template<typename T>
 class Image {
     struct Contents {
-        Contents(const buffer_t &b, uint8_t *a) : buf(b), ref_count(1), alloc(a) {}
+        Contents(const buffer_t &b, uint8_t *a, size_t m) : buf(b), ref_count(1), alloc(a), mapped_size(m) {}
         buffer_t buf;
         int ref_count;
         uint8_t *alloc;
+        // If alloc was mapped rather than allocated with new, the size
+        // of the mapping.
+        size_t mapped_size;
 
         void dev_free() {
             halide_device_free(NULL, &buf);
@@ -33,6 +55,12 @@ class Image {
             if (buf.dev) {
                 dev_free();
             }
+#ifdef __linux__
+            if (mapped_size) {
+                munmap(alloc, mapped_size);
+                return;
+            }
+#endif
             delete[] alloc;
         }
     };
@@ -64,13 +92,29 @@ class Image {
         if (z) size *= z;
         if (w) size *= w;
 
-        uint8_t *ptr = new uint8_t[sizeof(T)*size + 40];
+        size_t bytes = sizeof(T)*size + 40;
+        uint8_t *ptr = NULL;
+        size_t mapped_size = 0;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        size_t threshold = image_huge_page_threshold();
+        if (threshold && bytes >= threshold) {
+            void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, bytes, MADV_HUGEPAGE);
+                ptr = (uint8_t *)mapping;
+                mapped_size = bytes;
+            }
+        }
+#endif
+        if (!ptr) {
+            ptr = new uint8_t[bytes];
+        }
         buf.host = ptr;
         buf.host_dirty = false;
         buf.dev_dirty = false;
         buf.dev = 0;
         while ((size_t)buf.host & 0x1f) buf.host++;
-        contents = new Contents(buf, ptr);
+        contents = new Contents(buf, ptr, mapped_size);
     }
 
 public: